@@ -2,17 +2,39 @@
 ALSA code base retrieved from https://www.linuxjournal.com/article/6735 on 7th March 2022
 
 Makefile:
-gcc -Wall -pthread latency_measurement_new.c -lasound -o latency_measurement_new -lpigpio -lrt
+make      -> audio_lag_module (Raspberry Pi, pigpio and ALSA backend in hal_pigpio.c)
+make sim  -> audio_lag_module_sim (any Linux box, simulated DUT in hal_sim.c)
 */
 
-#include <pigpio.h>
-#include <alsa/asoundlib.h>
+#include "calibration.h"
+#include "drift.h"
+#include "edge_queue.h"
+#include "hal.h"
+#include "realtime.h"
+#include "results.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "waveform.h"
+#include "xcorr.h"
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 // Line level in and output
 #define LINE_IN 4 // GPIO 4
 #define LINE_OUT 5 // GPIO 5
+#define LINE_IN_USB_BOTTOM 16 // GPIO 16, line in of the DUT behind usb_audio_bot when measuring all devices
+#define LINE_IN_USB_TOP2 20 // GPIO 20
+#define LINE_IN_USB_BOTTOM2 21 // GPIO 21
 
 // User inputs
 #define START_MEASUREMENT_BUTTON 9 // GPIO 9
@@ -21,6 +43,13 @@ gcc -Wall -pthread latency_measurement_new.c -lasound -o latency_measurement_new
 #define USB_OUT_MODE_BUTTON 23 // GPIO 23
 #define HDMI_OUT_MODE_BUTTON 25 // GPIO 25
 #define EXIT_BUTTON 7 // GPIO 7
+#define BUTTON_DEBOUNCE_IN_MICROS 50000 // Presses of the same button closer than this are bounces
+#define BUTTON_WAIT_TIMEOUT_IN_S 1 // Only needed by the simulated backend, which delivers edges from HAL calls
+#define MAX_BUTTON_GPIO 32
+
+// Measurement modes without a button, selected with --mode
+#define CAPTURE_MODE 100 // Line out drives the line in of the DUT, the pulse arrives on its USB capture
+#define ROUND_TRIP_MODE 101 // USB playback looped back through the DUT into its USB capture
 
 // User feedback
 #define START_MEASUREMENT_LED 11 // GPIO 11
@@ -32,23 +61,160 @@ gcc -Wall -pthread latency_measurement_new.c -lasound -o latency_measurement_new
 #define HDMI_OUT_MODE_LED 24 // GPIO 24
 #define EXIT_LED 8 // GPIO 8
 
+// Real-time profile, the CPUs should be isolated with isolcpus=2,3 in /boot/cmdline.txt
+#define ALERT_CPU 2 // pigpio threads, they inherit it from the main thread during halInitialise
+#define MEASUREMENT_CPU 3
+#define ALERT_PRIORITY 90 // SCHED_FIFO, the alerts must never wait for the measurement
+#define MEASUREMENT_PRIORITY 80
+#define PREFAULT_STACK_BYTES (256 * 1024)
+#define SLEEP_TEST_SLEEPS 1000 // Self-test of the timer wakeup
+#define SLEEP_TEST_INTERVAL_IN_S 0.001
+int realtimeProfile = 0;
+unsigned int microsPerSample = 0; // 0 keeps the default of pigpio (5 us)
+
+// Rig calibration, GPIO 5 wired straight to GPIO 4 instead of a DUT
+#define RIG_PROFILE_PATH "/home/pi/Desktop/AudioLatencyMeasurement/rig_profile.csv" // One row per path and calibration
+#define RIG_PROFILE_CSV_HEADER "HOST,BUILD,TIMESTAMP,PATH,SAMPLES,OFFSET_IN_MICROS,MEAN_IN_MICROS,STANDARD_DEVIATION_IN_MICROS,P50_IN_MICROS,P99_IN_MICROS,MAX_IN_MICROS,JITTER_MEAN_IN_MICROS\n"
+#define RIG_TICK_SAMPLES 1000 // Tick increments observed for the tick resolution
+#define RIG_REGRESSION_MIN_IN_MICROS 5 // A path regressed if its p99 or offset grew by more than this
+#define RIG_REGRESSION_RATIO 0.2 // and by more than this part of the previous value
+#ifndef BUILD_ID
+#define BUILD_ID "" // The Makefile passes git describe
+#endif
+int rigOffsetInMicros = 0; // Of the path of the measurement mode, 0 if the rig was not calibrated
+const char *rigOffsetPath = NULL; // Path the offset was calibrated on, NULL if there is none
+int rigOffsetMode = -1; // Measurement mode the offset was loaded for
+int subtractRigOffset = 0; // Subtracts the offset from every latency instead of only reporting it
+
 // Latency measurement
 #define TOTAL_MEASUREMENTS 1000
-#define TOTAL_CALIBRATION_MEASUREMENTS 10
 #define SIGNAL_LENGTH_IN_S 0.001
 #define SIGNAL_START_INTERVAL_IN_S 0.1
 #define SIGNAL_MINIMUM_INTERVAL_IN_S 0.02 // Minimum interval to ensure correct amplification
 #define SIGNAL_ARRIVED 1
 #define SIGNAL_ON_THE_WAY 0
+#define SIGNAL_ARRIVING 2 // Its line in pulse rose, it is qualified once it falls
+#define SIGNAL_TIMED_OUT 3 // Lost, the next pulse was counted before it arrived
 #define CALIBRATE 0
 #define MEASURE 1
+#define CALIBRATION_INTERVAL_MARGIN 1.5 // The calibration stream waits this many times the longest latency of its window
+#define CALIBRATION_FEEDBACK_INTERVAL_IN_MICROS 200000 // LED and console update rate of the calibration
+#define SOAK_FLUSH_MEASUREMENTS 100 // Measurements appended to the soak CSV at once
+#define LIVE_STATISTICS_INTERVAL_IN_MICROS 100000 // Console update rate
+#define PIPELINE_MAX_DEPTH 8 // Pulses in flight at most
+#define PIPELINE_STRETCH_WEIGHT 100 // Pulses averaged for the stretch of the line in pulses
+#define PULSE_TRAIN_PULSES 20 // Pulses per DMA pulse train, the interval is adapted between trains
+#define MAX_PARALLEL_DEVICES 4 // USB cards named by 85-my-usb-audio.rules
+#define MIN_PULSE_WIDTH_RATIO 0.25 // Shorter line in pulses are spurious, relative to the sent pulse
+#define ACCEPTANCE_MIN_PULSES 20 // Valid pulses before the acceptance window is applied
+#define ACCEPTANCE_MIN_MARGIN_IN_MICROS 50 // The window reaches at least this far from the median
+#define IQR_PER_STANDARD_DEVIATION 1.349 // Of a normal distribution
+#define ARRIVAL_ACCEPTED 0
+#define ARRIVAL_TOO_EARLY 1
+#define ARRIVAL_TOO_LATE 2
 int measurementMode = LINE_OUT_MODE_BUTTON;
-uint32_t startTimestamp, endTimestamp;
-int latencyInMicros;
+uint64_t startTimestamp, endTimestamp; // Extended by unwrapTick
+long startPulse; // Index of the pulse that startTimestamp belongs to
+uint64_t lastTick64;
+int64_t latencyInMicros;
 int latencyMeasurementsInMicros[TOTAL_MEASUREMENTS];
 int validMeasurementsCount = 0;
 int maxLatencyInMicros = -1;
 int signalStatus;
+int pipelineDepth = 1; // Pulses in flight, 1 measures one pulse after the other
+typedef struct {
+    long pulse;
+    uint64_t startTimestamp;
+    int startSkewInMicros;
+    int inFlight;
+} codedPulse;
+codedPulse pulsesInFlight[PIPELINE_MAX_DEPTH]; // Indexed by pulse code
+int currentPulseCode;
+uint64_t lineInRiseTimestamp, lineOutRiseTimestamp;
+double pulseWidthInMicros; // Width of code 0, code n is n + 1 times as wide
+double pulseStretchInMicros; // Line in pulse width minus sent pulse width
+long pulseStretchCount;
+int dmaPulses = 0;
+halPulse pulseTrain[PULSE_TRAIN_PULSES];
+int pulseTrainCodes[PULSE_TRAIN_PULSES];
+int pulseTrainCount;
+int pulseTrainEmitted; // Pulses of the train already matched against the line in edges
+uint64_t pulseTrainStartTimestamp; // 0 until the first edge of the train was seen
+unsigned int glitchFilterInMicros = 0; // pigpio glitch filter on line in, 0 is off
+unsigned int noiseFilterSteadyInMicros = 0, noiseFilterActiveInMicros = 0; // pigpio noise filter on line in
+int minPulseWidthInMicros = -1; // Shorter line in pulses are spurious, -1 derives it from the pulse width
+double acceptanceSigmas = 0; // Arrivals further from the median latency are spurious, 0 accepts every latency
+long acceptanceWindowCount; // Valid pulses the window was computed from
+double acceptanceCentreInMicros, acceptanceMarginInMicros;
+typedef struct {
+    long pulse;
+    uint64_t startTimestamp;
+    int startSkewInMicros;
+    uint64_t riseTimestamp;
+    int pending;
+} arrivalCandidate;
+arrivalCandidate arrival; // Line in pulse that rose while a pulse was on the way
+long spuriousEdgeCount; // Line in pulses of the session that were no arrival
+int calibrationStream = 0; // The session is the pulse stream of the calibration mode
+calibrationWindow calibrationPulses;
+int calibrationCancelButton; // Button that ended the calibration stream, -1 if none
+uint64_t lastCalibrationFeedbackTimestamp;
+calibrationQuality lastCalibration; // At the end of the last calibration
+int lastCalibrationMode = -1; // Measurement mode of lastCalibration, -1 before the first calibration
+int64_t lastCalibrationTimeInMicros; // Wall clock at the end of the last calibration, since the epoch
+edgeQueue edgeEvents;
+int printEveryMeasurement = 1;
+edgeQueue buttonEvents;
+sem_t buttonSemaphore;
+uint64_t buttonPressTimestamps[MAX_BUTTON_GPIO]; // Last accepted press per button
+int exitRequested = 0; // The exit button was pressed during a run without user interface
+atomic_int busyPollingActive;
+latencyStats sessionStats;
+long sessionPulseCount;
+uint64_t lastLiveStatisticsTimestamp;
+int liveStatisticsPrinted;
+int maxP99InMicros = -1; // Pass criterion, -1 means not checked
+double maxLossInPercent = -1; // Pass criterion, -1 means not checked
+char sessionFilePath[1024]; // Without file type suffix
+int binaryResults = 0; // Streams the pulses into a binary result file instead of the CSV
+resultWriter sessionResults;
+int traceSessions = 0; // Records every edge and emission of a session into a trace file
+resultWriter sessionTrace;
+int driftTracking = 0; // Fits the latencies against their send time and looks for steps
+driftTracker sessionDrift;
+uint64_t driftStartTimestamp; // Send time 0 of the fit, the first tracked pulse
+long pcmDelaysInFrames[PIPELINE_MAX_DEPTH]; // snd_pcm_delay when the pulse was sent, -1 for line out
+FILE *driftFile; // Log of the tracked pulses of a session, NULL without one
+int telemetryEnabled = 0;
+const char *telemetrySocketPath = TELEMETRY_SOCKET_PATH;
+telemetryServer telemetry;
+uint64_t lastTelemetryTimestamp; // Of the last update of the percentiles
+uint64_t driftFileTimestamp;
+int64_t driftFileTimeInMicros; // Wall clock at driftFileTimestamp, since the epoch
+int soakMode = 0;
+long soakPulses = 0; // 0 means no limit
+double soakDurationInS = 0; // 0 means no limit
+double fixedSignalIntervalInS = 0; // 0 adapts the interval to the latency, see calculateSignalInterval
+int currentJob = 0; // Line of the running job in the job file, 0 outside of --jobs
+uint64_t soakEndTimestamp;
+FILE *soakFile;
+char soakDutInput[1024], soakDutOutput[1024];
+long sweepPulses = 0; // Pulses per configuration of a sweep, 0 means no sweep
+int persistentStream = 0;
+int useHardwareTimestamps = 0;
+int useMmap = 0;
+int pulseWaveform = WAVEFORM_CONSTANT;
+waveformBank pulseWaveforms;
+int startSkewsInMicros[TOTAL_MEASUREMENTS]; // Software minus hardware start reference
+int currentStartSkewInMicros;
+double pulseCostSumInMicros;
+uint32_t pulseCostMaxInMicros;
+int pulseCostCount;
+const char *captureDeviceName = NULL; // Detects the pulses in the capture of the DUT output instead of on line in
+const char *pcmDeviceName; // Last one opened by openPcmHandle
+double correlationConfidenceSum, correlationConfidenceMin;
+uint32_t correlationTimeSumInMicros, correlationTimeMaxInMicros;
+long correlationCount; // Accepted detections
 
 // ALSA variables
 
@@ -69,24 +235,124 @@ int signalStatus;
 #define PREFERRED_SAMPLE_RATE 44100
 #define NUMBER_OF_CHANNELS 1
 #define MINIMUM_NUMBER_OF_PERIODS 25 // To ensure long enough signal
-#define BYTES_PER_SAMPLE 2 /* Depends on the format type */
-snd_pcm_access_t ACCESS_TYPE = SND_PCM_ACCESS_RW_INTERLEAVED;
-snd_pcm_format_t FORMAT_TYPE = SND_PCM_FORMAT_S16_LE;
+#define PERSISTENT_STREAM_BUFFER_PERIODS 4 // Periods queued in front of a pulse at most
+#define FORMAT_TYPE HAL_PCM_FORMAT_S16_LE
+#define CAPTURE_RING_FRAMES (1 << 17) // Captured frames kept for the cross-correlation detector
+#define XCORR_MIN_CONFIDENCE 0.5 // Detections below are counted as lost pulses
+#define CORRELATION_MAX_PENDING 4 // Pulses waiting until their capture window was read
+#define CORRELATION_BUFFER_IN_S 0.005 // Queued playback at least, so a detection never causes an underrun
+#define XCORR_TEST_REFERENCE_FRAMES 1024
+#define XCORR_TEST_DETECTIONS 1000
+#define XCORR_TEST_NOISE 0.05 // Relative to full scale
+#define CAPTURE_THRESHOLD 0.1 // Relative to full scale, a captured pulse starts above it
+#define CAPTURE_HOLD_IN_S 0.001 // A captured pulse ends after this much silence, like the transistor
+#define CAPTURE_BUFFER_IN_S 4.0 // The capture reader may fall behind that far, longer than a DMA pulse train
+#define CAPTURE_POLL_TIMEOUT_IN_MS 100 // The capture reader checks this often whether it has to stop
+#define CAPTURE_WAIT_STEP_IN_MICROS 100
+#define CAPTURE_WAIT_TIMEOUT_IN_S 0.1 // Longest wait of the measurement loop for the capture reader
 unsigned int sampleRate;
 int bufferSize;
+unsigned int channelCount;
+// Requested hardware parameters, the configuration sweep changes them
+unsigned int requestedSampleRate = PREFERRED_SAMPLE_RATE;
+unsigned int requestedChannels = NUMBER_OF_CHANNELS;
+int requestedFormat = FORMAT_TYPE;
+unsigned long requestedPeriodFrames = 0; // 0 selects the minimum
+unsigned long requestedBufferFrames = 0; // 0 keeps the default buffer size of the measurement
+const char *requestedPcmDeviceName = NULL; // NULL opens the device of the measurement mode
+unsigned long negotiatedPeriodFrames, negotiatedBufferFrames;
+int negotiatedFormat = FORMAT_TYPE;
+#define MAX_SWEEP_VALUES 16 // Per dimension of the sweep grid
+#define SWEEP_RATE 0
+#define SWEEP_FORMAT 1
+#define SWEEP_CHANNELS 2
+#define SWEEP_PERIOD 3
+#define SWEEP_BUFFER 4
+#define SWEEP_DIMENSIONS 5
+#define SWEEP_DEFAULT_MAX_CHANNELS 8
+#define SWEEP_DEFAULT_PERIODS 4 // Period sizes swept by default, doubling from the minimum
+#define MAX_CACHED_CAPABILITIES 8
+#define MAX_JOBS 256 // In a job file
+#define JOB_LINE_LENGTH 1024
 
 // File creation
+#define FILE_NAME_PREFIX_SOAK "soak_"
+#define FILE_NAME_PREFIX_SWEEP "sweep_"
+#define FILE_NAME_PREFIX_JOB "job%d_" // Numbered by the line of the job in the job file
 #define FILE_NAME_PREFIX_LINE_TO_LINE "line-to-line_"
 #define FILE_NAME_PREFIX_USB_TO_LINE "usb-to-line_"
 #define FILE_NAME_PREFIX_HDMI_TO_LINE "hdmi-to-line_"
+#define FILE_NAME_PREFIX_LINE_TO_USB "line-to-usb_"
+#define FILE_NAME_PREFIX_USB_TO_USB "usb-to-usb_"
 #define FILE_NAME_SUFFIX_NO_TIMESTAMP "no-timestamp"
 #define FILE_TYPE_SUFFIX ".csv"
+#define FILE_NAME_TIMESTAMP_FORMAT "%Y-%m-%d_%H-%M-%S" // Sorts like the time
 #define DUT_OUTPUT_VALUE_LINE "LINE OUT"
+#define DUT_OUTPUT_VALUE_USB "USB OUT"
 #define DUT_INPUT_VALUE_LINE "LINE IN"
 #define DUT_INPUT_VALUE_USB "USB IN"
 #define DUT_INPUT_VALUE_HDMI "HDMI IN"
 #define MEASUREMENTS_FOLDER_PATH "/home/pi/Desktop/AudioLatencyMeasurement/measurements/"
-#define CSV_HEADER "LATENCY_IN_MICROS,DUT_INPUT,DUT_OUTPUT,BUFFER_SIZE,SAMPLE_RATE,CHANNELS\n"
+char measurementsFolderPath[1024] = MEASUREMENTS_FOLDER_PATH; // A job of --jobs can change it
+#define CSV_HEADER "LATENCY_IN_MICROS,DUT_INPUT,DUT_OUTPUT,BUFFER_SIZE,SAMPLE_RATE,CHANNELS,START_SKEW_IN_MICROS\n"
+#define FILE_NAME_SUFFIX_SUMMARY "_summary"
+#define SUMMARY_CSV_HEADER "PULSES,VALID,LOST,MEAN_IN_MICROS,STANDARD_DEVIATION_IN_MICROS,MIN_IN_MICROS,MAX_IN_MICROS,P50_IN_MICROS,P90_IN_MICROS,P99_IN_MICROS,P99_9_IN_MICROS,JITTER_MEAN_IN_MICROS,JITTER_MAX_IN_MICROS,DUT_INPUT,DUT_OUTPUT,RESULT,RIG_OFFSET_IN_MICROS,RIG_OFFSET_SUBTRACTED,SPURIOUS,DRIFT_IN_PPM,STEPS,CALIBRATION_DETECTION_RATE,CALIBRATION_SPREAD_IN_MICROS,CALIBRATION_DOUBLE_TRIGGERS,CALIBRATION_GRADE\n"
+#define SWEEP_SUMMARY_CSV_HEADER "SAMPLE_RATE,FORMAT,CHANNELS,PERIOD_FRAMES,BUFFER_FRAMES,PULSES,VALID,LOST,MEAN_IN_MICROS,STANDARD_DEVIATION_IN_MICROS,MIN_IN_MICROS,MAX_IN_MICROS,P50_IN_MICROS,P90_IN_MICROS,P99_IN_MICROS,RESULT\n"
+#define FILE_NAME_SUFFIX_DRIFT "_drift"
+#define DRIFT_CSV_HEADER "PULSE,SEND_TIME_IN_MICROS,LATENCY_IN_MICROS,PCM_DELAY_FRAMES,PCM_AVAIL_FRAMES,FIT_IN_MICROS,DRIFT_IN_PPM,STEP_IN_MICROS\n"
+#define RESULT_PASS 1
+#define RESULT_FAIL 0
+#define RESULT_NOT_CHECKED -1
+#define RESULT_ERROR -2 // A job of --jobs could not measure
+
+// ####
+// #### DRIFT TRACKING ####
+
+// With --drift the valid latencies are fitted against their send time (drift.h). The slope shows
+// how far the clock of a USB interface drifts from the tick, the steps show where it resyncs.
+
+void printDriftStep(const driftStep *step) {
+    if (!printEveryMeasurement) {
+        return;
+    }
+    if (liveStatisticsPrinted) {
+        printf("\n");
+        liveStatisticsPrinted = 0;
+    }
+    printf("### Step of %+.0f us at %.1f s, drift %+.2f ppm\n", step->sizeInMicros, step->timeInS, getDriftInPpm(&sessionDrift));
+}
+
+void trackDrift(long pulse, uint64_t signalStartTimestamp, int latencyInMicros) {
+    long delayInFrames = pcmDelaysInFrames[pulse % PIPELINE_MAX_DEPTH];
+    double timeInS;
+    int step;
+
+    if (!driftTracking) {
+        return;
+    }
+    if (sessionDrift.count == 0) {
+        driftStartTimestamp = signalStartTimestamp;
+    }
+    // Pipelined pulses may arrive out of order, their send time is slightly negative then
+    timeInS = (int64_t) (signalStartTimestamp - driftStartTimestamp) / 1000000.0;
+    step = addDriftSample(&sessionDrift, timeInS, latencyInMicros);
+    if (step) {
+        printDriftStep(&sessionDrift.lastStep);
+    }
+    if (driftFile == NULL) {
+        return;
+    }
+    fprintf(driftFile, "%ld,%lld,%d,", pulse,
+            (long long) (driftFileTimeInMicros + (int64_t) (signalStartTimestamp - driftFileTimestamp)), latencyInMicros);
+    if (delayInFrames >= 0) {
+        fprintf(driftFile, "%ld,%ld,", delayInFrames, (long) negotiatedBufferFrames - delayInFrames);
+    }
+    else {
+        fprintf(driftFile, ",,");
+    }
+    fprintf(driftFile, "%.1f,%.3f,%.0f\n", getDriftFitInMicros(&sessionDrift, timeInS), getDriftInPpm(&sessionDrift),
+            step ? sessionDrift.lastStep.sizeInMicros : 0.0);
+}
 
 // ####
 // #### LOGIC ####
@@ -94,15 +360,90 @@ int bufferSize;
 void resetMeasurement() {
     validMeasurementsCount = 0;
     maxLatencyInMicros = -1;
+    // No signal on the way until the first one is sent
+    signalStatus = SIGNAL_ARRIVED;
+    pulseCostSumInMicros = 0;
+    pulseCostMaxInMicros = 0;
+    pulseCostCount = 0;
     bufferSize = 0;
     sampleRate = 0;
+    negotiatedFormat = requestedFormat;
+    channelCount = NUMBER_OF_CHANNELS;
     // Fill measurement array with -1 values to mark invalid measurements
     for (int i = 0; i < TOTAL_MEASUREMENTS; i++) {
         latencyMeasurementsInMicros[i] = -1;
+        startSkewsInMicros[i] = 0;
+    }
+    currentStartSkewInMicros = 0;
+    correlationConfidenceSum = 0;
+    correlationConfidenceMin = 1.0;
+    correlationTimeSumInMicros = 0;
+    correlationTimeMaxInMicros = 0;
+    correlationCount = 0;
+    initLatencyStats(&sessionStats);
+    memset(pulsesInFlight, 0, sizeof(pulsesInFlight));
+    currentPulseCode = 0;
+    pulseWidthInMicros = SIGNAL_LENGTH_IN_S * 1000000.0;
+    pulseStretchInMicros = 0;
+    pulseStretchCount = 0;
+    sessionPulseCount = 0;
+    startPulse = 0;
+    startTimestamp = 0;
+    arrival.pending = 0;
+    spuriousEdgeCount = 0;
+    acceptanceWindowCount = 0;
+    initDriftTracker(&sessionDrift);
+    initCalibrationWindow(&calibrationPulses);
+    lastCalibrationFeedbackTimestamp = 0;
+    liveStatisticsPrinted = 0;
+    lastLiveStatisticsTimestamp = 0;
+}
+
+// The uint32_t tick of pigpio represents the number of microseconds since boot.
+// It wraps around from 4294967295 to 0 approximately every 72 minutes.
+// Ticks are extended to 64 bit relative to the latest extended tick, which is correct
+// as long as a tick is less than 35 minutes older or newer than that one.
+// The first tick is extended to 2^32 + tick, so slightly older ticks stay positive.
+// Every thread that extends ticks keeps its own latest extended tick.
+uint64_t unwrapTickFrom(uint64_t *latestTick64, uint32_t tick) {
+    uint64_t tick64;
+
+    if (*latestTick64 == 0) {
+        *latestTick64 = ((uint64_t) 1 << 32) + tick;
+    }
+    tick64 = *latestTick64 + (int32_t) (tick - (uint32_t) *latestTick64);
+    if (tick64 > *latestTick64) {
+        *latestTick64 = tick64;
+    }
+    return(tick64);
+}
+
+uint64_t unwrapTick(uint32_t tick) {
+    return(unwrapTickFrom(&lastTick64, tick));
+}
+
+uint64_t getTick64() {
+    return(unwrapTick(halTick()));
+}
+
+long getIterations(int measurementMethod) {
+    // The calibration stream runs until a button is pressed
+    if (measurementMethod == CALIBRATE) {
+        return(LONG_MAX);
+    }
+    else if (soakMode && soakPulses > 0) {
+        return(soakPulses);
+    }
+    else if (soakMode) {
+        return(LONG_MAX);
+    }
+    else if (sweepPulses > 0) {
+        return(sweepPulses);
     }
+    return(TOTAL_MEASUREMENTS);
 }
 
-double calculateSignalInterval(int measurementCount) {
+double calculateSignalIntervalFor(int maxLatencyInMicros, long measurementCount) {
     double signalIntervalInS, maxLatencyInS;
 
     // After the first signal that arrived, the signal interval converges to the maximum measured latency
@@ -112,10 +453,10 @@ double calculateSignalInterval(int measurementCount) {
         && maxLatencyInS < SIGNAL_START_INTERVAL_IN_S
         && measurementCount > 0) {
         if (maxLatencyInS <= SIGNAL_MINIMUM_INTERVAL_IN_S) {
-            signalIntervalInS = SIGNAL_MINIMUM_INTERVAL_IN_S + 1 / measurementCount * maxLatencyInS;
+            signalIntervalInS = SIGNAL_MINIMUM_INTERVAL_IN_S + 1.0 / measurementCount * maxLatencyInS;
         }
         else {
-            signalIntervalInS = maxLatencyInS + 1 / measurementCount * maxLatencyInS;
+            signalIntervalInS = maxLatencyInS + 1.0 / measurementCount * maxLatencyInS;
         }
     }
     // The interval from the first to the second signal is SIGNAL_START_INTERVAL_IN_S
@@ -125,9 +466,396 @@ double calculateSignalInterval(int measurementCount) {
     return(signalIntervalInS);
 }
 
+double calculateSignalInterval(long measurementCount) {
+    return(calculateSignalIntervalFor(maxLatencyInMicros, measurementCount));
+}
+
+// With pipelined pulses, a code is used again after pipelineDepth pulses.
+// Until then the pulse must have arrived, so the interval of one pulse at a time is shared by all codes.
+// Before the first pulse arrived, the latency is unknown and only one pulse is sent at a time.
+double calculatePipelinedSignalInterval(long measurementCount) {
+    double signalIntervalInS = calculateSignalInterval(measurementCount);
+
+    if (maxLatencyInMicros != -1) {
+        signalIntervalInS /= pipelineDepth;
+    }
+
+    if (signalIntervalInS < SIGNAL_MINIMUM_INTERVAL_IN_S) {
+        signalIntervalInS = SIGNAL_MINIMUM_INTERVAL_IN_S;
+    }
+    return(signalIntervalInS);
+}
+
+// The calibration stream sends the next pulse once the slowest pulse of its window would have arrived.
+// Until a pulse of the window arrived, the latency is unknown and the interval is SIGNAL_START_INTERVAL_IN_S.
+double calculateCalibrationInterval() {
+    calibrationQuality quality;
+    double signalIntervalInS;
+
+    getCalibrationQuality(&calibrationPulses, &quality);
+    if (quality.detected == 0) {
+        return(SIGNAL_START_INTERVAL_IN_S);
+    }
+    signalIntervalInS = CALIBRATION_INTERVAL_MARGIN * quality.maxInMicros / 1000000.0;
+    if (signalIntervalInS < SIGNAL_MINIMUM_INTERVAL_IN_S) {
+        signalIntervalInS = SIGNAL_MINIMUM_INTERVAL_IN_S;
+    }
+    return(signalIntervalInS);
+}
+
+// Time between two pulses of a session
+double getSignalInterval(int measurementMethod, long measurementCount) {
+    if (measurementMethod != MEASURE) {
+        return(calculateCalibrationInterval());
+    }
+    else if (fixedSignalIntervalInS > 0) {
+        return(fixedSignalIntervalInS);
+    }
+    else if (pipelineDepth > 1) {
+        return(calculatePipelinedSignalInterval(measurementCount));
+    }
+    return(calculateSignalInterval(measurementCount));
+}
+
+// Part of every latency that the rig adds itself, see RIG CALIBRATION
+int getSubtractedRigOffset() {
+    return(subtractRigOffset ? rigOffsetInMicros : 0);
+}
+
+void saveLatency(long pulse, uint64_t signalStartTimestamp, uint64_t signalEndTimestamp, int startSkewInMicros) {
+    int rejected;
+
+    latencyInMicros = (int64_t) (signalEndTimestamp - signalStartTimestamp) - getSubtractedRigOffset();
+    // Both timestamps are extended to 64 bit, so the wrap around of the tick does not matter.
+    // A negative latency means the edge was older than the signal.
+    rejected = latencyInMicros < 0 || latencyInMicros > INT_MAX;
+
+    // Queued for the background writer, nothing happens without --binary-results
+    appendResult(&sessionResults, pulse, signalStartTimestamp, signalEndTimestamp, startSkewInMicros,
+                 rejected ? RESULT_FLAG_REJECTED : 0);
+    publishTelemetryResult(&telemetry, pulse, signalStartTimestamp, signalEndTimestamp, startSkewInMicros,
+                           rejected ? RESULT_FLAG_REJECTED : 0);
+    finishCalibrationPulse(&calibrationPulses, pulse, rejected ? CALIBRATION_LOST : (int) latencyInMicros);
+
+    if (!rejected && validMeasurementsCount < TOTAL_MEASUREMENTS) {
+        
+        // Saving valid measurement
+        latencyMeasurementsInMicros[validMeasurementsCount] = (int) latencyInMicros;
+        startSkewsInMicros[validMeasurementsCount] = startSkewInMicros;
+        validMeasurementsCount += 1;
+        addLatency(&sessionStats, (int) latencyInMicros);
+        trackDrift(pulse, signalStartTimestamp, (int) latencyInMicros);
+        
+        // Updating maximum latency
+        if (maxLatencyInMicros == -1) {
+            maxLatencyInMicros = (int) latencyInMicros;
+        }
+        else if (latencyInMicros > maxLatencyInMicros) {
+            maxLatencyInMicros = (int) latencyInMicros;
+        }
+        else {
+            // Current latency is smaller than the maximum latency
+        }
+    }
+}
+
+// ####
+// #### STATISTICS ####
+
+long getLostPulses(const latencyStats *stats, long pulses) {
+    return(pulses > stats->count ? pulses - stats->count : 0);
+}
+
+double getLossInPercentOf(const latencyStats *stats, long pulses) {
+    return(pulses > 0 ? 100.0 * getLostPulses(stats, pulses) / pulses : 0.0);
+}
+
+long getLostPulseCount() {
+    return(getLostPulses(&sessionStats, sessionPulseCount));
+}
+
+double getLossInPercent() {
+    return(getLossInPercentOf(&sessionStats, sessionPulseCount));
+}
+
+// Checks the measurements against the pass criteria given on the command line
+int getResult(const latencyStats *stats, long pulses) {
+    if (maxP99InMicros == -1 && maxLossInPercent < 0) {
+        return(RESULT_NOT_CHECKED);
+    }
+    if (maxP99InMicros != -1
+        && (stats->count == 0 || getLatencyPercentile(stats, 99.0) > maxP99InMicros)) {
+        return(RESULT_FAIL);
+    }
+    if (maxLossInPercent >= 0 && getLossInPercentOf(stats, pulses) > maxLossInPercent) {
+        return(RESULT_FAIL);
+    }
+    return(RESULT_PASS);
+}
+
+int getSessionResult() {
+    return(getResult(&sessionStats, sessionPulseCount));
+}
+
+const char *getSessionResultName(int result) {
+    if (result == RESULT_PASS) {
+        return("PASS");
+    }
+    else if (result == RESULT_FAIL) {
+        return("FAIL");
+    }
+    else if (result == RESULT_ERROR) {
+        return("ERROR");
+    }
+    return("NOT CHECKED");
+}
+
+// Overwrites one console line with the statistics so far, at most every LIVE_STATISTICS_INTERVAL_IN_MICROS
+void printLiveStatistics() {
+    uint64_t now;
+
+    if (!printEveryMeasurement) {
+        return;
+    }
+    now = getTick64();
+    if (liveStatisticsPrinted && now - lastLiveStatisticsTimestamp < LIVE_STATISTICS_INTERVAL_IN_MICROS) {
+        return;
+    }
+    lastLiveStatisticsTimestamp = now;
+    liveStatisticsPrinted = 1;
+    printf("\r### Pulse %ld: %ld valid, last %d us, mean %.1f us, p50 %d us, p99 %d us, max %d us, jitter %.1f us",
+           sessionPulseCount,
+           sessionStats.count,
+           sessionStats.last,
+           sessionStats.mean,
+           getLatencyPercentile(&sessionStats, 50.0),
+           getLatencyPercentile(&sessionStats, 99.0),
+           sessionStats.max,
+           sessionStats.jitterMean);
+    if (driftTracking) {
+        printf(", drift %+.2f ppm", getDriftInPpm(&sessionDrift));
+    }
+    // Overwrites the end of a longer line before
+    printf("   ");
+    fflush(stdout);
+}
+
+// Quality of the last calibration of the measurement mode, NULL if it was not calibrated
+const calibrationQuality *getSessionCalibration() {
+    return(lastCalibrationMode == measurementMode ? &lastCalibration : NULL);
+}
+
+void printSessionStatistics() {
+    const calibrationQuality *calibration = getSessionCalibration();
+    int result = getSessionResult();
+
+    if (liveStatisticsPrinted) {
+        printf("\n");
+        liveStatisticsPrinted = 0;
+    }
+    printf("Pulses:    %ld (%ld valid, %ld lost, %.2f %% loss)\n",
+           sessionPulseCount, sessionStats.count, getLostPulseCount(), getLossInPercent());
+    if (spuriousEdgeCount > 0) {
+        printf("Spurious:  %ld line in pulses were no arrival\n", spuriousEdgeCount);
+    }
+    if (sessionStats.count > 0) {
+        printf("Latency:   mean %.1f us, standard deviation %.1f us, min %d us, max %d us\n",
+               sessionStats.mean, getLatencyStandardDeviation(&sessionStats), sessionStats.min, sessionStats.max);
+        printf("Quantiles: p50 %d us, p90 %d us, p99 %d us, p99.9 %d us\n",
+               getLatencyPercentile(&sessionStats, 50.0),
+               getLatencyPercentile(&sessionStats, 90.0),
+               getLatencyPercentile(&sessionStats, 99.0),
+               getLatencyPercentile(&sessionStats, 99.9));
+        printf("Jitter:    mean %.1f us, max %d us between consecutive pulses\n",
+               sessionStats.jitterMean, sessionStats.jitterMax);
+    }
+    if (driftTracking && sessionDrift.count > 1) {
+        printf("Drift:     %+.2f ppm over %.1f s, %ld steps",
+               getDriftInPpm(&sessionDrift), sessionDrift.history[(sessionDrift.count - 1) & (DRIFT_HISTORY - 1)].timeInS,
+               sessionDrift.stepCount);
+        if (sessionDrift.stepCount > 0) {
+            printf(", largest %+.0f us at %.1f s", sessionDrift.largestStep.sizeInMicros, sessionDrift.largestStep.timeInS);
+        }
+        printf("\n");
+    }
+    if (correlationCount > 0) {
+        printf("Detector:  confidence mean %.3f, min %.3f, %.1f us mean and %u us max per detection\n",
+               correlationConfidenceSum / correlationCount, correlationConfidenceMin,
+               (double) correlationTimeSumInMicros / correlationCount, correlationTimeMaxInMicros);
+    }
+    if (calibration != NULL) {
+        printf("Level:     %s at the last calibration, %.0f %% detected, spread %.1f us, %d double triggers\n",
+               getCalibrationGradeName(calibration->grade), 100.0 * calibration->detectionRate,
+               calibration->spreadInMicros, calibration->doubleTriggers);
+    }
+    if (rigOffsetPath != NULL) {
+        printf("Rig:       %d us offset on the %s path, %s\n",
+               rigOffsetInMicros, rigOffsetPath, subtractRigOffset ? "subtracted" : "included in the latencies");
+    }
+    if (result != RESULT_NOT_CHECKED) {
+        printf("Result:    %s\n", getSessionResultName(result));
+    }
+}
+
+// Saves the statistics as one record next to the measurements CSV at filePath
+// drift is NULL if the session was not tracked, calibration if the mode was not calibrated
+void writeSummaryFile(const char *filePath, const latencyStats *stats, long pulses, long spuriousEdges,
+                      const driftTracker *drift, const calibrationQuality *calibration,
+                      const char *dutInput, const char *dutOutput) {
+    FILE *filePointer;
+    char summaryFilePath[1024];
+
+    strcpy(summaryFilePath, filePath);
+    strcat(summaryFilePath, FILE_NAME_SUFFIX_SUMMARY);
+    strcat(summaryFilePath, FILE_TYPE_SUFFIX);
+    filePointer = fopen(summaryFilePath, "w");
+    if (filePointer == NULL) {
+        printf("audio_lag_module.c l.713: Could not open summary file\n");
+        return;
+    }
+    fprintf(filePointer, SUMMARY_CSV_HEADER);
+    fprintf(filePointer, "%ld,%ld,%ld,%.1f,%.1f,%d,%d,%d,%d,%d,%d,%.1f,%d,%s,%s,%s,%d,%d,%ld",
+            pulses,
+            stats->count,
+            getLostPulses(stats, pulses),
+            stats->mean,
+            getLatencyStandardDeviation(stats),
+            stats->min,
+            stats->max,
+            getLatencyPercentile(stats, 50.0),
+            getLatencyPercentile(stats, 90.0),
+            getLatencyPercentile(stats, 99.0),
+            getLatencyPercentile(stats, 99.9),
+            stats->jitterMean,
+            stats->jitterMax,
+            dutInput,
+            dutOutput,
+            getSessionResultName(getResult(stats, pulses)),
+            rigOffsetInMicros,
+            subtractRigOffset && rigOffsetPath != NULL,
+            spuriousEdges);
+    if (drift != NULL) {
+        fprintf(filePointer, ",%.3f,%ld", getDriftInPpm(drift), drift->stepCount);
+    }
+    else {
+        fprintf(filePointer, ",,");
+    }
+    if (calibration != NULL) {
+        fprintf(filePointer, ",%.3f,%.1f,%d,%s\n", calibration->detectionRate, calibration->spreadInMicros,
+                calibration->doubleTriggers, getCalibrationGradeName(calibration->grade));
+    }
+    else {
+        fprintf(filePointer, ",,,\n");
+    }
+    fclose(filePointer);
+}
+
+// Saves the statistics of the session next to its measurements CSV
+void writeSummaryToCSV(const char *dutInput, const char *dutOutput) {
+    writeSummaryFile(sessionFilePath, &sessionStats, sessionPulseCount, spuriousEdgeCount,
+                     driftTracking ? &sessionDrift : NULL, getSessionCalibration(), dutInput, dutOutput);
+}
+
+// ####
+// #### RIG PROFILE ####
+
+// The rig adds delays of its own to every latency, they are measured by --rig-calibration
+// (see RIG CALIBRATION) and saved in RIG_PROFILE_PATH, one row per path and calibration.
+// The offset of the latest calibration on this host is reported with every session.
+
+typedef struct {
+    char host[64];
+    char build[64];
+    char timestamp[32];
+    char path[32];
+    long samples;
+    int offsetInMicros;
+    double meanInMicros;
+    double deviationInMicros;
+    int p50InMicros;
+    int p99InMicros;
+    int maxInMicros;
+    double jitterMeanInMicros;
+} rigProfileEntry;
+
+const char *getBuildId() {
+    return(BUILD_ID[0] != '\0' ? BUILD_ID : "unknown");
+}
+
+// Path of the rig that the start and end timestamps of the measurement mode are taken on.
+// NULL if no calibrated path applies, like for the hardware start reference.
+const char *getRigPath(int mode) {
+    if (mode == LINE_OUT_MODE_BUTTON) {
+        return("line");
+    }
+    else if (mode == USB_OUT_MODE_BUTTON && !useHardwareTimestamps) {
+        return("usb-stamp");
+    }
+    else if (mode == HDMI_OUT_MODE_BUTTON && !useHardwareTimestamps) {
+        return("hdmi-stamp");
+    }
+    return(NULL);
+}
+
+// Latest entry of the path calibrated on this host, returns -1 if there is none
+int findRigProfileEntry(const char *path, rigProfileEntry *entry) {
+    FILE *filePointer;
+    char line[1024], host[64];
+    rigProfileEntry candidate;
+    int found = 0;
+
+    filePointer = fopen(RIG_PROFILE_PATH, "r");
+    if (filePointer == NULL) {
+        return(-1);
+    }
+    memset(host, 0, sizeof(host));
+    gethostname(host, sizeof(host) - 1);
+    while (fgets(line, sizeof(line), filePointer) != NULL) {
+        // The header does not match the numbers
+        if (sscanf(line, "%63[^,],%63[^,],%31[^,],%31[^,],%ld,%d,%lf,%lf,%d,%d,%d,%lf",
+                   candidate.host, candidate.build, candidate.timestamp, candidate.path,
+                   &candidate.samples, &candidate.offsetInMicros, &candidate.meanInMicros, &candidate.deviationInMicros,
+                   &candidate.p50InMicros, &candidate.p99InMicros, &candidate.maxInMicros, &candidate.jitterMeanInMicros) == 12
+            && strcmp(candidate.host, host) == 0
+            && strcmp(candidate.path, path) == 0) {
+            *entry = candidate;
+            found = 1;
+        }
+    }
+    fclose(filePointer);
+    return(found ? 0 : -1);
+}
+
+// Looks up the offset when a session starts in another measurement mode than the one before
+void loadRigOffset(int mode) {
+    rigProfileEntry entry;
+
+    if (mode == rigOffsetMode) {
+        return;
+    }
+    rigOffsetMode = mode;
+    rigOffsetInMicros = 0;
+    rigOffsetPath = getRigPath(mode);
+    if (rigOffsetPath == NULL || findRigProfileEntry(rigOffsetPath, &entry) < 0) {
+        if (subtractRigOffset) {
+            printf("audio_lag_module.c l.841: No rig offset for this measurement mode -> Latencies are not corrected\n");
+        }
+        rigOffsetPath = NULL;
+        return;
+    }
+    rigOffsetInMicros = entry.offsetInMicros;
+    printf("Rig offset: %d us on the %s path, calibrated %s with build %s%s\n",
+           rigOffsetInMicros, rigOffsetPath, entry.timestamp, entry.build,
+           subtractRigOffset ? " -> Subtracted from every latency" : "");
+}
+
+// ####
+// #### CSV FILES ####
+
 void getMeasurementDependentValuesForCSV(char *fileName, char *dutInput, char *dutOutput) {
     const char *fileNamePrefix;
 
+    strcpy(dutOutput, DUT_OUTPUT_VALUE_LINE);
     if (measurementMode == LINE_OUT_MODE_BUTTON) {
         fileNamePrefix = FILE_NAME_PREFIX_LINE_TO_LINE;
         strcpy(dutInput, DUT_INPUT_VALUE_LINE);
@@ -136,12 +864,21 @@ void getMeasurementDependentValuesForCSV(char *fileName, char *dutInput, char *d
         fileNamePrefix = FILE_NAME_PREFIX_USB_TO_LINE;
         strcpy(dutInput, DUT_INPUT_VALUE_USB);
     }
+    else if (measurementMode == CAPTURE_MODE) {
+        fileNamePrefix = FILE_NAME_PREFIX_LINE_TO_USB;
+        strcpy(dutInput, DUT_INPUT_VALUE_LINE);
+        strcpy(dutOutput, DUT_OUTPUT_VALUE_USB);
+    }
+    else if (measurementMode == ROUND_TRIP_MODE) {
+        fileNamePrefix = FILE_NAME_PREFIX_USB_TO_USB;
+        strcpy(dutInput, DUT_INPUT_VALUE_USB);
+        strcpy(dutOutput, DUT_OUTPUT_VALUE_USB);
+    }
     else {
         fileNamePrefix = FILE_NAME_PREFIX_HDMI_TO_LINE;
         strcpy(dutInput, DUT_INPUT_VALUE_HDMI);
     }
     strcpy(fileName, fileNamePrefix);
-    strcpy(dutOutput, DUT_OUTPUT_VALUE_LINE);
 }
 
 void usePigpioForTimestamp(char *fileName) {
@@ -149,7 +886,7 @@ void usePigpioForTimestamp(char *fileName) {
     char secondsSinceEpochString[1024];
     int microsSinceEpoch;
 
-    if (gpioTime(PI_TIME_ABSOLUTE, &secondsSinceEpoch, &microsSinceEpoch) == 0) {
+    if (halTime(&secondsSinceEpoch, &microsSinceEpoch) == 0) {
         sprintf(secondsSinceEpochString, "%d", secondsSinceEpoch);
         strcat(fileName, (const char *) secondsSinceEpochString);
     }
@@ -160,36 +897,24 @@ void usePigpioForTimestamp(char *fileName) {
 
 void addTimestampToFileName(char *fileName) {
     time_t currentTime;
-    char *currentTimeString;
+    struct tm localTime;
+    size_t length = strlen(fileName);
 
     currentTime = time(NULL);
 
-    if (currentTime == ((time_t)-1)) {
+    /* Local time without spaces and ":", so the name works on windows as well */
+    if (currentTime == ((time_t)-1)
+        || localtime_r(&currentTime, &localTime) == NULL
+        || strftime(fileName + length, 64, FILE_NAME_TIMESTAMP_FORMAT, &localTime) == 0) {
+        fileName[length] = '\0';
         usePigpioForTimestamp(fileName);
     }
-    else {
-        /* Convert to local time format. */
-        currentTimeString = ctime(&currentTime);
-
-        if (currentTimeString == NULL) {
-            usePigpioForTimestamp(fileName);
-        }
-        else {
-            strcat(fileName, currentTimeString);
-        }
-    }
 }
 
-void writeMeasurementsToCSV() {
-    FILE *filePointer;
-    char fileName[1024];
-    char dutInput[1024];
-    char dutOutput[1024];
-    char measurementsFolderPath[1024];
+// Sets filePath to the path of the file in the measurements folder, without file type suffix
+void getMeasurementsFilePath(char *filePath, char *fileName) {
     int i = 0;
 
-    getMeasurementDependentValuesForCSV(fileName, dutInput, dutOutput);
-    addTimestampToFileName(fileName);
     // Removing ":" character to make it windows compatible
     while (fileName[i] != '\0') {
         if (fileName[i] == ':') {
@@ -200,415 +925,4504 @@ void writeMeasurementsToCSV() {
         }
         i++;
     }
-    // Adding file type .csv and writing csv file
-    strcat(fileName, FILE_TYPE_SUFFIX);
     // Appending file name to measurements folder path
-    strcpy(measurementsFolderPath, MEASUREMENTS_FOLDER_PATH);
-    strcat(measurementsFolderPath, fileName);
-    filePointer = fopen(measurementsFolderPath, "w");
+    strcpy(filePath, measurementsFolderPath);
+    strcat(filePath, fileName);
+}
+
+// Creates a CSV file with the header in the measurements folder.
+// filePath is set to its path without file type suffix, the summary is saved next to it.
+FILE *createCSVFile(char *filePath, char *fileName) {
+    FILE *filePointer;
+    char csvFilePath[1024];
+
+    getMeasurementsFilePath(filePath, fileName);
+    strcpy(csvFilePath, filePath);
+    strcat(csvFilePath, FILE_TYPE_SUFFIX);
+    filePointer = fopen(csvFilePath, "w");
 
     if (filePointer != NULL) {
         fprintf(filePointer, CSV_HEADER);
-        for (int i = 0; i < TOTAL_MEASUREMENTS; i++) {
-            fprintf(filePointer, "%d,%s,%s,%d,%d,%d\n",
-                    latencyMeasurementsInMicros[i],
-                    dutInput,
-                    dutOutput,
-                    bufferSize,
-                    sampleRate,
-                    NUMBER_OF_CHANNELS);
-        }
-        fclose(filePointer);
     }
     else {
-        printf("audio_lag_module.c l.231: Could not open file\n");
+        printf("audio_lag_module.c l.948: Could not open file\n");
     }
+    return(filePointer);
 }
 
-// ####
-// #### LINE LEVEL VIA GPIOS ####
+// File name of a session with timestamp, for the CSV and the binary result file
+void getSessionFileName(char *fileName, char *dutInput, char *dutOutput) {
+    if (currentJob > 0) {
+        sprintf(fileName, FILE_NAME_PREFIX_JOB, currentJob);
+        getMeasurementDependentValuesForCSV(fileName + strlen(fileName), dutInput, dutOutput);
+    }
+    else if (soakMode) {
+        strcpy(fileName, FILE_NAME_PREFIX_SOAK);
+        getMeasurementDependentValuesForCSV(fileName + strlen(fileName), dutInput, dutOutput);
+    }
+    else {
+        getMeasurementDependentValuesForCSV(fileName, dutInput, dutOutput);
+    }
+    addTimestampToFileName(fileName);
+}
 
-// Line-in callback
-void onLineIn(int gpio, int level, uint32_t tick) {
-    
-    // Rising Edge
-    if (level == 1) {
+// Creates the CSV file of a session and writes its header
+FILE *openMeasurementsCSV(char *dutInput, char *dutOutput) {
+    char fileName[1024];
 
-        // This condition avoids, that multiple trigger of the transistor lead to reassignment of the endTimestamp
-        if (signalStatus == SIGNAL_ON_THE_WAY) {
-            endTimestamp = tick;
-            signalStatus = SIGNAL_ARRIVED;
-            gpioSetAlertFunc(LINE_IN, NULL);
-
-            latencyInMicros = endTimestamp - startTimestamp;
-
-            // The uint32_t tick parameter represents the number of microseconds since boot.
-            // This wraps around from 4294967295 to 0 approximately every 72 minutes.
-            // Thats why the provided latency could be both negative and wrong in this specific situation.
-            if (latencyInMicros >= 0 && validMeasurementsCount < TOTAL_MEASUREMENTS) {
-                
-                // Saving valid measurement
-                latencyMeasurementsInMicros[validMeasurementsCount] = latencyInMicros;
-                validMeasurementsCount += 1;
-                
-                // Updating maximum latency
-                if (maxLatencyInMicros == -1) {
-                    maxLatencyInMicros = latencyInMicros;
-                }
-                else if (latencyInMicros > maxLatencyInMicros) {
-                    maxLatencyInMicros = latencyInMicros;
-                }
-                else {
-                    // Current latency is smaller than the maximum latency
-                }
-            }
-        }  
+    getSessionFileName(fileName, dutInput, dutOutput);
+    return(createCSVFile(sessionFilePath, fileName));
+}
+
+// Creates the drift log of a session next to its CSV, the send times in it are wall clock times
+void openDriftLog() {
+    char fileName[1024], filePath[1024];
+    char dutInput[1024], dutOutput[1024];
+    struct timespec now;
+
+    getSessionFileName(fileName, dutInput, dutOutput);
+    getMeasurementsFilePath(filePath, fileName);
+    strcat(filePath, FILE_NAME_SUFFIX_DRIFT);
+    strcat(filePath, FILE_TYPE_SUFFIX);
+    driftFile = fopen(filePath, "w");
+    if (driftFile == NULL) {
+        printf("audio_lag_module.c l.989: Could not open drift file\n");
+        return;
     }
+    fprintf(driftFile, DRIFT_CSV_HEADER);
+    clock_gettime(CLOCK_REALTIME, &now);
+    driftFileTimestamp = getTick64();
+    driftFileTimeInMicros = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-// Line-out callback
-void onLineOut(int gpio, int level, uint32_t tick) {
-    
-    // Rising Edge
-    if (level == 1) {
-        startTimestamp = tick;
-        signalStatus = SIGNAL_ON_THE_WAY;
+void closeDriftLog() {
+    if (driftFile != NULL) {
+        fclose(driftFile);
+        driftFile = NULL;
     }
 }
 
-// Line-out signal creation
-void sendSignalViaLineOut(double signalIntervalInS) {
-    // Send signal through LINE_OUT gpio pin
-    gpioWrite(LINE_OUT, 1);
-    time_sleep(SIGNAL_LENGTH_IN_S);
-    gpioWrite(LINE_OUT, 0);
-    time_sleep(signalIntervalInS);
+void writeMeasurementRows(FILE *filePointer, const char *dutInput, const char *dutOutput, int count) {
+    for (int i = 0; i < count; i++) {
+        fprintf(filePointer, "%d,%s,%s,%d,%d,%d,%d\n",
+                latencyMeasurementsInMicros[i],
+                dutInput,
+                dutOutput,
+                bufferSize,
+                sampleRate,
+                channelCount,
+                startSkewsInMicros[i]);
+    }
 }
 
-void startMeasurementLineOut(int measurementMethod) {
-    double signalIntervalInS;
-    int iterations;
+void writeMeasurementsToCSV() {
+    FILE *filePointer;
+    char dutInput[1024];
+    char dutOutput[1024];
 
-    if (measurementMethod == CALIBRATE) {
-        iterations = TOTAL_CALIBRATION_MEASUREMENTS;
-    }
-    else {
-        iterations = TOTAL_MEASUREMENTS;
+    filePointer = openMeasurementsCSV(dutInput, dutOutput);
+    if (filePointer != NULL) {
+        writeMeasurementRows(filePointer, dutInput, dutOutput, TOTAL_MEASUREMENTS);
+        fclose(filePointer);
+        writeSummaryToCSV(dutInput, dutOutput);
     }
-    for (int i = 0; i < iterations; i++) {
-        printf("### Measurement %d\n", i);
-        if (measurementMethod == MEASURE) {
-            signalIntervalInS = calculateSignalInterval(i);
-        }
-        else {
-            signalIntervalInS = SIGNAL_START_INTERVAL_IN_S;
-        }
+}
+
+// ####
+// #### SOAK TEST ####
 
-        gpioSetAlertFunc(LINE_IN, onLineIn);
-        sendSignalViaLineOut(signalIntervalInS);
+// Appends the measurements collected so far to the soak CSV and empties the measurement array,
+// so a soak session runs with constant memory
+void flushSoakMeasurements() {
+    if (soakFile != NULL && validMeasurementsCount > 0) {
+        writeMeasurementRows(soakFile, soakDutInput, soakDutOutput, validMeasurementsCount);
+        fflush(soakFile);
+    }
+    for (int i = 0; i < validMeasurementsCount; i++) {
+        latencyMeasurementsInMicros[i] = -1;
+        startSkewsInMicros[i] = 0;
     }
+    validMeasurementsCount = 0;
 }
 
-void initGPIOs() {
-
-    // Initialise library
-    gpioInitialise();
+// ####
+// #### EDGE TRACE ####
 
-    // Set GPIO Modes
-    gpioSetMode(LINE_OUT, PI_OUTPUT);
-    gpioSetMode(LINE_IN, PI_INPUT);
-    gpioSetMode(START_MEASUREMENT_BUTTON, PI_INPUT);
-    gpioSetMode(CALIBRATION_MODE_BUTTON, PI_INPUT);
-    gpioSetMode(LINE_OUT_MODE_BUTTON, PI_INPUT);
-    gpioSetMode(USB_OUT_MODE_BUTTON, PI_INPUT);
-    gpioSetMode(HDMI_OUT_MODE_BUTTON, PI_INPUT);
-    gpioSetMode(EXIT_BUTTON, PI_INPUT);
-    gpioSetMode(START_MEASUREMENT_LED, PI_OUTPUT);
-    gpioSetMode(CALIBRATION_MODE_GREEN_LED, PI_OUTPUT);
-    gpioSetMode(CALIBRATION_MODE_YELLOW_LED, PI_OUTPUT);
-    gpioSetMode(CALIBRATION_MODE_RED_LED, PI_OUTPUT);
-    gpioSetMode(LINE_OUT_MODE_LED, PI_OUTPUT);
-    gpioSetMode(USB_OUT_MODE_LED, PI_OUTPUT);
-    gpioSetMode(HDMI_OUT_MODE_LED, PI_OUTPUT);
-    gpioSetMode(EXIT_LED, PI_OUTPUT);
-
-    // Register GPIO state change callback
-    gpioSetAlertFunc(LINE_OUT, onLineOut);
-    gpioSetAlertFunc(LINE_IN, onLineIn);
+// With --trace the measurement loop records every edge it takes from the queues and every pulse it
+// emits into a trace file (results.h), before anything is matched or rejected. --replay feeds such a
+// file through the same matching and statistics functions without the rig.
 
-    // Initial measurement mode
-    gpioWrite(LINE_OUT_MODE_LED, 1);
-    // For strange debugging reasons
-    gpioWrite(LINE_IN, 0);
-}
+// Nothing is recorded without --trace, the writer is closed then
+void traceEvent(int type, uint32_t tick, int gpio, int level, int code, long pulse, int32_t value) {
+    traceRecord record;
 
-void prepareExit() {
-    gpioSetMode(LINE_OUT, PI_OUTPUT);
-    gpioSetMode(LINE_IN, PI_OUTPUT);
-    gpioSetMode(START_MEASUREMENT_BUTTON, PI_OUTPUT);
-    gpioSetMode(CALIBRATION_MODE_BUTTON, PI_OUTPUT);
-    gpioSetMode(LINE_OUT_MODE_BUTTON, PI_OUTPUT);
-    gpioSetMode(USB_OUT_MODE_BUTTON, PI_OUTPUT);
-    gpioSetMode(HDMI_OUT_MODE_BUTTON, PI_OUTPUT);
-    gpioSetMode(EXIT_BUTTON, PI_OUTPUT);
-
-    gpioWrite(LINE_OUT, 0);
-    gpioWrite(LINE_IN, 0);
-    gpioWrite(START_MEASUREMENT_BUTTON, 0);
-    gpioWrite(CALIBRATION_MODE_BUTTON, 0);
-    gpioWrite(LINE_OUT_MODE_BUTTON, 0);
-    gpioWrite(USB_OUT_MODE_BUTTON, 0);
-    gpioWrite(HDMI_OUT_MODE_BUTTON, 0);
-    gpioWrite(EXIT_BUTTON, 0);
-    gpioWrite(START_MEASUREMENT_LED, 0);
-    gpioWrite(CALIBRATION_MODE_GREEN_LED, 0);
-    gpioWrite(CALIBRATION_MODE_YELLOW_LED, 0);
-    gpioWrite(CALIBRATION_MODE_RED_LED, 0);
-    gpioWrite(LINE_OUT_MODE_LED, 0);
-    gpioWrite(USB_OUT_MODE_LED, 0);
-    gpioWrite(HDMI_OUT_MODE_LED, 0);
-    gpioWrite(EXIT_LED, 0);
-    
-    // Terminate library
-    gpioTerminate();
-    
-    printf("\nExit\n");
+    record.tick = tick;
+    record.type = (uint8_t) type;
+    record.gpio = (uint8_t) gpio;
+    record.level = (uint8_t) level;
+    record.code = (uint8_t) code;
+    record.pulse = (uint32_t) pulse;
+    record.value = value;
+    appendTrace(&sessionTrace, &record);
 }
 
 // ####
-// #### PCM DEVICES (USB, HDMI, PCIE) VIA ALSA ####
+// #### EDGE QUALIFICATION ####
 
-void startMeasurementDigitalOut(int measurementMethod) {
-    double signalIntervalInS;
-    int status;
-    int dir;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *params;
-    unsigned int periodTimeInMicros;
-    snd_pcm_uframes_t frames;
-    long numberOfPeriods;
-    char *buffer;
-    int iterations;
+// A line in pulse is only the arrival of the pulse on the way if it rose after that pulse was sent,
+// is at least getMinPulseWidth wide and, with --acceptance-window, lies close enough to the median latency.
+// Everything else is counted as spurious: noise spikes, bounces of the transistor and late echoes.
+// A pulse that is still on the way when the next one is counted, or when its code is sent again, is lost.
+// The binary results get a record for both, so every pulse ends up valid or lost.
 
-    if (measurementMethod == CALIBRATE) {
-        iterations = TOTAL_CALIBRATION_MEASUREMENTS;
+int getMinPulseWidth() {
+    if (minPulseWidthInMicros >= 0) {
+        return(minPulseWidthInMicros);
     }
-    else {
-        iterations = TOTAL_MEASUREMENTS;
+    return((int) (pulseWidthInMicros * MIN_PULSE_WIDTH_RATIO));
+}
+
+// The window is centred on the median latency of the session and its spread is taken from the
+// interquartile range, so the few spurious arrivals accepted before it was applied hardly widen it.
+// It is open until enough pulses arrived and recomputed once per valid pulse.
+int checkAcceptanceWindow(uint64_t signalStartTimestamp, uint64_t riseTimestamp) {
+    double latency;
+
+    if (acceptanceSigmas <= 0 || sessionStats.count < ACCEPTANCE_MIN_PULSES) {
+        return(ARRIVAL_ACCEPTED);
+    }
+    if (acceptanceWindowCount != sessionStats.count) {
+        acceptanceWindowCount = sessionStats.count;
+        acceptanceCentreInMicros = getLatencyPercentile(&sessionStats, 50.0);
+        acceptanceMarginInMicros = acceptanceSigmas * (getLatencyPercentile(&sessionStats, 75.0)
+                                                       - getLatencyPercentile(&sessionStats, 25.0))
+                                   / IQR_PER_STANDARD_DEVIATION;
+        if (acceptanceMarginInMicros < ACCEPTANCE_MIN_MARGIN_IN_MICROS) {
+            acceptanceMarginInMicros = ACCEPTANCE_MIN_MARGIN_IN_MICROS;
+        }
+    }
+    latency = (double) (int64_t) (riseTimestamp - signalStartTimestamp) - getSubtractedRigOffset();
+    if (latency < acceptanceCentreInMicros - acceptanceMarginInMicros) {
+        return(ARRIVAL_TOO_EARLY);
     }
+    else if (latency > acceptanceCentreInMicros + acceptanceMarginInMicros) {
+        return(ARRIVAL_TOO_LATE);
+    }
+    return(ARRIVAL_ACCEPTED);
+}
 
-    for (int i = 0; i < iterations; i++) {
-        printf("### Measurement %d\n", i);
-        // Open PCM device for playback. 
-        // Measurement is only working consistently if pcm device is opened and closed in every iteration.
-        if (measurementMode == USB_OUT_MODE_BUTTON) {
-            status = snd_pcm_open(&handle, ALSA_USB_TOP_OUT, SND_PCM_STREAM_PLAYBACK, 0);
+void saveSpuriousEdge(long pulse, uint64_t signalStartTimestamp, uint64_t riseTimestamp) {
+    // Before the first pulse was sent
+    if (signalStartTimestamp == 0) {
+        signalStartTimestamp = riseTimestamp;
+    }
+    spuriousEdgeCount += 1;
+    appendResult(&sessionResults, pulse, signalStartTimestamp, riseTimestamp, 0, RESULT_FLAG_SPURIOUS);
+    publishTelemetryResult(&telemetry, pulse, signalStartTimestamp, riseTimestamp, 0, RESULT_FLAG_SPURIOUS);
+    addCalibrationDoubleTrigger(&calibrationPulses, pulse);
+}
+
+void saveLostPulse(long pulse, uint64_t signalStartTimestamp, uint64_t timeoutTimestamp, int startSkewInMicros) {
+    appendResult(&sessionResults, pulse, signalStartTimestamp, timeoutTimestamp, startSkewInMicros, RESULT_FLAG_LOST);
+    publishTelemetryResult(&telemetry, pulse, signalStartTimestamp, timeoutTimestamp, startSkewInMicros, RESULT_FLAG_LOST);
+    finishCalibrationPulse(&calibrationPulses, pulse, CALIBRATION_LOST);
+}
+
+// The pulse on the way is lost, unless its line in pulse already rose
+void timeOutSignal(uint64_t timestamp) {
+    if (signalStatus == SIGNAL_ON_THE_WAY) {
+        saveLostPulse(startPulse, startTimestamp, timestamp, currentStartSkewInMicros);
+        signalStatus = SIGNAL_TIMED_OUT;
+    }
+}
+
+// At the end of the session everything still on the way is lost
+void timeOutAllSignals(uint64_t timestamp) {
+    if (arrival.pending) {
+        arrival.pending = 0;
+        saveLostPulse(arrival.pulse, arrival.startTimestamp, timestamp, arrival.startSkewInMicros);
+        if (signalStatus == SIGNAL_ARRIVING) {
+            signalStatus = SIGNAL_TIMED_OUT;
+        }
+    }
+    timeOutSignal(timestamp);
+    for (int code = 0; code < PIPELINE_MAX_DEPTH; code++) {
+        if (pulsesInFlight[code].inFlight) {
+            pulsesInFlight[code].inFlight = 0;
+            saveLostPulse(pulsesInFlight[code].pulse, pulsesInFlight[code].startTimestamp, timestamp,
+                          pulsesInFlight[code].startSkewInMicros);
+        }
+    }
+}
+
+// The width of the line in pulse decides once it falls, the next pulse may be on the way already
+void finishArrival(uint64_t fallTimestamp) {
+    int current = signalStatus == SIGNAL_ARRIVING && arrival.pulse == startPulse;
+
+    arrival.pending = 0;
+    if (fallTimestamp - arrival.riseTimestamp < (uint64_t) getMinPulseWidth()) {
+        saveSpuriousEdge(arrival.pulse, arrival.startTimestamp, arrival.riseTimestamp);
+        if (current) {
+            signalStatus = SIGNAL_ON_THE_WAY;
+        }
+        else {
+            saveLostPulse(arrival.pulse, arrival.startTimestamp, fallTimestamp, arrival.startSkewInMicros);
+        }
+        return;
+    }
+    if (current) {
+        signalStatus = SIGNAL_ARRIVED;
+    }
+    endTimestamp = arrival.riseTimestamp;
+    saveLatency(arrival.pulse, arrival.startTimestamp, endTimestamp, arrival.startSkewInMicros);
+}
+
+// A line in pulse rose while the pulse was on the way
+void beginArrival(uint64_t riseTimestamp) {
+    int window;
+
+    // Its fall was missed, the queue overflowed
+    if (arrival.pending && arrival.pulse != startPulse) {
+        saveLostPulse(arrival.pulse, arrival.startTimestamp, riseTimestamp, arrival.startSkewInMicros);
+    }
+    arrival.pending = 0;
+    window = riseTimestamp < startTimestamp ? ARRIVAL_TOO_EARLY : checkAcceptanceWindow(startTimestamp, riseTimestamp);
+    if (window != ARRIVAL_ACCEPTED) {
+        saveSpuriousEdge(startPulse, startTimestamp, riseTimestamp);
+        signalStatus = SIGNAL_ON_THE_WAY;
+        if (window == ARRIVAL_TOO_LATE) {
+            timeOutSignal(riseTimestamp);
+        }
+        return;
+    }
+    arrival.pulse = startPulse;
+    arrival.startTimestamp = startTimestamp;
+    arrival.startSkewInMicros = currentStartSkewInMicros;
+    arrival.riseTimestamp = riseTimestamp;
+    arrival.pending = 1;
+    signalStatus = SIGNAL_ARRIVING;
+    if (getMinPulseWidth() == 0) {
+        finishArrival(riseTimestamp);
+    }
+}
+
+// The single pulse on the way starts, the previous one is lost if it did not arrive
+void startSignal(long pulse, uint64_t signalStartTimestamp) {
+    timeOutSignal(signalStartTimestamp);
+    startTimestamp = signalStartTimestamp;
+    startPulse = pulse;
+    pcmDelaysInFrames[pulse % PIPELINE_MAX_DEPTH] = -1;
+    signalStatus = SIGNAL_ON_THE_WAY;
+}
+
+// ####
+// #### PIPELINED PULSES ####
+
+// Several pulses are in flight at once. Each one carries a code from 0 to pipelineDepth - 1
+// in its width, which is the code plus one times pulseWidthInMicros. The DUT keeps the width,
+// but the line in pulse can be stretched a bit by the transistor. That stretch is learned from
+// the pulses that were matched so far and must stay below half of pulseWidthInMicros until then.
+
+int getPulseCode(long pulse) {
+    return(pipelineDepth > 1 ? (int) (pulse % pipelineDepth) : 0);
+}
+
+// Returns the code of a pulse with the given width or -1 if no code matches
+int decodePulseWidth(uint64_t widthInMicros, double stretchInMicros) {
+    long code = lround(((double) widthInMicros - stretchInMicros) / pulseWidthInMicros) - 1;
+
+    if (code < 0 || code >= pipelineDepth) {
+        return(-1);
+    }
+    return((int) code);
+}
+
+void registerCodedPulse(long pulse, int code, uint64_t signalStartTimestamp, int startSkewInMicros) {
+    if (code == -1) {
+        printf("audio_lag_module.c l.1242: Sent pulse has no valid code -> Ignoring it\n");
+        return;
+    }
+    // The code is sent again, so the pulse that had it did not arrive in time
+    if (pulsesInFlight[code].inFlight) {
+        saveLostPulse(pulsesInFlight[code].pulse, pulsesInFlight[code].startTimestamp, signalStartTimestamp,
+                      pulsesInFlight[code].startSkewInMicros);
+    }
+    pulsesInFlight[code].pulse = pulse;
+    pulsesInFlight[code].startTimestamp = signalStartTimestamp;
+    pulsesInFlight[code].startSkewInMicros = startSkewInMicros;
+    pulsesInFlight[code].inFlight = 1;
+}
+
+// Matches a complete line in pulse to the sent pulse with the same code
+void matchCodedPulse(uint64_t lineInFallTimestamp) {
+    uint64_t widthInMicros = lineInFallTimestamp - lineInRiseTimestamp;
+    int code = decodePulseWidth(widthInMicros, pulseStretchInMicros);
+    codedPulse *pulse;
+
+    int window;
+
+    // Not a pulse we sent, one that arrived already or an echo of an earlier one
+    if (code == -1 || !pulsesInFlight[code].inFlight || lineInRiseTimestamp < pulsesInFlight[code].startTimestamp) {
+        saveSpuriousEdge(sessionPulseCount - 1, lineInRiseTimestamp, lineInRiseTimestamp);
+        return;
+    }
+    pulse = &pulsesInFlight[code];
+    window = checkAcceptanceWindow(pulse->startTimestamp, lineInRiseTimestamp);
+    if (window != ARRIVAL_ACCEPTED) {
+        saveSpuriousEdge(pulse->pulse, pulse->startTimestamp, lineInRiseTimestamp);
+        if (window == ARRIVAL_TOO_LATE) {
+            pulse->inFlight = 0;
+            saveLostPulse(pulse->pulse, pulse->startTimestamp, lineInRiseTimestamp, pulse->startSkewInMicros);
+        }
+        return;
+    }
+    pulse->inFlight = 0;
+    saveLatency(pulse->pulse, pulse->startTimestamp, lineInRiseTimestamp, pulse->startSkewInMicros);
+
+    if (pulseStretchCount < PIPELINE_STRETCH_WEIGHT) {
+        pulseStretchCount += 1;
+    }
+    pulseStretchInMicros += ((double) widthInMicros - (code + 1) * pulseWidthInMicros - pulseStretchInMicros) / pulseStretchCount;
+}
+
+// The last pulses of a session can still be on the way after the last interval
+void waitForPulsesInFlight(long measurementCount) {
+    if (pipelineDepth > 1) {
+        halSleep(calculateSignalInterval(measurementCount));
+    }
+}
+
+// ####
+// #### REAL-TIME PROFILE ####
+
+void applyMemoryLock() {
+    int status = lockMemory(PREFAULT_STACK_BYTES);
+
+    if (status < 0) {
+        printf("audio_lag_module.c l.1302: Unable to lock memory (%s)\n", strerror(-status));
+    }
+}
+
+void applyThreadProfile(const char *threadName, int cpu, int priority) {
+    int status;
+
+    status = setCpuAffinity(cpu);
+    if (status < 0) {
+        printf("audio_lag_module.c l.1311: Unable to pin the %s thread to CPU %d (%s)\n", threadName, cpu, strerror(-status));
+    }
+    status = setRealtimePriority(priority);
+    if (status < 0) {
+        printf("audio_lag_module.c l.1315: Unable to set SCHED_FIFO priority %d for the %s thread (%s)\n",
+               priority, threadName, strerror(-status));
+    }
+}
+
+// ####
+// #### BUTTONS ####
+
+// Button alert callback, runs on the alert thread of pigpio and wakes up the main thread
+void onButtonAlert(int gpio, int level, uint32_t tick) {
+    pushEdgeEvent(&buttonEvents, gpio, level, tick);
+    sem_post(&buttonSemaphore);
+}
+
+// Returns the next debounced button press or -1 if there is none
+int takeButtonPress() {
+    edgeEvent event;
+    uint64_t timestamp;
+
+    while (popEdgeEvent(&buttonEvents, &event) == 0) {
+        if (event.level != 1 || event.gpio >= MAX_BUTTON_GPIO) {
+            continue;
+        }
+        timestamp = unwrapTick(event.tick);
+        if (buttonPressTimestamps[event.gpio] != 0
+            && timestamp - buttonPressTimestamps[event.gpio] < BUTTON_DEBOUNCE_IN_MICROS) {
+            continue;
+        }
+        buttonPressTimestamps[event.gpio] = timestamp;
+        return(event.gpio);
+    }
+    return(-1);
+}
+
+// Blocks without using the CPU until a button is pressed
+int waitForButtonPress() {
+    struct timespec timeout;
+    int button;
+
+    while ((button = takeButtonPress()) == -1) {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += BUTTON_WAIT_TIMEOUT_IN_S;
+        sem_timedwait(&buttonSemaphore, &timeout);
+        halTick();
+    }
+    return(button);
+}
+
+// Buttons pressed during a measurement are ignored, like before
+void discardButtonPresses() {
+    while (takeButtonPress() != -1) {
+        // Dropping press
+    }
+    while (sem_trywait(&buttonSemaphore) == 0) {
+        // Resetting wakeups
+    }
+}
+
+// Soak tests, sweeps and job queues only react to the exit button, the other presses are dropped.
+// The press stays requested, so a job queue still sees it after the soak test of a job ended on it.
+int isExitRequested() {
+    int button;
+
+    while ((button = takeButtonPress()) != -1) {
+        if (button == EXIT_BUTTON) {
+            exitRequested = 1;
+        }
+    }
+    return(exitRequested);
+}
+
+// ####
+// #### DMA PULSE TRAINS ####
+
+// The pulses of a train are emitted by the DMA controller at known offsets. Only the first line out
+// edge of a train is needed to place it in the tick timebase, all other line out edges are skipped.
+void onPulseTrainLineOut(int level, uint32_t tick) {
+    if (level == 1 && pulseTrainStartTimestamp == 0) {
+        pulseTrainStartTimestamp = unwrapTick(tick);
+    }
+}
+
+// The pulses of the next train are added to it while they are counted
+void resetPulseTrain() {
+    pulseTrainCount = 0;
+    traceEvent(TRACE_TRAIN_RESET, 0, LINE_OUT, 0, 0, sessionPulseCount, 0);
+}
+
+void addTrainPulse(uint32_t offsetInMicros, uint32_t widthInMicros, int code) {
+    pulseTrainCodes[pulseTrainCount] = code;
+    pulseTrain[pulseTrainCount].offsetInMicros = offsetInMicros;
+    pulseTrain[pulseTrainCount].widthInMicros = widthInMicros;
+    pulseTrainCount += 1;
+    traceEvent(TRACE_TRAIN_PULSE, 0, LINE_OUT, 0, code, sessionPulseCount - 1, (int32_t) offsetInMicros);
+}
+
+// The train is placed in the tick timebase by its first line out edge
+void markPulseTrainSent() {
+    pulseTrainEmitted = 0;
+    pulseTrainStartTimestamp = 0;
+    traceEvent(TRACE_TRAIN_SENT, 0, LINE_OUT, 0, 0, sessionPulseCount - 1, pulseTrainCount);
+}
+
+// Marks all pulses of the train as sent, that were emitted up to the given timestamp,
+// so they are matched against the line in edges in the order everything happened
+void emitPulseTrain(uint64_t untilTimestamp) {
+    uint64_t pulseStartTimestamp;
+    long pulse;
+
+    if (pulseTrainStartTimestamp == 0) {
+        return;
+    }
+    while (pulseTrainEmitted < pulseTrainCount) {
+        pulseStartTimestamp = pulseTrainStartTimestamp + pulseTrain[pulseTrainEmitted].offsetInMicros;
+        if (pulseStartTimestamp > untilTimestamp) {
+            break;
+        }
+        // The train holds the last pulses counted
+        pulse = sessionPulseCount - pulseTrainCount + pulseTrainEmitted;
+        if (pipelineDepth > 1) {
+            registerCodedPulse(pulse, pulseTrainCodes[pulseTrainEmitted], pulseStartTimestamp, 0);
+        }
+        else {
+            startSignal(pulse, pulseStartTimestamp);
+        }
+        pulseTrainEmitted += 1;
+    }
+}
+
+// Pulses still on the way are matched by their code, or after the next train was built
+void finishPulseTrain() {
+    traceEvent(TRACE_TRAIN_DONE, 0, LINE_OUT, 0, 0, sessionPulseCount - 1, 0);
+    emitPulseTrain(UINT64_MAX);
+}
+
+// ####
+// #### CAPTURE READER ####
+
+// In the capture and round trip modes the pulse arrives on the USB capture of the DUT instead of line in.
+// A reader thread waits for every period with poll, reads it and finds the pulses in it like the
+// transistor would. Their edges are queued with the tick at which the frame was captured,
+// so the measurement loop matches them like the edges of the line in GPIO.
+typedef struct {
+    halPcm *handle; /* NULL while the reader is stopped */
+    halPcmConfig config;
+    const char *deviceName;
+    pthread_t thread;
+    atomic_int active;
+    atomic_uint analysedTick; /* Tick at which the last frame searched for pulses was captured */
+    edgeQueue edgeEvents;
+    char *buffer; /* One period as read from the device */
+    float *samples; /* First channel of the period */
+    int signalOn;
+    unsigned long quietFrames;
+} captureReader;
+captureReader lineInCapture;
+edgeEvent nextGpioEvent, nextCaptureEvent; // Taken from their queues but not processed yet
+int nextGpioEventPending, nextCaptureEventPending;
+
+int isCaptureMode() {
+    return(measurementMode == CAPTURE_MODE || measurementMode == ROUND_TRIP_MODE);
+}
+
+// Frames captured since the stream started, at the tick of the timestamp
+double getFramesCaptured(const halPcmTimestamp *timestamp, unsigned int sampleRate) {
+    // The audio timestamp is more precise than the delay, like for the playback
+    if (timestamp->audioTimeInNanos >= 0) {
+        return(timestamp->audioTimeInNanos * sampleRate / 1000000000.0);
+    }
+    return((double) timestamp->framesWritten + timestamp->delayFrames);
+}
+
+// Opens the first USB card that can capture, in the same order as the USB playback devices
+int openCaptureReaderDevice(captureReader *reader) {
+    static const char *pcmNames[MAX_PARALLEL_DEVICES] = {ALSA_USB_TOP_OUT, ALSA_USB_BOTTOM_OUT, ALSA_USB_TOP2_OUT, ALSA_USB_BOTTOM2_OUT};
+    int status = -ENODEV;
+
+    for (int i = 0; i < MAX_PARALLEL_DEVICES && status < 0; i++) {
+        reader->deviceName = pcmNames[i];
+        status = halPcmOpenCapture(&reader->handle, reader->deviceName);
+    }
+    if (status < 0) {
+        printf("audio_lag_module.c l.1497: Unable to open a USB capture device\n");
+        reader->handle = NULL;
+        return(status);
+    }
+    reader->config.format = requestedFormat;
+    reader->config.channels = 1;
+    reader->config.sampleRate = requestedSampleRate;
+    reader->config.periodFrames = requestedPeriodFrames;
+    reader->config.bufferFrames = CAPTURE_BUFFER_IN_S * requestedSampleRate;
+    reader->config.mmap = 0;
+    status = halPcmConfigure(reader->handle, &reader->config);
+    if (status < 0) {
+        printf("audio_lag_module.c l.1509: Unable to set the hardware parameters of capture device %s\n", reader->deviceName);
+        halPcmClose(reader->handle);
+        reader->handle = NULL;
+    }
+    return(status);
+}
+
+// Finds the edges of the pulses in the period just read: On with the first loud frame,
+// off with the first frame of CAPTURE_HOLD_IN_S silence
+void findCapturedEdges(captureReader *reader, unsigned long frames) {
+    unsigned int rate = reader->config.sampleRate;
+    unsigned long holdFrames = rate * CAPTURE_HOLD_IN_S;
+    halPcmTimestamp timestamp;
+    uint32_t firstTick;
+
+    if (halPcmGetTimestamp(reader->handle, &timestamp) < 0) {
+        return;
+    }
+    // Tick at which the first frame of the period was captured
+    firstTick = timestamp.tick - (uint32_t) lround((getFramesCaptured(&timestamp, rate) - (double) (timestamp.framesWritten - frames))
+                                                   * 1000000.0 / rate);
+    getFirstChannelSamples(reader->buffer, reader->config.format, reader->config.channels, frames, reader->samples);
+    for (unsigned long frame = 0; frame < frames; frame++) {
+        if (fabsf(reader->samples[frame]) >= CAPTURE_THRESHOLD) {
+            reader->quietFrames = 0;
+            if (!reader->signalOn) {
+                reader->signalOn = 1;
+                pushEdgeEvent(&reader->edgeEvents, LINE_IN, 1, firstTick + (uint32_t) lround(frame * 1000000.0 / rate));
+            }
+        }
+        else if (reader->signalOn && ++reader->quietFrames >= holdFrames) {
+            reader->signalOn = 0;
+            pushEdgeEvent(&reader->edgeEvents, LINE_IN, 0,
+                          firstTick + (int32_t) lround(((double) frame + 1 - holdFrames) * 1000000.0 / rate));
+        }
+    }
+    atomic_store(&reader->analysedTick, firstTick + (uint32_t) lround(frames * 1000000.0 / rate));
+}
+
+void *runCaptureReader(void *argument) {
+    captureReader *reader = (captureReader *) argument;
+    int started = 0;
+    long status;
+
+    while (atomic_load(&reader->active)) {
+        // The first read starts the stream, poll would wait for nothing before
+        status = started ? halPcmWait(reader->handle, CAPTURE_POLL_TIMEOUT_IN_MS) : 1;
+        if (status == 0) {
+            continue;
+        }
+        if (status > 0) {
+            status = halPcmRead(reader->handle, reader->buffer, reader->config.periodFrames);
+        }
+        if (status == -EPIPE) {
+            printf("audio_lag_module.c l.1563: Overrun occured during snd_pcm_readi -> Preparing capture device, pulses on the way can be lost\n");
+            halPcmPrepare(reader->handle);
+            reader->signalOn = 0;
+            started = 0;
+        }
+        else if (status < 0) {
+            printf("audio_lag_module.c l.1569: Error during snd_pcm_readi -> Stopping capture reader\n");
+            break;
+        }
+        else {
+            started = 1;
+            findCapturedEdges(reader, (unsigned long) status);
+        }
+    }
+    atomic_store(&reader->active, 0);
+    return(NULL);
+}
+
+void freeCaptureReader(captureReader *reader) {
+    halPcmClose(reader->handle);
+    reader->handle = NULL;
+    free(reader->buffer);
+    reader->buffer = NULL;
+    free(reader->samples);
+    reader->samples = NULL;
+}
+
+int startCaptureReader() {
+    captureReader *reader = &lineInCapture;
+    int status;
+
+    status = openCaptureReaderDevice(reader);
+    if (status < 0) {
+        return(status);
+    }
+    reader->buffer = (char *) malloc(reader->config.periodFrames * getBytesPerSample(reader->config.format) * reader->config.channels);
+    reader->samples = (float *) malloc(reader->config.periodFrames * sizeof(float));
+    if (reader->buffer == NULL || reader->samples == NULL) {
+        freeCaptureReader(reader);
+        return(-ENOMEM);
+    }
+    reader->signalOn = 0;
+    reader->quietFrames = 0;
+    initEdgeQueue(&reader->edgeEvents);
+    nextCaptureEventPending = 0;
+    // Nothing sent before has to be searched for
+    atomic_store(&reader->analysedTick, halTick());
+    atomic_store(&reader->active, 1);
+    status = pthread_create(&reader->thread, NULL, runCaptureReader, reader);
+    if (status != 0) {
+        printf("audio_lag_module.c l.1613: Unable to start the capture reader (%s)\n", strerror(status));
+        atomic_store(&reader->active, 0);
+        freeCaptureReader(reader);
+        return(-status);
+    }
+    return(0);
+}
+
+void stopCaptureReader() {
+    captureReader *reader = &lineInCapture;
+
+    if (reader->handle == NULL) {
+        return;
+    }
+    atomic_store(&reader->active, 0);
+    pthread_join(reader->thread, NULL);
+    freeCaptureReader(reader);
+}
+
+// Waits until the reader searched the capture up to untilTick, so a pulse is never matched after the next one was sent.
+// The reader needs real time for that, so this sleeps for real instead of with halSleep.
+void waitForCapture(uint32_t untilTick) {
+    struct timespec step = {0, CAPTURE_WAIT_STEP_IN_MICROS * 1000};
+
+    for (long waitedInMicros = 0;
+         waitedInMicros < CAPTURE_WAIT_TIMEOUT_IN_S * 1000000
+         && atomic_load(&lineInCapture.active)
+         && (int32_t) (atomic_load(&lineInCapture.analysedTick) - untilTick) < 0;
+         waitedInMicros += CAPTURE_WAIT_STEP_IN_MICROS) {
+        nanosleep(&step, NULL);
+    }
+}
+
+// Takes the older one of the next GPIO edge and the next edge found by the capture reader,
+// returns -1 if there is none. In the capture modes the reader replaces the line in GPIO.
+int takeNextEdgeEvent(edgeEvent *event) {
+    while (!nextGpioEventPending && popEdgeEvent(&edgeEvents, &nextGpioEvent) == 0) {
+        nextGpioEventPending = !(isCaptureMode() && nextGpioEvent.gpio == LINE_IN);
+    }
+    if (!nextCaptureEventPending) {
+        nextCaptureEventPending = popEdgeEvent(&lineInCapture.edgeEvents, &nextCaptureEvent) == 0;
+    }
+    if (nextCaptureEventPending
+        && (!nextGpioEventPending || (int32_t) (nextCaptureEvent.tick - nextGpioEvent.tick) < 0)) {
+        *event = nextCaptureEvent;
+        nextCaptureEventPending = 0;
+        return(0);
+    }
+    if (nextGpioEventPending) {
+        *event = nextGpioEvent;
+        nextGpioEventPending = 0;
+        return(0);
+    }
+    return(-1);
+}
+
+// ####
+// #### BINARY RESULTS ####
+
+// With --binary-results the pulses of a session are streamed into a .lag file (results.h) while
+// measuring, instead of the CSV with one row per pulse. The summary CSV is saved next to it as before,
+// lag_export converts the file to CSV or JSON.
+
+unsigned int getTickResolutionInMicros() {
+    // 0 keeps the default of pigpio
+    return(microsPerSample > 0 ? microsPerSample : 5);
+}
+
+unsigned int getResultOptions() {
+    return((persistentStream ? RESULT_OPTION_PERSISTENT_STREAM : 0)
+           | (useHardwareTimestamps ? RESULT_OPTION_HW_TIMESTAMPS : 0)
+           | (useMmap ? RESULT_OPTION_MMAP : 0)
+           | (dmaPulses ? RESULT_OPTION_DMA_PULSES : 0)
+           | (realtimeProfile ? RESULT_OPTION_REALTIME : 0)
+           | (soakMode ? RESULT_OPTION_SOAK : 0)
+           | (subtractRigOffset && rigOffsetPath != NULL ? RESULT_OPTION_RIG_OFFSET : 0));
+}
+
+void describeSessionCalibration(resultHeader *header) {
+    const calibrationQuality *calibration = getSessionCalibration();
+
+    if (calibration == NULL) {
+        return;
+    }
+    header->calibrationPulses = calibration->pulses;
+    header->calibrationDetectionRate = (float) calibration->detectionRate;
+    header->calibrationSpreadInMicros = (float) calibration->spreadInMicros;
+    header->calibrationDoubleTriggers = calibration->doubleTriggers;
+    header->calibrationLatencyInMicros = calibration->medianInMicros;
+    header->calibrationGrade = calibration->grade;
+    if (header->startTimeInMicros > lastCalibrationTimeInMicros) {
+        header->calibrationAgeInS = (uint32_t) ((header->startTimeInMicros - lastCalibrationTimeInMicros) / 1000000);
+    }
+}
+
+// Configuration of the session as far as it is negotiated
+void describeSessionResults(resultHeader *header) {
+    // Line out sessions have no PCM configuration
+    if (sampleRate > 0) {
+        header->sampleRate = sampleRate;
+        header->channels = channelCount;
+        header->bytesPerFrame = getBytesPerSample(negotiatedFormat) * channelCount;
+        header->periodFrames = negotiatedPeriodFrames;
+        header->bufferFrames = negotiatedBufferFrames;
+        setResultText(header->format, sizeof(header->format), getFormatName(negotiatedFormat));
+    }
+    header->pipelineDepth = pipelineDepth;
+    header->options = getResultOptions();
+    header->rigOffsetInMicros = rigOffsetInMicros;
+    header->glitchFilterInMicros = glitchFilterInMicros;
+    header->noiseFilterInMicros = noiseFilterSteadyInMicros;
+    header->minPulseWidthInMicros = minPulseWidthInMicros;
+    header->acceptanceSigmas = (float) acceptanceSigmas;
+    describeSessionCalibration(header);
+    setResultText(header->waveform, sizeof(header->waveform), getWaveformName(pulseWaveform));
+    if (measurementMode == LINE_OUT_MODE_BUTTON || measurementMode == CAPTURE_MODE) {
+        snprintf(header->device, sizeof(header->device), "GPIO %d", LINE_OUT);
+    }
+    else if (pcmDeviceName != NULL) {
+        setResultText(header->device, sizeof(header->device), pcmDeviceName);
+    }
+    if (isCaptureMode() && lineInCapture.deviceName != NULL) {
+        setResultText(header->captureDevice, sizeof(header->captureDevice), lineInCapture.deviceName);
+    }
+    else if (captureDeviceName != NULL) {
+        setResultText(header->captureDevice, sizeof(header->captureDevice), captureDeviceName);
+    }
+    else if (!isCaptureMode()) {
+        snprintf(header->captureDevice, sizeof(header->captureDevice), "GPIO %d", LINE_IN);
+    }
+}
+
+// Creates the result file of a session, sessionFilePath is set like for the CSV
+int openSessionResults() {
+    char fileName[1024], filePath[1024];
+    char dutInput[1024], dutOutput[1024];
+    resultHeader header;
+    int status;
+
+    getSessionFileName(fileName, dutInput, dutOutput);
+    getMeasurementsFilePath(sessionFilePath, fileName);
+    strcpy(filePath, sessionFilePath);
+    strcat(filePath, RESULT_FILE_SUFFIX);
+    initResultHeader(&header, halTick(), getTickResolutionInMicros());
+    setResultText(header.dutInput, sizeof(header.dutInput), dutInput);
+    setResultText(header.dutOutput, sizeof(header.dutOutput), dutOutput);
+    describeSessionResults(&header);
+    status = openResultWriter(&sessionResults, filePath, &header);
+    if (status < 0) {
+        printf("audio_lag_module.c l.1762: Could not open result file (%s)\n", strerror(-status));
+    }
+    return(status);
+}
+
+// The header is rewritten once the configuration is known, so it is complete even after a crash
+void updateSessionResults() {
+    if (isResultWriterOpen(&sessionResults)) {
+        describeSessionResults(lockResultHeader(&sessionResults));
+        unlockResultHeader(&sessionResults);
+    }
+    if (isResultWriterOpen(&sessionTrace)) {
+        describeSessionResults(lockResultHeader(&sessionTrace));
+        unlockResultHeader(&sessionTrace);
+    }
+}
+
+// Prints what the writer of a result file lost
+void closeResults(resultWriter *writer, const char *name) {
+    unsigned int droppedResults = takeDroppedResultCount(writer);
+    int status = closeResultWriter(writer);
+
+    if (droppedResults > 0) {
+        printf("audio_lag_module.c l.1785: Result queue overflow on %s -> %u pulses not saved\n", name, droppedResults);
+    }
+    if (status < 0) {
+        printf("audio_lag_module.c l.1788: Could not write result file of %s (%s)\n", name, strerror(-status));
+    }
+}
+
+// Creates the trace file of a session, named like its results
+int openSessionTrace() {
+    char fileName[1024], filePath[1024];
+    char dutInput[1024], dutOutput[1024];
+    resultHeader header;
+    int status;
+
+    getSessionFileName(fileName, dutInput, dutOutput);
+    getMeasurementsFilePath(filePath, fileName);
+    strcat(filePath, TRACE_FILE_SUFFIX);
+    initTraceHeader(&header, halTick(), getTickResolutionInMicros());
+    setResultText(header.dutInput, sizeof(header.dutInput), dutInput);
+    setResultText(header.dutOutput, sizeof(header.dutOutput), dutOutput);
+    describeSessionResults(&header);
+    status = openResultWriter(&sessionTrace, filePath, &header);
+    if (status < 0) {
+        printf("audio_lag_module.c l.1808: Could not open trace file (%s)\n", strerror(-status));
+    }
+    return(status);
+}
+
+void closeSessionTrace() {
+    resultHeader *header;
+
+    if (!isResultWriterOpen(&sessionTrace)) {
+        return;
+    }
+    header = lockResultHeader(&sessionTrace);
+    describeSessionResults(header);
+    header->pulses = sessionPulseCount;
+    header->finished = 1;
+    unlockResultHeader(&sessionTrace);
+    closeResults(&sessionTrace, "the trace");
+}
+
+// Completes the result file of the session and saves the summary CSV next to it
+void closeSessionResults() {
+    resultHeader *header;
+    char dutInput[sizeof(header->dutInput)], dutOutput[sizeof(header->dutOutput)];
+
+    if (!isResultWriterOpen(&sessionResults)) {
+        return;
+    }
+    header = lockResultHeader(&sessionResults);
+    describeSessionResults(header);
+    header->pulses = sessionPulseCount;
+    header->finished = 1;
+    memcpy(dutInput, header->dutInput, sizeof(dutInput));
+    memcpy(dutOutput, header->dutOutput, sizeof(dutOutput));
+    unlockResultHeader(&sessionResults);
+    closeResults(&sessionResults, "the session");
+    writeSummaryToCSV(dutInput, dutOutput);
+}
+
+// ####
+// #### TELEMETRY ####
+
+// With --telemetry the measurement loop publishes every result and the running statistics of its
+// session into shared memory, and a server thread exposes them on a Unix domain socket (telemetry.h).
+// Publishing only writes memory, it never waits for the server or a reader.
+
+void startTelemetry() {
+    int status = openTelemetry(&telemetry, TELEMETRY_SHM_NAME, telemetrySocketPath);
+
+    if (status < 0) {
+        printf("audio_lag_module.c l.1857: Could not start the telemetry (%s)\n", strerror(-status));
+        return;
+    }
+    printf("Telemetry: shared memory %s, metrics on %s\n", TELEMETRY_SHM_NAME, telemetrySocketPath);
+}
+
+// Called before every pulse, the percentiles take STATS_BUCKETS steps and are only updated
+// every LIVE_STATISTICS_INTERVAL_IN_MICROS and once the session is over
+void publishTelemetryStatistics(int running) {
+    telemetryStatistics *statistics;
+    resultHeader header;
+    uint64_t now;
+
+    statistics = beginTelemetryUpdate(&telemetry);
+    if (statistics == NULL) {
+        return;
+    }
+    statistics->running = running;
+    statistics->pulses = sessionPulseCount;
+    statistics->valid = sessionStats.count;
+    statistics->lost = getLostPulseCount();
+    statistics->spurious = spuriousEdgeCount;
+    statistics->lastInMicros = sessionStats.last;
+    statistics->minInMicros = sessionStats.min;
+    statistics->maxInMicros = sessionStats.max;
+    statistics->meanInMicros = sessionStats.mean;
+    statistics->standardDeviationInMicros = getLatencyStandardDeviation(&sessionStats);
+    statistics->jitterMeanInMicros = sessionStats.jitterMean;
+    statistics->jitterMaxInMicros = sessionStats.jitterMax;
+    statistics->driftInPpm = driftTracking ? getDriftInPpm(&sessionDrift) : 0.0;
+    now = getTick64();
+    if (!running || now - lastTelemetryTimestamp >= LIVE_STATISTICS_INTERVAL_IN_MICROS) {
+        lastTelemetryTimestamp = now;
+        statistics->p50InMicros = getLatencyPercentile(&sessionStats, 50.0);
+        statistics->p90InMicros = getLatencyPercentile(&sessionStats, 90.0);
+        statistics->p99InMicros = getLatencyPercentile(&sessionStats, 99.0);
+        statistics->p999InMicros = getLatencyPercentile(&sessionStats, 99.9);
+        // The PCM device is only known once it was opened
+        memset(&header, 0, sizeof(header));
+        describeSessionResults(&header);
+        setResultText(statistics->device, sizeof(statistics->device), header.device);
+    }
+    endTelemetryUpdate(&telemetry);
+}
+
+void startTelemetrySession(int measurementMethod) {
+    telemetryStatistics *statistics;
+    char fileName[1024], dutInput[1024], dutOutput[1024];
+
+    statistics = beginTelemetryUpdate(&telemetry);
+    if (statistics == NULL) {
+        return;
+    }
+    getMeasurementDependentValuesForCSV(fileName, dutInput, dutOutput);
+    statistics->sessions += 1;
+    setResultText(statistics->method, sizeof(statistics->method), measurementMethod == CALIBRATE ? "calibrate" : "measure");
+    setResultText(statistics->dutInput, sizeof(statistics->dutInput), dutInput);
+    setResultText(statistics->dutOutput, sizeof(statistics->dutOutput), dutOutput);
+    statistics->device[0] = '\0';
+    endTelemetryUpdate(&telemetry);
+    lastTelemetryTimestamp = 0;
+    publishTelemetryStatistics(1);
+}
+
+// ####
+// #### CALIBRATION MODE ####
+
+// The calibration mode sends pulses as fast as the latency of the DUT allows until another button
+// is pressed, and grades the last CALIBRATION_WINDOW of them (calibration.h) on the LEDs and the
+// console every CALIBRATION_FEEDBACK_INTERVAL_IN_MICROS, so a new level of the DUT shows right away.
+// The quality at the end is saved with the later sessions of the same mode, in the header of the
+// binary results and in the summary CSV.
+
+void userFeedbackGoodSignal() {
+    halWrite(CALIBRATION_MODE_GREEN_LED, 1);
+    halWrite(CALIBRATION_MODE_YELLOW_LED, 1);
+    halWrite(CALIBRATION_MODE_RED_LED, 1);
+}
+
+void userFeedbackMediumSignal() {
+    halWrite(CALIBRATION_MODE_GREEN_LED, 0);
+    halWrite(CALIBRATION_MODE_YELLOW_LED, 1);
+    halWrite(CALIBRATION_MODE_RED_LED, 1);
+}
+
+void userFeedbackBadSignal() {
+    halWrite(CALIBRATION_MODE_GREEN_LED, 0);
+    halWrite(CALIBRATION_MODE_YELLOW_LED, 0);
+    halWrite(CALIBRATION_MODE_RED_LED, 1);
+}
+
+void userFeedbackCalibrationCancelled() {
+    halWrite(CALIBRATION_MODE_GREEN_LED, 0);
+    halWrite(CALIBRATION_MODE_YELLOW_LED, 0);
+    halWrite(CALIBRATION_MODE_RED_LED, 0);
+}
+
+void showCalibrationQuality(const calibrationQuality *quality) {
+    if (quality->grade == CALIBRATION_GRADE_GOOD) {
+        userFeedbackGoodSignal();
+    }
+    else if (quality->grade == CALIBRATION_GRADE_MEDIUM) {
+        userFeedbackMediumSignal();
+    }
+    else if (quality->grade == CALIBRATION_GRADE_BAD) {
+        userFeedbackBadSignal();
+    }
+    else {
+        // Too few pulses for a grade, the LEDs keep the last one
+    }
+}
+
+void printCalibrationQuality(const calibrationQuality *quality) {
+    printf("%d of %d pulses detected (%.0f %%), latency %d us, spread %.1f us, %d double triggers, %s",
+           quality->detected,
+           quality->pulses,
+           100.0 * quality->detectionRate,
+           quality->medianInMicros,
+           quality->spreadInMicros,
+           quality->doubleTriggers,
+           getCalibrationGradeName(quality->grade));
+}
+
+// Called before every pulse of the calibration stream, returns 0 once another button ended it
+int updateCalibration() {
+    calibrationQuality quality;
+    uint64_t now;
+    int button;
+
+    // The latencies of a calibration are not saved
+    validMeasurementsCount = 0;
+    // Pressing the calibration button again keeps the stream running
+    button = takeButtonPress();
+    if (button != -1 && button != CALIBRATION_MODE_BUTTON) {
+        calibrationCancelButton = button;
+        return(0);
+    }
+    now = getTick64();
+    if (lastCalibrationFeedbackTimestamp != 0 && now - lastCalibrationFeedbackTimestamp < CALIBRATION_FEEDBACK_INTERVAL_IN_MICROS) {
+        return(1);
+    }
+    getCalibrationQuality(&calibrationPulses, &quality);
+    if (quality.pulses == 0) {
+        return(1);
+    }
+    lastCalibrationFeedbackTimestamp = now;
+    showCalibrationQuality(&quality);
+    if (printEveryMeasurement) {
+        printf("\r### Calibration: ");
+        printCalibrationQuality(&quality);
+        // Overwrites the end of a longer line before
+        printf("   ");
+        fflush(stdout);
+        liveStatisticsPrinted = 1;
+    }
+    return(1);
+}
+
+// ####
+// #### LINE LEVEL VIA GPIOS ####
+
+// GPIO alert callback, runs on the alert thread of pigpio.
+// It only queues the edge, everything else happens in processEdgeEvents on the main thread.
+void onGpioAlert(int gpio, int level, uint32_t tick) {
+    // The glitch filter reports an edge once the level was steady, the edge itself was that much earlier
+    if (gpio == LINE_IN) {
+        tick -= glitchFilterInMicros;
+    }
+    pushEdgeEvent(&edgeEvents, gpio, level, tick);
+}
+
+// Line-in edge
+void onLineIn(int gpio, int level, uint32_t tick) {
+
+    if (pipelineDepth > 1) {
+        if (level == 1) {
+            lineInRiseTimestamp = unwrapTick(tick);
+        }
+        else {
+            matchCodedPulse(unwrapTick(tick));
+        }
+        return;
+    }
+    
+    // Rising Edge
+    if (level == 1) {
+
+        // This condition avoids, that multiple trigger of the transistor lead to reassignment of the endTimestamp
+        if (signalStatus == SIGNAL_ON_THE_WAY || signalStatus == SIGNAL_ARRIVING) {
+            beginArrival(unwrapTick(tick));
+        }
+        else {
+            saveSpuriousEdge(startPulse, startTimestamp, unwrapTick(tick));
+        }
+    }
+    else if (arrival.pending) {
+        finishArrival(unwrapTick(tick));
+    }
+}
+
+// Line-out edge, the edges of a pulse are processed before the next pulse is counted
+void onLineOut(int gpio, int level, uint32_t tick) {
+
+    // The code of the pulse is read from the width of the sent pulse
+    if (pipelineDepth > 1) {
+        if (level == 1) {
+            lineOutRiseTimestamp = unwrapTick(tick);
+        }
+        else {
+            registerCodedPulse(sessionPulseCount - 1, decodePulseWidth(unwrapTick(tick) - lineOutRiseTimestamp, 0), lineOutRiseTimestamp, 0);
+        }
+        return;
+    }
+    
+    // Rising Edge
+    if (level == 1) {
+        startSignal(sessionPulseCount - 1, unwrapTick(tick));
+    }
+}
+
+void processEdgeEvent(const edgeEvent *event) {
+    traceEvent(TRACE_EDGE, event->tick, event->gpio, event->level, 0, sessionPulseCount - 1, 0);
+    if (event->gpio == LINE_IN) {
+        if (pulseTrainCount > 0) {
+            emitPulseTrain(unwrapTick(event->tick));
+        }
+        onLineIn(event->gpio, event->level, event->tick);
+    }
+    else if (event->gpio == LINE_OUT && pulseTrainCount > 0) {
+        onPulseTrainLineOut(event->level, event->tick);
+    }
+    else if (event->gpio == LINE_OUT) {
+        onLineOut(event->gpio, event->level, event->tick);
+    }
+}
+
+// Matches all queued edges, in the order they occurred
+void processEdgeEvents() {
+    edgeEvent event;
+    unsigned int droppedEdges;
+
+    // The line out edges are queued right away, the captured pulse only after its period was read
+    if (isCaptureMode()) {
+        waitForCapture(halTick());
+    }
+    while (takeNextEdgeEvent(&event) == 0) {
+        processEdgeEvent(&event);
+    }
+    droppedEdges = takeDroppedEdgeCount(&edgeEvents) + takeDroppedEdgeCount(&lineInCapture.edgeEvents);
+    if (droppedEdges > 0) {
+        traceEvent(TRACE_EDGES_DROPPED, 0, 0, 0, 0, sessionPulseCount - 1, (int32_t) droppedEdges);
+        printf("audio_lag_module.c l.2108: Edge queue overflow -> %u edges lost\n", droppedEdges);
+    }
+}
+
+// The next pulse belongs to the session, the trace does not need its tick.
+// The previous one had its interval to arrive, all edges up to now were processed.
+void countPulse() {
+    timeOutSignal(lastTick64);
+    sessionPulseCount += 1;
+    startCalibrationPulse(&calibrationPulses, sessionPulseCount - 1);
+    traceEvent(TRACE_PULSE, 0, 0, 0, 0, sessionPulseCount - 1, 0);
+}
+
+// Called before every pulse, returns 0 if the session is over
+int prepareNextPulse() {
+    processEdgeEvents();
+    if (soakMode) {
+        if (validMeasurementsCount >= SOAK_FLUSH_MEASUREMENTS) {
+            flushSoakMeasurements();
+        }
+        if ((soakDurationInS > 0 && getTick64() >= soakEndTimestamp)
+            || isExitRequested()) {
+            return(0);
+        }
+    }
+    if (calibrationStream) {
+        if (!updateCalibration()) {
+            return(0);
+        }
+    }
+    else {
+        printLiveStatistics();
+    }
+    publishTelemetryStatistics(1);
+    countPulse();
+    return(1);
+}
+
+// Line-out signal creation
+void sendSignalViaLineOut(double signalIntervalInS, int code) {
+    // Send signal through LINE_OUT gpio pin
+    halWrite(LINE_OUT, 1);
+    halSleep(SIGNAL_LENGTH_IN_S * (code + 1));
+    halWrite(LINE_OUT, 0);
+    halSleep(signalIntervalInS);
+}
+
+// Builds the next train from the signal intervals, returns its duration
+uint32_t preparePulseTrain(int measurementMethod, long *pulse, long iterations) {
+    uint32_t offsetInMicros = 0, widthInMicros;
+    double signalIntervalInS;
+    int code;
+
+    resetPulseTrain();
+    while (pulseTrainCount < PULSE_TRAIN_PULSES && *pulse < iterations) {
+        if (!prepareNextPulse()) {
+            *pulse = iterations;
+            break;
+        }
+        signalIntervalInS = getSignalInterval(measurementMethod, *pulse);
+        code = getPulseCode(*pulse);
+        widthInMicros = (uint32_t) lround(SIGNAL_LENGTH_IN_S * 1000000.0 * (code + 1));
+        addTrainPulse(offsetInMicros, widthInMicros, code);
+        offsetInMicros += widthInMicros + (uint32_t) lround(signalIntervalInS * 1000000.0);
+        *pulse += 1;
+    }
+    return(offsetInMicros);
+}
+
+void startMeasurementLineOutDma(int measurementMethod) {
+    long iterations, pulse = 0;
+    uint32_t durationInMicros;
+    int status;
+
+    iterations = getIterations(measurementMethod);
+    while (pulse < iterations) {
+        durationInMicros = preparePulseTrain(measurementMethod, &pulse, iterations);
+        if (pulseTrainCount == 0) {
+            break;
+        }
+        markPulseTrainSent();
+        status = halPulseTrainSend(LINE_OUT, pulseTrain, pulseTrainCount, durationInMicros);
+        if (status < 0) {
+            printf("audio_lag_module.c l.2191: Unable to send pulse train (%d) -> Stopping measurement\n", status);
+            break;
+        }
+        // The CPU has nothing to do until the train is over
+        halSleep(durationInMicros / 1000000.0);
+        while (halPulseTrainBusy()) {
+            halSleep(SIGNAL_LENGTH_IN_S);
+        }
+        processEdgeEvents();
+        finishPulseTrain();
+    }
+    resetPulseTrain();
+    waitForPulsesInFlight(sessionPulseCount);
+    processEdgeEvents();
+}
+
+void startMeasurementLineOut(int measurementMethod) {
+    double signalIntervalInS;
+    long iterations;
+
+    if (dmaPulses) {
+        startMeasurementLineOutDma(measurementMethod);
+        return;
+    }
+    iterations = getIterations(measurementMethod);
+    for (long i = 0; i < iterations; i++) {
+        if (!prepareNextPulse()) {
+            break;
+        }
+        signalIntervalInS = getSignalInterval(measurementMethod, i);
+        sendSignalViaLineOut(signalIntervalInS, getPulseCode(i));
+    }
+    waitForPulsesInFlight(sessionPulseCount);
+    processEdgeEvents();
+}
+
+// Lights the LEDs of the measurement mode and turns off the ones of the other modes
+void showMeasurementMode() {
+    halWrite(LINE_OUT_MODE_LED, 0);
+    halWrite(USB_OUT_MODE_LED, 0);
+    halWrite(HDMI_OUT_MODE_LED, 0);
+    if (measurementMode == USB_OUT_MODE_BUTTON || measurementMode == ROUND_TRIP_MODE) {
+        halWrite(USB_OUT_MODE_LED, 1);
+    }
+    else if (measurementMode == HDMI_OUT_MODE_BUTTON) {
+        halWrite(HDMI_OUT_MODE_LED, 1);
+    }
+    else {
+        halWrite(LINE_OUT_MODE_LED, 1);
+    }
+    // The capture mode sends on line out and receives on USB
+    if (measurementMode == CAPTURE_MODE) {
+        halWrite(USB_OUT_MODE_LED, 1);
+    }
+}
+
+void initGPIOs() {
+
+    if (microsPerSample > 0 && halConfigureSampling(microsPerSample) < 0) {
+        printf("audio_lag_module.c l.2250: Unable to set the GPIO sample period to %u us\n", microsPerSample);
+    }
+    // The alert thread is created by halInitialise and inherits the profile of the main thread
+    if (realtimeProfile) {
+        applyThreadProfile("alert", ALERT_CPU, ALERT_PRIORITY);
+    }
+
+    // Initialise library
+    if (halInitialise() < 0) {
+        printf("audio_lag_module.c l.2259: Unable to initialise the hardware abstraction layer\n");
+        exit(1);
+    }
+    if (realtimeProfile) {
+        applyMemoryLock();
+        applyThreadProfile("measurement", MEASUREMENT_CPU, MEASUREMENT_PRIORITY);
+    }
+
+    // Set GPIO Modes
+    halSetMode(LINE_OUT, HAL_OUTPUT);
+    halSetMode(LINE_IN, HAL_INPUT);
+    halSetMode(START_MEASUREMENT_BUTTON, HAL_INPUT);
+    halSetMode(CALIBRATION_MODE_BUTTON, HAL_INPUT);
+    halSetMode(LINE_OUT_MODE_BUTTON, HAL_INPUT);
+    halSetMode(USB_OUT_MODE_BUTTON, HAL_INPUT);
+    halSetMode(HDMI_OUT_MODE_BUTTON, HAL_INPUT);
+    halSetMode(EXIT_BUTTON, HAL_INPUT);
+    halSetMode(START_MEASUREMENT_LED, HAL_OUTPUT);
+    halSetMode(CALIBRATION_MODE_GREEN_LED, HAL_OUTPUT);
+    halSetMode(CALIBRATION_MODE_YELLOW_LED, HAL_OUTPUT);
+    halSetMode(CALIBRATION_MODE_RED_LED, HAL_OUTPUT);
+    halSetMode(LINE_OUT_MODE_LED, HAL_OUTPUT);
+    halSetMode(USB_OUT_MODE_LED, HAL_OUTPUT);
+    halSetMode(HDMI_OUT_MODE_LED, HAL_OUTPUT);
+    halSetMode(EXIT_LED, HAL_OUTPUT);
+
+    // Short spikes on line in are dropped before they reach the alert function
+    if (glitchFilterInMicros > 0 && halGlitchFilter(LINE_IN, glitchFilterInMicros) < 0) {
+        printf("audio_lag_module.c l.2287: Unable to set the glitch filter of GPIO %d -> Measuring without it\n", LINE_IN);
+        glitchFilterInMicros = 0;
+    }
+    if (noiseFilterSteadyInMicros > 0
+        && halNoiseFilter(LINE_IN, noiseFilterSteadyInMicros, noiseFilterActiveInMicros) < 0) {
+        printf("audio_lag_module.c l.2292: Unable to set the noise filter of GPIO %d -> Measuring without it\n", LINE_IN);
+        noiseFilterSteadyInMicros = 0;
+    }
+
+    // Register GPIO state change callback once, edges are queued for the measurement loop
+    initEdgeQueue(&edgeEvents);
+    halSetAlertFunc(LINE_OUT, onGpioAlert);
+    halSetAlertFunc(LINE_IN, onGpioAlert);
+
+    // Button presses wake up the user interface loop
+    initEdgeQueue(&buttonEvents);
+    sem_init(&buttonSemaphore, 0, 0);
+    memset(buttonPressTimestamps, 0, sizeof(buttonPressTimestamps));
+    halSetAlertFunc(START_MEASUREMENT_BUTTON, onButtonAlert);
+    halSetAlertFunc(CALIBRATION_MODE_BUTTON, onButtonAlert);
+    halSetAlertFunc(LINE_OUT_MODE_BUTTON, onButtonAlert);
+    halSetAlertFunc(USB_OUT_MODE_BUTTON, onButtonAlert);
+    halSetAlertFunc(HDMI_OUT_MODE_BUTTON, onButtonAlert);
+    halSetAlertFunc(EXIT_BUTTON, onButtonAlert);
+
+    // Initial measurement mode
+    showMeasurementMode();
+    // For strange debugging reasons
+    halWrite(LINE_IN, 0);
+}
+
+void prepareExit() {
+    halSetMode(LINE_OUT, HAL_OUTPUT);
+    halSetMode(LINE_IN, HAL_OUTPUT);
+    halSetMode(START_MEASUREMENT_BUTTON, HAL_OUTPUT);
+    halSetMode(CALIBRATION_MODE_BUTTON, HAL_OUTPUT);
+    halSetMode(LINE_OUT_MODE_BUTTON, HAL_OUTPUT);
+    halSetMode(USB_OUT_MODE_BUTTON, HAL_OUTPUT);
+    halSetMode(HDMI_OUT_MODE_BUTTON, HAL_OUTPUT);
+    halSetMode(EXIT_BUTTON, HAL_OUTPUT);
+
+    halWrite(LINE_OUT, 0);
+    halWrite(LINE_IN, 0);
+    halWrite(START_MEASUREMENT_BUTTON, 0);
+    halWrite(CALIBRATION_MODE_BUTTON, 0);
+    halWrite(LINE_OUT_MODE_BUTTON, 0);
+    halWrite(USB_OUT_MODE_BUTTON, 0);
+    halWrite(HDMI_OUT_MODE_BUTTON, 0);
+    halWrite(EXIT_BUTTON, 0);
+    halWrite(START_MEASUREMENT_LED, 0);
+    halWrite(CALIBRATION_MODE_GREEN_LED, 0);
+    halWrite(CALIBRATION_MODE_YELLOW_LED, 0);
+    halWrite(CALIBRATION_MODE_RED_LED, 0);
+    halWrite(LINE_OUT_MODE_LED, 0);
+    halWrite(USB_OUT_MODE_LED, 0);
+    halWrite(HDMI_OUT_MODE_LED, 0);
+    halWrite(EXIT_LED, 0);
+    
+    freeWaveformBank(&pulseWaveforms);
+    closeTelemetry(&telemetry);
+
+    // Terminate library
+    halTerminate();
+    sem_destroy(&buttonSemaphore);
+    
+    printf("\nExit\n");
+}
+
+// ####
+// #### PCM DEVICES (USB, HDMI, PCIE) VIA ALSA ####
+
+// Set the desired hardware parameters and write them to the driver
+int configurePcmDevice(halPcm *handle, halPcmConfig *config) {
+    int status;
+
+    config->format = requestedFormat;
+    config->channels = requestedChannels;
+    config->sampleRate = requestedSampleRate;
+    config->mmap = useMmap;
+    status = halPcmConfigure(handle, config);
+    if (status < 0) {
+        printf("audio_lag_module.c l.2368: Unable to set PCM devices hardware parameters\n");
+    }
+    return(status);
+}
+
+// The CSV shows the negotiated parameters, which can differ from the requested ones
+void saveNegotiatedConfig(const halPcmConfig *config) {
+    sampleRate = config->sampleRate;
+    bufferSize = config->periodFrames * getBytesPerSample(config->format) * config->channels;
+    channelCount = config->channels;
+    negotiatedPeriodFrames = config->periodFrames;
+    negotiatedBufferFrames = config->bufferFrames;
+    negotiatedFormat = config->format;
+    updateSessionResults();
+}
+
+// Opens the PCM device of the current measurement mode, deviceName is set to the one that was opened
+int openPcmHandle(halPcm **handle, const char **deviceName) {
+    int status;
+
+    if (requestedPcmDeviceName != NULL) {
+        *deviceName = requestedPcmDeviceName;
+        status = halPcmOpen(handle, *deviceName);
+        if (status < 0) {
+            printf("audio_lag_module.c l.2392: Unable to open PCM Device %s\n", *deviceName);
+            return(status);
+        }
+    }
+    else if (measurementMode == USB_OUT_MODE_BUTTON || measurementMode == ROUND_TRIP_MODE) {
+        *deviceName = ALSA_USB_TOP_OUT;
+        status = halPcmOpen(handle, *deviceName);
+        if (status < 0) {
+            // Unable to open pcm device
+            *deviceName = ALSA_USB_BOTTOM_OUT;
+            status = halPcmOpen(handle, *deviceName);
             if (status < 0) {
                 // Unable to open pcm device
-                status = snd_pcm_open(&handle, ALSA_USB_BOTTOM_OUT, SND_PCM_STREAM_PLAYBACK, 0);
+                *deviceName = ALSA_USB_TOP2_OUT;
+                status = halPcmOpen(handle, *deviceName);
                 if (status < 0) {
                     // Unable to open pcm device
-                    status = snd_pcm_open(&handle, ALSA_USB_TOP2_OUT, SND_PCM_STREAM_PLAYBACK, 0);
+                    *deviceName = ALSA_USB_BOTTOM2_OUT;
+                    status = halPcmOpen(handle, *deviceName);
                     if (status < 0) {
-                        // Unable to open pcm device
-                        status = snd_pcm_open(&handle, ALSA_USB_BOTTOM2_OUT, SND_PCM_STREAM_PLAYBACK, 0);
-                        if (status < 0) {
-                            printf("audio_lag_module.c l.417: Unable to open PCM Device\n");
-                            return;
-                        }
+                        printf("audio_lag_module.c l.2412: Unable to open PCM Device\n");
+                        return(status);
                     }
                 }
             }
         }
-        // HDMI_MODE
-        else {
-            status = snd_pcm_open(&handle, ALSA_HDMI_OUT, SND_PCM_STREAM_PLAYBACK, 0);
-            if (status < 0) {
-                printf("audio_lag_module.c l.428: Unable to open PCM Device\n");
-                return;   
-            }
+    }
+    // HDMI_MODE
+    else {
+        *deviceName = ALSA_HDMI_OUT;
+        status = halPcmOpen(handle, *deviceName);
+        if (status < 0) {
+            printf("audio_lag_module.c l.2424: Unable to open PCM Device\n");
+            return(status);
+        }
+    }
+    pcmDeviceName = *deviceName;
+    return(0);
+}
+
+// Opens and configures the PCM device of the current measurement mode
+int openPcmDevice(halPcm **handle, halPcmConfig *config) {
+    const char *deviceName;
+    int status;
+
+    status = openPcmHandle(handle, &deviceName);
+    if (status < 0) {
+        return(status);
+    }
+    status = configurePcmDevice(*handle, config);
+    if (status < 0) {
+        halPcmClose(*handle);
+        return(status);
+    }
+    saveNegotiatedConfig(config);
+    return(0);
+}
+
+long getNumberOfSignalPeriods(halPcmConfig *config) {
+    long numberOfPeriods;
+
+    /* We want to loop for SIGNAL_LENGTH_IN_S */
+    numberOfPeriods = SIGNAL_LENGTH_IN_S * 1000000 / config->periodTimeInMicros;
+    if (numberOfPeriods < MINIMUM_NUMBER_OF_PERIODS) {
+        numberOfPeriods = MINIMUM_NUMBER_OF_PERIODS;
+    }
+    return(numberOfPeriods);
+}
+
+// Computes the pulse waveforms for the negotiated parameters, unless they are already computed
+int preparePulseWaveformBank(waveformBank *bank, halPcmConfig *config, long numberOfPeriods) {
+    unsigned long frames = config->periodFrames * numberOfPeriods;
+    int status;
+
+    if (isWaveformBankMatching(bank, config->format, config->sampleRate, config->channels, frames)) {
+        return(0);
+    }
+    freeWaveformBank(bank);
+    status = createWaveformBank(bank, config->format, config->sampleRate, config->channels, frames);
+    if (status < 0) {
+        printf("audio_lag_module.c l.2472: Unable to create the pulse waveforms\n");
+    }
+    return(status);
+}
+
+int preparePulseWaveform(halPcmConfig *config, long numberOfPeriods) {
+    return(preparePulseWaveformBank(&pulseWaveforms, config, numberOfPeriods));
+}
+
+const char *getPulsePeriod(long period, unsigned long periodFrames) {
+    return(pulseWaveforms.waveforms[pulseWaveform] + period * periodFrames * pulseWaveforms.bytesPerFrame);
+}
+
+// Writes frames via the mmap or read/write access of the stream, NULL writes silence
+long writePcmFrames(halPcm *handle, const char *frames, unsigned long count) {
+    if (useMmap) {
+        return(halPcmMmapWrite(handle, frames, count));
+    }
+    return(halPcmWrite(handle, frames != NULL ? frames : pulseWaveforms.silence, count));
+}
+
+void savePulseCost(uint32_t requestTimestamp, uint32_t queuedTimestamp) {
+    uint32_t pulseCostInMicros = queuedTimestamp - requestTimestamp;
+
+    pulseCostSumInMicros += pulseCostInMicros;
+    pulseCostCount += 1;
+    if (pulseCostInMicros > pulseCostMaxInMicros) {
+        pulseCostMaxInMicros = pulseCostInMicros;
+    }
+}
+
+// Tick at which the first frame of the pulse leaves the buffer according to the driver.
+// framesSincePulse is the number of frames written since the first frame of the pulse.
+int getHardwareStartTimestamp(halPcm *handle, halPcmConfig *config, unsigned long framesSincePulse, uint32_t *timestamp) {
+    halPcmTimestamp pcmTimestamp;
+    double pulseFrame, framesPlayed;
+    int status;
+
+    status = halPcmGetTimestamp(handle, &pcmTimestamp);
+    if (status < 0) {
+        return(status);
+    }
+    pulseFrame = (double) pcmTimestamp.framesWritten - framesSincePulse;
+    // The audio timestamp is more precise than the delay, which only moves in whole periods on USB
+    if (pcmTimestamp.audioTimeInNanos >= 0) {
+        framesPlayed = pcmTimestamp.audioTimeInNanos * config->sampleRate / 1000000000.0;
+    }
+    else {
+        framesPlayed = (double) pcmTimestamp.framesWritten - pcmTimestamp.delayFrames;
+    }
+    *timestamp = pcmTimestamp.tick + (int32_t) lround((pulseFrame - framesPlayed) * 1000000.0 / config->sampleRate);
+    return(0);
+}
+
+// Tick at which the pulse whose first writtenFrames were just written at queuedTimestamp is played.
+// All queued frames except the ones just written are played before the pulse.
+uint32_t getQueuedSignalStart(halPcm *handle, const halPcmConfig *config, unsigned long writtenFrames, uint32_t queuedTimestamp) {
+    long delayInFrames;
+
+    if (halPcmDelay(handle, &delayInFrames) < 0) {
+        printf("audio_lag_module.c l.2532: Unable to get PCM delay -> Using the tick of the write as start reference\n");
+        return(queuedTimestamp);
+    }
+    delayInFrames -= writtenFrames;
+    if (delayInFrames < 0) {
+        delayInFrames = 0;
+    }
+    return(queuedTimestamp + (uint32_t) (delayInFrames * 1000000LL / config->sampleRate));
+}
+
+// Start reference of a pulse, softwareTimestamp is the tick after its first frame was written
+uint64_t getDigitalSignalStart(halPcm *handle, halPcmConfig *config, unsigned long framesSincePulse,
+                               uint32_t softwareTimestamp, int *startSkewInMicros) {
+    uint32_t hardwareTimestamp;
+
+    *startSkewInMicros = 0;
+    if (useHardwareTimestamps) {
+        if (getHardwareStartTimestamp(handle, config, framesSincePulse, &hardwareTimestamp) == 0) {
+            *startSkewInMicros = (int32_t) (softwareTimestamp - hardwareTimestamp);
+            return(unwrapTick(hardwareTimestamp));
+        }
+        printf("audio_lag_module.c l.2553: Unable to get PCM timestamp -> Using software start reference\n");
+    }
+    return(unwrapTick(softwareTimestamp));
+}
+
+// Marks the last pulse counted as sent at signalStartTimestamp
+void markSignalStart(uint64_t signalStartTimestamp, int startSkewInMicros) {
+    startSignal(sessionPulseCount - 1, signalStartTimestamp);
+    currentStartSkewInMicros = startSkewInMicros;
+    traceEvent(TRACE_SIGNAL_START, (uint32_t) signalStartTimestamp, 0, 0, currentPulseCode, startPulse, startSkewInMicros);
+    if (pipelineDepth > 1) {
+        registerCodedPulse(startPulse, currentPulseCode, startTimestamp, currentStartSkewInMicros);
+    }
+}
+
+// Marks the pulse as sent, softwareTimestamp is the tick after its first frame was written
+void startDigitalSignal(halPcm *handle, halPcmConfig *config, unsigned long framesSincePulse, uint32_t softwareTimestamp) {
+    uint64_t signalStartTimestamp;
+    int startSkewInMicros;
+    long delayInFrames;
+
+    signalStartTimestamp = getDigitalSignalStart(handle, config, framesSincePulse, softwareTimestamp, &startSkewInMicros);
+    markSignalStart(signalStartTimestamp, startSkewInMicros);
+    // Logged with the drift, only read then to keep the system call out of the measurement
+    if (driftTracking && halPcmDelay(handle, &delayInFrames) == 0) {
+        pcmDelaysInFrames[(sessionPulseCount - 1) % PIPELINE_MAX_DEPTH] = delayInFrames;
+    }
+}
+
+// Code 0 is this wide, the codes of the pipelined pulses are told apart by it
+void setPulseWidth(double widthInMicros) {
+    pulseWidthInMicros = widthInMicros;
+    traceEvent(TRACE_PULSE_WIDTH, 0, 0, 0, 0, sessionPulseCount - 1, (int32_t) lround(widthInMicros * 1000.0));
+}
+
+void startMeasurementDigitalOutReopening(int measurementMethod) {
+    double signalIntervalInS;
+    long status;
+    halPcm *handle;
+    halPcmConfig config;
+    unsigned long frames;
+    long numberOfPeriods;
+    long iterations;
+    uint32_t requestTimestamp, queuedTimestamp;
+
+    iterations = getIterations(measurementMethod);
+
+    for (long i = 0; i < iterations; i++) {
+        if (!prepareNextPulse()) {
+            break;
+        }
+        requestTimestamp = halTick();
+        // Open PCM device for playback. 
+        // Measurement is only working consistently if pcm device is opened and closed in every iteration.
+        // Period size 0 selects the minimum to create smallest possible buffer size.
+        config.periodFrames = requestedPeriodFrames;
+        config.bufferFrames = requestedBufferFrames;
+        // The pulses sent so far are saved like at the end of the session
+        if (openPcmDevice(&handle, &config) < 0) {
+            break;
+        }
+        numberOfPeriods = getNumberOfSignalPeriods(&config);
+        // The waveform bank is only recomputed if the negotiated parameters changed
+        if (preparePulseWaveform(&config, numberOfPeriods) < 0) {
+            halPcmClose(handle);
+            break;
+        }
+        // Write one period at a time
+        frames = config.periodFrames;
+        
+        signalIntervalInS = getSignalInterval(measurementMethod, i);
+        
+        for (long period = 0; period < numberOfPeriods; period++) {
+            status = writePcmFrames(handle, getPulsePeriod(period, frames), frames);
+            if (status == -EPIPE) {
+                printf("audio_lag_module.c l.2628: Underrun occured during snd_pcm_writei -> Preparing PCM device to continue measurement\n");
+                halPcmPrepare(handle);
+            }
+            else if (status < 0) {
+                printf("audio_lag_module.c l.2632: Error during snd_pcm_writei -> Reopening PCM device\n");
+                break;
+            }
+            else {
+                if (signalStatus != SIGNAL_ON_THE_WAY) {
+                    queuedTimestamp = halTick();
+                    startDigitalSignal(handle, &config, frames, queuedTimestamp);
+                    savePulseCost(requestTimestamp, queuedTimestamp);
+                }
+            }
+        }
+        halPcmDrain(handle);
+        halPcmClose(handle);
+        halSleep(signalIntervalInS);
+    }
+    processEdgeEvents();
+}
+
+// Keeps one configured stream running for the whole session.
+// Between the pulses silence is written, so the writes are paced by the sound card
+// and a pulse is inserted into the running stream without any reconfiguration.
+// The start timestamp is the tick at which the first pulse frame is played,
+// estimated from the frames queued in front of it.
+void startMeasurementDigitalOutPersistent(int measurementMethod) {
+    double signalIntervalInS;
+    long status;
+    halPcm *handle;
+    halPcmConfig config;
+    unsigned long frames;
+    long numberOfPeriods, numberOfPulsePeriods, numberOfSilentPeriods;
+    long iterations;
+    uint32_t requestTimestamp, queuedTimestamp;
+
+    iterations = getIterations(measurementMethod);
+
+    config.periodFrames = requestedPeriodFrames;
+    config.bufferFrames = 0;
+    if (openPcmDevice(&handle, &config) < 0) {
+        return;
+    }
+    // Keep only a few periods queued, otherwise every pulse waits for a full buffer
+    config.bufferFrames = requestedBufferFrames > 0 ? requestedBufferFrames : config.periodFrames * PERSISTENT_STREAM_BUFFER_PERIODS;
+    if (halPcmConfigure(handle, &config) < 0) {
+        printf("audio_lag_module.c l.2675: Unable to set PCM devices buffer size\n");
+        halPcmClose(handle);
+        return;
+    }
+    saveNegotiatedConfig(&config);
+    frames = config.periodFrames;
+    numberOfPeriods = getNumberOfSignalPeriods(&config);
+    if (preparePulseWaveform(&config, numberOfPeriods) < 0) {
+        halPcmClose(handle);
+        return;
+    }
+    setPulseWidth((double) numberOfPeriods * config.periodTimeInMicros);
+
+    // Start the stream with silence
+    for (int period = 0; period < PERSISTENT_STREAM_BUFFER_PERIODS; period++) {
+        writePcmFrames(handle, NULL, frames);
+    }
+
+    for (long i = 0; i < iterations; i++) {
+        if (!prepareNextPulse()) {
+            break;
+        }
+        signalIntervalInS = getSignalInterval(measurementMethod, i);
+        numberOfSilentPeriods = signalIntervalInS * 1000000 / config.periodTimeInMicros;
+        // Coded pulses repeat the waveform code + 1 times
+        currentPulseCode = getPulseCode(i);
+        numberOfPulsePeriods = numberOfPeriods * (currentPulseCode + 1);
+
+        requestTimestamp = halTick();
+        for (long period = 0; period < numberOfPulsePeriods + numberOfSilentPeriods; period++) {
+            status = writePcmFrames(handle,
+                                    period < numberOfPulsePeriods ? getPulsePeriod(period % numberOfPeriods, frames) : NULL,
+                                    frames);
+            if (status == -EPIPE) {
+                printf("audio_lag_module.c l.2709: Underrun occured during snd_pcm_writei -> Preparing PCM device to continue measurement\n");
+                halPcmPrepare(handle);
+            }
+            else if (status < 0) {
+                printf("audio_lag_module.c l.2713: Error during snd_pcm_writei -> Closing PCM device\n");
+                iterations = i;
+                break;
+            }
+            else if (period == 0 && (pipelineDepth > 1 || signalStatus != SIGNAL_ON_THE_WAY)) {
+                queuedTimestamp = halTick();
+                startDigitalSignal(handle, &config, frames, getQueuedSignalStart(handle, &config, frames, queuedTimestamp));
+                savePulseCost(requestTimestamp, queuedTimestamp);
+            }
+        }
+    }
+    halPcmDrain(handle);
+    halPcmClose(handle);
+    waitForPulsesInFlight(sessionPulseCount);
+    processEdgeEvents();
+}
+
+// The cross-correlation detector finds the pulse in a capture of the DUT output instead of
+// waiting for the transistor on line in, so it resolves fractions of a sample and rates its detection.
+// The capture is read period by period next to the persistent playback stream. Once the window
+// of a pulse, from its start until the next pulse, has been read, the pulse waveform is searched in it.
+typedef struct {
+    long pulse;
+    uint64_t startTimestamp;
+    int startSkewInMicros;
+    uint64_t windowStartFrame; /* Capture frames, counted since the session started */
+    unsigned long windowFrames;
+    uint64_t captureTimestamp; /* Tick at which captureFrame was captured */
+    double captureFrame;
+} correlatedPulse;
+correlatedPulse pendingPulses[CORRELATION_MAX_PENDING];
+int pendingPulsesCount;
+float captureRing[CAPTURE_RING_FRAMES];
+uint64_t captureFramesRead;
+char *captureBuffer; // One period as read from the device
+float *detectionWindow;
+xcorrDetector pulseDetector;
+
+// Opens the capture device with the sample rate and period size of the playback
+int openCaptureDevice(halPcm **capture, const halPcmConfig *playbackConfig, halPcmConfig *captureConfig) {
+    int status;
+
+    status = halPcmOpenCapture(capture, captureDeviceName);
+    if (status < 0) {
+        printf("audio_lag_module.c l.2757: Unable to open capture device %s\n", captureDeviceName);
+        return(status);
+    }
+    captureConfig->format = playbackConfig->format;
+    captureConfig->channels = 1;
+    captureConfig->sampleRate = playbackConfig->sampleRate;
+    captureConfig->periodFrames = playbackConfig->periodFrames;
+    captureConfig->bufferFrames = 0;
+    captureConfig->mmap = 0;
+    status = halPcmConfigure(*capture, captureConfig);
+    if (status == 0 && captureConfig->sampleRate != playbackConfig->sampleRate) {
+        status = -EINVAL;
+    }
+    if (status < 0) {
+        printf("audio_lag_module.c l.2771: Unable to capture with %u Hz on %s\n", playbackConfig->sampleRate, captureDeviceName);
+        halPcmClose(*capture);
+    }
+    return(status);
+}
+
+void freeCorrelation() {
+    freeXcorrDetector(&pulseDetector);
+    free(detectionWindow);
+    detectionWindow = NULL;
+    free(captureBuffer);
+    captureBuffer = NULL;
+}
+
+// Prepares the detector for the pulse waveform of the session
+int prepareCorrelation(const halPcmConfig *captureConfig, unsigned long referenceFrames) {
+    int maxWindowFrames = referenceFrames + captureConfig->periodFrames + SIGNAL_START_INTERVAL_IN_S * captureConfig->sampleRate;
+    float *reference;
+    int status;
+
+    reference = (float *) malloc(referenceFrames * sizeof(float));
+    detectionWindow = (float *) malloc(maxWindowFrames * sizeof(float));
+    captureBuffer = (char *) malloc(captureConfig->periodFrames * getBytesPerSample(captureConfig->format) * captureConfig->channels);
+    if (reference == NULL || detectionWindow == NULL || captureBuffer == NULL) {
+        free(reference);
+        freeCorrelation();
+        return(-ENOMEM);
+    }
+    getWaveformSamples(pulseWaveform, captureConfig->sampleRate, referenceFrames, reference);
+    status = initXcorrDetector(&pulseDetector, reference, referenceFrames, maxWindowFrames);
+    free(reference);
+    if (status < 0) {
+        printf("audio_lag_module.c l.2803: Unable to prepare the cross-correlation detector (%d)\n", status);
+        freeCorrelation();
+        return(status);
+    }
+    captureFramesRead = 0;
+    pendingPulsesCount = 0;
+    return(0);
+}
+
+void saveLostCorrelatedPulse(const correlatedPulse *pulse) {
+    saveLostPulse(pulse->pulse, pulse->startTimestamp, getTick64(), pulse->startSkewInMicros);
+}
+
+// Every pulse still waiting for its capture window is lost
+void loseCorrelatedPulses() {
+    for (int i = 0; i < pendingPulsesCount; i++) {
+        saveLostCorrelatedPulse(&pendingPulses[i]);
+    }
+    pendingPulsesCount = 0;
+}
+
+// Queues the pulse whose first period was just written, silentFrames follow it.
+// Returns 1 if the pulse was queued, otherwise it is saved as lost.
+int registerCorrelatedPulse(halPcm *handle, halPcmConfig *config, halPcm *capture, uint32_t softwareTimestamp,
+                             unsigned long silentFrames) {
+    halPcmTimestamp captureTimestamp;
+    correlatedPulse *pulse;
+    double framesCaptured, pulseFrame;
+    long delayInFrames;
+
+    if (pendingPulsesCount == CORRELATION_MAX_PENDING || halPcmGetTimestamp(capture, &captureTimestamp) < 0) {
+        saveLostPulse(sessionPulseCount - 1, unwrapTick(softwareTimestamp), getTick64(), 0);
+        return(0);
+    }
+    pulse = &pendingPulses[pendingPulsesCount];
+    pulse->pulse = sessionPulseCount - 1;
+    pulse->startTimestamp = getDigitalSignalStart(handle, config, config->periodFrames, softwareTimestamp, &pulse->startSkewInMicros);
+    // Logged with the drift like in startDigitalSignal
+    if (driftTracking && halPcmDelay(handle, &delayInFrames) == 0) {
+        pcmDelaysInFrames[pulse->pulse % PIPELINE_MAX_DEPTH] = delayInFrames;
+    }
+    framesCaptured = getFramesCaptured(&captureTimestamp, config->sampleRate);
+    pulse->captureTimestamp = unwrapTick(captureTimestamp.tick);
+    pulse->captureFrame = (double) captureFramesRead - captureTimestamp.framesWritten + framesCaptured;
+    pulseFrame = pulse->captureFrame
+                 + (int64_t) (pulse->startTimestamp - pulse->captureTimestamp) * (double) config->sampleRate / 1000000.0;
+    // One period of margin for the uncertainty of the start reference
+    pulseFrame -= config->periodFrames;
+    pulse->windowStartFrame = pulseFrame > 0 ? (uint64_t) pulseFrame : 0;
+    pulse->windowFrames = pulseDetector.referenceLength + config->periodFrames + silentFrames;
+    if (pulse->windowFrames > (unsigned long) pulseDetector.maxCaptureLength) {
+        pulse->windowFrames = pulseDetector.maxCaptureLength;
+    }
+    pendingPulsesCount += 1;
+    return(1);
+}
+
+// Searches the pulse waveform in the capture window of the pulse and saves its latency,
+// or saves it as lost if it was not found with XCORR_MIN_CONFIDENCE
+void detectCorrelatedPulse(const correlatedPulse *pulse, unsigned int sampleRate) {
+    xcorrResult result;
+    uint32_t detectionStart, detectionTimeInMicros;
+    double arrivalTimestamp;
+
+    // Lost if the window has already been overwritten
+    if (captureFramesRead - pulse->windowStartFrame > CAPTURE_RING_FRAMES) {
+        saveLostCorrelatedPulse(pulse);
+        return;
+    }
+    for (unsigned long frame = 0; frame < pulse->windowFrames; frame++) {
+        detectionWindow[frame] = captureRing[(pulse->windowStartFrame + frame) % CAPTURE_RING_FRAMES];
+    }
+    detectionStart = halTick();
+    if (findReference(&pulseDetector, detectionWindow, pulse->windowFrames, &result) < 0) {
+        saveLostCorrelatedPulse(pulse);
+        return;
+    }
+    detectionTimeInMicros = halTick() - detectionStart;
+    if (result.confidence < XCORR_MIN_CONFIDENCE) {
+        saveLostCorrelatedPulse(pulse);
+        return;
+    }
+    correlationConfidenceSum += result.confidence;
+    if (result.confidence < correlationConfidenceMin) {
+        correlationConfidenceMin = result.confidence;
+    }
+    correlationTimeSumInMicros += detectionTimeInMicros;
+    if (detectionTimeInMicros > correlationTimeMaxInMicros) {
+        correlationTimeMaxInMicros = detectionTimeInMicros;
+    }
+    correlationCount += 1;
+    arrivalTimestamp = pulse->captureTimestamp
+                       + (pulse->windowStartFrame + result.lagInSamples - pulse->captureFrame) * 1000000.0 / sampleRate;
+    saveLatency(pulse->pulse, pulse->startTimestamp, (uint64_t) llround(arrivalTimestamp), pulse->startSkewInMicros);
+}
+
+// Reads one period into the capture ring and detects every pulse whose window is complete
+int readCapture(halPcm *capture, halPcmConfig *captureConfig) {
+    unsigned int bytesPerFrame = getBytesPerSample(captureConfig->format) * captureConfig->channels;
+    unsigned long offset, chunk;
+    long status;
+
+    status = halPcmRead(capture, captureBuffer, captureConfig->periodFrames);
+    if (status == -EPIPE) {
+        printf("audio_lag_module.c l.2907: Overrun occured during snd_pcm_readi -> Preparing capture device, pulses on the way are lost\n");
+        loseCorrelatedPulses();
+        return(halPcmPrepare(capture));
+    }
+    else if (status < 0) {
+        printf("audio_lag_module.c l.2912: Error during snd_pcm_readi -> Closing capture device\n");
+        return((int) status);
+    }
+    offset = captureFramesRead % CAPTURE_RING_FRAMES;
+    chunk = (unsigned long) status < CAPTURE_RING_FRAMES - offset ? (unsigned long) status : CAPTURE_RING_FRAMES - offset;
+    getFirstChannelSamples(captureBuffer, captureConfig->format, captureConfig->channels, chunk, captureRing + offset);
+    getFirstChannelSamples(captureBuffer + chunk * bytesPerFrame, captureConfig->format, captureConfig->channels,
+                           status - chunk, captureRing);
+    captureFramesRead += status;
+
+    while (pendingPulsesCount > 0
+           && captureFramesRead >= pendingPulses[0].windowStartFrame + pendingPulses[0].windowFrames) {
+        detectCorrelatedPulse(&pendingPulses[0], captureConfig->sampleRate);
+        pendingPulsesCount -= 1;
+        memmove(pendingPulses, pendingPulses + 1, pendingPulsesCount * sizeof(correlatedPulse));
+    }
+    return(0);
+}
+
+// Reads everything captured so far, at least one period
+int readAvailableCapture(halPcm *capture, halPcmConfig *captureConfig) {
+    long availableFrames;
+    int status;
+
+    do {
+        status = readCapture(capture, captureConfig);
+        if (status < 0) {
+            return(status);
+        }
+    } while (halPcmDelay(capture, &availableFrames) == 0 && availableFrames >= (long) captureConfig->periodFrames);
+    return(0);
+}
+
+// Queues silence until the buffer is full, so the stream survives a detection
+void fillPlaybackBuffer(halPcm *handle, halPcmConfig *config) {
+    for (unsigned long period = 0; period < config->bufferFrames / config->periodFrames; period++) {
+        writePcmFrames(handle, NULL, config->periodFrames);
+    }
+}
+
+// Same stream as startMeasurementDigitalOutPersistent, the pulses are detected in the capture
+void startMeasurementDigitalOutCorrelated(int measurementMethod) {
+    double signalIntervalInS;
+    long status;
+    halPcm *handle, *capture;
+    halPcmConfig config, captureConfig;
+    unsigned long frames;
+    long numberOfPeriods, numberOfSilentPeriods;
+    long bufferPeriods;
+    int pulseQueued;
+    long iterations;
+    uint32_t requestTimestamp, queuedTimestamp;
+
+    iterations = getIterations(measurementMethod);
+
+    config.periodFrames = requestedPeriodFrames;
+    config.bufferFrames = 0;
+    if (openPcmDevice(&handle, &config) < 0) {
+        return;
+    }
+    bufferPeriods = ceil(CORRELATION_BUFFER_IN_S * 1000000 / config.periodTimeInMicros);
+    if (bufferPeriods < PERSISTENT_STREAM_BUFFER_PERIODS) {
+        bufferPeriods = PERSISTENT_STREAM_BUFFER_PERIODS;
+    }
+    config.bufferFrames = requestedBufferFrames > 0 ? requestedBufferFrames : config.periodFrames * bufferPeriods;
+    if (halPcmConfigure(handle, &config) < 0) {
+        printf("audio_lag_module.c l.2978: Unable to set PCM devices buffer size\n");
+        halPcmClose(handle);
+        return;
+    }
+    saveNegotiatedConfig(&config);
+    frames = config.periodFrames;
+    numberOfPeriods = getNumberOfSignalPeriods(&config);
+    if (preparePulseWaveform(&config, numberOfPeriods) < 0) {
+        halPcmClose(handle);
+        return;
+    }
+    if (openCaptureDevice(&capture, &config, &captureConfig) < 0) {
+        halPcmClose(handle);
+        return;
+    }
+    if (prepareCorrelation(&captureConfig, numberOfPeriods * frames) < 0) {
+        halPcmClose(capture);
+        halPcmClose(handle);
+        return;
+    }
+    setPulseWidth((double) numberOfPeriods * config.periodTimeInMicros);
+
+    // Start both streams with silence, the capture timestamps are valid once it runs
+    fillPlaybackBuffer(handle, &config);
+    if (readCapture(capture, &captureConfig) < 0) {
+        iterations = 0;
+    }
+
+    for (long i = 0; i < iterations; i++) {
+        if (!prepareNextPulse()) {
+            break;
+        }
+        signalIntervalInS = getSignalInterval(measurementMethod, i);
+        numberOfSilentPeriods = signalIntervalInS * 1000000 / config.periodTimeInMicros;
+
+        requestTimestamp = halTick();
+        pulseQueued = 0;
+        for (long period = 0; period < numberOfPeriods + numberOfSilentPeriods; period++) {
+            status = writePcmFrames(handle, period < numberOfPeriods ? getPulsePeriod(period, frames) : NULL, frames);
+            if (status == -EPIPE) {
+                printf("audio_lag_module.c l.3018: Underrun occured during snd_pcm_writei -> Preparing PCM device to continue measurement\n");
+                halPcmPrepare(handle);
+                fillPlaybackBuffer(handle, &config);
+                // A pulse with a gap does not match the reference
+                if (pulseQueued && period < numberOfPeriods) {
+                    pendingPulsesCount -= 1;
+                    saveLostCorrelatedPulse(&pendingPulses[pendingPulsesCount]);
+                    pulseQueued = 0;
+                }
+            }
+            else if (status < 0) {
+                printf("audio_lag_module.c l.3029: Error during snd_pcm_writei -> Closing PCM device\n");
+                iterations = i;
+                break;
+            }
+            else if (period == 0) {
+                queuedTimestamp = halTick();
+                pulseQueued = registerCorrelatedPulse(handle, &config, capture,
+                                                      getQueuedSignalStart(handle, &config, frames, queuedTimestamp),
+                                                      numberOfSilentPeriods * frames);
+                savePulseCost(requestTimestamp, queuedTimestamp);
+            }
+            if (readAvailableCapture(capture, &captureConfig) < 0) {
+                iterations = i;
+                break;
+            }
+        }
+    }
+    halPcmDrain(handle);
+    halPcmClose(handle);
+    // The last pulses are still in the capture
+    while (pendingPulsesCount > 0) {
+        if (readCapture(capture, &captureConfig) < 0) {
+            loseCorrelatedPulses();
+        }
+    }
+    halPcmClose(capture);
+    freeCorrelation();
+    processEdgeEvents();
+}
+
+void startMeasurementDigitalOut(int measurementMethod) {
+    if (captureDeviceName != NULL) {
+        startMeasurementDigitalOutCorrelated(measurementMethod);
+    }
+    // Pipelined pulses need a stream that keeps running while they are on the way
+    else if (persistentStream || pipelineDepth > 1) {
+        startMeasurementDigitalOutPersistent(measurementMethod);
+    }
+    else {
+        startMeasurementDigitalOutReopening(measurementMethod);
+    }
+}
+
+// Runs one session in the current measurement mode
+void startMeasurement(int measurementMethod) {
+    loadRigOffset(measurementMode);
+    startTelemetrySession(measurementMethod);
+    if (isCaptureMode() && startCaptureReader() < 0) {
+        return;
+    }
+    // The CSV shows the capture parameters, the round trip the playback ones
+    if (measurementMode == CAPTURE_MODE) {
+        saveNegotiatedConfig(&lineInCapture.config);
+    }
+    if (measurementMode == LINE_OUT_MODE_BUTTON || measurementMode == CAPTURE_MODE) {
+        startMeasurementLineOut(measurementMethod);
+    }
+    // USB_, HDMI_, PCIE_OUT and the round trip
+    else {
+        startMeasurementDigitalOut(measurementMethod);
+    }
+    // The last pulse can still be in the part of the capture that was not read yet
+    if (isCaptureMode()) {
+        waitForCapture(halTick());
+        processEdgeEvents();
+        stopCaptureReader();
+    }
+    timeOutAllSignals(getTick64());
+    publishTelemetryStatistics(0);
+}
+
+// ####
+// #### PARALLEL DEVICES ####
+
+// Every USB card that can be opened is measured at the same time by its own worker thread.
+// The DUT behind a card answers on its own line in GPIO, its edges are routed to the queue
+// of the worker by GPIO. All workers take their timestamps from the same tick.
+// A worker keeps a persistent stream running and sends one pulse at a time.
+
+typedef struct {
+    const char *cardName; /* Tag of the result files */
+    const char *pcmName;
+    int lineIn;
+    pthread_t thread;
+    edgeQueue edgeEvents;
+    uint64_t lastTick64;
+    uint64_t startTimestamp;
+    uint64_t endTimestamp; /* Of --soak-duration, 0 without */
+    int signalStatus;
+    long pulse; /* On the way */
+    int maxLatencyInMicros;
+    int startSkewInMicros; /* Of the pulse on the way */
+    latencyStats stats;
+    long pulseCount;
+    int latenciesInMicros[SOAK_FLUSH_MEASUREMENTS]; /* Not yet written to the CSV */
+    int startSkewsInMicros[SOAK_FLUSH_MEASUREMENTS];
+    int latencyCount;
+    unsigned int sampleRate;
+    int bufferSize;
+    unsigned int channels;
+    waveformBank waveforms;
+    FILE *file; /* NULL with --binary-results */
+    resultWriter results;
+    char filePath[1024];
+} deviceMeasurement;
+
+deviceMeasurement parallelDevices[MAX_PARALLEL_DEVICES];
+int parallelDeviceCount;
+int measureAllDevices = 0;
+
+// Queues the edge for the worker of the device behind the line in
+void onDeviceAlert(int gpio, int level, uint32_t tick) {
+    for (int i = 0; i < parallelDeviceCount; i++) {
+        if (parallelDevices[i].lineIn == gpio) {
+            pushEdgeEvent(&parallelDevices[i].edgeEvents, gpio, level, tick);
+            return;
+        }
+    }
+}
+
+// Adds every USB card that can be opened, returns their number
+int discoverParallelDevices() {
+    static const char *cardNames[MAX_PARALLEL_DEVICES] = {"usb_audio_top", "usb_audio_bot", "usb_audio_top2", "usb_audio_bot2"};
+    static const char *pcmNames[MAX_PARALLEL_DEVICES] = {ALSA_USB_TOP_OUT, ALSA_USB_BOTTOM_OUT, ALSA_USB_TOP2_OUT, ALSA_USB_BOTTOM2_OUT};
+    static const int lineIns[MAX_PARALLEL_DEVICES] = {LINE_IN, LINE_IN_USB_BOTTOM, LINE_IN_USB_TOP2, LINE_IN_USB_BOTTOM2};
+    halPcm *handle;
+
+    parallelDeviceCount = 0;
+    for (int i = 0; i < MAX_PARALLEL_DEVICES; i++) {
+        if (halPcmOpen(&handle, pcmNames[i]) < 0) {
+            continue;
+        }
+        halPcmClose(handle);
+        memset(&parallelDevices[parallelDeviceCount], 0, sizeof(deviceMeasurement));
+        parallelDevices[parallelDeviceCount].cardName = cardNames[i];
+        parallelDevices[parallelDeviceCount].pcmName = pcmNames[i];
+        parallelDevices[parallelDeviceCount].lineIn = lineIns[i];
+        parallelDeviceCount += 1;
+    }
+    return(parallelDeviceCount);
+}
+
+// Creates the CSV of the device, or its result file with --binary-results. Returns 0 or -1.
+int openDeviceFile(deviceMeasurement *device, char *fileName) {
+    char filePath[1024];
+    resultHeader header;
+    int status;
+
+    if (!binaryResults) {
+        device->file = createCSVFile(device->filePath, fileName);
+        return(device->file != NULL ? 0 : -1);
+    }
+    getMeasurementsFilePath(device->filePath, fileName);
+    strcpy(filePath, device->filePath);
+    strcat(filePath, RESULT_FILE_SUFFIX);
+    initResultHeader(&header, halTick(), getTickResolutionInMicros());
+    setResultText(header.dutInput, sizeof(header.dutInput), DUT_INPUT_VALUE_USB);
+    setResultText(header.dutOutput, sizeof(header.dutOutput), DUT_OUTPUT_VALUE_LINE);
+    setResultText(header.device, sizeof(header.device), device->pcmName);
+    snprintf(header.captureDevice, sizeof(header.captureDevice), "GPIO %d", device->lineIn);
+    setResultText(header.waveform, sizeof(header.waveform), getWaveformName(pulseWaveform));
+    header.pipelineDepth = 1;
+    header.options = getResultOptions() | RESULT_OPTION_PERSISTENT_STREAM;
+    header.rigOffsetInMicros = rigOffsetInMicros;
+    status = openResultWriter(&device->results, filePath, &header);
+    if (status < 0) {
+        printf("audio_lag_module.c l.3195: Could not open result file of %s (%s)\n", device->cardName, strerror(-status));
+        return(-1);
+    }
+    return(0);
+}
+
+int isDeviceFileOpen(deviceMeasurement *device) {
+    return(device->file != NULL || isResultWriterOpen(&device->results));
+}
+
+void flushDeviceMeasurements(deviceMeasurement *device) {
+    for (int i = 0; i < device->latencyCount && device->file != NULL; i++) {
+        fprintf(device->file, "%d,%s,%s,%d,%d,%d,%d\n",
+                device->latenciesInMicros[i],
+                DUT_INPUT_VALUE_USB,
+                DUT_OUTPUT_VALUE_LINE,
+                device->bufferSize,
+                device->sampleRate,
+                device->channels,
+                device->startSkewsInMicros[i]);
+    }
+    if (device->file != NULL) {
+        fflush(device->file);
+    }
+    device->latencyCount = 0;
+}
+
+void closeDeviceFile(deviceMeasurement *device) {
+    resultHeader *header;
+
+    if (device->file != NULL) {
+        flushDeviceMeasurements(device);
+        fclose(device->file);
+        device->file = NULL;
+        return;
+    }
+    header = lockResultHeader(&device->results);
+    header->pulses = device->pulseCount;
+    header->finished = 1;
+    unlockResultHeader(&device->results);
+    closeResults(&device->results, device->cardName);
+}
+
+// The negotiated parameters of the device for its CSV rows or its result file
+void saveDeviceConfig(deviceMeasurement *device, const halPcmConfig *config) {
+    resultHeader *header;
+
+    device->sampleRate = config->sampleRate;
+    device->bufferSize = config->periodFrames * getBytesPerSample(config->format) * config->channels;
+    device->channels = config->channels;
+    if (isResultWriterOpen(&device->results)) {
+        header = lockResultHeader(&device->results);
+        header->sampleRate = config->sampleRate;
+        header->channels = config->channels;
+        header->bytesPerFrame = getBytesPerSample(config->format) * config->channels;
+        header->periodFrames = config->periodFrames;
+        header->bufferFrames = config->bufferFrames;
+        setResultText(header->format, sizeof(header->format), getFormatName(config->format));
+        unlockResultHeader(&device->results);
+    }
+}
+
+void saveDeviceLatency(deviceMeasurement *device, uint64_t signalEndTimestamp) {
+    int64_t latency = (int64_t) (signalEndTimestamp - device->startTimestamp) - getSubtractedRigOffset();
+    int rejected = latency < 0 || latency > INT_MAX;
+
+    appendResult(&device->results, device->pulse, device->startTimestamp, signalEndTimestamp, device->startSkewInMicros,
+                 rejected ? RESULT_FLAG_REJECTED : 0);
+    if (rejected) {
+        return;
+    }
+    if (device->latencyCount == SOAK_FLUSH_MEASUREMENTS) {
+        flushDeviceMeasurements(device);
+    }
+    device->latenciesInMicros[device->latencyCount] = (int) latency;
+    device->startSkewsInMicros[device->latencyCount] = device->startSkewInMicros;
+    device->latencyCount += 1;
+    addLatency(&device->stats, (int) latency);
+    if (latency > device->maxLatencyInMicros) {
+        device->maxLatencyInMicros = (int) latency;
+    }
+}
+
+// The pulse on the way of the device is lost, like timeOutSignal
+void timeOutDeviceSignal(deviceMeasurement *device, uint64_t timestamp) {
+    if (device->signalStatus == SIGNAL_ON_THE_WAY) {
+        appendResult(&device->results, device->pulse, device->startTimestamp, timestamp, device->startSkewInMicros, RESULT_FLAG_LOST);
+        device->signalStatus = SIGNAL_TIMED_OUT;
+    }
+}
+
+// Matches the rising line in edges of the device against its pulse on the way
+void processDeviceEdges(deviceMeasurement *device) {
+    edgeEvent event;
+    unsigned int droppedEdges;
+
+    while (popEdgeEvent(&device->edgeEvents, &event) == 0) {
+        if (event.level == 1 && device->signalStatus == SIGNAL_ON_THE_WAY) {
+            device->signalStatus = SIGNAL_ARRIVED;
+            saveDeviceLatency(device, unwrapTickFrom(&device->lastTick64, event.tick));
+        }
+    }
+    droppedEdges = takeDroppedEdgeCount(&device->edgeEvents);
+    if (droppedEdges > 0) {
+        printf("audio_lag_module.c l.3299: Edge queue overflow on %s -> %u edges lost\n", device->cardName, droppedEdges);
+    }
+}
+
+// Start reference of the pulse whose first period was just written
+void startDeviceSignal(deviceMeasurement *device, halPcm *handle, halPcmConfig *config) {
+    uint32_t softwareTimestamp, hardwareTimestamp;
+    int startSkewInMicros = 0;
+
+    softwareTimestamp = getQueuedSignalStart(handle, config, config->periodFrames, halTick());
+    // The interval is longer than the maximum latency, so the previous pulse arrived or is lost
+    processDeviceEdges(device);
+    timeOutDeviceSignal(device, unwrapTickFrom(&device->lastTick64, softwareTimestamp));
+    device->pulse = device->pulseCount - 1;
+    device->startTimestamp = unwrapTickFrom(&device->lastTick64, softwareTimestamp);
+    if (useHardwareTimestamps && getHardwareStartTimestamp(handle, config, config->periodFrames, &hardwareTimestamp) == 0) {
+        startSkewInMicros = (int32_t) (softwareTimestamp - hardwareTimestamp);
+        device->startTimestamp = unwrapTickFrom(&device->lastTick64, hardwareTimestamp);
+    }
+    device->startSkewInMicros = startSkewInMicros;
+    device->signalStatus = SIGNAL_ON_THE_WAY;
+}
+
+// Writes frames with the access the stream of the device was configured with, see writePcmFrames
+long writeDeviceFrames(halPcm *handle, const halPcmConfig *config, const char *frames, unsigned long count) {
+    if (config->mmap) {
+        return(halPcmMmapWrite(handle, frames, count));
+    }
+    return(halPcmWrite(handle, frames, count));
+}
+
+void *measureDevice(void *argument) {
+    deviceMeasurement *device = (deviceMeasurement *) argument;
+    long iterations = soakPulses > 0 ? soakPulses : soakDurationInS > 0 ? LONG_MAX : TOTAL_MEASUREMENTS;
+    halPcm *handle;
+    halPcmConfig config;
+    unsigned long frames;
+    long numberOfPeriods, numberOfSilentPeriods, status;
+
+    if (halPcmOpen(&handle, device->pcmName) < 0) {
+        printf("audio_lag_module.c l.3339: Unable to open PCM Device %s\n", device->pcmName);
+        return(NULL);
+    }
+    config.periodFrames = 0;
+    config.bufferFrames = 0;
+    if (configurePcmDevice(handle, &config) < 0) {
+        halPcmClose(handle);
+        return(NULL);
+    }
+    config.bufferFrames = config.periodFrames * PERSISTENT_STREAM_BUFFER_PERIODS;
+    numberOfPeriods = getNumberOfSignalPeriods(&config);
+    if (halPcmConfigure(handle, &config) < 0
+        || preparePulseWaveformBank(&device->waveforms, &config, numberOfPeriods) < 0) {
+        printf("audio_lag_module.c l.3352: Unable to prepare PCM Device %s\n", device->pcmName);
+        halPcmClose(handle);
+        return(NULL);
+    }
+    frames = config.periodFrames;
+    saveDeviceConfig(device, &config);
+
+    for (int period = 0; period < PERSISTENT_STREAM_BUFFER_PERIODS; period++) {
+        writeDeviceFrames(handle, &config, device->waveforms.silence, frames);
+    }
+    device->endTimestamp = 0;
+    if (soakDurationInS > 0) {
+        device->endTimestamp = unwrapTickFrom(&device->lastTick64, halTick()) + (uint64_t) (soakDurationInS * 1000000.0);
+    }
+    for (long i = 0; i < iterations; i++) {
+        processDeviceEdges(device);
+        // Like prepareNextPulse, the first limit reached ends the measurement
+        if (device->endTimestamp != 0 && unwrapTickFrom(&device->lastTick64, halTick()) >= device->endTimestamp) {
+            break;
+        }
+        device->pulseCount += 1;
+        numberOfSilentPeriods = calculateSignalIntervalFor(device->maxLatencyInMicros, i) * 1000000 / config.periodTimeInMicros;
+        for (long period = 0; period < numberOfPeriods + numberOfSilentPeriods; period++) {
+            status = period < numberOfPeriods
+                     ? writeDeviceFrames(handle, &config, device->waveforms.waveforms[pulseWaveform] + period * frames * device->waveforms.bytesPerFrame, frames)
+                     : writeDeviceFrames(handle, &config, device->waveforms.silence, frames);
+            if (status == -EPIPE) {
+                printf("audio_lag_module.c l.3379: Underrun on %s -> Preparing PCM device to continue measurement\n", device->cardName);
+                halPcmPrepare(handle);
+            }
+            else if (status < 0) {
+                printf("audio_lag_module.c l.3383: Error during snd_pcm_writei on %s -> Closing PCM device\n", device->cardName);
+                iterations = i;
+                break;
+            }
+            else if (period == 0) {
+                startDeviceSignal(device, handle, &config);
+            }
+        }
+    }
+    halPcmDrain(handle);
+    halPcmClose(handle);
+    processDeviceEdges(device);
+    timeOutDeviceSignal(device, unwrapTickFrom(&device->lastTick64, halTick()));
+    return(NULL);
+}
+
+void printDeviceStatistics() {
+    deviceMeasurement *device;
+
+    printf("%-16s %8s %8s %8s %10s %10s %10s %10s %12s\n",
+           "DEVICE", "PULSES", "VALID", "LOSS %", "MEAN us", "P50 us", "P99 us", "MAX us", "RESULT");
+    for (int i = 0; i < parallelDeviceCount; i++) {
+        device = &parallelDevices[i];
+        printf("%-16s %8ld %8ld %8.2f %10.1f %10d %10d %10d %12s\n",
+               device->cardName,
+               device->pulseCount,
+               device->stats.count,
+               getLossInPercentOf(&device->stats, device->pulseCount),
+               device->stats.mean,
+               getLatencyPercentile(&device->stats, 50.0),
+               getLatencyPercentile(&device->stats, 99.0),
+               device->stats.max,
+               getSessionResultName(getResult(&device->stats, device->pulseCount)));
+    }
+}
+
+// Measures all USB cards at once, returns RESULT_FAIL if any of them failed
+int runParallelMeasurement() {
+    deviceMeasurement *device;
+    char fileName[1024];
+    int result = RESULT_NOT_CHECKED, deviceResult, started = 0;
+
+    if (discoverParallelDevices() == 0) {
+        printf("audio_lag_module.c l.3426: No USB audio device found\n");
+        return(RESULT_FAIL);
+    }
+    // The cards are measured like --mode usb
+    loadRigOffset(USB_OUT_MODE_BUTTON);
+    halWrite(START_MEASUREMENT_LED, 1);
+    for (int i = 0; i < parallelDeviceCount; i++) {
+        device = &parallelDevices[i];
+        device->maxLatencyInMicros = -1;
+        device->signalStatus = SIGNAL_ARRIVED;
+        initLatencyStats(&device->stats);
+        initEdgeQueue(&device->edgeEvents);
+        sprintf(fileName, "%s%s_", FILE_NAME_PREFIX_USB_TO_LINE, device->cardName);
+        addTimestampToFileName(fileName);
+        if (openDeviceFile(device, fileName) < 0) {
+            continue;
+        }
+        halSetMode(device->lineIn, HAL_INPUT);
+        halSetAlertFunc(device->lineIn, onDeviceAlert);
+        printf("Measuring %s with line in GPIO %d\n", device->cardName, device->lineIn);
+    }
+    for (int i = 0; i < parallelDeviceCount; i++) {
+        if (isDeviceFileOpen(&parallelDevices[i])
+            && pthread_create(&parallelDevices[i].thread, NULL, measureDevice, &parallelDevices[i]) == 0) {
+            started |= 1 << i;
+        }
+    }
+    for (int i = 0; i < parallelDeviceCount; i++) {
+        device = &parallelDevices[i];
+        if (started & (1 << i)) {
+            pthread_join(device->thread, NULL);
+        }
+        if (device->lineIn != LINE_IN) {
+            halSetAlertFunc(device->lineIn, NULL);
+        }
+        if (!isDeviceFileOpen(device)) {
+            result = RESULT_FAIL;
+            continue;
+        }
+        closeDeviceFile(device);
+        freeWaveformBank(&device->waveforms);
+        writeSummaryFile(device->filePath, &device->stats, device->pulseCount, 0, NULL, NULL, DUT_INPUT_VALUE_USB, DUT_OUTPUT_VALUE_LINE);
+        deviceResult = getResult(&device->stats, device->pulseCount);
+        if (deviceResult == RESULT_FAIL || (deviceResult == RESULT_PASS && result == RESULT_NOT_CHECKED)) {
+            result = deviceResult;
+        }
+    }
+    // The line in of the top card belongs to the single device measurements again
+    halSetAlertFunc(LINE_IN, onGpioAlert);
+    halWrite(START_MEASUREMENT_LED, 0);
+    printDeviceStatistics();
+    return(result);
+}
+
+// ####
+// #### CONFIGURATION SWEEP ####
+
+// A sweep measures a batch of pulses for every combination of sample rate, format,
+// channel count, period size and buffer size in a grid. The grid is built from the
+// capabilities of the device, which are probed once and cached, and can be narrowed
+// down on the command line. A buffer size of 0 keeps the default of the measurement.
+
+typedef struct {
+    long values[MAX_SWEEP_VALUES];
+    int count;
+} sweepValues;
+
+typedef struct {
+    const char *requestedName; /* Device of a job, NULL for the device of the measurement mode */
+    int mode; /* Measurement mode of the entry if requestedName is NULL */
+    const char *deviceName; /* The device that was probed */
+    halPcmCapabilities capabilities;
+} cachedCapabilities;
+
+sweepValues sweepRequests[SWEEP_DIMENSIONS]; // Empty means the default values of the dimension
+const char *sweepDimensionNames[SWEEP_DIMENSIONS] = {"rate", "format", "channels", "period", "buffer"};
+cachedCapabilities capabilityCache[MAX_CACHED_CAPABILITIES];
+int capabilityCacheCount = 0;
+
+void addSweepValue(sweepValues *values, long value) {
+    if (values->count < MAX_SWEEP_VALUES) {
+        values->values[values->count] = value;
+        values->count += 1;
+    }
+}
+
+// Comma separated list of numbers, or of format names for the format dimension
+int parseSweepValues(const char *list, int dimension) {
+    char copy[1024];
+    char *token, *end;
+    long value;
+
+    setResultText(copy, sizeof(copy), list);
+    sweepRequests[dimension].count = 0;
+    for (token = strtok(copy, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (dimension == SWEEP_FORMAT) {
+            value = parseFormat(token);
+            if (value < 0) {
+                return(-1);
+            }
+        }
+        else {
+            value = strtol(token, &end, 10);
+            if (*end != '\0' || value < 0 || (value == 0 && dimension != SWEEP_BUFFER)) {
+                return(-1);
+            }
+        }
+        addSweepValue(&sweepRequests[dimension], value);
+    }
+    return(sweepRequests[dimension].count > 0 ? 0 : -1);
+}
+
+// The cache is searched before a device is opened, by the requested device name or, without one,
+// by the measurement mode, whose device is only known once it was opened
+int isCachedCapabilitiesOfDevice(const cachedCapabilities *entry) {
+    if (requestedPcmDeviceName != NULL) {
+        return(entry->requestedName != NULL && strcmp(entry->requestedName, requestedPcmDeviceName) == 0);
+    }
+    return(entry->requestedName == NULL && entry->mode == measurementMode);
+}
+
+// Probes the capabilities of the device of the measurement mode once, later calls return the cached ones
+int getPcmCapabilities(halPcmCapabilities *capabilities, const char **deviceName) {
+    halPcm *handle;
+    int status;
+
+    for (int i = 0; i < capabilityCacheCount; i++) {
+        if (isCachedCapabilitiesOfDevice(&capabilityCache[i])) {
+            *deviceName = capabilityCache[i].deviceName;
+            *capabilities = capabilityCache[i].capabilities;
+            return(0);
+        }
+    }
+    status = openPcmHandle(&handle, deviceName);
+    if (status < 0) {
+        return(status);
+    }
+    status = halPcmGetCapabilities(handle, capabilities);
+    halPcmClose(handle);
+    if (status < 0) {
+        printf("audio_lag_module.c l.3566: Unable to probe the hardware parameters of %s\n", *deviceName);
+        return(status);
+    }
+    if (capabilityCacheCount < MAX_CACHED_CAPABILITIES) {
+        capabilityCache[capabilityCacheCount].requestedName = requestedPcmDeviceName;
+        capabilityCache[capabilityCacheCount].mode = measurementMode;
+        capabilityCache[capabilityCacheCount].deviceName = *deviceName;
+        capabilityCache[capabilityCacheCount].capabilities = *capabilities;
+        capabilityCacheCount += 1;
+    }
+    return(0);
+}
+
+void printPcmCapabilities(const char *deviceName, const halPcmCapabilities *capabilities) {
+    printf("%s supports\n", deviceName);
+    printf("  Rates:    ");
+    for (int i = 0; i < capabilities->sampleRateCount; i++) {
+        printf(" %u", capabilities->sampleRates[i]);
+    }
+    printf("\n  Formats:  ");
+    for (int format = 0; format < HAL_PCM_FORMAT_COUNT; format++) {
+        if (capabilities->formats & (1 << format)) {
+            printf(" %s", getFormatName(format));
+        }
+    }
+    printf("\n  Channels:  %u to %u\n", capabilities->minChannels, capabilities->maxChannels);
+    printf("  Periods:   %lu to %lu frames\n", capabilities->minPeriodFrames, capabilities->maxPeriodFrames);
+    printf("  Buffers:   %lu to %lu frames\n", capabilities->minBufferFrames, capabilities->maxBufferFrames);
+}
+
+int isSweepValueSupported(int dimension, long value, const halPcmCapabilities *capabilities) {
+    switch (dimension) {
+        case SWEEP_RATE:
+            for (int i = 0; i < capabilities->sampleRateCount; i++) {
+                if (capabilities->sampleRates[i] == value) {
+                    return(1);
+                }
+            }
+            return(0);
+        case SWEEP_FORMAT:
+            return((capabilities->formats & (1 << value)) != 0);
+        case SWEEP_CHANNELS:
+            return(value >= capabilities->minChannels && value <= capabilities->maxChannels);
+        case SWEEP_PERIOD:
+            return(value >= capabilities->minPeriodFrames && value <= capabilities->maxPeriodFrames);
+        default:
+            return(value == 0 || (value >= capabilities->minBufferFrames && value <= capabilities->maxBufferFrames));
+    }
+}
+
+// Every rate and format, channel counts and period sizes doubling from the minimum
+void addDefaultSweepValues(int dimension, const halPcmCapabilities *capabilities, sweepValues *values) {
+    switch (dimension) {
+        case SWEEP_RATE:
+            for (int i = 0; i < capabilities->sampleRateCount; i++) {
+                addSweepValue(values, capabilities->sampleRates[i]);
+            }
+            break;
+        case SWEEP_FORMAT:
+            for (int format = 0; format < HAL_PCM_FORMAT_COUNT; format++) {
+                if (capabilities->formats & (1 << format)) {
+                    addSweepValue(values, format);
+                }
+            }
+            break;
+        case SWEEP_CHANNELS:
+            for (unsigned int channels = capabilities->minChannels > 0 ? capabilities->minChannels : 1;
+                 channels <= capabilities->maxChannels && channels <= SWEEP_DEFAULT_MAX_CHANNELS;
+                 channels *= 2) {
+                addSweepValue(values, channels);
+            }
+            break;
+        case SWEEP_PERIOD:
+            for (unsigned long frames = capabilities->minPeriodFrames > 0 ? capabilities->minPeriodFrames : 1;
+                 frames <= capabilities->maxPeriodFrames && values->count < SWEEP_DEFAULT_PERIODS;
+                 frames *= 2) {
+                addSweepValue(values, frames);
+            }
+            break;
+        default:
+            addSweepValue(values, 0);
+    }
+}
+
+// Returns the number of configurations in the grid
+long buildSweepGrid(const halPcmCapabilities *capabilities, sweepValues *grid) {
+    long points = 1;
+
+    for (int dimension = 0; dimension < SWEEP_DIMENSIONS; dimension++) {
+        grid[dimension].count = 0;
+        if (sweepRequests[dimension].count == 0) {
+            addDefaultSweepValues(dimension, capabilities, &grid[dimension]);
+        }
+        for (int i = 0; i < sweepRequests[dimension].count; i++) {
+            if (isSweepValueSupported(dimension, sweepRequests[dimension].values[i], capabilities)) {
+                addSweepValue(&grid[dimension], sweepRequests[dimension].values[i]);
+            }
+            else {
+                printf("Skipping %s %ld, the device does not support it\n",
+                       sweepDimensionNames[dimension], sweepRequests[dimension].values[i]);
+            }
+        }
+        points *= grid[dimension].count;
+    }
+    return(points);
+}
+
+// One record per configuration with the negotiated parameters and the statistics of its batch
+void writeSweepSummaryRow(FILE *filePointer) {
+    fprintf(filePointer, "%u,%s,%u,%lu,%lu,%ld,%ld,%ld,%.1f,%.1f,%d,%d,%d,%d,%d,%s\n",
+            sampleRate,
+            getFormatName(negotiatedFormat),
+            channelCount,
+            negotiatedPeriodFrames,
+            negotiatedBufferFrames,
+            sessionPulseCount,
+            sessionStats.count,
+            getLostPulseCount(),
+            sessionStats.mean,
+            getLatencyStandardDeviation(&sessionStats),
+            sessionStats.min,
+            sessionStats.max,
+            getLatencyPercentile(&sessionStats, 50.0),
+            getLatencyPercentile(&sessionStats, 90.0),
+            getLatencyPercentile(&sessionStats, 99.0),
+            getSessionResultName(getSessionResult()));
+    fflush(filePointer);
+}
+
+// Returns RESULT_FAIL if any configuration failed the pass criteria
+int runSweep() {
+    halPcmCapabilities capabilities;
+    sweepValues grid[SWEEP_DIMENSIONS];
+    long values[SWEEP_DIMENSIONS];
+    const char *deviceName;
+    char fileName[1024], summaryFilePath[1024], dutInput[1024], dutOutput[1024];
+    FILE *sweepFile, *summaryFile;
+    long points, remaining;
+    int result = RESULT_NOT_CHECKED, pointResult;
+
+    if (measurementMode == LINE_OUT_MODE_BUTTON || measurementMode == CAPTURE_MODE) {
+        printf("audio_lag_module.c l.3707: The sweep needs a PCM device, use --mode usb, hdmi or roundtrip\n");
+        return(RESULT_FAIL);
+    }
+    if (getPcmCapabilities(&capabilities, &deviceName) < 0) {
+        return(RESULT_FAIL);
+    }
+    printPcmCapabilities(deviceName, &capabilities);
+    points = buildSweepGrid(&capabilities, grid);
+    if (points == 0) {
+        printf("audio_lag_module.c l.3716: No configuration left to sweep\n");
+        return(RESULT_FAIL);
+    }
+
+    strcpy(fileName, FILE_NAME_PREFIX_SWEEP);
+    getMeasurementDependentValuesForCSV(fileName + strlen(fileName), dutInput, dutOutput);
+    addTimestampToFileName(fileName);
+    sweepFile = createCSVFile(sessionFilePath, fileName);
+    if (sweepFile == NULL) {
+        return(RESULT_FAIL);
+    }
+    strcpy(summaryFilePath, sessionFilePath);
+    strcat(summaryFilePath, FILE_NAME_SUFFIX_SUMMARY);
+    strcat(summaryFilePath, FILE_TYPE_SUFFIX);
+    summaryFile = fopen(summaryFilePath, "w");
+    if (summaryFile == NULL) {
+        printf("audio_lag_module.c l.3732: Could not open summary file\n");
+        fclose(sweepFile);
+        return(RESULT_FAIL);
+    }
+    fprintf(summaryFile, SWEEP_SUMMARY_CSV_HEADER);
+
+    halWrite(START_MEASUREMENT_LED, 1);
+    printEveryMeasurement = 0;
+    exitRequested = 0;
+    for (long point = 0; point < points && !isExitRequested(); point++) {
+        // Mixed radix counter over the grid, the buffer size changes fastest
+        remaining = point;
+        for (int dimension = SWEEP_DIMENSIONS - 1; dimension >= 0; dimension--) {
+            values[dimension] = grid[dimension].values[remaining % grid[dimension].count];
+            remaining /= grid[dimension].count;
+        }
+        requestedSampleRate = (unsigned int) values[SWEEP_RATE];
+        requestedFormat = (int) values[SWEEP_FORMAT];
+        requestedChannels = (unsigned int) values[SWEEP_CHANNELS];
+        requestedPeriodFrames = (unsigned long) values[SWEEP_PERIOD];
+        requestedBufferFrames = (unsigned long) values[SWEEP_BUFFER];
+
+        resetMeasurement();
+        startMeasurement(MEASURE);
+        writeMeasurementRows(sweepFile, dutInput, dutOutput, validMeasurementsCount);
+        fflush(sweepFile);
+        writeSweepSummaryRow(summaryFile);
+
+        pointResult = getSessionResult();
+        if (pointResult == RESULT_FAIL || (pointResult == RESULT_PASS && result == RESULT_NOT_CHECKED)) {
+            result = pointResult;
+        }
+        printf("%ld/%ld: %u Hz, %s, %u ch, period %lu, buffer %lu frames -> %ld of %ld valid, p50 %d us, p99 %d us\n",
+               point + 1, points, sampleRate, getFormatName(negotiatedFormat), channelCount,
+               negotiatedPeriodFrames, negotiatedBufferFrames, sessionStats.count, sessionPulseCount,
+               getLatencyPercentile(&sessionStats, 50.0), getLatencyPercentile(&sessionStats, 99.0));
+    }
+    printEveryMeasurement = 1;
+    halWrite(START_MEASUREMENT_LED, 0);
+    fclose(sweepFile);
+    fclose(summaryFile);
+
+    // Back to the fixed configuration of the button driven measurements
+    requestedSampleRate = PREFERRED_SAMPLE_RATE;
+    requestedFormat = FORMAT_TYPE;
+    requestedChannels = NUMBER_OF_CHANNELS;
+    requestedPeriodFrames = 0;
+    requestedBufferFrames = 0;
+    return(result);
+}
+
+// ####
+// #### USER INTERFACE VIA GPIOS ####
+
+void turnOffAllButtonLEDs() {
+    halWrite(LINE_OUT_MODE_LED, 0);
+    halWrite(USB_OUT_MODE_LED, 0);
+    halWrite(HDMI_OUT_MODE_LED, 0);
+    halWrite(EXIT_LED, 0);
+}
+
+// Returns the button that ended the calibration, -1 if the stream could not be started
+int runCalibration() {
+    calibrationQuality quality;
+    struct timespec now;
+
+    resetMeasurement();
+    calibrationCancelButton = -1;
+    calibrationStream = 1;
+    startMeasurement(CALIBRATE);
+    calibrationStream = 0;
+    userFeedbackCalibrationCancelled();
+    if (liveStatisticsPrinted) {
+        printf("\n");
+        liveStatisticsPrinted = 0;
+    }
+    getCalibrationQuality(&calibrationPulses, &quality);
+    if (quality.pulses == 0) {
+        return(calibrationCancelButton);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    lastCalibration = quality;
+    lastCalibrationMode = measurementMode;
+    lastCalibrationTimeInMicros = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    printf("Calibration: ");
+    printCalibrationQuality(&lastCalibration);
+    printf("\n");
+    return(calibrationCancelButton);
+}
+
+void waitForUserInput() {
+    int button = -1;
+
+    while (1) {
+        // The button that cancelled a calibration is handled right away
+        if (button == -1) {
+            button = waitForButtonPress();
+        }
+        if (button == START_MEASUREMENT_BUTTON) {
+            halWrite(START_MEASUREMENT_LED, 1);
+            resetMeasurement();
+            if (binaryResults) {
+                openSessionResults();
+            }
+            if (traceSessions) {
+                openSessionTrace();
+            }
+            if (driftTracking) {
+                openDriftLog();
+            }
+            startMeasurement(MEASURE);
+            closeSessionTrace();
+            closeDriftLog();
+            printSessionStatistics();
+            // Falls back to the CSV if the result file could not be created
+            if (isResultWriterOpen(&sessionResults)) {
+                closeSessionResults();
+            }
+            else {
+                writeMeasurementsToCSV();
+            }
+            halWrite(START_MEASUREMENT_LED, 0);
+            discardButtonPresses();
+            button = -1;
+        }
+        else if (button == CALIBRATION_MODE_BUTTON) {
+            button = runCalibration();
+        }
+        // Measurement mode got changed
+        // Duplicate code could not be avoided here.
+        else if (button == LINE_OUT_MODE_BUTTON) {
+            turnOffAllButtonLEDs();
+            measurementMode = LINE_OUT_MODE_BUTTON;
+            halWrite(LINE_OUT_MODE_LED, 1);
+            button = -1;
+        }
+        else if (button == USB_OUT_MODE_BUTTON) {
+            turnOffAllButtonLEDs();
+            measurementMode = USB_OUT_MODE_BUTTON;
+            halWrite(USB_OUT_MODE_LED, 1);
+            button = -1;
+        }
+        else if (button == HDMI_OUT_MODE_BUTTON) {
+            turnOffAllButtonLEDs();
+            measurementMode = HDMI_OUT_MODE_BUTTON;
+            halWrite(HDMI_OUT_MODE_LED, 1);
+            button = -1;
+        }
+        else if (button == EXIT_BUTTON) {
+            halWrite(EXIT_LED, 1);
+            halSleep(0.1);
+            prepareExit();
+            return;
+        }
+        else {
+            button = -1;
+        }
+    }
+}
+
+// ####
+// #### SOAK TEST ####
+
+// Returns the result of the pass criteria
+int runSoakTest() {
+    uint64_t soakStartTimestamp;
+    double soakTimeInS;
+    int status;
+
+    soakMode = 1;
+    resetMeasurement();
+    if (binaryResults) {
+        status = openSessionResults();
+    }
+    else {
+        soakFile = openMeasurementsCSV(soakDutInput, soakDutOutput);
+        status = soakFile != NULL ? 0 : -1;
+    }
+    if (status < 0) {
+        soakMode = 0;
+        return(RESULT_FAIL);
+    }
+    if (traceSessions) {
+        openSessionTrace();
+    }
+    if (driftTracking) {
+        openDriftLog();
+    }
+    halWrite(START_MEASUREMENT_LED, 1);
+    soakStartTimestamp = getTick64();
+    soakEndTimestamp = soakStartTimestamp + (uint64_t) (soakDurationInS * 1000000.0);
+    startMeasurement(MEASURE);
+    closeSessionTrace();
+    closeDriftLog();
+    flushSoakMeasurements();
+    soakTimeInS = (getTick64() - soakStartTimestamp) / 1000000.0;
+    halWrite(START_MEASUREMENT_LED, 0);
+    if (soakFile != NULL) {
+        fclose(soakFile);
+        soakFile = NULL;
+        writeSummaryToCSV(soakDutInput, soakDutOutput);
+    }
+    closeSessionResults();
+    soakMode = 0;
+
+    printSessionStatistics();
+    printf("Soak test finished after %.1f s\n", soakTimeInS);
+    return(getSessionResult());
+}
+
+// ####
+// #### BATCH JOBS ####
+
+// --jobs runs the measurements of a job file one after the other without user interface.
+// Every line is one job of KEY=VALUE pairs, # starts a comment, like
+//   mode=usb device=hw:CARD=usb_audio_bot pulses=5000 interval=0.05 rate=48000 period=64 output=/media/usb/
+// Keys a job leaves out keep the values of the command line. Every job runs like a soak test
+// and names its files after its line. The requested ALSA parameters are checked against the
+// cached capabilities of the device (see CONFIGURATION SWEEP) before the job starts.
+
+typedef struct {
+    int line; /* In the job file, names the files of the job */
+    int measurementMode;
+    char deviceName[64]; /* Empty opens the device of the measurement mode */
+    long pulses; /* 0 means no limit */
+    double durationInS; /* 0 means no limit */
+    double intervalInS; /* 0 adapts it to the latency */
+    long alsaValues[SWEEP_DIMENSIONS]; /* Indexed like the sweep dimensions */
+    int alsaRequested; /* One bit per dimension given in the job */
+    int maxP99InMicros;
+    double maxLossInPercent;
+    char outputFolder[1024]; /* Ends with a slash */
+} batchJob;
+
+batchJob jobs[MAX_JOBS];
+int jobCount = 0;
+
+int parseMeasurementMode(const char *mode) {
+    if (strcmp(mode, "line") == 0) {
+        return(LINE_OUT_MODE_BUTTON);
+    }
+    else if (strcmp(mode, "usb") == 0) {
+        return(USB_OUT_MODE_BUTTON);
+    }
+    else if (strcmp(mode, "hdmi") == 0) {
+        return(HDMI_OUT_MODE_BUTTON);
+    }
+    else if (strcmp(mode, "capture") == 0) {
+        return(CAPTURE_MODE);
+    }
+    else if (strcmp(mode, "roundtrip") == 0) {
+        return(ROUND_TRIP_MODE);
+    }
+    return(-1);
+}
+
+const char *getMeasurementModeName(int mode) {
+    switch (mode) {
+        case USB_OUT_MODE_BUTTON:
+            return("usb");
+        case HDMI_OUT_MODE_BUTTON:
+            return("hdmi");
+        case CAPTURE_MODE:
+            return("capture");
+        case ROUND_TRIP_MODE:
+            return("roundtrip");
+        default:
+            return("line");
+    }
+}
+
+// A job that leaves out every key, taken from the command line
+void getDefaultJob(batchJob *job) {
+    memset(job, 0, sizeof(batchJob));
+    job->measurementMode = measurementMode;
+    job->pulses = soakPulses;
+    job->durationInS = soakDurationInS;
+    job->intervalInS = fixedSignalIntervalInS;
+    job->maxP99InMicros = maxP99InMicros;
+    job->maxLossInPercent = maxLossInPercent;
+    setResultText(job->outputFolder, sizeof(job->outputFolder), measurementsFolderPath);
+}
+
+// Returns -1 if the key is unknown or its value invalid
+int setJobValue(batchJob *job, const char *key, const char *value) {
+    char *end;
+    long number;
+
+    if (strcmp(key, "mode") == 0) {
+        job->measurementMode = parseMeasurementMode(value);
+        return(job->measurementMode == -1 ? -1 : 0);
+    }
+    else if (strcmp(key, "device") == 0) {
+        setResultText(job->deviceName, sizeof(job->deviceName), value);
+        return(0);
+    }
+    else if (strcmp(key, "pulses") == 0) {
+        job->pulses = strtol(value, &end, 10);
+        return(*end != '\0' || job->pulses < 0 ? -1 : 0);
+    }
+    else if (strcmp(key, "duration") == 0) {
+        job->durationInS = strtod(value, &end);
+        return(*end != '\0' || job->durationInS < 0 ? -1 : 0);
+    }
+    else if (strcmp(key, "interval") == 0) {
+        if (strcmp(value, "adaptive") == 0) {
+            job->intervalInS = 0;
+            return(0);
+        }
+        job->intervalInS = strtod(value, &end);
+        return(*end != '\0' || job->intervalInS <= 0 ? -1 : 0);
+    }
+    else if (strcmp(key, "max-p99") == 0) {
+        job->maxP99InMicros = (int) strtol(value, &end, 10);
+        return(*end != '\0' || job->maxP99InMicros <= 0 ? -1 : 0);
+    }
+    else if (strcmp(key, "max-loss") == 0) {
+        job->maxLossInPercent = strtod(value, &end);
+        return(*end != '\0' || job->maxLossInPercent < 0 ? -1 : 0);
+    }
+    else if (strcmp(key, "output") == 0) {
+        if (*value == '\0' || strlen(value) + 2 > sizeof(job->outputFolder)) {
+            return(-1);
+        }
+        strcpy(job->outputFolder, value);
+        if (value[strlen(value) - 1] != '/') {
+            strcat(job->outputFolder, "/");
+        }
+        return(0);
+    }
+    // The ALSA parameters are named like the sweep dimensions
+    for (int dimension = 0; dimension < SWEEP_DIMENSIONS; dimension++) {
+        if (strcmp(key, sweepDimensionNames[dimension]) != 0) {
+            continue;
+        }
+        if (dimension == SWEEP_FORMAT) {
+            number = parseFormat(value);
+            if (number < 0) {
+                return(-1);
+            }
+        }
+        else {
+            number = strtol(value, &end, 10);
+            if (*end != '\0' || number < 0 || (number == 0 && dimension != SWEEP_BUFFER)) {
+                return(-1);
+            }
+        }
+        job->alsaValues[dimension] = number;
+        job->alsaRequested |= 1 << dimension;
+        return(0);
+    }
+    return(-1);
+}
+
+// Reads all jobs before the first one runs, so a typo does not stop the queue halfway
+int loadJobFile(const char *path) {
+    FILE *filePointer;
+    char text[JOB_LINE_LENGTH];
+    char *token, *value, *position;
+    batchJob defaults, *job;
+    int line = 0, status = 0;
+
+    filePointer = fopen(path, "r");
+    if (filePointer == NULL) {
+        printf("audio_lag_module.c l.4096: Could not open job file %s (%s)\n", path, strerror(errno));
+        return(-1);
+    }
+    getDefaultJob(&defaults);
+    jobCount = 0;
+    while (status == 0 && fgets(text, sizeof(text), filePointer) != NULL) {
+        line += 1;
+        if (strchr(text, '\n') == NULL && !feof(filePointer)) {
+            printf("%s:%d: Line longer than %d characters\n", path, line, JOB_LINE_LENGTH - 2);
+            status = -1;
+            break;
+        }
+        text[strcspn(text, "#")] = '\0';
+        token = strtok_r(text, " \t\r\n", &position);
+        if (token == NULL) {
+            continue;
+        }
+        if (jobCount == MAX_JOBS) {
+            printf("%s:%d: More than %d jobs\n", path, line, MAX_JOBS);
+            status = -1;
+            break;
+        }
+        job = &jobs[jobCount];
+        *job = defaults;
+        job->line = line;
+        for (; token != NULL && status == 0; token = strtok_r(NULL, " \t\r\n", &position)) {
+            value = strchr(token, '=');
+            if (value == NULL) {
+                printf("%s:%d: %s is no KEY=VALUE pair\n", path, line, token);
+                status = -1;
+                break;
+            }
+            *value = '\0';
+            if (setJobValue(job, token, value + 1) < 0) {
+                printf("%s:%d: Invalid %s %s\n", path, line, token, value + 1);
+                status = -1;
+            }
+        }
+        if (status == 0 && (job->deviceName[0] != '\0' || job->alsaRequested != 0)
+            && (job->measurementMode == LINE_OUT_MODE_BUTTON || job->measurementMode == CAPTURE_MODE)) {
+            printf("%s:%d: A %s job has no PCM device to configure\n", path, line, getMeasurementModeName(job->measurementMode));
+            status = -1;
+        }
+        // Like a button driven session without limits
+        if (job->pulses == 0 && job->durationInS == 0) {
+            job->pulses = TOTAL_MEASUREMENTS;
+        }
+        jobCount += 1;
+    }
+    fclose(filePointer);
+    if (status == 0 && jobCount == 0) {
+        printf("%s: No jobs\n", path);
+        status = -1;
+    }
+    return(status);
+}
+
+void applyJob(const batchJob *job) {
+    measurementMode = job->measurementMode;
+    requestedPcmDeviceName = job->deviceName[0] != '\0' ? job->deviceName : NULL;
+    soakPulses = job->pulses;
+    soakDurationInS = job->durationInS;
+    fixedSignalIntervalInS = job->intervalInS;
+    maxP99InMicros = job->maxP99InMicros;
+    maxLossInPercent = job->maxLossInPercent;
+    strcpy(measurementsFolderPath, job->outputFolder);
+    requestedSampleRate = job->alsaRequested & (1 << SWEEP_RATE) ? (unsigned int) job->alsaValues[SWEEP_RATE] : PREFERRED_SAMPLE_RATE;
+    requestedFormat = job->alsaRequested & (1 << SWEEP_FORMAT) ? (int) job->alsaValues[SWEEP_FORMAT] : FORMAT_TYPE;
+    requestedChannels = job->alsaRequested & (1 << SWEEP_CHANNELS) ? (unsigned int) job->alsaValues[SWEEP_CHANNELS] : NUMBER_OF_CHANNELS;
+    requestedPeriodFrames = job->alsaRequested & (1 << SWEEP_PERIOD) ? (unsigned long) job->alsaValues[SWEEP_PERIOD] : 0;
+    requestedBufferFrames = job->alsaRequested & (1 << SWEEP_BUFFER) ? (unsigned long) job->alsaValues[SWEEP_BUFFER] : 0;
+}
+
+// The device must support every ALSA parameter the job asks for, it is probed once per device
+int checkJobConfiguration(const batchJob *job) {
+    halPcmCapabilities capabilities;
+    const char *deviceName;
+
+    if (job->alsaRequested == 0) {
+        return(0);
+    }
+    if (getPcmCapabilities(&capabilities, &deviceName) < 0) {
+        return(-1);
+    }
+    for (int dimension = 0; dimension < SWEEP_DIMENSIONS; dimension++) {
+        if ((job->alsaRequested & (1 << dimension))
+            && !isSweepValueSupported(dimension, job->alsaValues[dimension], &capabilities)) {
+            printf("audio_lag_module.c l.4183: %s does not support %s %ld\n",
+                   deviceName, sweepDimensionNames[dimension], job->alsaValues[dimension]);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+void printJob(const batchJob *job, int number) {
+    printf("### Job %d/%d (line %d): %s", number, jobCount, job->line, getMeasurementModeName(job->measurementMode));
+    if (job->deviceName[0] != '\0') {
+        printf(" on %s", job->deviceName);
+    }
+    if (job->pulses > 0) {
+        printf(", %ld pulses", job->pulses);
+    }
+    if (job->durationInS > 0) {
+        printf(", %.0f s", job->durationInS);
+    }
+    if (job->intervalInS > 0) {
+        printf(", every %.3f s", job->intervalInS);
+    }
+    printf(" -> %s\n", job->outputFolder);
+}
+
+// Returns the result of the pass criteria, RESULT_ERROR if nothing could be measured
+int runJob(const batchJob *job) {
+    int result;
+
+    applyJob(job);
+    showMeasurementMode();
+    if (mkdir(measurementsFolderPath, 0755) < 0 && errno != EEXIST) {
+        printf("audio_lag_module.c l.4215: Could not create %s (%s)\n", measurementsFolderPath, strerror(errno));
+        return(RESULT_ERROR);
+    }
+    if (checkJobConfiguration(job) < 0) {
+        return(RESULT_ERROR);
+    }
+    currentJob = job->line;
+    result = runSoakTest();
+    currentJob = 0;
+    // The device could not be opened or no pulse came back
+    if (sessionStats.count == 0) {
+        return(RESULT_ERROR);
+    }
+    return(result);
+}
+
+// Returns the exit status, 1 if a job failed, could not measure or was skipped by the exit button
+int runJobs() {
+    batchJob defaults;
+    uint64_t jobStartTimestamp;
+    int result, passed = 0, failed = 0, unchecked = 0, errors = 0, skipped = 0;
+
+    getDefaultJob(&defaults);
+    userFeedbackCalibrationCancelled();
+    exitRequested = 0;
+    for (int i = 0; i < jobCount; i++) {
+        if (isExitRequested()) {
+            skipped = jobCount - i;
+            break;
+        }
+        printJob(&jobs[i], i + 1);
+        jobStartTimestamp = getTick64();
+        result = runJob(&jobs[i]);
+        if (result == RESULT_PASS) {
+            passed += 1;
+        }
+        else if (result == RESULT_FAIL) {
+            failed += 1;
+        }
+        else if (result == RESULT_ERROR) {
+            errors += 1;
+        }
+        else {
+            unchecked += 1;
+        }
+        printf("### Job %d/%d (line %d): %s after %.1f s\n\n", i + 1, jobCount, jobs[i].line,
+               getSessionResultName(result), (getTick64() - jobStartTimestamp) / 1000000.0);
+        // Green while every job went well, red after the first one that did not
+        if (failed == 0 && errors == 0) {
+            userFeedbackGoodSignal();
+        }
+        else {
+            userFeedbackBadSignal();
+        }
+    }
+    applyJob(&defaults);
+    showMeasurementMode();
+    printf("Jobs: %d passed, %d failed, %d not checked, %d could not measure, %d skipped\n",
+           passed, failed, unchecked, errors, skipped);
+    return(failed > 0 || errors > 0 || skipped > 0 ? 1 : 0);
+}
+
+// ####
+// #### BENCHMARK ####
+
+double getClockInS(clockid_t clock) {
+    struct timespec time;
+
+    clock_gettime(clock, &time);
+    return(time.tv_sec + time.tv_nsec / 1000000000.0);
+}
+
+typedef struct {
+    int sessions;
+    long totalPulses;
+    long totalValid;
+    double latencySumInMicros;
+    double latencySquareSumInMicros;
+    double startSkewSumInMicros;
+    double pulseCostSumInMicros;
+    long pulseCostCount;
+    uint32_t pulseCostMaxInMicros;
+    double rigTimeInS;
+    double wallTimeInS;
+    double cpuTimeInS;
+    latencyStats latencies; /* Of all sessions */
+} benchmarkResult;
+
+// Runs whole measurement sessions back to back without user interface.
+// With the simulated backend the pulse intervals are fast forwarded, so the
+// wall time is the overhead of the harness itself.
+void benchmarkSessions(int sessions, benchmarkResult *result) {
+    uint64_t sessionStartTick;
+
+    memset(result, 0, sizeof(benchmarkResult));
+    initLatencyStats(&result->latencies);
+    result->sessions = sessions;
+    printEveryMeasurement = 0;
+    result->wallTimeInS = getClockInS(CLOCK_MONOTONIC);
+    result->cpuTimeInS = getClockInS(CLOCK_THREAD_CPUTIME_ID);
+
+    for (int session = 0; session < sessions; session++) {
+        resetMeasurement();
+        sessionStartTick = getTick64();
+        startMeasurement(MEASURE);
+        result->rigTimeInS += (getTick64() - sessionStartTick) / 1000000.0;
+        result->totalPulses += TOTAL_MEASUREMENTS;
+        result->totalValid += validMeasurementsCount;
+        for (int i = 0; i < validMeasurementsCount; i++) {
+            result->latencySumInMicros += latencyMeasurementsInMicros[i];
+            result->latencySquareSumInMicros += (double) latencyMeasurementsInMicros[i] * latencyMeasurementsInMicros[i];
+            result->startSkewSumInMicros += startSkewsInMicros[i];
+            addLatency(&result->latencies, latencyMeasurementsInMicros[i]);
+        }
+        result->pulseCostSumInMicros += pulseCostSumInMicros;
+        result->pulseCostCount += pulseCostCount;
+        if (pulseCostMaxInMicros > result->pulseCostMaxInMicros) {
+            result->pulseCostMaxInMicros = pulseCostMaxInMicros;
         }
+    }
+    result->wallTimeInS = getClockInS(CLOCK_MONOTONIC) - result->wallTimeInS;
+    result->cpuTimeInS = getClockInS(CLOCK_THREAD_CPUTIME_ID) - result->cpuTimeInS;
+    printEveryMeasurement = 1;
+}
 
-        // Allocate a hardware parameters object. 
-        snd_pcm_hw_params_alloca(&params);
+void printBenchmarkResult(benchmarkResult *result) {
+    double meanLatency = -1, latencyDeviation = -1;
 
-        // Fill it in with default values. 
-        snd_pcm_hw_params_any(handle, params);
+    if (result->totalValid > 0) {
+        meanLatency = result->latencySumInMicros / result->totalValid;
+        latencyDeviation = sqrt(fmax(0, result->latencySquareSumInMicros / result->totalValid - meanLatency * meanLatency));
+    }
+    printf("Sessions:                 %d\n", result->sessions);
+    printf("Pulses (valid):           %ld (%ld)\n", result->totalPulses, result->totalValid);
+    printf("Latency:                  %.1f us mean, %.1f us standard deviation\n", meanLatency, latencyDeviation);
+    if (result->totalValid > 0) {
+        printf("Latency quantiles:        p50 %d us, p99 %d us, p99.9 %d us, max %d us\n",
+               getLatencyPercentile(&result->latencies, 50.0),
+               getLatencyPercentile(&result->latencies, 99.0),
+               getLatencyPercentile(&result->latencies, 99.9),
+               result->latencies.max);
+        printf("Pulse to pulse jitter:    %.1f us mean, %d us max\n",
+               result->latencies.jitterMean, result->latencies.jitterMax);
+    }
+    if (useHardwareTimestamps && result->totalValid > 0) {
+        printf("Start skew:               %.1f us mean (software minus hardware reference)\n",
+               result->startSkewSumInMicros / result->totalValid);
+    }
+    if (result->pulseCostCount > 0) {
+        printf("Pulse request to queued:  %.1f us mean, %u us max\n",
+               result->pulseCostSumInMicros / result->pulseCostCount, result->pulseCostMaxInMicros);
+    }
+    printf("Rig time:                 %.3f s\n", result->rigTimeInS);
+    printf("Wall time:                %.3f s (%.1f sessions per minute)\n",
+           result->wallTimeInS, result->wallTimeInS > 0 ? result->sessions * 60.0 / result->wallTimeInS : 0.0);
+    printf("Harness CPU time / pulse: %.2f us\n",
+           result->totalPulses > 0 ? result->cpuTimeInS * 1000000.0 / result->totalPulses : 0.0);
+}
 
-        // Set the desired hardware parameters. 
-        snd_pcm_hw_params_set_access(handle, params, ACCESS_TYPE);
-        //snd_pcm_hw_params_set_access(handle, params, SND_PCM_FORMAT_S32_LE);
-        snd_pcm_hw_params_set_format(handle, params, FORMAT_TYPE);
-        snd_pcm_hw_params_set_channels(handle, params, NUMBER_OF_CHANNELS);
-        sampleRate = PREFERRED_SAMPLE_RATE;
-        snd_pcm_hw_params_set_rate_near(handle, params, &sampleRate, &dir);
-        // Set period size to minimum to create smallest possible buffer size.
-        snd_pcm_hw_params_get_period_size_min(params, (snd_pcm_uframes_t *) &frames, &dir);
-        snd_pcm_hw_params_set_period_size_near(handle, params, &frames, &dir);
+void runBenchmark(int sessions) {
+    benchmarkResult result;
 
-        // Write the parameters to the driver 
-        status = snd_pcm_hw_params(handle, params);
-        if (status < 0) {
-            printf("audio_lag_module.c l.462: Unable to set PCM devices hardware parameters\n");
-            return;
-        }
-        
-        // Use a buffer large enough to hold one period 
-        snd_pcm_hw_params_get_period_size(params, &frames, &dir);
-        bufferSize = frames * BYTES_PER_SAMPLE * NUMBER_OF_CHANNELS;
-        buffer = (char *) malloc(bufferSize);
+    benchmarkSessions(sessions, &result);
+    printBenchmarkResult(&result);
+}
+
+// Compares reopening the PCM device for every pulse against one persistent stream
+void runStreamComparison(int sessions) {
+    benchmarkResult reopening, persistent;
+    int previousPersistentStream = persistentStream;
+
+    if (measurementMode == LINE_OUT_MODE_BUTTON || measurementMode == CAPTURE_MODE) {
+        printf("The stream comparison needs the usb, hdmi or roundtrip mode\n");
+        return;
+    }
+    persistentStream = 0;
+    benchmarkSessions(sessions, &reopening);
+    persistentStream = 1;
+    benchmarkSessions(sessions, &persistent);
+    persistentStream = previousPersistentStream;
+
+    printf("\n### Reopening the PCM device for every pulse\n");
+    printBenchmarkResult(&reopening);
+    printf("\n### Persistent PCM stream\n");
+    printBenchmarkResult(&persistent);
+}
+
+// The user interface loop before it waited for button events
+void *pollButtonsBusy(void *argument) {
+    while (atomic_load(&busyPollingActive)) {
+        halRead(START_MEASUREMENT_BUTTON);
+        halRead(CALIBRATION_MODE_BUTTON);
+        halRead(LINE_OUT_MODE_BUTTON);
+        halRead(USB_OUT_MODE_BUTTON);
+        halRead(HDMI_OUT_MODE_BUTTON);
+        halRead(EXIT_BUTTON);
+    }
+    return(NULL);
+}
+
+// Compares the latency jitter while the buttons are polled in a busy loop on another core
+// against the event driven user interface, which sleeps until a button is pressed
+void runUserInterfaceComparison(int sessions) {
+    benchmarkResult busyPolling, eventDriven;
+    pthread_t pollingThread;
+
+    atomic_store(&busyPollingActive, 1);
+    if (pthread_create(&pollingThread, NULL, pollButtonsBusy, NULL) != 0) {
+        printf("audio_lag_module.c l.4423: Unable to start the polling thread\n");
+        return;
+    }
+    benchmarkSessions(sessions, &busyPolling);
+    atomic_store(&busyPollingActive, 0);
+    pthread_join(pollingThread, NULL);
+    benchmarkSessions(sessions, &eventDriven);
+
+    printf("\n### Buttons polled in a busy loop\n");
+    printBenchmarkResult(&busyPolling);
+    printf("\n### Event driven buttons\n");
+    printBenchmarkResult(&eventDriven);
+}
+
+// How late halSleep returns, which is how late the measurement thread reacts
+void measureSleepOvershoot(latencyStats *overshoots) {
+    uint64_t before, after;
+    int64_t overshootInMicros;
+
+    initLatencyStats(overshoots);
+    for (int i = 0; i < SLEEP_TEST_SLEEPS; i++) {
+        before = getTick64();
+        halSleep(SLEEP_TEST_INTERVAL_IN_S);
+        after = getTick64();
+        overshootInMicros = (int64_t) (after - before) - (int64_t) (SLEEP_TEST_INTERVAL_IN_S * 1000000.0);
+        addLatency(overshoots, overshootInMicros > 0 ? (int) overshootInMicros : 0);
+    }
+}
+
+// Enables one setting of the real-time profile after the other for the measurement thread
+// and reports how each one changes the jitter. The alert thread keeps the profile it was started with.
+void runRealtimeSelfTest(int sessions) {
+    const char *steps[] = {"Default scheduling", "+ Memory locked", "+ CPU affinity", "+ SCHED_FIFO"};
+    benchmarkResult results[4];
+    latencyStats overshoots[4];
+    double deviation, previousDeviation = -1;
 
-        // Fill audio buffer
-        for (int byte = 0; byte < bufferSize; byte++) {
-            buffer[byte] = 127;
+    setRealtimePriority(0);
+    setCpuAffinity(-1);
+    unlockMemory();
+    for (int step = 0; step < 4; step++) {
+        if (step == 1) {
+            applyMemoryLock();
         }
-        
-        /* We want to loop for SIGNAL_LENGTH_IN_S */
-        snd_pcm_hw_params_get_period_time(params, &periodTimeInMicros, &dir);
-        
-        if (measurementMethod == MEASURE) {
-            signalIntervalInS = calculateSignalInterval(i);
+        else if (step == 2) {
+            applyThreadProfile("measurement", MEASUREMENT_CPU, 0);
         }
-        else {
-            signalIntervalInS = SIGNAL_START_INTERVAL_IN_S;
+        else if (step == 3) {
+            applyThreadProfile("measurement", MEASUREMENT_CPU, MEASUREMENT_PRIORITY);
         }
-        numberOfPeriods = SIGNAL_LENGTH_IN_S * 1000000 / periodTimeInMicros;
-        if (numberOfPeriods < MINIMUM_NUMBER_OF_PERIODS) {
-            numberOfPeriods = MINIMUM_NUMBER_OF_PERIODS;
+        benchmarkSessions(sessions, &results[step]);
+        measureSleepOvershoot(&overshoots[step]);
+    }
+
+    printf("GPIO sample period: %u us, alert thread %s\n",
+           microsPerSample > 0 ? microsPerSample : 5, realtimeProfile ? "real-time" : "default");
+    printf("%-20s %14s %14s %14s %24s\n", "Setting", "Latency SD", "p99 - p50", "Pulse jitter", "Sleep overshoot p99/max");
+    for (int step = 0; step < 4; step++) {
+        deviation = getLatencyStandardDeviation(&results[step].latencies);
+        printf("%-20s %11.1f us %11d us %11.1f us %15d/%d us",
+               steps[step],
+               deviation,
+               getLatencyPercentile(&results[step].latencies, 99.0) - getLatencyPercentile(&results[step].latencies, 50.0),
+               results[step].latencies.jitterMean,
+               getLatencyPercentile(&overshoots[step], 99.0),
+               overshoots[step].max);
+        if (previousDeviation > 0) {
+            printf("  (latency SD %+.1f %%)", 100.0 * (deviation - previousDeviation) / previousDeviation);
         }
-        
-        while (numberOfPeriods > 0) {
-            status = snd_pcm_writei(handle, buffer, frames);
-            if (status == -EPIPE) {
-                printf("audio_lag_module.c l.493: Underrun occured during snd_pcm_writei -> Preparing PCM device to continue measurement\n");
-                snd_pcm_prepare(handle);
-            }
-            else if (status < 0) {
-                printf("audio_lag_module.c l.497: Error during snd_pcm_writei -> Reopening PCM device\n");
-                break;
-            }
-            else {
-                if (signalStatus != SIGNAL_ON_THE_WAY) {
-                    startTimestamp = gpioTick();
-                    signalStatus = SIGNAL_ON_THE_WAY;
-                    gpioSetAlertFunc(LINE_IN, onLineIn);
-                }
+        printf("\n");
+        previousDeviation = deviation;
+    }
+}
+
+// Random normal number for the synthetic captures
+double getTestNoise() {
+    double u1, u2;
+
+    do {
+        u1 = rand() / (RAND_MAX + 1.0);
+    } while (u1 <= 0.0);
+    u2 = rand() / (RAND_MAX + 1.0);
+    return(sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+// Plays the reference into windows with known fractional delays, random polarity and noise
+void runSyntheticCorrelationTest(xcorrDetector *detector, const float *reference, float *window, int windowFrames) {
+    xcorrResult result;
+    double delay, position, polarity, error, time;
+    double errorSum = 0, errorMax = 0, confidenceSum = 0, confidenceMin = 1.0, timeSum = 0, timeMax = 0;
+    int frame, accepted = 0;
+
+    srand(1);
+    for (int detection = 0; detection < XCORR_TEST_DETECTIONS; detection++) {
+        delay = (windowFrames - detector->referenceLength - 1) * (rand() / (RAND_MAX + 1.0));
+        polarity = rand() % 2 == 0 ? 0.5 : -0.5;
+        for (int i = 0; i < windowFrames; i++) {
+            position = i - delay;
+            frame = (int) floor(position);
+            window[i] = XCORR_TEST_NOISE * getTestNoise();
+            if (frame >= 0 && frame + 1 < detector->referenceLength) {
+                window[i] += polarity * (reference[frame] + (reference[frame + 1] - reference[frame]) * (position - frame));
             }
-            numberOfPeriods--;
         }
-        snd_pcm_drain(handle);
-        snd_pcm_close(handle);
-        free(buffer);
-        time_sleep(signalIntervalInS);
+        time = getClockInS(CLOCK_MONOTONIC);
+        findReference(detector, window, windowFrames, &result);
+        time = (getClockInS(CLOCK_MONOTONIC) - time) * 1000000.0;
+        timeSum += time;
+        timeMax = fmax(timeMax, time);
+        confidenceSum += result.confidence;
+        confidenceMin = fmin(confidenceMin, result.confidence);
+        error = fabs(result.lagInSamples - delay);
+        errorSum += error;
+        errorMax = fmax(errorMax, error);
+        if (error < 1.0 && result.confidence >= XCORR_MIN_CONFIDENCE) {
+            accepted += 1;
+        }
     }
+    printf("Detections:         %d (%d within one sample and confidence >= %.2f)\n",
+           XCORR_TEST_DETECTIONS, accepted, XCORR_MIN_CONFIDENCE);
+    printf("Error:              mean %.3f samples (%.2f us), max %.3f samples (%.2f us)\n",
+           errorSum / XCORR_TEST_DETECTIONS, errorSum / XCORR_TEST_DETECTIONS * 1000000.0 / PREFERRED_SAMPLE_RATE,
+           errorMax, errorMax * 1000000.0 / PREFERRED_SAMPLE_RATE);
+    printf("Confidence:         mean %.3f, min %.3f (noise %.3f of full scale)\n",
+           confidenceSum / XCORR_TEST_DETECTIONS, confidenceMin, XCORR_TEST_NOISE);
+    printf("Time per detection: %.1f us mean, %.1f us max\n", timeSum / XCORR_TEST_DETECTIONS, timeMax);
 }
 
-// ####
-// #### USER INTERFACE VIA GPIOS ####
+// Finds every pulse in a raw S16_LE mono recording at PREFERRED_SAMPLE_RATE
+int runFileCorrelationTest(xcorrDetector *detector, const char *path, float *window, int windowFrames) {
+    FILE *filePointer;
+    char *frames;
+    float *samples;
+    long count, start = 0;
+    int pulses = 0;
+    xcorrResult result;
+    double pulseFrame, previousPulseFrame = -1;
 
-void userFeedbackGoodSignal() {
-    gpioWrite(CALIBRATION_MODE_GREEN_LED, 1);
-    gpioWrite(CALIBRATION_MODE_YELLOW_LED, 1);
-    gpioWrite(CALIBRATION_MODE_RED_LED, 1);
+    filePointer = fopen(path, "rb");
+    if (filePointer == NULL) {
+        printf("audio_lag_module.c l.4563: Could not open %s\n", path);
+        return(-ENOENT);
+    }
+    fseek(filePointer, 0, SEEK_END);
+    count = ftell(filePointer) / 2;
+    fseek(filePointer, 0, SEEK_SET);
+    frames = (char *) malloc(count * 2);
+    samples = (float *) malloc(count * sizeof(float));
+    if (frames == NULL || samples == NULL || fread(frames, 2, count, filePointer) != (size_t) count) {
+        printf("audio_lag_module.c l.4572: Could not read %s\n", path);
+        free(frames);
+        free(samples);
+        fclose(filePointer);
+        return(-EIO);
+    }
+    fclose(filePointer);
+    getFirstChannelSamples(frames, HAL_PCM_FORMAT_S16_LE, 1, count, samples);
+    free(frames);
+
+    while (start + windowFrames <= count) {
+        memcpy(window, samples + start, windowFrames * sizeof(float));
+        findReference(detector, window, windowFrames, &result);
+        if (result.confidence < XCORR_MIN_CONFIDENCE) {
+            start += windowFrames - detector->referenceLength;
+            continue;
+        }
+        pulseFrame = start + result.lagInSamples;
+        printf("Pulse at frame %.2f (%.3f ms), confidence %.3f", pulseFrame, pulseFrame * 1000.0 / PREFERRED_SAMPLE_RATE,
+               result.confidence);
+        if (previousPulseFrame >= 0) {
+            printf(", %.3f ms after the previous one", (pulseFrame - previousPulseFrame) * 1000.0 / PREFERRED_SAMPLE_RATE);
+        }
+        printf("\n");
+        previousPulseFrame = pulseFrame;
+        pulses += 1;
+        start = (long) pulseFrame + detector->referenceLength;
+    }
+    printf("Pulses:             %d in %.3f s\n", pulses, (double) count / PREFERRED_SAMPLE_RATE);
+    free(samples);
+    return(0);
 }
 
-void userFeedbackMediumSignal() {
-    gpioWrite(CALIBRATION_MODE_GREEN_LED, 0);
-    gpioWrite(CALIBRATION_MODE_YELLOW_LED, 1);
-    gpioWrite(CALIBRATION_MODE_RED_LED, 1);
+// Runs the cross-correlation detector without a DUT, on synthetic captures or on a recording.
+// The reference is the pulse waveform, the chirp if the constant one is selected.
+int runCorrelationTest(const char *input) {
+    int waveform = pulseWaveform == WAVEFORM_CONSTANT ? WAVEFORM_CHIRP : pulseWaveform;
+    int windowFrames = XCORR_TEST_REFERENCE_FRAMES + SIGNAL_START_INTERVAL_IN_S * PREFERRED_SAMPLE_RATE;
+    float reference[XCORR_TEST_REFERENCE_FRAMES];
+    xcorrDetector detector;
+    float *window;
+    int status;
+
+    getWaveformSamples(waveform, PREFERRED_SAMPLE_RATE, XCORR_TEST_REFERENCE_FRAMES, reference);
+    window = (float *) malloc(windowFrames * sizeof(float));
+    if (window == NULL) {
+        return(-ENOMEM);
+    }
+    status = initXcorrDetector(&detector, reference, XCORR_TEST_REFERENCE_FRAMES, windowFrames);
+    if (status < 0) {
+        free(window);
+        return(status);
+    }
+    printf("Reference:          %s, %d frames at %d Hz, window %d frames, FFT size %d\n",
+           getWaveformName(waveform), XCORR_TEST_REFERENCE_FRAMES, PREFERRED_SAMPLE_RATE, windowFrames, detector.size);
+    if (strcmp(input, "synthetic") == 0) {
+        runSyntheticCorrelationTest(&detector, reference, window, windowFrames);
+    }
+    else {
+        status = runFileCorrelationTest(&detector, input, window, windowFrames);
+    }
+    freeXcorrDetector(&detector);
+    free(window);
+    return(status);
 }
 
-void userFeedbackBadSignal() {
-    gpioWrite(CALIBRATION_MODE_GREEN_LED, 0);
-    gpioWrite(CALIBRATION_MODE_YELLOW_LED, 0);
-    gpioWrite(CALIBRATION_MODE_RED_LED, 1);
+// ####
+// #### RIG CALIBRATION ####
+
+// With GPIO 5 wired straight to GPIO 4 the line path measures the rig alone. Both edges are sampled by
+// pigpio, so their latency is what the sampling adds, and the alert thread shows how late it dispatches
+// them. The digital path times snd_pcm_writei on the usb or hdmi device and the step from its return to
+// the start stamp of the sessions. The transistor on line in is not part of the loop.
+// Every calibration is appended to RIG_PROFILE_PATH, so the paths can be compared across builds.
+
+latencyStats rigDispatchStats; // Written by the alert thread while the line path is calibrated
+
+// Line in alert of the calibration, measures how late the edge is dispatched
+void onRigLineIn(int gpio, int level, uint32_t tick) {
+    int32_t dispatchInMicros;
+
+    onGpioAlert(gpio, level, tick);
+    if (level == 1) {
+        dispatchInMicros = (int32_t) (halTick() - tick);
+        addLatency(&rigDispatchStats, dispatchInMicros > 0 ? dispatchInMicros : 0);
+    }
 }
 
-void userFeedbackCalibrationCancelled() {
-    gpioWrite(CALIBRATION_MODE_GREEN_LED, 0);
-    gpioWrite(CALIBRATION_MODE_YELLOW_LED, 0);
-    gpioWrite(CALIBRATION_MODE_RED_LED, 0);
+void makeRigProfileEntry(rigProfileEntry *entry, const char *path, const latencyStats *stats, int offsetInMicros) {
+    time_t now = time(NULL);
+    struct tm localTime;
+
+    memset(entry, 0, sizeof(rigProfileEntry));
+    gethostname(entry->host, sizeof(entry->host) - 1);
+    snprintf(entry->build, sizeof(entry->build), "%s", getBuildId());
+    strftime(entry->timestamp, sizeof(entry->timestamp), FILE_NAME_TIMESTAMP_FORMAT, localtime_r(&now, &localTime));
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->samples = stats->count;
+    entry->offsetInMicros = offsetInMicros;
+    entry->meanInMicros = stats->mean;
+    entry->deviationInMicros = getLatencyStandardDeviation(stats);
+    entry->p50InMicros = getLatencyPercentile(stats, 50.0);
+    entry->p99InMicros = getLatencyPercentile(stats, 99.0);
+    entry->maxInMicros = stats->max;
+    entry->jitterMeanInMicros = stats->jitterMean;
 }
 
-void turnOffAllButtonLEDs() {
-    gpioWrite(LINE_OUT_MODE_LED, 0);
-    gpioWrite(USB_OUT_MODE_LED, 0);
-    gpioWrite(HDMI_OUT_MODE_LED, 0);
-    gpioWrite(EXIT_LED, 0);
+// Steps of the tick when it is read in a loop, the smallest one is its resolution
+void measureTickResolution(rigProfileEntry *entry) {
+    latencyStats steps;
+    uint32_t previousTick = halTick(), tick;
+
+    initLatencyStats(&steps);
+    while (steps.count < RIG_TICK_SAMPLES) {
+        tick = halTick();
+        if (tick != previousTick) {
+            addLatency(&steps, (int) (tick - previousTick));
+            previousTick = tick;
+        }
+    }
+    makeRigProfileEntry(entry, "tick", &steps, 0);
 }
 
-void waitForUserInput() {
-    while (1) {
-        if (gpioRead(START_MEASUREMENT_BUTTON) == 1) {
-            gpioWrite(START_MEASUREMENT_LED, 1);
-            resetMeasurement();
-            if (measurementMode == LINE_OUT_MODE_BUTTON) {
-                startMeasurementLineOut(MEASURE);
-            }
-            // USB_, HDMI_, PCIE_OUT
-            else {
-                startMeasurementDigitalOut(MEASURE);
-            }
-            writeMeasurementsToCSV();
-            gpioWrite(START_MEASUREMENT_LED, 0);
-        }
-        else if (gpioRead(CALIBRATION_MODE_BUTTON) == 1) {
-            while (gpioRead(START_MEASUREMENT_BUTTON) == 0
-                    && gpioRead(LINE_OUT_MODE_BUTTON) == 0
-                    && gpioRead(USB_OUT_MODE_BUTTON) == 0
-                    && gpioRead(HDMI_OUT_MODE_BUTTON) == 0
-                    && gpioRead(EXIT_BUTTON) == 0) {
-                resetMeasurement();
-                if (measurementMode == LINE_OUT_MODE_BUTTON) {
-                    startMeasurementLineOut(CALIBRATE);
-                }
-                // USB_, HDMI_, PCIE_OUT
-                else {
-                    startMeasurementDigitalOut(CALIBRATE);
-                }
-                if (validMeasurementsCount == TOTAL_CALIBRATION_MEASUREMENTS) {
-                    userFeedbackGoodSignal();
-                }
-                else if (validMeasurementsCount > TOTAL_CALIBRATION_MEASUREMENTS / 5) {
-                    userFeedbackMediumSignal();
-                }
-                else {
-                    userFeedbackBadSignal();
-                }
+// One line out session through the loopback, the mean latency is the offset of the line path
+int calibrateLinePath(rigProfileEntry *line, rigProfileEntry *dispatch) {
+    int previousMode = measurementMode, previousPipelineDepth = pipelineDepth;
+
+    measurementMode = LINE_OUT_MODE_BUTTON;
+    pipelineDepth = 1;
+    initLatencyStats(&rigDispatchStats);
+    halSetAlertFunc(LINE_IN, onRigLineIn);
+    printEveryMeasurement = 0;
+    resetMeasurement();
+    startMeasurement(MEASURE);
+    printEveryMeasurement = 1;
+    halSetAlertFunc(LINE_IN, onGpioAlert);
+    measurementMode = previousMode;
+    pipelineDepth = previousPipelineDepth;
+    if (sessionStats.count == 0) {
+        printf("audio_lag_module.c l.4711: No pulse arrived on GPIO %d -> Is GPIO %d wired to it?\n", LINE_IN, LINE_OUT);
+        return(-1);
+    }
+    makeRigProfileEntry(line, "line", &sessionStats, (int) lround(sessionStats.mean));
+    // The alert tick is the sample time, the dispatch delay is reported but not part of any latency
+    makeRigProfileEntry(dispatch, "alert-dispatch", &rigDispatchStats, 0);
+    return(0);
+}
+
+// Writes silence to the device like the sessions write their pulses, with --persistent-stream into one
+// running stream, otherwise into a freshly opened one every time.
+// The start stamp is taken like in the sessions (getDigitalSignalStart), with --hw-timestamps from the
+// PCM status. It is late by its step from the return of snd_pcm_writei, which shortens every latency.
+// Without --hw-timestamps the sessions stamp the return itself and the step is 0.
+// The stamp of a freshly opened stream can also lie before the return, so the offset is the signed mean
+// of the steps and their statistics are kept by the size of the step.
+int calibrateDigitalPath(rigProfileEntry *writes, rigProfileEntry *stamps) {
+    int previousMode = measurementMode;
+    latencyStats writeStats, stampStats;
+    halPcm *handle;
+    halPcmConfig config;
+    uint32_t requestTimestamp, returnTimestamp;
+    uint64_t stampTimestamp;
+    long status;
+    int64_t stepInMicros;
+    double stepSumInMicros = 0;
+    int opened, startSkewInMicros;
+
+    if (measurementMode != HDMI_OUT_MODE_BUTTON) {
+        measurementMode = USB_OUT_MODE_BUTTON;
+    }
+    initLatencyStats(&writeStats);
+    initLatencyStats(&stampStats);
+    config.periodFrames = requestedPeriodFrames;
+    config.bufferFrames = requestedBufferFrames;
+    opened = openPcmDevice(&handle, &config) == 0;
+    if (opened && preparePulseWaveform(&config, getNumberOfSignalPeriods(&config)) < 0) {
+        halPcmClose(handle);
+        opened = 0;
+    }
+    for (long i = 0; i < TOTAL_MEASUREMENTS && opened; i++) {
+        if (!persistentStream && i > 0) {
+            halPcmClose(handle);
+            opened = openPcmDevice(&handle, &config) == 0;
+            if (!opened) {
+                break;
             }
-            userFeedbackCalibrationCancelled();
         }
-        // Measurement mode got changed
-        // Duplicate code could not be avoided here.
-        else if (gpioRead(LINE_OUT_MODE_BUTTON) == 1) {
-            turnOffAllButtonLEDs();
-            measurementMode = LINE_OUT_MODE_BUTTON;
-            gpioWrite(LINE_OUT_MODE_LED, 1);
+        requestTimestamp = halTick();
+        status = writePcmFrames(handle, NULL, config.periodFrames);
+        returnTimestamp = halTick();
+        if (status == -EPIPE) {
+            halPcmPrepare(handle);
         }
-        else if (gpioRead(USB_OUT_MODE_BUTTON) == 1) {
-            turnOffAllButtonLEDs();
-            measurementMode = USB_OUT_MODE_BUTTON;
-            gpioWrite(USB_OUT_MODE_LED, 1);
+        else if (status < 0) {
+            printf("audio_lag_module.c l.4766: Error during snd_pcm_writei -> Stopping the benchmark\n");
+            break;
         }
-        else if (gpioRead(HDMI_OUT_MODE_BUTTON) == 1) {
-            turnOffAllButtonLEDs();
-            measurementMode = HDMI_OUT_MODE_BUTTON;
-            gpioWrite(HDMI_OUT_MODE_LED, 1);
+        else {
+            // The first frame of the write stands for the first frame of a pulse
+            stampTimestamp = getDigitalSignalStart(handle, &config, (unsigned long) status, returnTimestamp, &startSkewInMicros);
+            addLatency(&writeStats, (int) (returnTimestamp - requestTimestamp));
+            stepInMicros = (int64_t) stampTimestamp - (int64_t) unwrapTick(returnTimestamp);
+            stepSumInMicros += stepInMicros;
+            addLatency(&stampStats, (int) llabs(stepInMicros));
         }
-        else if (gpioRead(EXIT_BUTTON) == 1) {
-            gpioWrite(EXIT_LED, 1);
-            time_sleep(0.1);
-            prepareExit();
-            return;
+    }
+    if (opened) {
+        halPcmClose(handle);
+    }
+    if (writeStats.count > 0) {
+        makeRigProfileEntry(writes, measurementMode == HDMI_OUT_MODE_BUTTON ? "hdmi-writei" : "usb-writei", &writeStats, 0);
+        makeRigProfileEntry(stamps, measurementMode == HDMI_OUT_MODE_BUTTON ? "hdmi-stamp" : "usb-stamp",
+                            &stampStats, (int) -lround(stepSumInMicros / writeStats.count));
+    }
+    measurementMode = previousMode;
+    return(writeStats.count > 0 ? 0 : -1);
+}
+
+// A path regressed if the value grew by more than the tolerance of the previous calibration
+int isRigValueRegression(int value, int previousValue) {
+    int tolerance = (int) (abs(previousValue) * RIG_REGRESSION_RATIO);
+
+    if (tolerance < RIG_REGRESSION_MIN_IN_MICROS) {
+        tolerance = RIG_REGRESSION_MIN_IN_MICROS;
+    }
+    return(value - previousValue > tolerance);
+}
+
+int appendRigProfileEntries(const rigProfileEntry *entries, int count) {
+    FILE *filePointer;
+
+    filePointer = fopen(RIG_PROFILE_PATH, "a");
+    if (filePointer == NULL) {
+        printf("audio_lag_module.c l.4805: Could not open %s\n", RIG_PROFILE_PATH);
+        return(-1);
+    }
+    if (ftell(filePointer) == 0) {
+        fprintf(filePointer, RIG_PROFILE_CSV_HEADER);
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(filePointer, "%s,%s,%s,%s,%ld,%d,%.1f,%.1f,%d,%d,%d,%.1f\n",
+                entries[i].host, entries[i].build, entries[i].timestamp, entries[i].path,
+                entries[i].samples, entries[i].offsetInMicros, entries[i].meanInMicros, entries[i].deviationInMicros,
+                entries[i].p50InMicros, entries[i].p99InMicros, entries[i].maxInMicros, entries[i].jitterMeanInMicros);
+    }
+    fclose(filePointer);
+    return(0);
+}
+
+// Returns 1 if a path could not be calibrated or regressed since the previous calibration on this host
+int runRigCalibration() {
+    rigProfileEntry entries[5], previous;
+    int count = 0, regression, regressions = 0;
+
+    subtractRigOffset = 0;
+    printf("Calibrating the rig with build %s, GPIO %d must be wired straight to GPIO %d\n", getBuildId(), LINE_OUT, LINE_IN);
+    measureTickResolution(&entries[count]);
+    count += 1;
+    if (calibrateLinePath(&entries[count], &entries[count + 1]) == 0) {
+        count += 2;
+    }
+    if (calibrateDigitalPath(&entries[count], &entries[count + 1]) == 0) {
+        count += 2;
+    }
+
+    printf("%-16s %8s %8s %9s %8s %8s %8s %8s %8s   %s\n",
+           "PATH", "SAMPLES", "OFFSET", "MEAN", "SD", "P50", "P99", "MAX", "JITTER", "PREVIOUS CALIBRATION");
+    for (int i = 0; i < count; i++) {
+        printf("%-16s %8ld %5d us %6.1f us %5.1f us %5d us %5d us %5d us %5.1f us   ",
+               entries[i].path, entries[i].samples, entries[i].offsetInMicros, entries[i].meanInMicros,
+               entries[i].deviationInMicros, entries[i].p50InMicros, entries[i].p99InMicros,
+               entries[i].maxInMicros, entries[i].jitterMeanInMicros);
+        if (findRigProfileEntry(entries[i].path, &previous) < 0) {
+            printf("-\n");
+            continue;
         }
-        else {
-            // No action, just keeping the while loop going
+        regression = isRigValueRegression(entries[i].p99InMicros, previous.p99InMicros)
+                     || isRigValueRegression(abs(entries[i].offsetInMicros), abs(previous.offsetInMicros));
+        regressions += regression;
+        printf("build %s: offset %+d us, p99 %+d us%s\n", previous.build,
+               entries[i].offsetInMicros - previous.offsetInMicros, entries[i].p99InMicros - previous.p99InMicros,
+               regression ? " -> REGRESSION" : "");
+    }
+    if (appendRigProfileEntries(entries, count) < 0 || count < 5) {
+        return(1);
+    }
+    return(regressions > 0 ? 1 : 0);
+}
+
+// ####
+// #### REPLAY ####
+
+// Measurement mode of a recorded session, from the DUT input and output in its header
+int getRecordedMeasurementMode(const resultHeader *header) {
+    char dutInput[sizeof(header->dutInput) + 1], dutOutput[sizeof(header->dutOutput) + 1];
+
+    setResultText(dutInput, sizeof(dutInput), header->dutInput);
+    setResultText(dutOutput, sizeof(dutOutput), header->dutOutput);
+    if (strcmp(dutOutput, DUT_OUTPUT_VALUE_USB) == 0) {
+        return(strcmp(dutInput, DUT_INPUT_VALUE_USB) == 0 ? ROUND_TRIP_MODE : CAPTURE_MODE);
+    }
+    else if (strcmp(dutInput, DUT_INPUT_VALUE_USB) == 0) {
+        return(USB_OUT_MODE_BUTTON);
+    }
+    else if (strcmp(dutInput, DUT_INPUT_VALUE_HDMI) == 0) {
+        return(HDMI_OUT_MODE_BUTTON);
+    }
+    return(LINE_OUT_MODE_BUTTON);
+}
+
+// Settings of the recorded session that change how its pulses are matched and saved
+void applyRecordedSettings(const resultHeader *header) {
+    measurementMode = getRecordedMeasurementMode(header);
+    pipelineDepth = header->pipelineDepth > 1 ? (int) header->pipelineDepth : 1;
+    useHardwareTimestamps = (header->options & RESULT_OPTION_HW_TIMESTAMPS) != 0;
+    subtractRigOffset = (header->options & RESULT_OPTION_RIG_OFFSET) != 0;
+    rigOffsetInMicros = header->rigOffsetInMicros;
+    rigOffsetMode = measurementMode;
+    rigOffsetPath = rigOffsetInMicros != 0 ? getRigPath(measurementMode) : NULL;
+    // The glitch filter is already taken out of the recorded ticks
+    minPulseWidthInMicros = header->minPulseWidthInMicros;
+    acceptanceSigmas = header->acceptanceSigmas;
+}
+
+// Feeds the events of a trace through the matching and statistics of the measurement loop,
+// as fast as they can be read. Returns 1 if the trace could not be read.
+int runReplay(const char *path) {
+    resultFile file;
+    const traceRecord *record;
+    edgeEvent event;
+    uint64_t firstTimestamp = 0, lastTimestamp = 0, replayTick64 = 0;
+    long edges = 0, droppedEdges = 0;
+    double replayTimeInS;
+    int status;
+
+    status = mapTraceFile(&file, path);
+    if (status < 0) {
+        printf("audio_lag_module.c l.4909: Unable to read trace %s (%s)\n", path, strerror(-status));
+        return(1);
+    }
+    if (!file.header->finished) {
+        printf("%s: The session did not finish, replaying the events up to its end\n", path);
+    }
+    applyRecordedSettings(file.header);
+    printEveryMeasurement = 0;
+    resetMeasurement();
+    sampleRate = file.header->sampleRate;
+    channelCount = file.header->channels > 0 ? file.header->channels : NUMBER_OF_CHANNELS;
+    bufferSize = file.header->periodFrames * file.header->bytesPerFrame;
+    lastTick64 = 0;
+
+    replayTimeInS = getClockInS(CLOCK_MONOTONIC);
+    for (long i = 0; i < file.count; i++) {
+        record = getTraceRecord(&file, i);
+        switch (record->type) {
+            case TRACE_EDGE:
+                event.gpio = record->gpio;
+                event.level = record->level;
+                event.tick = record->tick;
+                processEdgeEvent(&event);
+                lastTimestamp = unwrapTickFrom(&replayTick64, record->tick);
+                if (edges == 0) {
+                    firstTimestamp = lastTimestamp;
+                }
+                edges += 1;
+                break;
+            case TRACE_PULSE:
+                // Long sessions are kept in constant memory like soak tests
+                if (validMeasurementsCount >= SOAK_FLUSH_MEASUREMENTS) {
+                    flushSoakMeasurements();
+                }
+                countPulse();
+                break;
+            case TRACE_SIGNAL_START:
+                currentPulseCode = record->code;
+                markSignalStart(unwrapTick(record->tick), record->value);
+                break;
+            case TRACE_PULSE_WIDTH:
+                setPulseWidth(record->value / 1000.0);
+                break;
+            case TRACE_TRAIN_RESET:
+                resetPulseTrain();
+                break;
+            case TRACE_TRAIN_PULSE:
+                // The width is not needed to match the pulses
+                addTrainPulse((uint32_t) record->value, 0, record->code);
+                break;
+            case TRACE_TRAIN_SENT:
+                markPulseTrainSent();
+                break;
+            case TRACE_TRAIN_DONE:
+                finishPulseTrain();
+                break;
+            case TRACE_EDGES_DROPPED:
+                droppedEdges += record->value;
+                break;
+            default:
+                break;
         }
     }
+    timeOutAllSignals(lastTick64);
+    replayTimeInS = getClockInS(CLOCK_MONOTONIC) - replayTimeInS;
+
+    printf("Replayed %ld events (%ld edges) of %.1f s in %.3f s", file.count, edges,
+           (lastTimestamp - firstTimestamp) / 1000000.0, replayTimeInS);
+    if (replayTimeInS > 0) {
+        printf(", %.0f times real time", (lastTimestamp - firstTimestamp) / 1000000.0 / replayTimeInS);
+    }
+    printf("\n");
+    if (droppedEdges > 0 || file.trailingBytes > 0) {
+        printf("The recording lost %ld edges in full queues, %zu bytes of an incomplete event are ignored\n",
+               droppedEdges, file.trailingBytes);
+    }
+    printSessionStatistics();
+    unmapResultFile(&file);
+    return(0);
+}
+
+// ####
+// #### COMMAND LINE ####
+
+void printUsage(const char *programName) {
+    printf("Usage: %s [options]\n", programName);
+    printf("Without options the measurement is controlled with the buttons of the rig.\n");
+    printf("  -m, --mode line|usb|hdmi|capture|roundtrip\n");
+    printf("                              Initial measurement mode (default line). capture sends the pulse\n");
+    printf("                              from line out GPIO %d into the line in of the DUT and detects it in\n", LINE_OUT);
+    printf("                              the USB capture of the DUT, roundtrip plays it on USB and detects it\n");
+    printf("                              in the USB capture after the DUT looped it back\n");
+    printf("  -b, --benchmark SESSIONS    Run SESSIONS measurement sessions without user interface\n");
+    printf("                              and print the time the harness needed\n");
+    printf("  -p, --persistent-stream     Keep one PCM stream running for the whole session\n");
+    printf("                              instead of reopening the device for every pulse\n");
+    printf("  -t, --hw-timestamps         Use the PCM status timestamps as start reference for usb and hdmi\n");
+    printf("                              and save the skew of the software reference in the CSV\n");
+    printf("  -M, --mmap                  Write the pulses directly into the ring buffer of usb and hdmi devices\n");
+    printf("  -w, --waveform NAME         Pulse waveform for usb and hdmi: constant (default), square,\n");
+    printf("                              sine, chirp or mls\n");
+    printf("  -c, --compare-streams SESSIONS\n");
+    printf("                              Benchmark reopening against the persistent stream\n");
+    printf("  -s, --soak-duration SECONDS Measure continuously for SECONDS without user interface\n");
+    printf("  -n, --soak-pulses PULSES    Measure continuously for PULSES pulses without user interface\n");
+    printf("                              (both can be combined, the first limit reached ends the test)\n");
+    printf("  -D, --dma-pulses            Emit the line out pulses as DMA pulse trains with exact timing\n");
+    printf("  -P, --pipeline DEPTH        Keep up to DEPTH (2 to %d) pulses in flight, each coded by its width.\n", PIPELINE_MAX_DEPTH);
+    printf("                              usb and hdmi use the persistent stream then\n");
+    printf("      --max-p99 MICROS        Pass criterion: 99th latency percentile of a session\n");
+    printf("      --max-loss PERCENT      Pass criterion: lost pulses of a session\n");
+    printf("  -u, --compare-ui SESSIONS   Benchmark the latency jitter with the old busy polling of the buttons\n");
+    printf("                              against the event driven user interface\n");
+    printf("  -R, --realtime              Lock memory, pin the measurement and alert threads to CPU %d and %d\n",
+           MEASUREMENT_CPU, ALERT_CPU);
+    printf("                              and schedule them with SCHED_FIFO\n");
+    printf("  -S, --sample-micros MICROS  GPIO sample period: 1, 2, 4, 5 (default), 8 or 10\n");
+    printf("  -T, --rt-selftest SESSIONS  Report how each setting of the real-time profile changes the jitter\n");
+    printf("  -A, --all-devices           Measure every USB card at once, each DUT answers on its own line in:\n");
+    printf("                              usb_audio_top GPIO %d, usb_audio_bot GPIO %d, usb_audio_top2 GPIO %d,\n",
+           LINE_IN, LINE_IN_USB_BOTTOM, LINE_IN_USB_TOP2);
+    printf("                              usb_audio_bot2 GPIO %d. -n and -s limit the pulses per device\n", LINE_IN_USB_BOTTOM2);
+    printf("  -G, --sweep PULSES          Measure PULSES pulses (up to %d) for every combination of sample rate,\n", TOTAL_MEASUREMENTS);
+    printf("                              format, channel count and period size the usb or hdmi device supports\n");
+    printf("      --sweep-rates LIST      Only sweep these sample rates, like 44100,48000\n");
+    printf("      --sweep-formats LIST    Only sweep these formats: S16_LE, S24_3LE, S32_LE\n");
+    printf("      --sweep-channels LIST   Only sweep these channel counts (default 1, 2, 4, 8 if supported)\n");
+    printf("      --sweep-periods LIST    Only sweep these period sizes in frames (default the minimum doubled 3 times)\n");
+    printf("      --sweep-buffers LIST    Sweep these buffer sizes in frames, 0 is the default of the measurement\n");
+    printf("  -X, --capture DEVICE        Detect the usb or hdmi pulses by cross-correlating a capture of the DUT\n");
+    printf("                              output on DEVICE, like hw:CARD=usb_audio_top, instead of on line in.\n");
+    printf("                              Use the chirp or mls waveform\n");
+    printf("      --xcorr-test synthetic|FILE\n");
+    printf("                              Run the cross-correlation detector on synthetic captures or on a raw\n");
+    printf("                              S16_LE mono recording at %d Hz and report accuracy and speed\n", PREFERRED_SAMPLE_RATE);
+    printf("  -O, --binary-results        Stream the pulses of measurement sessions, soak tests and --all-devices\n");
+    printf("                              into a compact %s file instead of the CSV, lag_export converts it\n", RESULT_FILE_SUFFIX);
+    printf("  -K, --rig-calibration       Measure the delays of the rig itself with GPIO %d wired to GPIO %d and\n", LINE_OUT, LINE_IN);
+    printf("                              time snd_pcm_writei, save them in %s\n", RIG_PROFILE_PATH);
+    printf("                              and exit with status 1 if a path regressed since the last calibration\n");
+    printf("      --subtract-rig-offset   Subtract the calibrated offset of the rig from every latency,\n");
+    printf("                              otherwise it is only reported\n");
+    printf("  -E, --trace                 Record every edge and emitted pulse of measurement sessions and soak tests\n");
+    printf("                              into a %s file next to the results\n", TRACE_FILE_SUFFIX);
+    printf("      --replay FILE           Feed a trace through the matching and statistics without the rig\n");
+    printf("      --glitch-filter MICROS  Drop line in level changes shorter than MICROS in pigpio\n");
+    printf("      --noise-filter STEADY,ACTIVE\n");
+    printf("                              Ignore line in until its level was steady for STEADY us, then report\n");
+    printf("                              it for ACTIVE us, see gpioNoiseFilter\n");
+    printf("      --min-width MICROS      Line in pulses shorter than MICROS are no arrival (default %.0f %% of\n",
+           MIN_PULSE_WIDTH_RATIO * 100);
+    printf("                              the sent pulse, 0 takes the first rising edge)\n");
+    printf("      --acceptance-window SIGMAS\n");
+    printf("                              After %d valid pulses, arrivals further than SIGMAS standard deviations\n",
+           ACCEPTANCE_MIN_PULSES);
+    printf("                              (at least %d us) from the median latency are spurious, later ones lose the pulse\n",
+           ACCEPTANCE_MIN_MARGIN_IN_MICROS);
+    printf("  -d, --drift                 Fit the latency against the send time to report the clock drift in ppm\n");
+    printf("                              and latency steps, and log every pulse with snd_pcm_delay and\n");
+    printf("                              snd_pcm_avail into a %s%s file next to the results\n", FILE_NAME_SUFFIX_DRIFT, FILE_TYPE_SUFFIX);
+    printf("  -J, --jobs FILE             Run the measurements listed in FILE one after the other, one job of\n");
+    printf("                              KEY=VALUE pairs per line: mode, device, pulses, duration, interval\n");
+    printf("                              (SECONDS or adaptive), rate, format, channels, period, buffer,\n");
+    printf("                              output (folder), max-p99 and max-loss. Exits with status 1 if a job\n");
+    printf("                              failed or could not measure\n");
+    printf("      --telemetry[=SOCKET]    Publish every result and the running statistics into the shared memory\n");
+    printf("                              %s and serve them as Prometheus metrics on the Unix socket\n", TELEMETRY_SHM_NAME);
+    printf("                              SOCKET (default %s)\n", TELEMETRY_SOCKET_PATH);
+    printf("  -h, --help                  Show this help\n");
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+    static struct option longOptions[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"benchmark", required_argument, NULL, 'b'},
+        {"persistent-stream", no_argument, NULL, 'p'},
+        {"compare-streams", required_argument, NULL, 'c'},
+        {"hw-timestamps", no_argument, NULL, 't'},
+        {"mmap", no_argument, NULL, 'M'},
+        {"waveform", required_argument, NULL, 'w'},
+        {"soak-duration", required_argument, NULL, 's'},
+        {"soak-pulses", required_argument, NULL, 'n'},
+        {"dma-pulses", no_argument, NULL, 'D'},
+        {"pipeline", required_argument, NULL, 'P'},
+        {"max-p99", required_argument, NULL, 'Q'},
+        {"max-loss", required_argument, NULL, 'L'},
+        {"compare-ui", required_argument, NULL, 'u'},
+        {"realtime", no_argument, NULL, 'R'},
+        {"sample-micros", required_argument, NULL, 'S'},
+        {"rt-selftest", required_argument, NULL, 'T'},
+        {"all-devices", no_argument, NULL, 'A'},
+        {"sweep", required_argument, NULL, 'G'},
+        {"sweep-rates", required_argument, NULL, 'r'},
+        {"sweep-formats", required_argument, NULL, 'F'},
+        {"sweep-channels", required_argument, NULL, 'C'},
+        {"sweep-periods", required_argument, NULL, 'Z'},
+        {"sweep-buffers", required_argument, NULL, 'B'},
+        {"capture", required_argument, NULL, 'X'},
+        {"xcorr-test", required_argument, NULL, 'x'},
+        {"binary-results", no_argument, NULL, 'O'},
+        {"rig-calibration", no_argument, NULL, 'K'},
+        {"subtract-rig-offset", no_argument, NULL, 'k'},
+        {"trace", no_argument, NULL, 'E'},
+        {"replay", required_argument, NULL, 'y'},
+        {"glitch-filter", required_argument, NULL, 'g'},
+        {"noise-filter", required_argument, NULL, 'N'},
+        {"min-width", required_argument, NULL, 'W'},
+        {"acceptance-window", required_argument, NULL, 'a'},
+        {"drift", no_argument, NULL, 'd'},
+        {"jobs", required_argument, NULL, 'J'},
+        {"telemetry", optional_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    int benchmarkSessionCount = 0;
+    int comparisonSessionCount = 0;
+    int interfaceComparisonSessionCount = 0;
+    int selfTestSessionCount = 0;
+    const char *correlationTestInput = NULL;
+    int rigCalibration = 0;
+    const char *replayPath = NULL;
+    const char *jobFilePath = NULL;
+    int result;
+
+    while ((option = getopt_long(argc, argv, "m:b:pc:tMw:s:n:DP:u:RS:T:AG:X:OKEdJ:h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'm':
+                measurementMode = parseMeasurementMode(optarg);
+                if (measurementMode == -1) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'b':
+                benchmarkSessionCount = atoi(optarg);
+                if (benchmarkSessionCount <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'p':
+                persistentStream = 1;
+                break;
+            case 't':
+                useHardwareTimestamps = 1;
+                break;
+            case 'M':
+                useMmap = 1;
+                break;
+            case 'w':
+                pulseWaveform = parseWaveform(optarg);
+                if (pulseWaveform == -1) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'c':
+                comparisonSessionCount = atoi(optarg);
+                if (comparisonSessionCount <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 's':
+                soakDurationInS = atof(optarg);
+                if (soakDurationInS <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'n':
+                soakPulses = atol(optarg);
+                if (soakPulses <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'D':
+                dmaPulses = 1;
+                break;
+            case 'P':
+                pipelineDepth = atoi(optarg);
+                if (pipelineDepth < 2 || pipelineDepth > PIPELINE_MAX_DEPTH) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'Q':
+                maxP99InMicros = atoi(optarg);
+                if (maxP99InMicros <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'L':
+                maxLossInPercent = atof(optarg);
+                if (maxLossInPercent < 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'u':
+                interfaceComparisonSessionCount = atoi(optarg);
+                if (interfaceComparisonSessionCount <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'R':
+                realtimeProfile = 1;
+                break;
+            case 'S':
+                microsPerSample = atoi(optarg);
+                if (microsPerSample != 1 && microsPerSample != 2 && microsPerSample != 4
+                    && microsPerSample != 5 && microsPerSample != 8 && microsPerSample != 10) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'T':
+                selfTestSessionCount = atoi(optarg);
+                if (selfTestSessionCount <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'A':
+                measureAllDevices = 1;
+                break;
+            case 'G':
+                sweepPulses = atol(optarg);
+                if (sweepPulses <= 0 || sweepPulses > TOTAL_MEASUREMENTS) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'r':
+            case 'F':
+            case 'C':
+            case 'Z':
+            case 'B':
+                if (parseSweepValues(optarg, option == 'r' ? SWEEP_RATE
+                                             : option == 'F' ? SWEEP_FORMAT
+                                             : option == 'C' ? SWEEP_CHANNELS
+                                             : option == 'Z' ? SWEEP_PERIOD
+                                             : SWEEP_BUFFER) < 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'X':
+                captureDeviceName = optarg;
+                break;
+            case 'x':
+                correlationTestInput = optarg;
+                break;
+            case 'O':
+                binaryResults = 1;
+                break;
+            case 'K':
+                rigCalibration = 1;
+                break;
+            case 'k':
+                subtractRigOffset = 1;
+                break;
+            case 'E':
+                traceSessions = 1;
+                break;
+            case 'y':
+                replayPath = optarg;
+                break;
+            case 'g':
+                glitchFilterInMicros = atoi(optarg);
+                if (glitchFilterInMicros == 0 || glitchFilterInMicros > 300000) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'N':
+                if (sscanf(optarg, "%u,%u", &noiseFilterSteadyInMicros, &noiseFilterActiveInMicros) != 2
+                    || noiseFilterSteadyInMicros == 0 || noiseFilterSteadyInMicros > 300000
+                    || noiseFilterActiveInMicros > 1000000) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'W':
+                minPulseWidthInMicros = atoi(optarg);
+                if (minPulseWidthInMicros < 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'a':
+                acceptanceSigmas = atof(optarg);
+                if (acceptanceSigmas <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'd':
+                driftTracking = 1;
+                break;
+            case 'J':
+                jobFilePath = optarg;
+                break;
+            case 'l':
+                telemetryEnabled = 1;
+                if (optarg != NULL) {
+                    telemetrySocketPath = optarg;
+                }
+                break;
+            case 'h':
+                printUsage(argv[0]);
+                return(0);
+            default:
+                printUsage(argv[0]);
+                return(1);
+        }
+    }
+
+    // Coded pulses are told apart by their width on line in only
+    if (captureDeviceName != NULL && pipelineDepth > 1) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // The capture modes read the USB capture themselves
+    if ((measurementMode == CAPTURE_MODE || measurementMode == ROUND_TRIP_MODE) && (captureDeviceName != NULL || measureAllDevices)) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // A sweep saves its pulses per configuration in one CSV
+    if (binaryResults && sweepPulses > 0) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // Only the sessions of the measurement loop are traced, the detector and the workers have their own
+    if (traceSessions && (captureDeviceName != NULL || measureAllDevices || sweepPulses > 0)) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // The workers of --all-devices and the sweep keep their own statistics
+    if (driftTracking && (measureAllDevices || sweepPulses > 0)) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // The workers of --all-devices take the first rising edge of their line in unfiltered
+    if (measureAllDevices && (glitchFilterInMicros > 0 || noiseFilterSteadyInMicros > 0
+                              || minPulseWidthInMicros >= 0 || acceptanceSigmas > 0)) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // Every job is a session of the measurement loop
+    if (jobFilePath != NULL && (measureAllDevices || sweepPulses > 0)) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    // A typo in the job file stops before anything is measured
+    if (jobFilePath != NULL && loadJobFile(jobFilePath) < 0) {
+        return(1);
+    }
+    // Needs neither GPIOs nor PCM devices
+    if (replayPath != NULL) {
+        return(runReplay(replayPath));
+    }
+    if (correlationTestInput != NULL) {
+        return(runCorrelationTest(correlationTestInput) < 0 ? 1 : 0);
+    }
 
     initGPIOs();
-    waitForUserInput();
+    if (telemetryEnabled) {
+        startTelemetry();
+    }
+    if (rigCalibration) {
+        result = runRigCalibration();
+        prepareExit();
+        return(result);
+    }
+    else if (jobFilePath != NULL) {
+        result = runJobs();
+        prepareExit();
+        return(result);
+    }
+    else if (benchmarkSessionCount > 0) {
+        runBenchmark(benchmarkSessionCount);
+        prepareExit();
+    }
+    else if (comparisonSessionCount > 0) {
+        runStreamComparison(comparisonSessionCount);
+        prepareExit();
+    }
+    else if (selfTestSessionCount > 0) {
+        runRealtimeSelfTest(selfTestSessionCount);
+        prepareExit();
+    }
+    else if (interfaceComparisonSessionCount > 0) {
+        runUserInterfaceComparison(interfaceComparisonSessionCount);
+        prepareExit();
+    }
+    else if (sweepPulses > 0) {
+        result = runSweep();
+        prepareExit();
+        return(result == RESULT_FAIL ? 1 : 0);
+    }
+    else if (measureAllDevices) {
+        result = runParallelMeasurement();
+        prepareExit();
+        return(result == RESULT_FAIL ? 1 : 0);
+    }
+    else if (soakDurationInS > 0 || soakPulses > 0) {
+        result = runSoakTest();
+        prepareExit();
+        return(result == RESULT_FAIL ? 1 : 0);
+    }
+    else {
+        waitForUserInput();
+    }
+    return(0);
 }
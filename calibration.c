@@ -0,0 +1,124 @@
+/*
+Calibration quality
+*/
+
+#include "calibration.h"
+#include <stdlib.h>
+
+#define IQR_PER_STANDARD_DEVIATION 1.349 // Of a normal distribution
+
+static int compareLatencies(const void *a, const void *b) {
+    return(*(const int *) a - *(const int *) b);
+}
+
+// Nearest rank of the sorted latencies
+static int getSortedPercentile(const int *latencies, int count, double percentile) {
+    int rank = (int) (percentile / 100.0 * count);
+
+    return(latencies[rank < count ? rank : count - 1]);
+}
+
+// Slot of the pulse, -1 if it is no longer or not yet in the window
+static int findCalibrationSlot(const calibrationWindow *window, long pulse) {
+    int slot;
+
+    if (pulse < 0) {
+        return(-1);
+    }
+    slot = (int) (pulse & (CALIBRATION_WINDOW - 1));
+    return(window->pulses[slot] == pulse ? slot : -1);
+}
+
+void initCalibrationWindow(calibrationWindow *window) {
+    for (int slot = 0; slot < CALIBRATION_WINDOW; slot++) {
+        window->pulses[slot] = -1;
+        window->latenciesInMicros[slot] = CALIBRATION_PENDING;
+        window->doubleTriggers[slot] = 0;
+    }
+}
+
+void startCalibrationPulse(calibrationWindow *window, long pulse) {
+    int slot = (int) (pulse & (CALIBRATION_WINDOW - 1));
+
+    window->pulses[slot] = pulse;
+    window->latenciesInMicros[slot] = CALIBRATION_PENDING;
+    window->doubleTriggers[slot] = 0;
+}
+
+void finishCalibrationPulse(calibrationWindow *window, long pulse, int latencyInMicros) {
+    int slot = findCalibrationSlot(window, pulse);
+
+    if (slot >= 0) {
+        window->latenciesInMicros[slot] = latencyInMicros;
+    }
+}
+
+void addCalibrationDoubleTrigger(calibrationWindow *window, long pulse) {
+    int slot = findCalibrationSlot(window, pulse);
+
+    if (slot >= 0) {
+        window->doubleTriggers[slot] += 1;
+    }
+}
+
+void getCalibrationQuality(const calibrationWindow *window, calibrationQuality *quality) {
+    int latencies[CALIBRATION_WINDOW];
+
+    quality->pulses = 0;
+    quality->detected = 0;
+    quality->doubleTriggers = 0;
+    for (int slot = 0; slot < CALIBRATION_WINDOW; slot++) {
+        if (window->pulses[slot] < 0) {
+            continue;
+        }
+        quality->doubleTriggers += window->doubleTriggers[slot];
+        if (window->latenciesInMicros[slot] == CALIBRATION_PENDING) {
+            continue;
+        }
+        quality->pulses += 1;
+        if (window->latenciesInMicros[slot] >= 0) {
+            latencies[quality->detected] = window->latenciesInMicros[slot];
+            quality->detected += 1;
+        }
+    }
+    quality->detectionRate = quality->pulses > 0 ? (double) quality->detected / quality->pulses : 0.0;
+    quality->medianInMicros = -1;
+    quality->maxInMicros = -1;
+    quality->spreadInMicros = 0.0;
+    if (quality->detected > 0) {
+        qsort(latencies, quality->detected, sizeof(int), compareLatencies);
+        quality->medianInMicros = getSortedPercentile(latencies, quality->detected, 50.0);
+        quality->maxInMicros = latencies[quality->detected - 1];
+        quality->spreadInMicros = (getSortedPercentile(latencies, quality->detected, 75.0)
+                                   - getSortedPercentile(latencies, quality->detected, 25.0))
+                                  / IQR_PER_STANDARD_DEVIATION;
+    }
+
+    if (quality->pulses < CALIBRATION_MIN_PULSES) {
+        quality->grade = CALIBRATION_GRADE_NONE;
+    }
+    else if (quality->detectionRate >= CALIBRATION_GOOD_DETECTION_RATE
+             && quality->doubleTriggers == 0
+             && quality->spreadInMicros <= CALIBRATION_MAX_GOOD_SPREAD_IN_MICROS) {
+        quality->grade = CALIBRATION_GRADE_GOOD;
+    }
+    else if (quality->detectionRate > CALIBRATION_MEDIUM_DETECTION_RATE) {
+        quality->grade = CALIBRATION_GRADE_MEDIUM;
+    }
+    else {
+        quality->grade = CALIBRATION_GRADE_BAD;
+    }
+}
+
+const char *getCalibrationGradeName(int grade) {
+    if (grade == CALIBRATION_GRADE_GOOD) {
+        return("GOOD");
+    }
+    else if (grade == CALIBRATION_GRADE_MEDIUM) {
+        return("MEDIUM");
+    }
+    else if (grade == CALIBRATION_GRADE_BAD) {
+        return("BAD");
+    }
+    return("NONE");
+}
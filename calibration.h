@@ -0,0 +1,55 @@
+/*
+Calibration quality
+
+The calibration mode sends a continuous stream of pulses while the level of the DUT is adjusted.
+The outcome of the last CALIBRATION_WINDOW pulses is kept in a ring indexed by pulse, so the
+quality follows a new level after a few pulses:
+- the detection rate is the part of the finished pulses that arrived,
+- the spread is the interquartile range of their latencies scaled to a standard deviation, so a
+  single late arrival does not dominate it,
+- double triggers are line in pulses that were no arrival, like the ringing of an overdriven input.
+A pulse is finished once it arrived or was lost, pulses still on the way are left out.
+*/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#define CALIBRATION_WINDOW 16 // Pulses, must be a power of two
+#define CALIBRATION_MIN_PULSES 4 // Finished pulses in the window before it is graded
+#define CALIBRATION_GOOD_DETECTION_RATE 0.95
+#define CALIBRATION_MEDIUM_DETECTION_RATE 0.2 // Above, like 2 of the 10 pulses of the old calibration
+#define CALIBRATION_MAX_GOOD_SPREAD_IN_MICROS 500.0
+#define CALIBRATION_PENDING -1 // Latency of a pulse on the way
+#define CALIBRATION_LOST -2
+#define CALIBRATION_GRADE_NONE 0 // Too few finished pulses
+#define CALIBRATION_GRADE_BAD 1
+#define CALIBRATION_GRADE_MEDIUM 2
+#define CALIBRATION_GRADE_GOOD 3
+
+typedef struct {
+    long pulses[CALIBRATION_WINDOW]; /* Pulse in each slot, -1 if empty */
+    int latenciesInMicros[CALIBRATION_WINDOW]; /* Or CALIBRATION_PENDING or CALIBRATION_LOST */
+    int doubleTriggers[CALIBRATION_WINDOW];
+} calibrationWindow;
+
+typedef struct {
+    int pulses; /* Finished pulses in the window */
+    int detected;
+    double detectionRate;
+    int medianInMicros; /* -1 without a detected pulse */
+    int maxInMicros;
+    double spreadInMicros;
+    int doubleTriggers; /* Of all pulses in the window */
+    int grade; /* CALIBRATION_GRADE_* */
+} calibrationQuality;
+
+void initCalibrationWindow(calibrationWindow *window);
+/* The pulse was sent and replaces the oldest one of the window */
+void startCalibrationPulse(calibrationWindow *window, long pulse);
+/* latencyInMicros is CALIBRATION_LOST if the pulse did not arrive, pulses no longer in the window are ignored */
+void finishCalibrationPulse(calibrationWindow *window, long pulse, int latencyInMicros);
+void addCalibrationDoubleTrigger(calibrationWindow *window, long pulse);
+void getCalibrationQuality(const calibrationWindow *window, calibrationQuality *quality);
+const char *getCalibrationGradeName(int grade);
+
+#endif
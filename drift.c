@@ -0,0 +1,151 @@
+/*
+Latency drift and steps
+*/
+
+#include "drift.h"
+#include <math.h>
+#include <string.h>
+
+static void addFitSample(driftFit *fit, double timeInS, double latencyInMicros) {
+    double timeDelta, latencyDelta;
+
+    fit->count += 1;
+    timeDelta = timeInS - fit->meanTime;
+    latencyDelta = latencyInMicros - fit->meanLatency;
+    fit->meanTime += timeDelta / fit->count;
+    fit->meanLatency += latencyDelta / fit->count;
+    fit->timeSquareSum += timeDelta * (timeInS - fit->meanTime);
+    fit->productSum += timeDelta * (latencyInMicros - fit->meanLatency);
+    fit->latencySquareSum += latencyDelta * (latencyInMicros - fit->meanLatency);
+}
+
+// Reverts addFitSample of a sample that is in the fit
+static void removeFitSample(driftFit *fit, double timeInS, double latencyInMicros) {
+    double timeDelta, latencyDelta;
+
+    if (fit->count <= 1) {
+        memset(fit, 0, sizeof(driftFit));
+        return;
+    }
+    timeDelta = timeInS - fit->meanTime;
+    latencyDelta = latencyInMicros - fit->meanLatency;
+    fit->count -= 1;
+    fit->meanTime -= timeDelta / fit->count;
+    fit->meanLatency -= latencyDelta / fit->count;
+    fit->timeSquareSum -= timeDelta * (timeInS - fit->meanTime);
+    fit->productSum -= timeDelta * (latencyInMicros - fit->meanLatency);
+    fit->latencySquareSum -= latencyDelta * (latencyInMicros - fit->meanLatency);
+}
+
+static double getFitSlope(const driftFit *fit) {
+    return(fit->count >= 2 && fit->timeSquareSum > 0 ? fit->productSum / fit->timeSquareSum : 0.0);
+}
+
+static double getFitValue(const driftFit *fit, double timeInS) {
+    return(fit->meanLatency + getFitSlope(fit) * (timeInS - fit->meanTime));
+}
+
+static double getResidualDeviation(const driftFit *fit) {
+    double residualSquareSum = fit->latencySquareSum;
+
+    if (fit->timeSquareSum > 0) {
+        residualSquareSum -= fit->productSum * fit->productSum / fit->timeSquareSum;
+    }
+    if (fit->count <= 2 || residualSquareSum <= 0) {
+        return(DRIFT_MIN_DEVIATION_IN_MICROS);
+    }
+    return(fmax(sqrt(residualSquareSum / (fit->count - 2)), DRIFT_MIN_DEVIATION_IN_MICROS));
+}
+
+void initDriftTracker(driftTracker *tracker) {
+    memset(tracker, 0, sizeof(driftTracker));
+}
+
+// The samples from start up to the newest one leave the segment and start the next one
+static void startDriftSegment(driftTracker *tracker, long start) {
+    driftFit *fit = &tracker->segment;
+    driftSample *sample;
+    double differenceSum = 0;
+
+    // Older samples are no longer kept and stay in the segment before
+    if (start < tracker->count - DRIFT_HISTORY) {
+        start = tracker->count - DRIFT_HISTORY;
+    }
+    for (long i = start; i < tracker->count - 1; i++) {
+        sample = &tracker->history[i & (DRIFT_HISTORY - 1)];
+        removeFitSample(fit, sample->timeInS, sample->latencyInMicros);
+    }
+    for (long i = start; i < tracker->count; i++) {
+        sample = &tracker->history[i & (DRIFT_HISTORY - 1)];
+        differenceSum += sample->latencyInMicros - getFitValue(fit, sample->timeInS);
+    }
+    tracker->stepCount += 1;
+    tracker->lastStep.timeInS = tracker->history[start & (DRIFT_HISTORY - 1)].timeInS;
+    tracker->lastStep.sizeInMicros = differenceSum / (tracker->count - start);
+    tracker->lastStep.sample = start;
+    if (tracker->stepCount == 1 || fabs(tracker->lastStep.sizeInMicros) > fabs(tracker->largestStep.sizeInMicros)) {
+        tracker->largestStep = tracker->lastStep;
+    }
+
+    if (fit->count >= 2) {
+        tracker->pooledTimeSquareSum += fit->timeSquareSum;
+        tracker->pooledProductSum += fit->productSum;
+    }
+    memset(fit, 0, sizeof(driftFit));
+    for (long i = start; i < tracker->count; i++) {
+        sample = &tracker->history[i & (DRIFT_HISTORY - 1)];
+        addFitSample(fit, sample->timeInS, sample->latencyInMicros);
+    }
+    tracker->cusumHigh = 0;
+    tracker->cusumLow = 0;
+}
+
+int addDriftSample(driftTracker *tracker, double timeInS, double latencyInMicros) {
+    driftFit *fit = &tracker->segment;
+    long index = tracker->count;
+    double residual;
+
+    tracker->history[index & (DRIFT_HISTORY - 1)].timeInS = timeInS;
+    tracker->history[index & (DRIFT_HISTORY - 1)].latencyInMicros = latencyInMicros;
+    tracker->count += 1;
+    if (fit->count >= DRIFT_MIN_SEGMENT_SAMPLES) {
+        // The sample is checked against the fit before it is added
+        residual = (latencyInMicros - getFitValue(fit, timeInS)) / getResidualDeviation(fit);
+        residual = fmax(-DRIFT_CUSUM_CLAMP, fmin(DRIFT_CUSUM_CLAMP, residual));
+        if (tracker->cusumHigh == 0) {
+            tracker->cusumHighStart = index;
+        }
+        if (tracker->cusumLow == 0) {
+            tracker->cusumLowStart = index;
+        }
+        tracker->cusumHigh = fmax(0, tracker->cusumHigh + residual - DRIFT_CUSUM_SLACK);
+        tracker->cusumLow = fmax(0, tracker->cusumLow - residual - DRIFT_CUSUM_SLACK);
+        if (tracker->cusumHigh > DRIFT_CUSUM_THRESHOLD || tracker->cusumLow > DRIFT_CUSUM_THRESHOLD) {
+            startDriftSegment(tracker, tracker->cusumHigh > DRIFT_CUSUM_THRESHOLD ? tracker->cusumHighStart : tracker->cusumLowStart);
+            return(1);
+        }
+    }
+    addFitSample(fit, timeInS, latencyInMicros);
+    return(0);
+}
+
+double getDriftInPpm(const driftTracker *tracker) {
+    const driftFit *fit = &tracker->segment;
+    double timeSquareSum = tracker->pooledTimeSquareSum, productSum = tracker->pooledProductSum;
+
+    if (fit->count >= 2) {
+        timeSquareSum += fit->timeSquareSum;
+        productSum += fit->productSum;
+    }
+    return(timeSquareSum > 0 ? productSum / timeSquareSum : 0.0);
+}
+
+double getDriftFitInMicros(const driftTracker *tracker, double timeInS) {
+    if (tracker->count == 0) {
+        return(0.0);
+    }
+    if (tracker->segment.count < 2) {
+        return(tracker->history[(tracker->count - 1) & (DRIFT_HISTORY - 1)].latencyInMicros);
+    }
+    return(getFitValue(&tracker->segment, timeInS));
+}
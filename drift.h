@@ -0,0 +1,69 @@
+/*
+Latency drift and steps
+
+The latencies of a session are fitted against their send time with an online linear regression.
+With the send time in seconds and the latency in microseconds, the slope is the drift of the DUT
+clock against the tick in ppm.
+Steps, like a USB interface that drops or repeats a period to resync its clock, are found with a
+two-sided CUSUM on the residuals of the fit. The residuals are normalized by their standard
+deviation and clamped, so a single outlier cannot trigger a step. The samples since the change
+point start a new segment, and the drift is pooled over the slopes of all segments, so a step does
+not bend it.
+Every sample is added in O(1) time and constant memory.
+*/
+
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#define DRIFT_HISTORY 256 // Samples kept to move them into a new segment, must be a power of two
+#define DRIFT_MIN_SEGMENT_SAMPLES 20 // Steps are searched once a segment has this many samples
+#define DRIFT_CUSUM_SLACK 0.5 // Residuals within this many standard deviations are ignored
+#define DRIFT_CUSUM_THRESHOLD 12.0 // A step is found once a sum exceeds this many standard deviations
+#define DRIFT_CUSUM_CLAMP 3.0 // Residuals count this many standard deviations at most
+#define DRIFT_MIN_DEVIATION_IN_MICROS 2.0 // Residuals of a smaller spread count like this one
+
+typedef struct {
+    double timeInS;
+    double latencyInMicros;
+} driftSample;
+
+// Regression of one segment, the sums are updated like Welford's algorithm
+typedef struct {
+    long count;
+    double meanTime;
+    double meanLatency;
+    double timeSquareSum; /* Of the deviations from the means */
+    double productSum;
+    double latencySquareSum;
+} driftFit;
+
+typedef struct {
+    double timeInS; /* Send time of the first sample after the step */
+    double sizeInMicros; /* Later latencies minus the fit before */
+    long sample; /* Index of the first sample after the step */
+} driftStep;
+
+typedef struct {
+    long count; /* Samples added */
+    driftFit segment;
+    double pooledTimeSquareSum; /* Of the segments before */
+    double pooledProductSum;
+    double cusumHigh;
+    double cusumLow;
+    long cusumHighStart; /* First sample of the current rise of each sum */
+    long cusumLowStart;
+    long stepCount;
+    driftStep lastStep;
+    driftStep largestStep;
+    driftSample history[DRIFT_HISTORY];
+} driftTracker;
+
+void initDriftTracker(driftTracker *tracker);
+/* Returns 1 if the sample completed a step, which is then in lastStep */
+int addDriftSample(driftTracker *tracker, double timeInS, double latencyInMicros);
+/* Pooled slope of all segments in microseconds per second, 0 until two samples of a segment */
+double getDriftInPpm(const driftTracker *tracker);
+/* Latency of the current segment at timeInS, the latest latency until the fit has two samples */
+double getDriftFitInMicros(const driftTracker *tracker, double timeInS);
+
+#endif
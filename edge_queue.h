@@ -0,0 +1,72 @@
+/*
+Lock-free single-producer/single-consumer queue of GPIO edges
+
+The producer is the alert callback, which runs on pigpio's alert thread and
+must not do more than pushing the raw edge. The consumer is the measurement
+loop, which does all matching and bookkeeping on the main thread.
+*/
+
+#ifndef EDGE_QUEUE_H
+#define EDGE_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define EDGE_QUEUE_SIZE 4096 // Must be a power of two
+
+typedef struct {
+    int gpio;
+    int level;
+    uint32_t tick;
+} edgeEvent;
+
+typedef struct {
+    edgeEvent events[EDGE_QUEUE_SIZE];
+    atomic_uint head; /* Next slot written by the producer */
+    atomic_uint tail; /* Next slot read by the consumer */
+    atomic_uint dropped; /* Edges lost because the queue was full */
+} edgeQueue;
+
+static inline void initEdgeQueue(edgeQueue *queue) {
+    atomic_store_explicit(&queue->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->dropped, 0, memory_order_relaxed);
+}
+
+// Producer side, returns 0 or -1 if the queue is full
+static inline int pushEdgeEvent(edgeQueue *queue, int gpio, int level, uint32_t tick) {
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    edgeEvent *event;
+
+    if (head - tail == EDGE_QUEUE_SIZE) {
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+        return(-1);
+    }
+    event = &queue->events[head & (EDGE_QUEUE_SIZE - 1)];
+    event->gpio = gpio;
+    event->level = level;
+    event->tick = tick;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return(0);
+}
+
+// Consumer side, returns 0 or -1 if the queue is empty
+static inline int popEdgeEvent(edgeQueue *queue, edgeEvent *event) {
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (head == tail) {
+        return(-1);
+    }
+    *event = queue->events[tail & (EDGE_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return(0);
+}
+
+// Consumer side, returns the number of dropped edges since the last call
+static inline unsigned int takeDroppedEdgeCount(edgeQueue *queue) {
+    return(atomic_exchange_explicit(&queue->dropped, 0, memory_order_relaxed));
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+Hardware abstraction layer
+
+The measurement logic in audio_lag_module.c does not call pigpio or ALSA directly.
+Everything it needs from the rig goes through the functions below:
+- GPIO modes, levels and edge alerts (line in, line out, buttons and LEDs)
+- The microsecond tick used as timebase for all latency measurements
+- Sleeping between pulses
+- Pulse trains timed by DMA instead of the CPU
+- PCM playback devices (USB, HDMI)
+- PCM capture devices (USB), to record what the DUT plays
+
+Two backends implement this interface, the one being used is chosen when linking:
+- hal_pigpio.c talks to the Raspberry Pi via pigpio and ALSA (make)
+- hal_sim.c simulates a DUT on a normal Linux box (make sim)
+*/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+// GPIO modes
+#define HAL_INPUT 0
+#define HAL_OUTPUT 1
+
+// PCM sample formats
+#define HAL_PCM_FORMAT_S16_LE 0
+#define HAL_PCM_FORMAT_S24_3LE 1 // 24 bit in 3 bytes, common on USB
+#define HAL_PCM_FORMAT_S32_LE 2
+#define HAL_PCM_FORMAT_COUNT 3
+
+// Sample rates tested by halPcmGetCapabilities
+#define HAL_PCM_STANDARD_RATES {8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000}
+#define HAL_PCM_STANDARD_RATE_COUNT 11
+
+// Same signature as pigpio's gpioAlertFunc_t
+typedef void (*halAlertFunc)(int gpio, int level, uint32_t tick);
+
+// Opaque PCM device handle
+typedef struct halPcm halPcm;
+
+// Pulse trains
+#define HAL_PULSE_TRAIN_MAX_PULSES 2000
+
+// One pulse of a pulse train
+typedef struct {
+    uint32_t offsetInMicros; /* Rising edge, relative to the start of the train */
+    uint32_t widthInMicros;
+} halPulse;
+
+// Requested and negotiated hardware parameters of a PCM device
+typedef struct {
+    unsigned int sampleRate;
+    unsigned int channels;
+    int format;
+    unsigned long periodFrames; /* 0 selects the minimum period size */
+    unsigned long bufferFrames; /* 0 keeps the drivers default buffer size */
+    int mmap; /* 1 writes into the mapped ring buffer, only halPcmMmapWrite can be used then */
+    unsigned int periodTimeInMicros; /* Set by halPcmConfigure */
+} halPcmConfig;
+
+// Hardware parameters a PCM device supports
+typedef struct {
+    unsigned int sampleRates[HAL_PCM_STANDARD_RATE_COUNT]; /* Supported ones of HAL_PCM_STANDARD_RATES */
+    int sampleRateCount;
+    unsigned int formats; /* Bit mask of the supported HAL_PCM_FORMAT_* values */
+    unsigned int minChannels;
+    unsigned int maxChannels;
+    unsigned long minPeriodFrames;
+    unsigned long maxPeriodFrames;
+    unsigned long minBufferFrames;
+    unsigned long maxBufferFrames;
+} halPcmCapabilities;
+
+// Playback position of a PCM device reported by the driver
+typedef struct {
+    uint32_t tick; /* When the position was sampled, in the halTick timebase */
+    uint64_t framesWritten; /* Since the stream was started or prepared */
+    long delayFrames; /* Frames written but not yet played at tick */
+    int64_t audioTimeInNanos; /* Played time since the stream was started at tick, -1 if not reported */
+} halPcmTimestamp;
+
+// ####
+// #### GPIO AND TIMING ####
+
+int halConfigureSampling(unsigned int microsPerSample); /* Before halInitialise, 1, 2, 4, 5, 8 or 10 */
+int halInitialise(void);
+void halTerminate(void);
+int halSetMode(unsigned int gpio, unsigned int mode);
+int halRead(unsigned int gpio);
+int halWrite(unsigned int gpio, unsigned int level);
+int halSetAlertFunc(unsigned int gpio, halAlertFunc function);
+/* Level changes shorter than steadyMicros are not reported, the others steadyMicros late. 0 is off */
+int halGlitchFilter(unsigned int gpio, unsigned int steadyMicros);
+/* Level changes are ignored until the level was steady for steadyMicros, */
+/* then they are reported for activeMicros. 0 is off                      */
+int halNoiseFilter(unsigned int gpio, unsigned int steadyMicros, unsigned int activeMicros);
+uint32_t halTick(void);
+void halSleep(double seconds);
+int halTime(int *seconds, int *micros);
+
+// ####
+// #### PULSE TRAINS ####
+
+/* Emits the pulses on gpio without the CPU, the train is durationInMicros long.     */
+/* Pulses must be sorted and must not overlap. Returns immediately, only one train   */
+/* can be sent at a time. The edges are reported to the alert function of the gpio. */
+int halPulseTrainSend(unsigned int gpio, const halPulse *pulses, int count, uint32_t durationInMicros);
+int halPulseTrainBusy(void);
+
+// ####
+// #### PCM PLAYBACK ####
+
+/* All PCM functions return a negative errno value on failure,       */
+/* halPcmWrite returns -EPIPE on underrun like snd_pcm_writei does.  */
+int halPcmOpen(halPcm **pcm, const char *deviceName);
+int halPcmGetCapabilities(halPcm *pcm, halPcmCapabilities *capabilities); /* Before halPcmConfigure */
+int halPcmConfigure(halPcm *pcm, halPcmConfig *config); /* Sets config to the negotiated values */
+long halPcmWrite(halPcm *pcm, const void *buffer, unsigned long frames);
+long halPcmMmapWrite(halPcm *pcm, const void *buffer, unsigned long frames); /* NULL buffer writes silence */
+int halPcmDelay(halPcm *pcm, long *frames); /* Frames written but not yet played */
+int halPcmGetTimestamp(halPcm *pcm, halPcmTimestamp *timestamp);
+int halPcmPrepare(halPcm *pcm);
+int halPcmDrain(halPcm *pcm);
+int halPcmClose(halPcm *pcm);
+
+// ####
+// #### PCM CAPTURE ####
+
+/* Capture devices are configured, prepared and closed with the playback functions above.     */
+/* halPcmRead blocks until the frames are captured and returns -EPIPE on overrun, the first   */
+/* read starts the stream. halPcmGetTimestamp reports the frames read so far in framesWritten */
+/* and the frames captured but not read yet in delayFrames.                                   */
+int halPcmOpenCapture(halPcm **pcm, const char *deviceName);
+long halPcmRead(halPcm *pcm, void *buffer, unsigned long frames);
+/* Waits with poll until a period can be read, or written on playback devices. Returns 1 if */
+/* it can, 0 after timeoutInMillis and -EPIPE on overrun or underrun. A capture stream has  */
+/* to be started with halPcmRead before.                                                     */
+int halPcmWait(halPcm *pcm, int timeoutInMillis);
+
+#endif
@@ -0,0 +1,432 @@
+/*
+Hardware abstraction layer backend for the Raspberry Pi
+
+GPIOs and timing via pigpio, PCM devices via ALSA.
+ALSA code base retrieved from https://www.linuxjournal.com/article/6735 on 7th March 2022
+*/
+
+#include "hal.h"
+#include <pigpio.h>
+#include <alsa/asoundlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WAVE_PULSES 100 // Pulses per DMA wave, longer pulse trains chain several waves
+#define WAVE_MAX_CHAINED ((HAL_PULSE_TRAIN_MAX_PULSES + WAVE_PULSES - 1) / WAVE_PULSES)
+
+static snd_pcm_access_t ACCESS_TYPE = SND_PCM_ACCESS_RW_INTERLEAVED;
+static gpioPulse_t wavePulses[2 * WAVE_PULSES + 1];
+
+struct halPcm {
+    snd_pcm_t *handle;
+    uint64_t framesWritten;
+    int audioTimestampType;
+    unsigned int bytesPerFrame;
+};
+
+// ####
+// #### GPIO AND TIMING ####
+
+// The GPIOs are sampled by DMA, the sample period is the resolution of the alert ticks
+int halConfigureSampling(unsigned int microsPerSample) {
+    return(gpioCfgClock(microsPerSample, PI_CLOCK_PCM, 0));
+}
+
+int halInitialise(void) {
+    return(gpioInitialise());
+}
+
+void halTerminate(void) {
+    gpioTerminate();
+}
+
+int halSetMode(unsigned int gpio, unsigned int mode) {
+    return(gpioSetMode(gpio, mode == HAL_OUTPUT ? PI_OUTPUT : PI_INPUT));
+}
+
+int halRead(unsigned int gpio) {
+    return(gpioRead(gpio));
+}
+
+int halWrite(unsigned int gpio, unsigned int level) {
+    return(gpioWrite(gpio, level));
+}
+
+int halSetAlertFunc(unsigned int gpio, halAlertFunc function) {
+    return(gpioSetAlertFunc(gpio, function));
+}
+
+// The filters are applied by pigpio before the alert functions are called
+int halGlitchFilter(unsigned int gpio, unsigned int steadyMicros) {
+    return(gpioGlitchFilter(gpio, steadyMicros));
+}
+
+int halNoiseFilter(unsigned int gpio, unsigned int steadyMicros, unsigned int activeMicros) {
+    return(gpioNoiseFilter(gpio, steadyMicros, activeMicros));
+}
+
+uint32_t halTick(void) {
+    return(gpioTick());
+}
+
+void halSleep(double seconds) {
+    time_sleep(seconds);
+}
+
+int halTime(int *seconds, int *micros) {
+    return(gpioTime(PI_TIME_ABSOLUTE, seconds, micros));
+}
+
+// ALSA reports CLOCK_MONOTONIC timestamps, the tick counts microseconds since boot.
+// Both are sampled back to back to map one into the other.
+static uint32_t monotonicToTick(const struct timespec *time) {
+    struct timespec now;
+    uint32_t before, after;
+    int64_t ageInMicros;
+
+    before = gpioTick();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    after = gpioTick();
+    ageInMicros = (int64_t) (now.tv_sec - time->tv_sec) * 1000000 + (now.tv_nsec - time->tv_nsec) / 1000;
+    return(before + (after - before) / 2 - (uint32_t) ageInMicros);
+}
+
+// ####
+// #### PULSE TRAINS ####
+
+// Every pulse becomes a rising and a falling step of a pigpio wave, each delayed until the next step.
+// The DMA controller emits the waves, so the timing does not depend on the scheduler.
+int halPulseTrainSend(unsigned int gpio, const halPulse *pulses, int count, uint32_t durationInMicros) {
+    char chain[WAVE_MAX_CHAINED];
+    uint32_t mask = 1u << gpio;
+    uint32_t time = 0, next;
+    int waves = 0, steps, wave, status;
+
+    if (count <= 0 || count > HAL_PULSE_TRAIN_MAX_PULSES) {
+        return(-EINVAL);
+    }
+    for (int i = 0; i < count; i++) {
+        next = i + 1 < count ? pulses[i + 1].offsetInMicros : durationInMicros;
+        if (pulses[i].offsetInMicros + pulses[i].widthInMicros > next) {
+            return(-EINVAL);
+        }
+    }
+    if (gpioWaveTxBusy()) {
+        return(-EBUSY);
+    }
+    // Deletes the waves of the previous train
+    gpioWaveClear();
+
+    for (int first = 0; first < count; first += WAVE_PULSES) {
+        steps = 0;
+        for (int i = first; i < count && i < first + WAVE_PULSES; i++) {
+            if (i == 0 && pulses[i].offsetInMicros > 0) {
+                wavePulses[steps++] = (gpioPulse_t) {0, 0, pulses[i].offsetInMicros};
+            }
+            next = i + 1 < count ? pulses[i + 1].offsetInMicros : durationInMicros;
+            time = pulses[i].offsetInMicros + pulses[i].widthInMicros;
+            wavePulses[steps++] = (gpioPulse_t) {mask, 0, pulses[i].widthInMicros};
+            wavePulses[steps++] = (gpioPulse_t) {0, mask, next - time};
+        }
+        // gpioWaveCreate would send the pulses added so far as if they were the whole train
+        status = gpioWaveAddGeneric(steps, wavePulses);
+        if (status < 0) {
+            gpioWaveClear();
+            return(status);
+        }
+        wave = gpioWaveCreate();
+        if (wave < 0) {
+            gpioWaveClear();
+            return(wave);
+        }
+        chain[waves++] = (char) wave;
+    }
+    return(gpioWaveChain(chain, waves));
+}
+
+int halPulseTrainBusy(void) {
+    return(gpioWaveTxBusy());
+}
+
+// ####
+// #### PCM PLAYBACK ####
+
+static snd_pcm_format_t toAlsaFormat(int format) {
+    switch (format) {
+        case HAL_PCM_FORMAT_S24_3LE:
+            return(SND_PCM_FORMAT_S24_3LE);
+        case HAL_PCM_FORMAT_S32_LE:
+            return(SND_PCM_FORMAT_S32_LE);
+        case HAL_PCM_FORMAT_S16_LE:
+        default:
+            return(SND_PCM_FORMAT_S16_LE);
+    }
+}
+
+static int openPcm(halPcm **pcm, const char *deviceName, snd_pcm_stream_t stream) {
+    int status;
+
+    *pcm = (halPcm *) malloc(sizeof(halPcm));
+    if (*pcm == NULL) {
+        return(-ENOMEM);
+    }
+    (*pcm)->framesWritten = 0;
+    (*pcm)->audioTimestampType = SND_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+    status = snd_pcm_open(&(*pcm)->handle, deviceName, stream, 0);
+    if (status < 0) {
+        free(*pcm);
+        *pcm = NULL;
+    }
+    return(status);
+}
+
+int halPcmOpen(halPcm **pcm, const char *deviceName) {
+    return(openPcm(pcm, deviceName, SND_PCM_STREAM_PLAYBACK));
+}
+
+int halPcmGetCapabilities(halPcm *pcm, halPcmCapabilities *capabilities) {
+    static const unsigned int standardRates[HAL_PCM_STANDARD_RATE_COUNT] = HAL_PCM_STANDARD_RATES;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_uframes_t frames;
+    int status;
+    int dir;
+
+    snd_pcm_hw_params_alloca(&params);
+    status = snd_pcm_hw_params_any(pcm->handle, params);
+    if (status < 0) {
+        return(status);
+    }
+    snd_pcm_hw_params_set_access(pcm->handle, params, ACCESS_TYPE);
+    capabilities->sampleRateCount = 0;
+    for (int i = 0; i < HAL_PCM_STANDARD_RATE_COUNT; i++) {
+        if (snd_pcm_hw_params_test_rate(pcm->handle, params, standardRates[i], 0) == 0) {
+            capabilities->sampleRates[capabilities->sampleRateCount] = standardRates[i];
+            capabilities->sampleRateCount += 1;
+        }
+    }
+    capabilities->formats = 0;
+    for (int format = 0; format < HAL_PCM_FORMAT_COUNT; format++) {
+        if (snd_pcm_hw_params_test_format(pcm->handle, params, toAlsaFormat(format)) == 0) {
+            capabilities->formats |= 1 << format;
+        }
+    }
+    snd_pcm_hw_params_get_channels_min(params, &capabilities->minChannels);
+    snd_pcm_hw_params_get_channels_max(params, &capabilities->maxChannels);
+    snd_pcm_hw_params_get_period_size_min(params, &frames, &dir);
+    capabilities->minPeriodFrames = frames;
+    snd_pcm_hw_params_get_period_size_max(params, &frames, &dir);
+    capabilities->maxPeriodFrames = frames;
+    snd_pcm_hw_params_get_buffer_size_min(params, &frames);
+    capabilities->minBufferFrames = frames;
+    snd_pcm_hw_params_get_buffer_size_max(params, &frames);
+    capabilities->maxBufferFrames = frames;
+    return(0);
+}
+
+int halPcmConfigure(halPcm *pcm, halPcmConfig *config) {
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *swParams;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t bufferFrames;
+    int status;
+    int dir;
+
+    // Allocate a hardware parameters object.
+    snd_pcm_hw_params_alloca(&params);
+
+    // Fill it in with default values.
+    snd_pcm_hw_params_any(pcm->handle, params);
+
+    // Set the desired hardware parameters.
+    snd_pcm_hw_params_set_access(pcm->handle, params, config->mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : ACCESS_TYPE);
+    status = snd_pcm_hw_params_set_format(pcm->handle, params, toAlsaFormat(config->format));
+    if (status < 0) {
+        return(status);
+    }
+    snd_pcm_hw_params_set_channels_near(pcm->handle, params, &config->channels);
+    snd_pcm_hw_params_set_rate_near(pcm->handle, params, &config->sampleRate, &dir);
+    if (config->periodFrames == 0) {
+        // Set period size to minimum to create smallest possible buffer size.
+        snd_pcm_hw_params_get_period_size_min(params, &frames, &dir);
+    }
+    else {
+        frames = config->periodFrames;
+    }
+    snd_pcm_hw_params_set_period_size_near(pcm->handle, params, &frames, &dir);
+    if (config->bufferFrames != 0) {
+        bufferFrames = config->bufferFrames;
+        snd_pcm_hw_params_set_buffer_size_near(pcm->handle, params, &bufferFrames);
+    }
+
+    // Write the parameters to the driver
+    status = snd_pcm_hw_params(pcm->handle, params);
+    if (status < 0) {
+        return(status);
+    }
+    snd_pcm_hw_params_get_rate(params, &config->sampleRate, &dir);
+    snd_pcm_hw_params_get_channels(params, &config->channels);
+    snd_pcm_hw_params_get_period_size(params, &frames, &dir);
+    config->periodFrames = frames;
+    pcm->bytesPerFrame = snd_pcm_format_physical_width(toAlsaFormat(config->format)) / 8 * config->channels;
+    snd_pcm_hw_params_get_buffer_size(params, &bufferFrames);
+    config->bufferFrames = bufferFrames;
+    snd_pcm_hw_params_get_period_time(params, &config->periodTimeInMicros, &dir);
+    // The link timestamp is taken where the samples leave the host, if the driver supports it
+    if (snd_pcm_hw_params_supports_audio_ts_type(params, SND_PCM_AUDIO_TSTAMP_TYPE_LINK)) {
+        pcm->audioTimestampType = SND_PCM_AUDIO_TSTAMP_TYPE_LINK;
+    }
+
+    // Timestamps of the status use the same clock as monotonicToTick
+    snd_pcm_sw_params_alloca(&swParams);
+    snd_pcm_sw_params_current(pcm->handle, swParams);
+    snd_pcm_sw_params_set_tstamp_mode(pcm->handle, swParams, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(pcm->handle, swParams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    status = snd_pcm_sw_params(pcm->handle, swParams);
+    if (status < 0) {
+        return(status);
+    }
+    pcm->framesWritten = 0;
+    return(0);
+}
+
+long halPcmWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    snd_pcm_sframes_t status;
+
+    status = snd_pcm_writei(pcm->handle, buffer, frames);
+    if (status > 0) {
+        pcm->framesWritten += status;
+    }
+    return(status);
+}
+
+// Copies the frames straight into the ring buffer of the driver
+long halPcmMmapWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, chunk;
+    snd_pcm_sframes_t available, committed;
+    unsigned long written = 0;
+    char *destination;
+    int status;
+
+    while (written < frames) {
+        available = snd_pcm_avail_update(pcm->handle);
+        if (available < 0) {
+            return(available);
+        }
+        // Block until there is room, like snd_pcm_writei does
+        if (available == 0) {
+            status = snd_pcm_wait(pcm->handle, 1000);
+            if (status < 0) {
+                return(status);
+            }
+            continue;
+        }
+        chunk = frames - written;
+        status = snd_pcm_mmap_begin(pcm->handle, &areas, &offset, &chunk);
+        if (status < 0) {
+            return(status);
+        }
+        destination = (char *) areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8;
+        if (buffer == NULL) {
+            memset(destination, 0, chunk * pcm->bytesPerFrame);
+        }
+        else {
+            memcpy(destination, (const char *) buffer + written * pcm->bytesPerFrame, chunk * pcm->bytesPerFrame);
+        }
+        committed = snd_pcm_mmap_commit(pcm->handle, offset, chunk);
+        if (committed < 0) {
+            return(committed);
+        }
+        written += committed;
+        pcm->framesWritten += committed;
+        // Committing does not start the stream like a write does
+        if (snd_pcm_state(pcm->handle) == SND_PCM_STATE_PREPARED) {
+            status = snd_pcm_start(pcm->handle);
+            if (status < 0) {
+                return(status);
+            }
+        }
+    }
+    return(written);
+}
+
+int halPcmDelay(halPcm *pcm, long *frames) {
+    snd_pcm_sframes_t delay;
+    int status;
+
+    status = snd_pcm_delay(pcm->handle, &delay);
+    // The delay is undefined if the call fails
+    *frames = status < 0 ? 0 : delay;
+    return(status);
+}
+
+int halPcmGetTimestamp(halPcm *pcm, halPcmTimestamp *timestamp) {
+    snd_pcm_status_t *status;
+    snd_pcm_audio_tstamp_config_t audioTimestampConfig;
+    snd_pcm_audio_tstamp_report_t audioTimestampReport;
+    snd_htimestamp_t systemTime, audioTime;
+    int result;
+
+    snd_pcm_status_alloca(&status);
+    audioTimestampConfig.type_requested = pcm->audioTimestampType;
+    audioTimestampConfig.report_delay = 1;
+    snd_pcm_status_set_audio_htstamp_config(status, &audioTimestampConfig);
+    result = snd_pcm_status(pcm->handle, status);
+    if (result < 0) {
+        return(result);
+    }
+    snd_pcm_status_get_htstamp(status, &systemTime);
+    snd_pcm_status_get_audio_htstamp(status, &audioTime);
+    snd_pcm_status_get_audio_htstamp_report(status, &audioTimestampReport);
+
+    timestamp->tick = monotonicToTick(&systemTime);
+    timestamp->framesWritten = pcm->framesWritten;
+    timestamp->delayFrames = snd_pcm_status_get_delay(status);
+    if (audioTimestampReport.valid) {
+        timestamp->audioTimeInNanos = (int64_t) audioTime.tv_sec * 1000000000 + audioTime.tv_nsec;
+    }
+    else {
+        timestamp->audioTimeInNanos = -1;
+    }
+    return(0);
+}
+
+int halPcmPrepare(halPcm *pcm) {
+    pcm->framesWritten = 0;
+    return(snd_pcm_prepare(pcm->handle));
+}
+
+int halPcmDrain(halPcm *pcm) {
+    return(snd_pcm_drain(pcm->handle));
+}
+
+int halPcmClose(halPcm *pcm) {
+    int status;
+
+    status = snd_pcm_close(pcm->handle);
+    free(pcm);
+    return(status);
+}
+
+// ####
+// #### PCM CAPTURE ####
+
+int halPcmOpenCapture(halPcm **pcm, const char *deviceName) {
+    return(openPcm(pcm, deviceName, SND_PCM_STREAM_CAPTURE));
+}
+
+long halPcmRead(halPcm *pcm, void *buffer, unsigned long frames) {
+    snd_pcm_sframes_t status;
+
+    status = snd_pcm_readi(pcm->handle, buffer, frames);
+    if (status > 0) {
+        pcm->framesWritten += status;
+    }
+    return(status);
+}
+
+int halPcmWait(halPcm *pcm, int timeoutInMillis) {
+    return(snd_pcm_wait(pcm->handle, timeoutInMillis));
+}
@@ -0,0 +1,1246 @@
+/*
+Hardware abstraction layer backend simulating the rig and a DUT
+
+Runs on any Linux box without pigpio, ALSA, a Raspberry Pi or a DUT (make sim).
+The simulated DUT is wired like the real one:
+- A level change on SIM_LINE_OUT reappears on SIM_LINE_IN after a sampled latency
+- Non-silent audio written to any PCM device reappears on SIM_LINE_IN, or the line in
+  given for the device in SIM_PCM_DEVICES, after the playback position reached it plus
+  a sampled latency
+
+Capture devices record what the simulated DUT plays: Audio written while the transistor
+is on reappears on every capture device after the same latency as on line in, plus noise.
+They record what the DUT gets on its line in as well: A pulse on SIM_LINE_OUT reappears on
+every capture device at half of full scale, after the same latency as on SIM_LINE_IN.
+
+The glitch filter of a GPIO drops the level changes shorter than its steady time and reports
+the others that much later, like pigpio. The noise filter only drops the short level changes.
+
+Time is virtual: The tick runs with the real monotonic clock, but halSleep and
+blocking PCM writes fast forward it instead of sleeping. This way a session takes
+only as long as the harness code itself needs, which is what we want to benchmark.
+Alert functions are called synchronously from halTick, halRead, halWrite, halSleep
+and the PCM functions once the virtual time passed the edge.
+The functions can be called from several threads, but only the thread that called
+halInitialise fast forwards the virtual time. Other threads sleep and block for real,
+so measurements on several devices in parallel take as long as on the rig.
+
+The DUT is configured with environment variables:
+SIM_LATENCY_US          Mean latency in microseconds (default 5000)
+SIM_JITTER_US           Jitter in microseconds, standard deviation for normal,
+                        half width for uniform and mean for exponential (default 100)
+SIM_JITTER_DISTRIBUTION normal, uniform or exponential (default normal)
+SIM_LOSS_RATE           Probability that a pulse never arrives (default 0)
+SIM_GLITCH_RATE         Probability of a noise spike on the line in between sending a pulse
+                        and its arrival (default 0)
+SIM_GLITCH_US           Width of the noise spikes in microseconds (default 20)
+SIM_DRIFT_PPM           Drift of the DUT clock, the latency grows by this many microseconds
+                        per second since halInitialise (default 0)
+SIM_STEP_US             Latency step once SIM_STEP_AFTER_S passed, like a resync of the
+                        DUT clock (default 0)
+SIM_STEP_AFTER_S        Seconds after halInitialise (default 10)
+SIM_SEED                Seed of the random number generator (default 1)
+SIM_WAKEUP_US           Mean scheduler wakeup delay after PCM writes that started
+                        the stream or blocked (default 0)
+SIM_TICK_START          Tick value at halInitialise, to provoke wrap arounds (default 0)
+SIM_PERIOD_FRAMES       Minimum period size of the PCM devices (default 8)
+SIM_BUFFER_FRAMES       Buffer size of the PCM devices, writes block when it is full (default 4096)
+SIM_PCM_DEVICES         Comma separated list of PCM devices that can be opened, each one
+                        optionally followed by @GPIO of its line in
+                        (default hw:CARD=usb_audio_top,hw:CARD=vc4hdmi)
+SIM_CAPTURE_NOISE       Standard deviation of the noise on the capture devices,
+                        relative to full scale (default 0.01)
+SIM_CAPTURE_BUFFER_FRAMES
+                        Buffer size of the capture devices, a read is needed before it is
+                        full (default 262144)
+SIM_BUTTONS             Comma separated button presses as GPIO:SECONDS after halInitialise,
+                        each one bouncing once (default none)
+*/
+
+#include "hal.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Wiring of the simulated DUT, same as on the rig
+#define SIM_LINE_IN 4
+#define SIM_LINE_OUT 5
+
+#define SIM_MAX_GPIOS 54
+#define SIM_MAX_CHANNELS 8
+#define SIM_REAL_WAIT_STEP_US 200 // Edge delivery resolution of threads that wait for real
+#define SIM_MAX_PENDING_EDGES 16384 // Enough for the longest pulse train
+#define SIM_SIGNAL_THRESHOLD 1024 // Absolute sample value that triggers the transistor
+#define SIM_DEFAULT_PCM_DEVICES "hw:CARD=usb_audio_top,hw:CARD=vc4hdmi"
+#define SIM_PLAYED_SAMPLES (1 << 18) // Samples the simulated DUT remembers for the capture devices
+#define SIM_LINE_CAPTURE_LEVEL 0.5f // High level of SIM_LINE_OUT on the capture devices
+#define SIM_LINE_CAPTURE_STEP_US 10 // Spacing of the samples remembered for a line out pulse
+#define SIM_BUTTON_BOUNCE_US 300
+#define SIM_BUTTON_PRESS_US 150000
+
+#define SIM_DISTRIBUTION_NORMAL 0
+#define SIM_DISTRIBUTION_UNIFORM 1
+#define SIM_DISTRIBUTION_EXPONENTIAL 2
+
+typedef struct {
+    uint64_t timeInMicros;
+    int gpio;
+    int level;
+} simEdge;
+
+// Sample the DUT plays, as it reaches the capture devices
+typedef struct {
+    double timeInMicros;
+    float value;
+} simSample;
+
+struct halPcm {
+    halPcmConfig config;
+    int lineIn;
+    int capture;
+    int running;
+    uint64_t startInMicros;
+    uint64_t framesWritten;
+    int signalOn;
+    unsigned long quietFrames;
+    double signalLatencyInMicros;
+};
+
+// Simulated DUT
+static double latencyMeanInMicros;
+static double jitterInMicros;
+static int jitterDistribution;
+static double lossRate;
+static double glitchRate;
+static double glitchWidthInMicros;
+static double driftInPpm;
+static double stepInMicros;
+static double stepAfterInMicros;
+static double wakeupInMicros;
+static unsigned long minimumPeriodFrames;
+static unsigned long bufferFrames;
+static unsigned long captureBufferFrames;
+static const char *pcmDevices;
+static double captureNoise;
+static uint64_t randomState;
+
+// Virtual time
+static struct timespec startTime;
+static uint64_t skippedMicros;
+static uint32_t tickStart;
+static pthread_t halThread;
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER; // Taken by every hal function
+static __thread int deliveringEdges; // The alert functions of this thread run under simLock
+static unsigned int microsPerSample = 5; // Alert ticks are rounded down to it, like pigpio samples the GPIOs
+
+// GPIO state
+static int levels[SIM_MAX_GPIOS];
+static halAlertFunc alertFunctions[SIM_MAX_GPIOS];
+static unsigned int glitchFilterInMicros[SIM_MAX_GPIOS]; // Steady times, 0 is off
+static unsigned int noiseFilterInMicros[SIM_MAX_GPIOS];
+static simEdge pendingEdges[SIM_MAX_PENDING_EDGES]; /* Binary min-heap ordered by time */
+static int pendingEdgesCount;
+static int lineOutPulseLost;
+static double lineOutPulseLatencyInMicros;
+static uint64_t lineOutRiseInMicros;
+static uint64_t pulseTrainEndInMicros;
+
+// Played samples
+static simSample playedSamples[SIM_PLAYED_SAMPLES]; /* Ring, ordered by time */
+static uint64_t playedSamplesCount;
+
+// ####
+// #### RANDOM LATENCIES ####
+
+static double getEnvDouble(const char *name, double defaultValue) {
+    const char *value = getenv(name);
+
+    if (value == NULL || *value == '\0') {
+        return(defaultValue);
+    }
+    return(strtod(value, NULL));
+}
+
+// xorshift64*, good enough and identical on every platform for a given seed
+static double randomUniform() {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return((double) ((randomState * 2685821657736338717ULL) >> 11) / 9007199254740992.0);
+}
+
+static double randomNormal() {
+    double u1, u2;
+
+    // Box-Muller transform
+    do {
+        u1 = randomUniform();
+    } while (u1 <= 0.0);
+    u2 = randomUniform();
+    return(sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+// sendInMicros is the virtual time the pulse is played at
+static double sampleLatencyInMicros(uint64_t sendInMicros) {
+    double latency;
+
+    switch (jitterDistribution) {
+        case SIM_DISTRIBUTION_UNIFORM:
+            latency = latencyMeanInMicros + jitterInMicros * (2.0 * randomUniform() - 1.0);
+            break;
+        case SIM_DISTRIBUTION_EXPONENTIAL:
+            latency = latencyMeanInMicros - jitterInMicros * log(1.0 - randomUniform());
+            break;
+        default:
+            latency = latencyMeanInMicros + jitterInMicros * randomNormal();
+            break;
+    }
+    latency += driftInPpm * sendInMicros / 1000000.0;
+    if (sendInMicros >= stepAfterInMicros) {
+        latency += stepInMicros;
+    }
+    if (latency < 0) {
+        latency = 0;
+    }
+    return(latency);
+}
+
+static int samplePulseLost() {
+    return(lossRate > 0 && randomUniform() < lossRate);
+}
+
+// ####
+// #### VIRTUAL TIME AND EDGE DELIVERY ####
+
+static uint64_t nowInMicros() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((uint64_t) (now.tv_sec - startTime.tv_sec) * 1000000
+           + (now.tv_nsec - startTime.tv_nsec) / 1000
+           + skippedMicros);
+}
+
+static void pushEdge(uint64_t timeInMicros, int gpio, int level) {
+    int child, parent;
+    simEdge edge = {timeInMicros, gpio, level};
+
+    if (pendingEdgesCount == SIM_MAX_PENDING_EDGES) {
+        printf("hal_sim.c l.233: Too many pending edges -> Dropping edge\n");
+        return;
+    }
+    child = pendingEdgesCount++;
+    while (child > 0) {
+        parent = (child - 1) / 2;
+        if (pendingEdges[parent].timeInMicros <= timeInMicros) {
+            break;
+        }
+        pendingEdges[child] = pendingEdges[parent];
+        child = parent;
+    }
+    pendingEdges[child] = edge;
+}
+
+static simEdge popEdge() {
+    simEdge first = pendingEdges[0];
+    simEdge last = pendingEdges[--pendingEdgesCount];
+    int parent = 0;
+    int child;
+
+    while ((child = 2 * parent + 1) < pendingEdgesCount) {
+        if (child + 1 < pendingEdgesCount
+            && pendingEdges[child + 1].timeInMicros < pendingEdges[child].timeInMicros) {
+            child++;
+        }
+        if (last.timeInMicros <= pendingEdges[child].timeInMicros) {
+            break;
+        }
+        pendingEdges[parent] = pendingEdges[child];
+        parent = child;
+    }
+    pendingEdges[parent] = last;
+    return(first);
+}
+
+// Delivers all edges up to untilInMicros, fast forwarding the virtual time to each of them
+static void deliverEdges(uint64_t untilInMicros) {
+    simEdge edge;
+    uint64_t now;
+
+    while (pendingEdgesCount > 0 && pendingEdges[0].timeInMicros <= untilInMicros) {
+        edge = popEdge();
+        now = nowInMicros();
+        if (edge.timeInMicros > now) {
+            skippedMicros += edge.timeInMicros - now;
+        }
+        levels[edge.gpio] = edge.level;
+        if (alertFunctions[edge.gpio] != NULL) {
+            deliveringEdges = 1;
+            alertFunctions[edge.gpio](edge.gpio, edge.level,
+                                      (uint32_t) (tickStart + edge.timeInMicros / microsPerSample * microsPerSample));
+            deliveringEdges = 0;
+        }
+    }
+}
+
+static void advanceTo(uint64_t targetInMicros) {
+    uint64_t now;
+    struct timespec step = {0, SIM_REAL_WAIT_STEP_US * 1000};
+
+    if (!pthread_equal(pthread_self(), halThread)) {
+        // Waiting for real, the other threads go on meanwhile
+        while ((now = nowInMicros()) < targetInMicros) {
+            deliverEdges(now);
+            pthread_mutex_unlock(&simLock);
+            if (targetInMicros - now < SIM_REAL_WAIT_STEP_US) {
+                step.tv_nsec = (targetInMicros - now) * 1000;
+            }
+            nanosleep(&step, NULL);
+            pthread_mutex_lock(&simLock);
+        }
+        deliverEdges(targetInMicros);
+        return;
+    }
+    deliverEdges(targetInMicros);
+    now = nowInMicros();
+    if (targetInMicros > now) {
+        skippedMicros += targetInMicros - now;
+    }
+}
+
+// An edge of the DUT on one of the line ins, delayed by the glitch filter of the GPIO
+static void pushInputEdge(uint64_t timeInMicros, int gpio, int level) {
+    pushEdge(timeInMicros + glitchFilterInMicros[gpio], gpio, level);
+}
+
+// Maybe adds a spike between a pulse sent at sendInMicros and its arrival, unless a filter drops it
+static void pushGlitch(uint64_t sendInMicros, double latencyInMicros, int gpio) {
+    uint64_t riseInMicros;
+
+    if (glitchRate <= 0 || randomUniform() >= glitchRate || latencyInMicros < 2 * glitchWidthInMicros) {
+        return;
+    }
+    riseInMicros = sendInMicros + (uint64_t) (randomUniform() * (latencyInMicros - 2 * glitchWidthInMicros));
+    if (glitchWidthInMicros < glitchFilterInMicros[gpio] || glitchWidthInMicros < noiseFilterInMicros[gpio]) {
+        return;
+    }
+    pushInputEdge(riseInMicros, gpio, 1);
+    pushInputEdge(riseInMicros + (uint64_t) glitchWidthInMicros, gpio, 0);
+}
+
+// ####
+// #### GPIO AND TIMING ####
+
+// Remembers a line out pulse as the DUT records it on its line in
+static void recordLineOutPulse(uint64_t riseInMicros, uint64_t fallInMicros, double latencyInMicros) {
+    simSample *played;
+
+    for (uint64_t time = riseInMicros; time <= fallInMicros; time += SIM_LINE_CAPTURE_STEP_US) {
+        played = &playedSamples[playedSamplesCount % SIM_PLAYED_SAMPLES];
+        played->timeInMicros = time + latencyInMicros;
+        played->value = SIM_LINE_CAPTURE_LEVEL;
+        playedSamplesCount += 1;
+    }
+    played = &playedSamples[playedSamplesCount % SIM_PLAYED_SAMPLES];
+    played->timeInMicros = fallInMicros + latencyInMicros;
+    played->value = 0.0f;
+    playedSamplesCount += 1;
+}
+
+// Schedules the button presses of SIM_BUTTONS
+static void scheduleButtonPresses(const char *buttons) {
+    unsigned int gpio;
+    double seconds;
+    uint64_t time;
+    int length;
+
+    while (sscanf(buttons, "%u:%lf%n", &gpio, &seconds, &length) == 2) {
+        if (gpio < SIM_MAX_GPIOS && seconds >= 0) {
+            time = (uint64_t) (seconds * 1000000.0);
+            pushEdge(time, gpio, 1);
+            pushEdge(time + SIM_BUTTON_BOUNCE_US, gpio, 0);
+            pushEdge(time + 2 * SIM_BUTTON_BOUNCE_US, gpio, 1);
+            pushEdge(time + SIM_BUTTON_PRESS_US, gpio, 0);
+        }
+        buttons += length;
+        if (*buttons != ',') {
+            break;
+        }
+        buttons++;
+    }
+}
+
+static int simConfigureSampling(unsigned int micros) {
+    if (micros == 0 || micros > 10) {
+        return(-EINVAL);
+    }
+    microsPerSample = micros;
+    return(0);
+}
+
+static int simInitialise(void) {
+    const char *distribution;
+
+    latencyMeanInMicros = getEnvDouble("SIM_LATENCY_US", 5000);
+    jitterInMicros = getEnvDouble("SIM_JITTER_US", 100);
+    lossRate = getEnvDouble("SIM_LOSS_RATE", 0);
+    glitchRate = getEnvDouble("SIM_GLITCH_RATE", 0);
+    glitchWidthInMicros = getEnvDouble("SIM_GLITCH_US", 20);
+    driftInPpm = getEnvDouble("SIM_DRIFT_PPM", 0);
+    stepInMicros = getEnvDouble("SIM_STEP_US", 0);
+    stepAfterInMicros = getEnvDouble("SIM_STEP_AFTER_S", 10) * 1000000.0;
+    wakeupInMicros = getEnvDouble("SIM_WAKEUP_US", 0);
+    randomState = (uint64_t) getEnvDouble("SIM_SEED", 1);
+    if (randomState == 0) {
+        randomState = 1;
+    }
+    tickStart = (uint32_t) getEnvDouble("SIM_TICK_START", 0);
+    minimumPeriodFrames = (unsigned long) getEnvDouble("SIM_PERIOD_FRAMES", 8);
+    bufferFrames = (unsigned long) getEnvDouble("SIM_BUFFER_FRAMES", 4096);
+    captureNoise = getEnvDouble("SIM_CAPTURE_NOISE", 0.01);
+    captureBufferFrames = (unsigned long) getEnvDouble("SIM_CAPTURE_BUFFER_FRAMES", 262144);
+    pcmDevices = getenv("SIM_PCM_DEVICES");
+    if (pcmDevices == NULL) {
+        pcmDevices = SIM_DEFAULT_PCM_DEVICES;
+    }
+    distribution = getenv("SIM_JITTER_DISTRIBUTION");
+    if (distribution == NULL || strcmp(distribution, "normal") == 0) {
+        jitterDistribution = SIM_DISTRIBUTION_NORMAL;
+        distribution = "normal";
+    }
+    else if (strcmp(distribution, "uniform") == 0) {
+        jitterDistribution = SIM_DISTRIBUTION_UNIFORM;
+    }
+    else if (strcmp(distribution, "exponential") == 0) {
+        jitterDistribution = SIM_DISTRIBUTION_EXPONENTIAL;
+    }
+    else {
+        printf("hal_sim.c l.422: Unknown SIM_JITTER_DISTRIBUTION %s\n", distribution);
+        return(-EINVAL);
+    }
+
+    memset(levels, 0, sizeof(levels));
+    memset(alertFunctions, 0, sizeof(alertFunctions));
+    memset(glitchFilterInMicros, 0, sizeof(glitchFilterInMicros));
+    memset(noiseFilterInMicros, 0, sizeof(noiseFilterInMicros));
+    pendingEdgesCount = 0;
+    skippedMicros = 0;
+    pulseTrainEndInMicros = 0;
+    playedSamplesCount = 0;
+    halThread = pthread_self();
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (getenv("SIM_BUTTONS") != NULL) {
+        scheduleButtonPresses(getenv("SIM_BUTTONS"));
+    }
+
+    printf("Simulated DUT: latency %.0f us, %s jitter %.0f us, loss rate %.3f, glitch rate %.3f, drift %.1f ppm\n",
+           latencyMeanInMicros, distribution, jitterInMicros, lossRate, glitchRate, driftInPpm);
+    return(0);
+}
+
+static void simTerminate(void) {
+    pendingEdgesCount = 0;
+    memset(alertFunctions, 0, sizeof(alertFunctions));
+}
+
+static int simSetMode(unsigned int gpio, unsigned int mode) {
+    if (gpio >= SIM_MAX_GPIOS) {
+        return(-EINVAL);
+    }
+    return(0);
+}
+
+static int simRead(unsigned int gpio) {
+    if (gpio >= SIM_MAX_GPIOS) {
+        return(-EINVAL);
+    }
+    deliverEdges(nowInMicros());
+    return(levels[gpio]);
+}
+
+static int simWrite(unsigned int gpio, unsigned int level) {
+    uint64_t now;
+
+    if (gpio >= SIM_MAX_GPIOS) {
+        return(-EINVAL);
+    }
+    now = nowInMicros();
+    deliverEdges(now);
+    level = level ? 1 : 0;
+    if (levels[gpio] == (int) level) {
+        return(0);
+    }
+    levels[gpio] = level;
+    // Alerts are reported for outputs as well
+    pushEdge(now, gpio, level);
+
+    if (gpio == SIM_LINE_OUT) {
+        if (level == 1) {
+            lineOutPulseLost = samplePulseLost();
+            lineOutPulseLatencyInMicros = sampleLatencyInMicros(now);
+            lineOutRiseInMicros = now;
+            pushGlitch(now, lineOutPulseLatencyInMicros, SIM_LINE_IN);
+        }
+        if (!lineOutPulseLost) {
+            pushInputEdge(now + (uint64_t) lineOutPulseLatencyInMicros, SIM_LINE_IN, level);
+        }
+        if (!lineOutPulseLost && level == 0) {
+            recordLineOutPulse(lineOutRiseInMicros, now, lineOutPulseLatencyInMicros);
+        }
+    }
+    return(0);
+}
+
+static int simSetAlertFunc(unsigned int gpio, halAlertFunc function) {
+    if (gpio >= SIM_MAX_GPIOS) {
+        return(-EINVAL);
+    }
+    alertFunctions[gpio] = function;
+    return(0);
+}
+
+static int simGlitchFilter(unsigned int gpio, unsigned int steadyMicros) {
+    if (gpio >= SIM_MAX_GPIOS || steadyMicros > 300000) {
+        return(-EINVAL);
+    }
+    glitchFilterInMicros[gpio] = steadyMicros;
+    return(0);
+}
+
+// Only the steady time matters, the simulated DUT sends no bursts of noise
+static int simNoiseFilter(unsigned int gpio, unsigned int steadyMicros, unsigned int activeMicros) {
+    if (gpio >= SIM_MAX_GPIOS || steadyMicros > 300000 || activeMicros > 1000000) {
+        return(-EINVAL);
+    }
+    noiseFilterInMicros[gpio] = steadyMicros;
+    return(0);
+}
+
+static uint32_t simTick(void) {
+    uint64_t now = nowInMicros();
+
+    deliverEdges(now);
+    return((uint32_t) (tickStart + now));
+}
+
+static void simSleep(double seconds) {
+    if (seconds > 0) {
+        advanceTo(nowInMicros() + (uint64_t) (seconds * 1000000.0));
+    }
+}
+
+static int simTime(int *seconds, int *micros) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    *seconds = now.tv_sec;
+    *micros = now.tv_nsec / 1000;
+    return(0);
+}
+
+// ####
+// #### PULSE TRAINS ####
+
+// All edges of the train are scheduled at once, like the DMA controller does it on the rig
+static int simPulseTrainSend(unsigned int gpio, const halPulse *pulses, int count, uint32_t durationInMicros) {
+    uint64_t now, riseTime, fallTime;
+    double latencyInMicros;
+
+    if (gpio >= SIM_MAX_GPIOS || count <= 0 || count > HAL_PULSE_TRAIN_MAX_PULSES) {
+        return(-EINVAL);
+    }
+    now = nowInMicros();
+    deliverEdges(now);
+    if (now < pulseTrainEndInMicros) {
+        return(-EBUSY);
+    }
+    for (int i = 0; i < count; i++) {
+        if ((i > 0 && pulses[i].offsetInMicros < pulses[i - 1].offsetInMicros + pulses[i - 1].widthInMicros)
+            || pulses[i].offsetInMicros + pulses[i].widthInMicros > durationInMicros) {
+            return(-EINVAL);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        riseTime = now + pulses[i].offsetInMicros;
+        fallTime = riseTime + pulses[i].widthInMicros;
+        pushEdge(riseTime, gpio, 1);
+        pushEdge(fallTime, gpio, 0);
+        if (gpio == SIM_LINE_OUT && !samplePulseLost()) {
+            latencyInMicros = sampleLatencyInMicros(riseTime);
+            pushGlitch(riseTime, latencyInMicros, SIM_LINE_IN);
+            pushInputEdge(riseTime + (uint64_t) latencyInMicros, SIM_LINE_IN, 1);
+            pushInputEdge(fallTime + (uint64_t) latencyInMicros, SIM_LINE_IN, 0);
+            recordLineOutPulse(riseTime, fallTime, latencyInMicros);
+        }
+    }
+    pulseTrainEndInMicros = now + durationInMicros;
+    return(0);
+}
+
+static int simPulseTrainBusy(void) {
+    uint64_t now = nowInMicros();
+
+    deliverEdges(now);
+    return(now < pulseTrainEndInMicros);
+}
+
+// ####
+// #### PCM PLAYBACK ####
+
+// Returns the line in GPIO of the device or -1 if it is not in SIM_PCM_DEVICES
+static int findPcmDevice(const char *deviceName) {
+    size_t length = strlen(deviceName);
+    const char *match = pcmDevices;
+
+    while ((match = strstr(match, deviceName)) != NULL) {
+        if ((match == pcmDevices || match[-1] == ',')
+            && (match[length] == '\0' || match[length] == ',')) {
+            return(SIM_LINE_IN);
+        }
+        if ((match == pcmDevices || match[-1] == ',') && match[length] == '@') {
+            return(atoi(match + length + 1));
+        }
+        match += length;
+    }
+    return(-1);
+}
+
+static uint64_t framePlaybackTime(halPcm *pcm, uint64_t frame) {
+    return(pcm->startInMicros + frame * 1000000 / pcm->config.sampleRate);
+}
+
+static int getFormatBytes(int format) {
+    switch (format) {
+        case HAL_PCM_FORMAT_S24_3LE:
+            return(3);
+        case HAL_PCM_FORMAT_S32_LE:
+            return(4);
+        default:
+            return(2);
+    }
+}
+
+// Upper 16 bits of a sample
+static int16_t getSampleLevel(const unsigned char *sample, int sampleBytes) {
+    return((int16_t) (sample[sampleBytes - 2] | (sample[sampleBytes - 1] << 8)));
+}
+
+// Remembers the first channel of a frame played while the transistor is on
+static void recordPlayedSample(halPcm *pcm, uint64_t frame, const unsigned char *sample, int sampleBytes) {
+    simSample *played = &playedSamples[playedSamplesCount % SIM_PLAYED_SAMPLES];
+
+    played->timeInMicros = pcm->startInMicros + (double) frame * 1000000.0 / pcm->config.sampleRate
+                           + pcm->signalLatencyInMicros;
+    played->value = getSampleLevel(sample, sampleBytes) / 32768.0f;
+    playedSamplesCount += 1;
+}
+
+// Value on the capture devices at timeInMicros, interpolated between the played samples.
+// Between two pulses nothing is played.
+static double getPlayedValue(double timeInMicros, double samplePeriodInMicros) {
+    uint64_t low, high, middle;
+    const simSample *before, *after;
+
+    low = playedSamplesCount > SIM_PLAYED_SAMPLES ? playedSamplesCount - SIM_PLAYED_SAMPLES : 0;
+    high = playedSamplesCount;
+    if (low == high || playedSamples[low % SIM_PLAYED_SAMPLES].timeInMicros > timeInMicros) {
+        return(0.0);
+    }
+    // Last sample played at or before timeInMicros
+    while (high - low > 1) {
+        middle = low + (high - low) / 2;
+        if (playedSamples[middle % SIM_PLAYED_SAMPLES].timeInMicros <= timeInMicros) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+    before = &playedSamples[low % SIM_PLAYED_SAMPLES];
+    if (low + 1 == playedSamplesCount) {
+        return(timeInMicros - before->timeInMicros < samplePeriodInMicros ? before->value : 0.0);
+    }
+    after = &playedSamples[(low + 1) % SIM_PLAYED_SAMPLES];
+    if (after->timeInMicros - before->timeInMicros > 1.5 * samplePeriodInMicros) {
+        return(0.0);
+    }
+    return(before->value + (after->value - before->value) * (timeInMicros - before->timeInMicros)
+                           / (after->timeInMicros - before->timeInMicros));
+}
+
+// The transistor on line in switches on with the first loud sample and off after 1 ms of silence.
+// Only the upper 16 bits of a sample are compared against the threshold.
+static void detectSignal(halPcm *pcm, const unsigned char *samples, unsigned long frames) {
+    unsigned long holdFrames = pcm->config.sampleRate / 1000;
+    int sampleBytes = getFormatBytes(pcm->config.format);
+    const unsigned char *sample;
+    int loud;
+    uint64_t time;
+
+    for (unsigned long frame = 0; frame < frames; frame++) {
+        loud = 0;
+        for (unsigned int channel = 0; channel < pcm->config.channels; channel++) {
+            sample = samples + (frame * pcm->config.channels + channel) * sampleBytes;
+            if (abs(getSampleLevel(sample, sampleBytes)) > SIM_SIGNAL_THRESHOLD) {
+                loud = 1;
+            }
+        }
+        if (loud) {
+            pcm->quietFrames = 0;
+            if (!pcm->signalOn) {
+                pcm->signalOn = 1;
+                time = framePlaybackTime(pcm, pcm->framesWritten + frame);
+                pcm->signalLatencyInMicros = samplePulseLost() ? -1 : sampleLatencyInMicros(time);
+                if (pcm->signalLatencyInMicros >= 0) {
+                    pushGlitch(time, pcm->signalLatencyInMicros, pcm->lineIn);
+                    pushInputEdge(time + (uint64_t) pcm->signalLatencyInMicros, pcm->lineIn, 1);
+                }
+            }
+        }
+        else if (pcm->signalOn && ++pcm->quietFrames >= holdFrames) {
+            pcm->signalOn = 0;
+            if (pcm->signalLatencyInMicros >= 0) {
+                time = framePlaybackTime(pcm, pcm->framesWritten + frame);
+                pushInputEdge(time + (uint64_t) pcm->signalLatencyInMicros, pcm->lineIn, 0);
+            }
+        }
+        if (pcm->signalOn && pcm->signalLatencyInMicros >= 0) {
+            recordPlayedSample(pcm, pcm->framesWritten + frame, samples + frame * pcm->config.channels * sampleBytes, sampleBytes);
+        }
+    }
+}
+
+static void detectSilence(halPcm *pcm, unsigned long frames) {
+    unsigned long holdFrames = pcm->config.sampleRate / 1000;
+
+    if (pcm->signalOn && pcm->quietFrames + frames >= holdFrames) {
+        pcm->signalOn = 0;
+        if (pcm->signalLatencyInMicros >= 0) {
+            pushInputEdge(framePlaybackTime(pcm, pcm->framesWritten + holdFrames - pcm->quietFrames)
+                          + (uint64_t) pcm->signalLatencyInMicros, pcm->lineIn, 0);
+        }
+    }
+    else if (pcm->signalOn) {
+        pcm->quietFrames += frames;
+    }
+}
+
+static void stopSignal(halPcm *pcm) {
+    if (pcm->signalOn) {
+        pcm->signalOn = 0;
+        if (pcm->signalLatencyInMicros >= 0) {
+            pushInputEdge(framePlaybackTime(pcm, pcm->framesWritten) + (uint64_t) pcm->signalLatencyInMicros,
+                          pcm->lineIn, 0);
+        }
+    }
+}
+
+static int simPcmOpen(halPcm **pcm, const char *deviceName) {
+    int lineIn = findPcmDevice(deviceName);
+
+    if (lineIn < 0 || lineIn >= SIM_MAX_GPIOS) {
+        *pcm = NULL;
+        return(-ENOENT);
+    }
+    *pcm = (halPcm *) calloc(1, sizeof(halPcm));
+    if (*pcm == NULL) {
+        return(-ENOMEM);
+    }
+    (*pcm)->lineIn = lineIn;
+    return(0);
+}
+
+// Every standard rate and format, up to SIM_MAX_CHANNELS channels and periods up to half the buffer
+static int simPcmGetCapabilities(halPcm *pcm, halPcmCapabilities *capabilities) {
+    static const unsigned int standardRates[HAL_PCM_STANDARD_RATE_COUNT] = HAL_PCM_STANDARD_RATES;
+
+    for (int i = 0; i < HAL_PCM_STANDARD_RATE_COUNT; i++) {
+        capabilities->sampleRates[i] = standardRates[i];
+    }
+    capabilities->sampleRateCount = HAL_PCM_STANDARD_RATE_COUNT;
+    capabilities->formats = (1 << HAL_PCM_FORMAT_COUNT) - 1;
+    capabilities->minChannels = 1;
+    capabilities->maxChannels = SIM_MAX_CHANNELS;
+    capabilities->minPeriodFrames = minimumPeriodFrames;
+    capabilities->maxPeriodFrames = bufferFrames / 2;
+    capabilities->minBufferFrames = minimumPeriodFrames;
+    capabilities->maxBufferFrames = bufferFrames;
+    return(0);
+}
+
+static int simPcmConfigure(halPcm *pcm, halPcmConfig *config) {
+    unsigned long maxBufferFrames = pcm->capture ? captureBufferFrames : bufferFrames;
+
+    if (config->format < 0 || config->format >= HAL_PCM_FORMAT_COUNT || config->channels == 0 || config->sampleRate == 0) {
+        return(-EINVAL);
+    }
+    if (config->channels > SIM_MAX_CHANNELS) {
+        config->channels = SIM_MAX_CHANNELS;
+    }
+    if (config->periodFrames < minimumPeriodFrames) {
+        config->periodFrames = minimumPeriodFrames;
+    }
+    if (config->periodFrames > bufferFrames / 2) {
+        config->periodFrames = bufferFrames / 2;
+    }
+    if (config->bufferFrames > maxBufferFrames) {
+        config->bufferFrames = maxBufferFrames;
+    }
+    config->periodTimeInMicros = config->periodFrames * 1000000 / config->sampleRate;
+    if (config->bufferFrames == 0) {
+        config->bufferFrames = bufferFrames;
+    }
+    if (config->bufferFrames < config->periodFrames) {
+        config->bufferFrames = config->periodFrames;
+    }
+    pcm->config = *config;
+    pcm->running = 0;
+    return(0);
+}
+
+// Both write functions behave the same, silence is passed as NULL buffer
+static long simPcmWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    uint64_t now = nowInMicros();
+    uint64_t bufferStart;
+    int wokenUp = 0;
+
+    deliverEdges(now);
+    if (pcm->running && now > framePlaybackTime(pcm, pcm->framesWritten)) {
+        // Everything written so far has been played before this write -> underrun
+        stopSignal(pcm);
+        pcm->running = 0;
+        return(-EPIPE);
+    }
+    if (!pcm->running) {
+        pcm->running = 1;
+        pcm->startInMicros = now;
+        pcm->framesWritten = 0;
+        wokenUp = 1;
+    }
+    // Block until the hardware buffer has room for the frames
+    if (pcm->framesWritten + frames > pcm->config.bufferFrames) {
+        bufferStart = framePlaybackTime(pcm, pcm->framesWritten + frames - pcm->config.bufferFrames);
+        if (bufferStart > now) {
+            advanceTo(bufferStart);
+            wokenUp = 1;
+        }
+    }
+    if (buffer != NULL) {
+        detectSignal(pcm, (const unsigned char *) buffer, frames);
+    }
+    else {
+        detectSilence(pcm, frames);
+    }
+    pcm->framesWritten += frames;
+    // After starting the stream or blocking the caller is woken up a bit later than the write finished
+    if (wokenUp && wakeupInMicros > 0) {
+        advanceTo(nowInMicros() + (uint64_t) (-wakeupInMicros * log(1.0 - randomUniform())));
+    }
+    return((long) frames);
+}
+
+static long simPcmMmapWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    return(simPcmWrite(pcm, buffer, frames));
+}
+
+static int simPcmDelay(halPcm *pcm, long *frames) {
+    uint64_t now = nowInMicros();
+    uint64_t framesPlayed;
+
+    deliverEdges(now);
+    *frames = 0;
+    if (pcm->running && pcm->capture) {
+        // Frames captured but not read yet
+        framesPlayed = now > pcm->startInMicros ? (now - pcm->startInMicros) * pcm->config.sampleRate / 1000000 : 0;
+        if (framesPlayed > pcm->framesWritten) {
+            *frames = (long) (framesPlayed - pcm->framesWritten);
+        }
+    }
+    else if (pcm->running && now > pcm->startInMicros) {
+        framesPlayed = (now - pcm->startInMicros) * pcm->config.sampleRate / 1000000;
+        if (framesPlayed < pcm->framesWritten) {
+            *frames = (long) (pcm->framesWritten - framesPlayed);
+        }
+    }
+    else if (pcm->running) {
+        *frames = (long) pcm->framesWritten;
+    }
+    return(0);
+}
+
+static int simPcmGetTimestamp(halPcm *pcm, halPcmTimestamp *timestamp) {
+    uint64_t now = nowInMicros();
+
+    deliverEdges(now);
+    timestamp->tick = (uint32_t) (tickStart + now);
+    timestamp->framesWritten = pcm->running ? pcm->framesWritten : 0;
+    simPcmDelay(pcm, &timestamp->delayFrames);
+    if (pcm->running && now > pcm->startInMicros) {
+        timestamp->audioTimeInNanos = (int64_t) (now - pcm->startInMicros) * 1000;
+    }
+    else {
+        timestamp->audioTimeInNanos = pcm->running ? 0 : -1;
+    }
+    return(0);
+}
+
+static int simPcmPrepare(halPcm *pcm) {
+    stopSignal(pcm);
+    pcm->running = 0;
+    return(0);
+}
+
+static int simPcmDrain(halPcm *pcm) {
+    if (pcm->running) {
+        stopSignal(pcm);
+        advanceTo(framePlaybackTime(pcm, pcm->framesWritten));
+        pcm->running = 0;
+    }
+    return(0);
+}
+
+static int simPcmClose(halPcm *pcm) {
+    stopSignal(pcm);
+    free(pcm);
+    return(0);
+}
+
+// ####
+// #### PCM CAPTURE ####
+
+static int simPcmOpenCapture(halPcm **pcm, const char *deviceName) {
+    int status = simPcmOpen(pcm, deviceName);
+
+    if (status == 0) {
+        (*pcm)->capture = 1;
+    }
+    return(status);
+}
+
+// Blocks until the frames are captured, the first channel carries what the DUT played
+static long simPcmRead(halPcm *pcm, void *buffer, unsigned long frames) {
+    uint64_t now = nowInMicros();
+    int sampleBytes = getFormatBytes(pcm->config.format);
+    double samplePeriodInMicros = 1000000.0 / pcm->config.sampleRate;
+    unsigned char *sample = (unsigned char *) buffer;
+    double value;
+    int32_t level;
+
+    if (!pcm->capture) {
+        return(-EBADFD);
+    }
+    deliverEdges(now);
+    if (pcm->running && now > framePlaybackTime(pcm, pcm->framesWritten + pcm->config.bufferFrames)) {
+        // Frames were captured into a full buffer -> overrun
+        pcm->running = 0;
+        return(-EPIPE);
+    }
+    if (!pcm->running) {
+        pcm->running = 1;
+        pcm->startInMicros = now;
+        pcm->framesWritten = 0;
+    }
+    advanceTo(framePlaybackTime(pcm, pcm->framesWritten + frames));
+    for (unsigned long frame = 0; frame < frames; frame++) {
+        value = getPlayedValue(pcm->startInMicros + (pcm->framesWritten + frame) * samplePeriodInMicros, samplePeriodInMicros)
+                + captureNoise * randomNormal();
+        level = (int32_t) lround(fmax(-1.0, fmin(value, 2147483647.0 / 2147483648.0)) * 2147483648.0);
+        for (unsigned int channel = 0; channel < pcm->config.channels; channel++) {
+            // The most significant bytes of the 32 bit level, little endian
+            for (int byte = 0; byte < sampleBytes; byte++) {
+                *sample++ = (level >> (8 * (4 - sampleBytes + byte))) & 0xFF;
+            }
+        }
+    }
+    pcm->framesWritten += frames;
+    return((long) frames);
+}
+
+static int simPcmWait(halPcm *pcm, int timeoutInMillis) {
+    uint64_t now = nowInMicros();
+    uint64_t deadline = timeoutInMillis < 0 ? UINT64_MAX : now + (uint64_t) timeoutInMillis * 1000;
+    uint64_t ready = now;
+
+    deliverEdges(now);
+    if (!pcm->running) {
+        // A stopped capture stream never gets a period, a stopped playback stream has room
+        if (pcm->capture) {
+            advanceTo(deadline);
+            return(0);
+        }
+        return(1);
+    }
+    if (pcm->capture) {
+        if (now > framePlaybackTime(pcm, pcm->framesWritten + pcm->config.bufferFrames)) {
+            pcm->running = 0;
+            return(-EPIPE);
+        }
+        ready = framePlaybackTime(pcm, pcm->framesWritten + pcm->config.periodFrames);
+    }
+    else if (now > framePlaybackTime(pcm, pcm->framesWritten)) {
+        stopSignal(pcm);
+        pcm->running = 0;
+        return(-EPIPE);
+    }
+    else if (pcm->framesWritten + pcm->config.periodFrames > pcm->config.bufferFrames) {
+        ready = framePlaybackTime(pcm, pcm->framesWritten + pcm->config.periodFrames - pcm->config.bufferFrames);
+    }
+    if (ready > deadline) {
+        advanceTo(deadline);
+        return(0);
+    }
+    if (ready > now) {
+        advanceTo(ready);
+    }
+    return(1);
+}
+
+// ####
+// #### ENTRY POINTS ####
+
+// Every hal function runs under simLock, so threads see the edges and PCM devices consistently
+
+int halConfigureSampling(unsigned int micros) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simConfigureSampling(micros);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halInitialise(void) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simInitialise();
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+void halTerminate(void) {
+    pthread_mutex_lock(&simLock);
+    simTerminate();
+    pthread_mutex_unlock(&simLock);
+}
+
+int halSetMode(unsigned int gpio, unsigned int mode) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simSetMode(gpio, mode);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halRead(unsigned int gpio) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simRead(gpio);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halWrite(unsigned int gpio, unsigned int level) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simWrite(gpio, level);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halSetAlertFunc(unsigned int gpio, halAlertFunc function) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simSetAlertFunc(gpio, function);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halGlitchFilter(unsigned int gpio, unsigned int steadyMicros) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simGlitchFilter(gpio, steadyMicros);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halNoiseFilter(unsigned int gpio, unsigned int steadyMicros, unsigned int activeMicros) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simNoiseFilter(gpio, steadyMicros, activeMicros);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+uint32_t halTick(void) {
+    uint32_t result;
+
+    // Alert functions may read the tick like with pigpio, simLock is already held then
+    if (deliveringEdges) {
+        return((uint32_t) (tickStart + nowInMicros()));
+    }
+    pthread_mutex_lock(&simLock);
+    result = simTick();
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+void halSleep(double seconds) {
+    pthread_mutex_lock(&simLock);
+    simSleep(seconds);
+    pthread_mutex_unlock(&simLock);
+}
+
+int halTime(int *seconds, int *micros) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simTime(seconds, micros);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPulseTrainSend(unsigned int gpio, const halPulse *pulses, int count, uint32_t durationInMicros) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPulseTrainSend(gpio, pulses, count, durationInMicros);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPulseTrainBusy(void) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPulseTrainBusy();
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmOpen(halPcm **pcm, const char *deviceName) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmOpen(pcm, deviceName);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmGetCapabilities(halPcm *pcm, halPcmCapabilities *capabilities) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmGetCapabilities(pcm, capabilities);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmConfigure(halPcm *pcm, halPcmConfig *config) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmConfigure(pcm, config);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+long halPcmWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    long result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmWrite(pcm, buffer, frames);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+long halPcmMmapWrite(halPcm *pcm, const void *buffer, unsigned long frames) {
+    long result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmMmapWrite(pcm, buffer, frames);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmDelay(halPcm *pcm, long *frames) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmDelay(pcm, frames);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmGetTimestamp(halPcm *pcm, halPcmTimestamp *timestamp) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmGetTimestamp(pcm, timestamp);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmPrepare(halPcm *pcm) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmPrepare(pcm);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmDrain(halPcm *pcm) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmDrain(pcm);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmClose(halPcm *pcm) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmClose(pcm);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmOpenCapture(halPcm **pcm, const char *deviceName) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmOpenCapture(pcm, deviceName);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+long halPcmRead(halPcm *pcm, void *buffer, unsigned long frames) {
+    long result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmRead(pcm, buffer, frames);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
+
+int halPcmWait(halPcm *pcm, int timeoutInMillis) {
+    int result;
+
+    pthread_mutex_lock(&simLock);
+    result = simPcmWait(pcm, timeoutInMillis);
+    pthread_mutex_unlock(&simLock);
+    return(result);
+}
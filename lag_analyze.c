@@ -0,0 +1,755 @@
+/*
+Offline analysis of the measurements CSVs and binary result files (.lag) of audio_lag_module.
+
+All files below the given paths are memory-mapped and parsed by one thread per CPU. The pulses are
+grouped by device, direction (DUT_INPUT to DUT_OUTPUT) and configuration (BUFFER_SIZE, SAMPLE_RATE,
+CHANNELS). Rows with -1 are lost pulses. For every group the percentiles, a histogram and the drift
+over the session are printed, and the devices measured with the same direction and configuration
+are compared with each other.
+
+The device is the label in front of the direction in the file name, like focusrite_cm4io in
+focusrite_cm4io_usb-to-line_..., and the card of --all-devices files. Copies of the same file,
+like the ones the udev rule puts on USB sticks, are counted once.
+*/
+
+#define _GNU_SOURCE
+#include "results.h"
+#include "stats.h"
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define MAX_COLUMNS 16
+#define MAX_THREADS 64
+#define DRIFT_SEGMENTS 10 // The session is split into this many parts of equal pulse count
+#define DEFAULT_HISTOGRAM_BINS 20
+#define HISTOGRAM_WIDTH 50 // Characters of the longest bar
+#define HISTOGRAM_LOW_PERCENTILE 0.1 // The histogram covers this range, the rest is in the outer bins
+#define HISTOGRAM_HIGH_PERCENTILE 99.9
+#define CSV_SUFFIX ".csv"
+#define SUMMARY_SUFFIX "_summary.csv"
+#define NO_DEVICE "-"
+
+typedef struct {
+    char device[64];
+    char dutInput[16];
+    char dutOutput[16];
+    int bufferSize;
+    int sampleRate;
+    int channels;
+} groupKey;
+
+typedef struct {
+    groupKey key;
+    latencyStats stats;
+    long pulses; /* Including the lost ones */
+    long files;
+    double segmentSums[DRIFT_SEGMENTS];
+    long segmentCounts[DRIFT_SEGMENTS];
+    double slopeNumerator; /* Least squares of latency over pulse index, within each file */
+    double slopeDenominator;
+    long currentFile; /* Sums of the file that is parsed right now */
+    long fileCount;
+    double fileSumX, fileSumY, fileSumXX, fileSumXY;
+} analysisGroup;
+
+typedef struct {
+    analysisGroup **groups;
+    int count;
+    int capacity;
+    analysisGroup *lastGroup; /* Most rows belong to the group of the row before */
+} groupTable;
+
+typedef struct {
+    char *path;
+    off_t size;
+} inputFile;
+
+typedef struct {
+    pthread_t thread;
+    groupTable groups;
+    long csvFiles;
+    long resultFiles;
+    long skippedFiles; /* No measurements, like the summaries */
+    long unreadableFiles;
+    long validRows;
+    long lostRows;
+} analysisThread;
+
+inputFile *inputFiles;
+long inputFileCount, inputFileCapacity;
+atomic_long nextInputFile;
+
+// ####
+// #### GROUPS ####
+
+void finishGroupFile(analysisGroup *group) {
+    if (group->fileCount >= 2) {
+        group->slopeNumerator += group->fileSumXY - group->fileSumX * group->fileSumY / group->fileCount;
+        group->slopeDenominator += group->fileSumXX - group->fileSumX * group->fileSumX / group->fileCount;
+    }
+    group->fileCount = 0;
+    group->fileSumX = 0;
+    group->fileSumY = 0;
+    group->fileSumXX = 0;
+    group->fileSumXY = 0;
+}
+
+analysisGroup *findGroup(groupTable *table, const groupKey *key, long fileIndex) {
+    analysisGroup *group = table->lastGroup;
+
+    if (group == NULL || memcmp(&group->key, key, sizeof(groupKey)) != 0) {
+        group = NULL;
+        for (int i = 0; i < table->count && group == NULL; i++) {
+            if (memcmp(&table->groups[i]->key, key, sizeof(groupKey)) == 0) {
+                group = table->groups[i];
+            }
+        }
+    }
+    if (group == NULL) {
+        if (table->count == table->capacity) {
+            table->capacity = table->capacity > 0 ? table->capacity * 2 : 16;
+            table->groups = (analysisGroup **) realloc(table->groups, table->capacity * sizeof(analysisGroup *));
+        }
+        group = (analysisGroup *) calloc(1, sizeof(analysisGroup));
+        if (table->groups == NULL || group == NULL) {
+            fprintf(stderr, "lag_analyze.c l.123: Out of memory\n");
+            exit(1);
+        }
+        group->key = *key;
+        initLatencyStats(&group->stats);
+        group->currentFile = -1;
+        table->groups[table->count] = group;
+        table->count += 1;
+    }
+    // The jitter and the drift are only computed within a file
+    if (group->currentFile != fileIndex) {
+        finishGroupFile(group);
+        group->currentFile = fileIndex;
+        group->files += 1;
+        group->stats.last = -1;
+    }
+    table->lastGroup = group;
+    return(group);
+}
+
+// pulse counts from 0 in a session of sessionPulses pulses
+void addPulse(analysisGroup *group, long pulse, long sessionPulses, int latencyInMicros) {
+    int segment;
+
+    addLatency(&group->stats, latencyInMicros);
+    segment = sessionPulses > 0 ? (int) (pulse * DRIFT_SEGMENTS / sessionPulses) : 0;
+    if (segment < 0) {
+        segment = 0;
+    }
+    else if (segment >= DRIFT_SEGMENTS) {
+        segment = DRIFT_SEGMENTS - 1;
+    }
+    group->segmentSums[segment] += latencyInMicros;
+    group->segmentCounts[segment] += 1;
+    group->fileCount += 1;
+    group->fileSumX += pulse;
+    group->fileSumY += latencyInMicros;
+    group->fileSumXX += (double) pulse * pulse;
+    group->fileSumXY += (double) pulse * latencyInMicros;
+}
+
+void mergeGroup(analysisGroup *group, const analysisGroup *other) {
+    mergeLatencyStats(&group->stats, &other->stats);
+    group->pulses += other->pulses;
+    group->files += other->files;
+    for (int segment = 0; segment < DRIFT_SEGMENTS; segment++) {
+        group->segmentSums[segment] += other->segmentSums[segment];
+        group->segmentCounts[segment] += other->segmentCounts[segment];
+    }
+    group->slopeNumerator += other->slopeNumerator;
+    group->slopeDenominator += other->slopeDenominator;
+}
+
+// Microseconds per 1000 pulses, 0 if unknown
+double getDriftSlope(const analysisGroup *group) {
+    return(group->slopeDenominator > 0 ? 1000.0 * group->slopeNumerator / group->slopeDenominator : 0.0);
+}
+
+// ####
+// #### FILES ####
+
+int hasSuffix(const char *text, const char *suffix) {
+    size_t length = strlen(text), suffixLength = strlen(suffix);
+
+    return(length >= suffixLength && strcmp(text + length - suffixLength, suffix) == 0);
+}
+
+void addInputFile(const char *path, off_t size) {
+    if (!hasSuffix(path, RESULT_FILE_SUFFIX) && (!hasSuffix(path, CSV_SUFFIX) || hasSuffix(path, SUMMARY_SUFFIX))) {
+        return;
+    }
+    if (inputFileCount == inputFileCapacity) {
+        inputFileCapacity = inputFileCapacity > 0 ? inputFileCapacity * 2 : 256;
+        inputFiles = (inputFile *) realloc(inputFiles, inputFileCapacity * sizeof(inputFile));
+        if (inputFiles == NULL) {
+            fprintf(stderr, "lag_analyze.c l.198: Out of memory\n");
+            exit(1);
+        }
+    }
+    inputFiles[inputFileCount].path = strdup(path);
+    inputFiles[inputFileCount].size = size;
+    inputFileCount += 1;
+}
+
+int onDirectoryEntry(const char *path, const struct stat *status, int type, struct FTW *position) {
+    if (type == FTW_F) {
+        addInputFile(path, status->st_size);
+    }
+    return(0);
+}
+
+const char *getBaseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return(slash != NULL ? slash + 1 : path);
+}
+
+int compareInputFiles(const void *a, const void *b) {
+    const inputFile *fileA = (const inputFile *) a;
+    const inputFile *fileB = (const inputFile *) b;
+    int order = strcmp(getBaseName(fileA->path), getBaseName(fileB->path));
+
+    if (order != 0) {
+        return(order);
+    }
+    if (fileA->size != fileB->size) {
+        return(fileA->size < fileB->size ? -1 : 1);
+    }
+    return(strcmp(fileA->path, fileB->path));
+}
+
+// A session is copied with the same name and size, the first copy is kept. Returns the copies removed.
+long removeCopies() {
+    long kept = 0;
+
+    qsort(inputFiles, inputFileCount, sizeof(inputFile), compareInputFiles);
+    for (long i = 0; i < inputFileCount; i++) {
+        if (kept > 0
+            && inputFiles[kept - 1].size == inputFiles[i].size
+            && strcmp(getBaseName(inputFiles[kept - 1].path), getBaseName(inputFiles[i].path)) == 0) {
+            free(inputFiles[i].path);
+            continue;
+        }
+        inputFiles[kept] = inputFiles[i];
+        kept += 1;
+    }
+    kept = inputFileCount - kept;
+    inputFileCount -= kept;
+    return(kept);
+}
+
+// Device label of the file name: the text in front of the direction and the card of --all-devices files
+void getDeviceLabel(const char *path, char *device, size_t size) {
+    static const char *directions[] = {"line-to-line_", "usb-to-line_", "hdmi-to-line_", "line-to-usb_", "usb-to-usb_"};
+    static const char *cards[] = {"usb_audio_top2_", "usb_audio_bot2_", "usb_audio_top_", "usb_audio_bot_"};
+    const char *name = getBaseName(path), *direction = NULL, *card = NULL;
+    size_t labelLength = 0, cardLength = 0;
+
+    for (size_t i = 0; i < sizeof(directions) / sizeof(directions[0]) && direction == NULL; i++) {
+        direction = strstr(name, directions[i]);
+        if (direction != NULL) {
+            labelLength = direction - name;
+            direction += strlen(directions[i]);
+        }
+    }
+    if (strncmp(name, "soak_", 5) == 0 || strncmp(name, "sweep_", 6) == 0) {
+        name = strchr(name, '_') + 1;
+        labelLength = labelLength > (size_t) (name - getBaseName(path)) ? labelLength - (name - getBaseName(path)) : 0;
+    }
+    // The separator in front of the direction
+    if (labelLength > 0) {
+        labelLength -= 1;
+    }
+    for (size_t i = 0; direction != NULL && i < sizeof(cards) / sizeof(cards[0]) && card == NULL; i++) {
+        if (strncmp(direction, cards[i], strlen(cards[i])) == 0) {
+            card = direction;
+            cardLength = strlen(cards[i]) - 1;
+        }
+    }
+    if (labelLength == 0 && card == NULL) {
+        snprintf(device, size, "%s", NO_DEVICE);
+    }
+    else if (card == NULL) {
+        snprintf(device, size, "%.*s", (int) labelLength, name);
+    }
+    else if (labelLength == 0) {
+        snprintf(device, size, "%.*s", (int) cardLength, card);
+    }
+    else {
+        snprintf(device, size, "%.*s/%.*s", (int) labelLength, name, (int) cardLength, card);
+    }
+}
+
+// Fields of one CSV line, not terminated
+typedef struct {
+    const char *start[MAX_COLUMNS];
+    int length[MAX_COLUMNS];
+    int count;
+} csvFields;
+
+// Splits the line at data, returns the start of the next line
+const char *splitCsvLine(const char *data, const char *end, csvFields *fields) {
+    const char *fieldStart = data;
+
+    fields->count = 0;
+    while (data < end && *data != '\n') {
+        if (*data == ',') {
+            if (fields->count < MAX_COLUMNS) {
+                fields->start[fields->count] = fieldStart;
+                fields->length[fields->count] = data - fieldStart;
+                fields->count += 1;
+            }
+            fieldStart = data + 1;
+        }
+        data++;
+    }
+    if (fields->count < MAX_COLUMNS) {
+        fields->start[fields->count] = fieldStart;
+        // Line breaks of windows
+        fields->length[fields->count] = data - fieldStart - (data > fieldStart && data[-1] == '\r');
+        fields->count += 1;
+    }
+    return(data < end ? data + 1 : end);
+}
+
+int getColumn(const csvFields *header, const char *name) {
+    for (int column = 0; column < header->count; column++) {
+        if (header->length[column] == (int) strlen(name) && strncmp(header->start[column], name, header->length[column]) == 0) {
+            return(column);
+        }
+    }
+    return(-1);
+}
+
+// Parses a decimal integer, returns 0 if the field is no integer
+int parseField(const csvFields *fields, int column, long *value) {
+    const char *digit;
+    int negative;
+
+    if (column < 0 || column >= fields->count || fields->length[column] == 0) {
+        return(0);
+    }
+    digit = fields->start[column];
+    negative = *digit == '-';
+    digit += negative;
+    *value = 0;
+    if (digit == fields->start[column] + fields->length[column]) {
+        return(0);
+    }
+    for (; digit < fields->start[column] + fields->length[column]; digit++) {
+        if (*digit < '0' || *digit > '9') {
+            return(0);
+        }
+        *value = *value * 10 + (*digit - '0');
+    }
+    if (negative) {
+        *value = -*value;
+    }
+    return(1);
+}
+
+void copyField(const csvFields *fields, int column, char *text, size_t size) {
+    if (column < 0 || column >= fields->count) {
+        text[0] = '\0';
+        return;
+    }
+    snprintf(text, size, "%.*s", fields->length[column], fields->start[column]);
+}
+
+// Returns the file mapped into memory or NULL
+const char *mapFile(const char *path, size_t *size) {
+    struct stat status;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return(NULL);
+    }
+    if (fstat(fd, &status) < 0 || status.st_size == 0) {
+        close(fd);
+        return(NULL);
+    }
+    *size = status.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return(NULL);
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);
+    return((const char *) map);
+}
+
+void analyseCsvFile(analysisThread *thread, long fileIndex, const char *path) {
+    const char *data, *end, *line;
+    csvFields fields;
+    groupKey key;
+    analysisGroup *group;
+    size_t size;
+    long rows = 0, row = 0, latency, pulse, value;
+    int latencyColumn, pulseColumn, inputColumn, outputColumn, bufferColumn, rateColumn, channelsColumn;
+
+    data = mapFile(path, &size);
+    if (data == NULL) {
+        thread->unreadableFiles += 1;
+        return;
+    }
+    end = data + size;
+    line = splitCsvLine(data, end, &fields);
+    latencyColumn = getColumn(&fields, "LATENCY_IN_MICROS");
+    pulseColumn = getColumn(&fields, "PULSE");
+    inputColumn = getColumn(&fields, "DUT_INPUT");
+    outputColumn = getColumn(&fields, "DUT_OUTPUT");
+    bufferColumn = getColumn(&fields, "BUFFER_SIZE");
+    rateColumn = getColumn(&fields, "SAMPLE_RATE");
+    channelsColumn = getColumn(&fields, "CHANNELS");
+    if (latencyColumn < 0) {
+        thread->skippedFiles += 1;
+        munmap((void *) data, size);
+        return;
+    }
+    thread->csvFiles += 1;
+    // The session length places the pulses in the drift segments
+    for (const char *next = line; next < end && (next = memchr(next, '\n', end - next)) != NULL; next++) {
+        rows += 1;
+    }
+    if (size > 0 && end[-1] != '\n') {
+        rows += 1;
+    }
+    memset(&key, 0, sizeof(groupKey));
+    getDeviceLabel(path, key.device, sizeof(key.device));
+    while (line < end) {
+        line = splitCsvLine(line, end, &fields);
+        if (!parseField(&fields, latencyColumn, &latency)) {
+            continue;
+        }
+        copyField(&fields, inputColumn, key.dutInput, sizeof(key.dutInput));
+        copyField(&fields, outputColumn, key.dutOutput, sizeof(key.dutOutput));
+        key.bufferSize = parseField(&fields, bufferColumn, &value) ? (int) value : 0;
+        key.sampleRate = parseField(&fields, rateColumn, &value) ? (int) value : 0;
+        key.channels = parseField(&fields, channelsColumn, &value) ? (int) value : 0;
+        group = findGroup(&thread->groups, &key, fileIndex);
+        group->pulses += 1;
+        if (!parseField(&fields, pulseColumn, &pulse)) {
+            pulse = row;
+        }
+        row += 1;
+        // -1 marks a lost pulse
+        if (latency < 0) {
+            thread->lostRows += 1;
+            continue;
+        }
+        thread->validRows += 1;
+        addPulse(group, pulse, rows, (int) latency);
+    }
+    munmap((void *) data, size);
+}
+
+void analyseResultFile(analysisThread *thread, long fileIndex, const char *path) {
+    resultFile file;
+    const resultHeader *header;
+    const resultRecord *record;
+    groupKey key;
+    analysisGroup *group;
+    long sessionPulses, valid = 0;
+
+    if (mapResultFile(&file, path) < 0) {
+        thread->unreadableFiles += 1;
+        return;
+    }
+    thread->resultFiles += 1;
+    header = file.header;
+    memset(&key, 0, sizeof(groupKey));
+    getDeviceLabel(path, key.device, sizeof(key.device));
+    setResultText(key.dutInput, sizeof(key.dutInput), header->dutInput);
+    setResultText(key.dutOutput, sizeof(key.dutOutput), header->dutOutput);
+    key.bufferSize = header->periodFrames * header->bytesPerFrame;
+    key.sampleRate = header->sampleRate;
+    key.channels = header->channels;
+    group = findGroup(&thread->groups, &key, fileIndex);
+    // The pulse count of a session that did not finish is known up to its last record
+    sessionPulses = header->finished ? (long) header->pulses
+                    : file.count > 0 ? (long) getResultRecord(&file, file.count - 1)->pulse + 1 : 0;
+    for (long i = 0; i < file.count; i++) {
+        record = getResultRecord(&file, i);
+        if (!isValidResult(record)) {
+            continue;
+        }
+        addPulse(group, record->pulse, sessionPulses, getResultLatencyInMicros(header, record));
+        valid += 1;
+    }
+    group->pulses += sessionPulses > valid ? sessionPulses : valid;
+    thread->validRows += valid;
+    thread->lostRows += sessionPulses > valid ? sessionPulses - valid : 0;
+    unmapResultFile(&file);
+}
+
+void *runAnalysisThread(void *argument) {
+    analysisThread *thread = (analysisThread *) argument;
+    long fileIndex;
+
+    while ((fileIndex = atomic_fetch_add(&nextInputFile, 1)) < inputFileCount) {
+        if (hasSuffix(inputFiles[fileIndex].path, RESULT_FILE_SUFFIX)) {
+            analyseResultFile(thread, fileIndex, inputFiles[fileIndex].path);
+        }
+        else {
+            analyseCsvFile(thread, fileIndex, inputFiles[fileIndex].path);
+        }
+    }
+    for (int i = 0; i < thread->groups.count; i++) {
+        finishGroupFile(thread->groups.groups[i]);
+    }
+    return(NULL);
+}
+
+// ####
+// #### REPORT ####
+
+// Same direction and configuration, the devices are compared within
+int compareSetup(const groupKey *a, const groupKey *b) {
+    int order = strcmp(a->dutInput, b->dutInput);
+
+    if (order == 0) {
+        order = strcmp(a->dutOutput, b->dutOutput);
+    }
+    if (order == 0) {
+        order = a->sampleRate - b->sampleRate;
+    }
+    if (order == 0) {
+        order = a->bufferSize - b->bufferSize;
+    }
+    if (order == 0) {
+        order = a->channels - b->channels;
+    }
+    return(order);
+}
+
+int compareGroups(const void *a, const void *b) {
+    const analysisGroup *groupA = *(analysisGroup * const *) a;
+    const analysisGroup *groupB = *(analysisGroup * const *) b;
+    int order = compareSetup(&groupA->key, &groupB->key);
+
+    if (order == 0) {
+        order = getLatencyPercentile(&groupA->stats, 50.0) - getLatencyPercentile(&groupB->stats, 50.0);
+    }
+    if (order == 0) {
+        order = strcmp(groupA->key.device, groupB->key.device);
+    }
+    return(order);
+}
+
+void printGroupTable(analysisGroup **groups, int count) {
+    int best = 0;
+
+    printf("%-24s %-20s %6s %6s %3s %6s %8s %8s %7s %8s %7s %7s %7s %7s %7s %7s %9s %9s\n",
+           "DEVICE", "DIRECTION", "BUFFER", "RATE", "CH", "FILES", "PULSES", "VALID", "LOSS %",
+           "MEAN us", "SD us", "P50 us", "P90 us", "P99 us", "MAX us", "JIT us", "DRIFT/1k", "VS BEST");
+    for (int i = 0; i < count; i++) {
+        const analysisGroup *group = groups[i];
+        const latencyStats *stats = &group->stats;
+        char direction[64], comparison[32];
+
+        // The first group of a setup has the lowest median
+        if (i == 0 || compareSetup(&groups[i - 1]->key, &group->key) != 0) {
+            best = i;
+            printf("\n");
+        }
+        snprintf(direction, sizeof(direction), "%s > %s", group->key.dutInput, group->key.dutOutput);
+        if (best == i || stats->count == 0) {
+            snprintf(comparison, sizeof(comparison), "%s", best == i ? "best" : "-");
+        }
+        else {
+            snprintf(comparison, sizeof(comparison), "+%d us", getLatencyPercentile(stats, 50.0) - getLatencyPercentile(&groups[best]->stats, 50.0));
+        }
+        printf("%-24s %-20s %6d %6d %3d %6ld %8ld %8ld %7.2f %8.1f %7.1f %7d %7d %7d %7d %7.1f %+9.2f %9s\n",
+               group->key.device, direction, group->key.bufferSize, group->key.sampleRate, group->key.channels,
+               group->files, group->pulses, stats->count,
+               group->pulses > 0 ? 100.0 * (group->pulses - stats->count) / group->pulses : 0.0,
+               stats->mean, getLatencyStandardDeviation(stats),
+               getLatencyPercentile(stats, 50.0), getLatencyPercentile(stats, 90.0), getLatencyPercentile(stats, 99.0),
+               stats->max, stats->jitterMean, getDriftSlope(group), comparison);
+    }
+}
+
+void printGroupDetails(const analysisGroup *group, int bins) {
+    const latencyStats *stats = &group->stats;
+    long counts[bins], maxCount = 0;
+    int low, high;
+    double width;
+
+    printf("\n%s, %s > %s, %d B, %d Hz, %d ch: %ld valid of %ld pulses in %ld files\n",
+           group->key.device, group->key.dutInput, group->key.dutOutput,
+           group->key.bufferSize, group->key.sampleRate, group->key.channels,
+           stats->count, group->pulses, group->files);
+    if (stats->count == 0) {
+        return;
+    }
+    printf("  Percentiles: p0.1 %d, p1 %d, p10 %d, p50 %d, p90 %d, p99 %d, p99.9 %d us\n",
+           getLatencyPercentile(stats, 0.1), getLatencyPercentile(stats, 1.0), getLatencyPercentile(stats, 10.0),
+           getLatencyPercentile(stats, 50.0), getLatencyPercentile(stats, 90.0), getLatencyPercentile(stats, 99.0),
+           getLatencyPercentile(stats, 99.9));
+    low = getLatencyPercentile(stats, HISTOGRAM_LOW_PERCENTILE);
+    high = getLatencyPercentile(stats, HISTOGRAM_HIGH_PERCENTILE);
+    if (high - low + 1 < bins) {
+        bins = high - low + 1;
+    }
+    getLatencyHistogram(stats, low, high, bins, counts);
+    for (int bin = 0; bin < bins; bin++) {
+        if (counts[bin] > maxCount) {
+            maxCount = counts[bin];
+        }
+    }
+    width = (double) (high - low + 1) / bins;
+    for (int bin = 0; bin < bins; bin++) {
+        printf("  %7.0f us |%-*.*s %ld\n",
+               low + bin * width, HISTOGRAM_WIDTH,
+               (int) ((counts[bin] * HISTOGRAM_WIDTH + maxCount - 1) / maxCount),
+               "##################################################",
+               counts[bin]);
+    }
+    printf("  Drift (mean per tenth of the session):");
+    for (int segment = 0; segment < DRIFT_SEGMENTS; segment++) {
+        if (group->segmentCounts[segment] > 0) {
+            printf(" %.0f", group->segmentSums[segment] / group->segmentCounts[segment]);
+        }
+        else {
+            printf(" -");
+        }
+    }
+    printf(" us, slope %+.2f us per 1000 pulses\n", getDriftSlope(group));
+}
+
+// ####
+// #### COMMAND LINE ####
+
+void printUsage(const char *programName) {
+    printf("Usage: %s [options] PATH...\n", programName);
+    printf("Analyses all measurement CSVs and %s files in the PATHs and the directories below them.\n", RESULT_FILE_SUFFIX);
+    printf("  -s, --summary      Only print the table of all groups\n");
+    printf("  -b, --bins BINS    Histogram bins per group (default %d)\n", DEFAULT_HISTOGRAM_BINS);
+    printf("  -j, --threads N    Parse with N threads (default one per CPU)\n");
+    printf("  -h, --help         Show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option longOptions[] = {
+        {"summary", no_argument, NULL, 's'},
+        {"bins", required_argument, NULL, 'b'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    static analysisThread threads[MAX_THREADS];
+    groupTable groups = {NULL, 0, 0, NULL};
+    struct timespec start, end;
+    struct stat status;
+    long copies, csvFiles = 0, resultFiles = 0, skippedFiles = 0, unreadableFiles = 0, validRows = 0, lostRows = 0;
+    int option, summaryOnly = 0, bins = DEFAULT_HISTOGRAM_BINS, threadCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    analysisGroup *group;
+
+    while ((option = getopt_long(argc, argv, "sb:j:h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 's':
+                summaryOnly = 1;
+                break;
+            case 'b':
+                bins = atoi(optarg);
+                if (bins <= 0 || bins > 1000) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'j':
+                threadCount = atoi(optarg);
+                if (threadCount <= 0) {
+                    printUsage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'h':
+                printUsage(argv[0]);
+                return(0);
+            default:
+                printUsage(argv[0]);
+                return(1);
+        }
+    }
+    if (optind == argc) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    if (threadCount > MAX_THREADS) {
+        threadCount = MAX_THREADS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = optind; i < argc; i++) {
+        if (stat(argv[i], &status) < 0) {
+            fprintf(stderr, "lag_analyze.c l.700: Unable to read %s\n", argv[i]);
+        }
+        else if (S_ISDIR(status.st_mode)) {
+            nftw(argv[i], onDirectoryEntry, 32, FTW_PHYS);
+        }
+        else {
+            addInputFile(argv[i], status.st_size);
+        }
+    }
+    copies = removeCopies();
+    if (threadCount > inputFileCount) {
+        threadCount = inputFileCount > 0 ? inputFileCount : 1;
+    }
+
+    atomic_store(&nextInputFile, 0);
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i].thread, NULL, runAnalysisThread, &threads[i]) != 0) {
+            fprintf(stderr, "lag_analyze.c l.717: Unable to start thread %d\n", i);
+            return(1);
+        }
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i].thread, NULL);
+        csvFiles += threads[i].csvFiles;
+        resultFiles += threads[i].resultFiles;
+        skippedFiles += threads[i].skippedFiles;
+        unreadableFiles += threads[i].unreadableFiles;
+        validRows += threads[i].validRows;
+        lostRows += threads[i].lostRows;
+        // Every thread has its own groups, they are added up in the order of the threads
+        for (int j = 0; j < threads[i].groups.count; j++) {
+            // -1 is the file index of the merged groups, so findGroup counts no file
+            group = findGroup(&groups, &threads[i].groups.groups[j]->key, -1);
+            mergeGroup(group, threads[i].groups.groups[j]);
+            free(threads[i].groups.groups[j]);
+        }
+        free(threads[i].groups.groups);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%ld CSV and %ld result files (%ld copies, %ld without measurements, %ld unreadable) in %.3f s with %d threads\n",
+           csvFiles, resultFiles, copies, skippedFiles, unreadableFiles,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, threadCount);
+    printf("%ld valid and %ld lost pulses in %d groups\n", validRows, lostRows, groups.count);
+    if (groups.count == 0) {
+        return(0);
+    }
+    qsort(groups.groups, groups.count, sizeof(analysisGroup *), compareGroups);
+    printGroupTable(groups.groups, groups.count);
+    if (!summaryOnly) {
+        for (int i = 0; i < groups.count; i++) {
+            printGroupDetails(groups.groups[i], bins);
+        }
+    }
+    return(0);
+}
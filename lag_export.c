@@ -0,0 +1,238 @@
+/*
+Exports a binary result file (.lag) of audio_lag_module as CSV or JSON to stdout.
+
+The CSV has the columns of the measurements CSV, without the rows of the lost pulses,
+and the pulse index and send time in front. --rejected adds the rejected and lost pulses and the
+spurious edges, their FLAGS tell them apart. The JSON holds the header and all records.
+A trace file (.lagtrace) is exported as CSV with one row per event.
+*/
+
+#include "results.h"
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CSV_HEADER "PULSE,LATENCY_IN_MICROS,DUT_INPUT,DUT_OUTPUT,BUFFER_SIZE,SAMPLE_RATE,CHANNELS,START_SKEW_IN_MICROS,SEND_TIME_IN_MICROS,FLAGS\n"
+#define TRACE_CSV_HEADER "EVENT,TICK,TIME_IN_MICROS,GPIO,LEVEL,PULSE,CODE,VALUE\n"
+
+void printUsage(const char *programName) {
+    printf("Usage: %s [options] FILE.lag|FILE.lagtrace\n", programName);
+    printf("  -j, --json       Export the header and all records as JSON instead of CSV\n");
+    printf("  -r, --rejected   Also export the rejected and lost pulses and the spurious edges\n");
+    printf("  -h, --help       Show this help\n");
+}
+
+// Text fields of the header as JSON string, they are not terminated if they fill their field
+void printJsonString(const char *text, size_t size) {
+    putchar('"');
+    for (size_t i = 0; i < size && text[i] != '\0'; i++) {
+        if (text[i] == '"' || text[i] == '\\') {
+            printf("\\%c", text[i]);
+        }
+        else if ((unsigned char) text[i] < 0x20) {
+            printf("\\u%04x", text[i]);
+        }
+        else {
+            putchar(text[i]);
+        }
+    }
+    putchar('"');
+}
+
+void printJsonField(const char *name, const char *text, size_t size) {
+    printf("  \"%s\": ", name);
+    printJsonString(text, size);
+    printf(",\n");
+}
+
+void exportCsv(const resultFile *file, int withRejected) {
+    const resultHeader *header = file->header;
+    const resultRecord *record;
+    resultTimebase timebase;
+    int64_t sendTimeInMicros;
+
+    initResultTimebase(&timebase, header);
+    printf(CSV_HEADER);
+    for (long i = 0; i < file->count; i++) {
+        record = getResultRecord(file, i);
+        sendTimeInMicros = getResultTimeInMicros(&timebase, record->sendTick);
+        if (!isValidResult(record) && !withRejected) {
+            continue;
+        }
+        printf("%" PRIu32 ",%" PRId32 ",%.*s,%.*s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%d,%" PRId64 ",%u\n",
+               record->pulse,
+               getResultLatencyInMicros(header, record),
+               (int) sizeof(header->dutInput), header->dutInput,
+               (int) sizeof(header->dutOutput), header->dutOutput,
+               header->periodFrames * header->bytesPerFrame,
+               header->sampleRate,
+               header->channels,
+               record->startSkewInMicros,
+               sendTimeInMicros,
+               record->flags);
+    }
+}
+
+void exportJson(const resultFile *file, int withRejected) {
+    const resultHeader *header = file->header;
+    const resultRecord *record;
+    resultTimebase timebase;
+    int64_t sendTimeInMicros;
+    int first = 1;
+
+    printf("{\n");
+    printf("  \"version\": %" PRIu32 ",\n", header->version);
+    printf("  \"finished\": %s,\n", header->finished ? "true" : "false");
+    printf("  \"pulses\": %" PRIu64 ",\n", header->pulses);
+    printf("  \"startTimeInMicros\": %" PRId64 ",\n", header->startTimeInMicros);
+    printf("  \"startTick\": %" PRIu32 ",\n", header->startTick);
+    printf("  \"tickResolutionInMicros\": %" PRIu32 ",\n", header->tickResolutionInMicros);
+    printJsonField("dutInput", header->dutInput, sizeof(header->dutInput));
+    printJsonField("dutOutput", header->dutOutput, sizeof(header->dutOutput));
+    printJsonField("device", header->device, sizeof(header->device));
+    printJsonField("captureDevice", header->captureDevice, sizeof(header->captureDevice));
+    printJsonField("format", header->format, sizeof(header->format));
+    printJsonField("waveform", header->waveform, sizeof(header->waveform));
+    printf("  \"sampleRate\": %" PRIu32 ",\n", header->sampleRate);
+    printf("  \"channels\": %" PRIu32 ",\n", header->channels);
+    printf("  \"bytesPerFrame\": %" PRIu32 ",\n", header->bytesPerFrame);
+    printf("  \"periodFrames\": %" PRIu32 ",\n", header->periodFrames);
+    printf("  \"bufferFrames\": %" PRIu32 ",\n", header->bufferFrames);
+    printf("  \"pipelineDepth\": %" PRIu32 ",\n", header->pipelineDepth);
+    printf("  \"persistentStream\": %s,\n", header->options & RESULT_OPTION_PERSISTENT_STREAM ? "true" : "false");
+    printf("  \"hwTimestamps\": %s,\n", header->options & RESULT_OPTION_HW_TIMESTAMPS ? "true" : "false");
+    printf("  \"mmap\": %s,\n", header->options & RESULT_OPTION_MMAP ? "true" : "false");
+    printf("  \"dmaPulses\": %s,\n", header->options & RESULT_OPTION_DMA_PULSES ? "true" : "false");
+    printf("  \"realtime\": %s,\n", header->options & RESULT_OPTION_REALTIME ? "true" : "false");
+    printf("  \"soak\": %s,\n", header->options & RESULT_OPTION_SOAK ? "true" : "false");
+    printf("  \"rigOffsetInMicros\": %" PRId32 ",\n", header->rigOffsetInMicros);
+    printf("  \"rigOffsetSubtracted\": %s,\n", header->options & RESULT_OPTION_RIG_OFFSET ? "true" : "false");
+    printf("  \"glitchFilterInMicros\": %" PRIu32 ",\n", header->glitchFilterInMicros);
+    printf("  \"noiseFilterInMicros\": %" PRIu32 ",\n", header->noiseFilterInMicros);
+    printf("  \"minPulseWidthInMicros\": %" PRId32 ",\n", header->minPulseWidthInMicros);
+    printf("  \"acceptanceSigmas\": %.2f,\n", header->acceptanceSigmas);
+    printf("  \"calibrationPulses\": %" PRIu32 ",\n", header->calibrationPulses);
+    printf("  \"calibrationDetectionRate\": %.3f,\n", header->calibrationDetectionRate);
+    printf("  \"calibrationSpreadInMicros\": %.1f,\n", header->calibrationSpreadInMicros);
+    printf("  \"calibrationDoubleTriggers\": %" PRIu32 ",\n", header->calibrationDoubleTriggers);
+    printf("  \"calibrationLatencyInMicros\": %" PRId32 ",\n", header->calibrationLatencyInMicros);
+    printf("  \"calibrationGrade\": %" PRIu32 ",\n", header->calibrationGrade);
+    printf("  \"calibrationAgeInS\": %" PRIu32 ",\n", header->calibrationAgeInS);
+    printJsonField("host", header->host, sizeof(header->host));
+    printJsonField("system", header->system, sizeof(header->system));
+    printf("  \"records\": [");
+    initResultTimebase(&timebase, header);
+    for (long i = 0; i < file->count; i++) {
+        record = getResultRecord(file, i);
+        sendTimeInMicros = getResultTimeInMicros(&timebase, record->sendTick);
+        if (!isValidResult(record) && !withRejected) {
+            continue;
+        }
+        printf("%s\n    {\"pulse\": %" PRIu32 ", \"latencyInMicros\": %" PRId32 ", \"startSkewInMicros\": %d, "
+               "\"sendTimeInMicros\": %" PRId64 ", \"flags\": %u}",
+               first ? "" : ",",
+               record->pulse,
+               getResultLatencyInMicros(header, record),
+               record->startSkewInMicros,
+               sendTimeInMicros,
+               record->flags);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+}
+
+const char *getTraceEventName(unsigned int type) {
+    static const char *names[] = {"UNKNOWN", "EDGE", "PULSE", "SIGNAL_START", "PULSE_WIDTH", "TRAIN_RESET",
+                                  "TRAIN_PULSE", "TRAIN_SENT", "TRAIN_DONE", "EDGES_DROPPED"};
+
+    return(type < sizeof(names) / sizeof(names[0]) ? names[type] : names[0]);
+}
+
+// Only the events with a tick have a time, the others keep the time of the event before
+void exportTraceCsv(const resultFile *file) {
+    const traceRecord *record;
+    resultTimebase timebase;
+    int64_t timeInMicros = 0;
+
+    initResultTimebase(&timebase, file->header);
+    printf(TRACE_CSV_HEADER);
+    for (long i = 0; i < file->count; i++) {
+        record = getTraceRecord(file, i);
+        if (record->type == TRACE_EDGE || record->type == TRACE_SIGNAL_START) {
+            timeInMicros = getResultTimeInMicros(&timebase, record->tick);
+        }
+        printf("%s,%" PRIu32 ",%" PRId64 ",%u,%u,%" PRIu32 ",%u,%" PRId32 "\n",
+               getTraceEventName(record->type),
+               record->tick,
+               timeInMicros,
+               record->gpio,
+               record->level,
+               record->pulse,
+               record->code,
+               record->value);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static struct option longOptions[] = {
+        {"json", no_argument, NULL, 'j'},
+        {"rejected", no_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    resultFile file;
+    int option, json = 0, withRejected = 0, status;
+
+    while ((option = getopt_long(argc, argv, "jrh", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'j':
+                json = 1;
+                break;
+            case 'r':
+                withRejected = 1;
+                break;
+            case 'h':
+                printUsage(argv[0]);
+                return(0);
+            default:
+                printUsage(argv[0]);
+                return(1);
+        }
+    }
+    if (optind != argc - 1) {
+        printUsage(argv[0]);
+        return(1);
+    }
+    status = mapResultFile(&file, argv[optind]);
+    if (status == -EINVAL && mapTraceFile(&file, argv[optind]) == 0) {
+        if (json) {
+            fprintf(stderr, "%s: Traces are only exported as CSV\n", argv[optind]);
+        }
+        if (file.trailingBytes > 0) {
+            fprintf(stderr, "%s: Ignoring %zu bytes of an incomplete event\n", argv[optind], file.trailingBytes);
+        }
+        exportTraceCsv(&file);
+        unmapResultFile(&file);
+        return(0);
+    }
+    if (status < 0) {
+        fprintf(stderr, "lag_export.c l.221: Unable to read %s (%s)\n", argv[optind], strerror(-status));
+        return(1);
+    }
+    if (!file.header->finished) {
+        fprintf(stderr, "%s: The session did not finish, the pulse count is unknown\n", argv[optind]);
+    }
+    if (file.trailingBytes > 0) {
+        fprintf(stderr, "%s: Ignoring %zu bytes of an incomplete record\n", argv[optind], file.trailingBytes);
+    }
+    if (json) {
+        exportJson(&file, withRejected);
+    }
+    else {
+        exportCsv(&file, withRejected);
+    }
+    unmapResultFile(&file);
+    return(0);
+}
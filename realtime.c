@@ -0,0 +1,58 @@
+/*
+Real-time execution profile
+*/
+
+#define _GNU_SOURCE
+#include "realtime.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Touches every page of a stack region, so it is mapped before it is needed
+static void prefaultStack(size_t bytes) {
+    volatile char stack[bytes];
+
+    memset((char *) stack, 0, bytes);
+}
+
+int lockMemory(size_t prefaultStackBytes) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        return(-errno);
+    }
+    if (prefaultStackBytes > 0) {
+        prefaultStack(prefaultStackBytes);
+    }
+    return(0);
+}
+
+int unlockMemory(void) {
+    if (munlockall() != 0) {
+        return(-errno);
+    }
+    return(0);
+}
+
+int setCpuAffinity(int cpu) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    if (cpu >= 0) {
+        CPU_SET(cpu, &cpus);
+    }
+    else {
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &cpus);
+        }
+    }
+    return(-pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus));
+}
+
+int setRealtimePriority(int priority) {
+    struct sched_param parameter;
+
+    memset(&parameter, 0, sizeof(parameter));
+    parameter.sched_priority = priority;
+    return(-pthread_setschedparam(pthread_self(), priority > 0 ? SCHED_FIFO : SCHED_OTHER, &parameter));
+}
@@ -0,0 +1,23 @@
+/*
+Real-time execution profile
+
+Keeps page faults and preemption out of the measured microseconds:
+- Memory is locked and the stack is prefaulted, so no page fault happens while measuring
+- Threads are pinned to a CPU, best one isolated with isolcpus= in /boot/cmdline.txt
+- Threads are scheduled with SCHED_FIFO, so only higher priority real-time threads preempt them
+
+All functions act on the calling thread and return 0 or a negative errno value.
+Threads created afterwards inherit the CPU affinity and the scheduling policy.
+*/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+int lockMemory(size_t prefaultStackBytes);
+int unlockMemory(void);
+int setCpuAffinity(int cpu); /* -1 allows all CPUs */
+int setRealtimePriority(int priority); /* 0 switches back to SCHED_OTHER */
+
+#endif
@@ -0,0 +1,346 @@
+/*
+Binary result files
+*/
+
+#define _GNU_SOURCE
+#include "results.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+void initResultHeader(resultHeader *header, uint32_t startTick, unsigned int tickResolutionInMicros) {
+    struct timespec now;
+    struct utsname system;
+
+    memset(header, 0, sizeof(resultHeader));
+    memcpy(header->magic, RESULT_MAGIC, sizeof(header->magic));
+    header->version = RESULT_VERSION;
+    header->headerSize = sizeof(resultHeader);
+    header->recordSize = sizeof(resultRecord);
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->startTimeInMicros = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    header->startTick = startTick;
+    header->tickResolutionInMicros = tickResolutionInMicros;
+    gethostname(header->host, sizeof(header->host) - 1);
+    if (uname(&system) == 0) {
+        snprintf(header->system, sizeof(header->system), "%.40s %.40s %.40s", system.sysname, system.release, system.machine);
+    }
+}
+
+void initTraceHeader(resultHeader *header, uint32_t startTick, unsigned int tickResolutionInMicros) {
+    initResultHeader(header, startTick, tickResolutionInMicros);
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->recordSize = sizeof(traceRecord);
+}
+
+void setResultText(char *field, size_t size, const char *text) {
+    strncpy(field, text, size - 1);
+    field[size - 1] = '\0';
+}
+
+// Writes all of data at offset, returns 0 or -errno
+static int writeFully(int fd, const void *data, size_t count, off_t offset) {
+    const char *bytes = (const char *) data;
+    ssize_t written;
+
+    while (count > 0) {
+        written = pwrite(fd, bytes, count, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return(-errno);
+        }
+        bytes += written;
+        count -= written;
+        offset += written;
+    }
+    return(0);
+}
+
+// Writes the queued records behind the ones in the file and the header if it changed
+static void writePendingResults(resultWriter *writer) {
+    unsigned int tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&writer->head, memory_order_acquire);
+    unsigned int count;
+    resultHeader header;
+    int headerChanged, status = 0, written = 0;
+
+    while (tail != head && status == 0) {
+        // Up to the end of the ring at once
+        count = head - tail;
+        if (count > RESULT_QUEUE_SIZE - (tail & (RESULT_QUEUE_SIZE - 1))) {
+            count = RESULT_QUEUE_SIZE - (tail & (RESULT_QUEUE_SIZE - 1));
+        }
+        status = writeFully(writer->fd, &writer->records[tail & (RESULT_QUEUE_SIZE - 1)], count * sizeof(resultRecord), writer->size);
+        if (status == 0) {
+            writer->size += count * sizeof(resultRecord);
+        }
+        tail += count;
+        atomic_store_explicit(&writer->tail, tail, memory_order_release);
+        written = 1;
+    }
+    pthread_mutex_lock(&writer->headerLock);
+    headerChanged = writer->headerChanged;
+    if (headerChanged) {
+        header = writer->header;
+        writer->headerChanged = 0;
+    }
+    pthread_mutex_unlock(&writer->headerLock);
+    if (headerChanged && status == 0) {
+        status = writeFully(writer->fd, &header, sizeof(resultHeader), 0);
+        written = 1;
+    }
+    // On the SD card as well, in case the power is cut
+    if (written && status == 0 && fdatasync(writer->fd) < 0) {
+        status = -errno;
+    }
+    if (status < 0 && writer->error == 0) {
+        writer->error = -status;
+    }
+}
+
+static void *runResultWriter(void *argument) {
+    resultWriter *writer = (resultWriter *) argument;
+    struct timespec deadline;
+    int active;
+
+    do {
+        active = atomic_load(&writer->active);
+        writePendingResults(writer);
+        if (active) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) (RESULT_FLUSH_INTERVAL_IN_S * 1000000000.0);
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            sem_timedwait(&writer->wakeup, &deadline);
+        }
+    } while (active);
+    return(NULL);
+}
+
+int openResultWriter(resultWriter *writer, const char *path, const resultHeader *header) {
+    int status;
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        return(-errno);
+    }
+    // A session that crashes right away still has a readable file
+    status = writeFully(writer->fd, header, sizeof(resultHeader), 0);
+    if (status < 0) {
+        close(writer->fd);
+        return(status);
+    }
+    writer->size = sizeof(resultHeader);
+    writer->error = 0;
+    writer->header = *header;
+    writer->headerChanged = 0;
+    atomic_store(&writer->head, 0);
+    atomic_store(&writer->tail, 0);
+    atomic_store(&writer->dropped, 0);
+    pthread_mutex_init(&writer->headerLock, NULL);
+    sem_init(&writer->wakeup, 0, 0);
+    atomic_store(&writer->active, 1);
+    status = pthread_create(&writer->thread, NULL, runResultWriter, writer);
+    if (status != 0) {
+        atomic_store(&writer->active, 0);
+        sem_destroy(&writer->wakeup);
+        pthread_mutex_destroy(&writer->headerLock);
+        close(writer->fd);
+        return(-status);
+    }
+    return(0);
+}
+
+// Next free slot of the queue, NULL if the writer is closed or the queue is full
+static resultRecord *getFreeRecord(resultWriter *writer) {
+    unsigned int head, tail;
+
+    if (!atomic_load_explicit(&writer->active, memory_order_relaxed)) {
+        return(NULL);
+    }
+    head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&writer->tail, memory_order_acquire);
+    if (head - tail == RESULT_QUEUE_SIZE) {
+        atomic_fetch_add_explicit(&writer->dropped, 1, memory_order_relaxed);
+        return(NULL);
+    }
+    return(&writer->records[head & (RESULT_QUEUE_SIZE - 1)]);
+}
+
+// Hands the slot of getFreeRecord to the writer thread
+static void queueRecord(resultWriter *writer) {
+    unsigned int head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&writer->head, head + 1, memory_order_release);
+    // The writer does not wait for its interval if the queue fills up faster
+    if (head + 1 - tail == RESULT_QUEUE_SIZE / 2) {
+        sem_post(&writer->wakeup);
+    }
+}
+
+int appendResult(resultWriter *writer, long pulse, uint32_t sendTick, uint32_t arriveTick, int startSkewInMicros, unsigned int flags) {
+    resultRecord *record = getFreeRecord(writer);
+
+    if (record == NULL) {
+        return(-1);
+    }
+    record->pulse = (uint32_t) pulse;
+    record->sendTick = sendTick;
+    record->arriveTick = arriveTick;
+    record->flags = (uint16_t) flags;
+    if (startSkewInMicros > INT16_MAX) {
+        startSkewInMicros = INT16_MAX;
+    }
+    else if (startSkewInMicros < INT16_MIN) {
+        startSkewInMicros = INT16_MIN;
+    }
+    record->startSkewInMicros = (int16_t) startSkewInMicros;
+    queueRecord(writer);
+    return(0);
+}
+
+int appendTrace(resultWriter *writer, const traceRecord *trace) {
+    resultRecord *record = getFreeRecord(writer);
+
+    if (record == NULL) {
+        return(-1);
+    }
+    memcpy(record, trace, sizeof(traceRecord));
+    queueRecord(writer);
+    return(0);
+}
+
+resultHeader *lockResultHeader(resultWriter *writer) {
+    pthread_mutex_lock(&writer->headerLock);
+    return(&writer->header);
+}
+
+void unlockResultHeader(resultWriter *writer) {
+    writer->headerChanged = 1;
+    pthread_mutex_unlock(&writer->headerLock);
+}
+
+int isResultWriterOpen(resultWriter *writer) {
+    return(atomic_load(&writer->active));
+}
+
+unsigned int takeDroppedResultCount(resultWriter *writer) {
+    return(atomic_exchange_explicit(&writer->dropped, 0, memory_order_relaxed));
+}
+
+int closeResultWriter(resultWriter *writer) {
+    int status;
+
+    if (!atomic_load(&writer->active)) {
+        return(0);
+    }
+    atomic_store(&writer->active, 0);
+    sem_post(&writer->wakeup);
+    pthread_join(writer->thread, NULL);
+    status = -writer->error;
+    if (close(writer->fd) < 0 && status == 0) {
+        status = -errno;
+    }
+    sem_destroy(&writer->wakeup);
+    pthread_mutex_destroy(&writer->headerLock);
+    return(status);
+}
+
+static int mapFileWithMagic(resultFile *file, const char *path, const char *magic) {
+    struct stat fileStatus;
+    int fd, status = 0;
+
+    memset(file, 0, sizeof(resultFile));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return(-errno);
+    }
+    if (fstat(fd, &fileStatus) < 0) {
+        status = -errno;
+    }
+    else if (fileStatus.st_size < (off_t) sizeof(resultHeader)) {
+        status = -EINVAL;
+    }
+    else {
+        file->size = fileStatus.st_size;
+        file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->map == MAP_FAILED) {
+            status = -errno;
+            file->map = NULL;
+        }
+    }
+    close(fd);
+    if (status < 0) {
+        return(status);
+    }
+    file->header = (const resultHeader *) file->map;
+    if (memcmp(file->header->magic, magic, sizeof(file->header->magic)) != 0
+        || file->header->version != RESULT_VERSION
+        || file->header->headerSize < sizeof(resultHeader)
+        || file->header->headerSize > file->size
+        || file->header->recordSize < sizeof(resultRecord)) {
+        unmapResultFile(file);
+        return(-EINVAL);
+    }
+    madvise(file->map, file->size, MADV_SEQUENTIAL);
+    file->records = (const char *) file->map + file->header->headerSize;
+    file->count = (file->size - file->header->headerSize) / file->header->recordSize;
+    file->trailingBytes = (file->size - file->header->headerSize) % file->header->recordSize;
+    return(0);
+}
+
+int mapResultFile(resultFile *file, const char *path) {
+    return(mapFileWithMagic(file, path, RESULT_MAGIC));
+}
+
+int mapTraceFile(resultFile *file, const char *path) {
+    return(mapFileWithMagic(file, path, TRACE_MAGIC));
+}
+
+void unmapResultFile(resultFile *file) {
+    if (file->map != NULL) {
+        munmap(file->map, file->size);
+    }
+    memset(file, 0, sizeof(resultFile));
+}
+
+const resultRecord *getResultRecord(const resultFile *file, long index) {
+    return((const resultRecord *) (file->records + index * file->header->recordSize));
+}
+
+const traceRecord *getTraceRecord(const resultFile *file, long index) {
+    return((const traceRecord *) (file->records + index * file->header->recordSize));
+}
+
+int32_t getResultLatencyInMicros(const resultHeader *header, const resultRecord *record) {
+    int32_t latencyInMicros = (int32_t) (record->arriveTick - record->sendTick);
+
+    if (header->options & RESULT_OPTION_RIG_OFFSET) {
+        latencyInMicros -= header->rigOffsetInMicros;
+    }
+    return(latencyInMicros);
+}
+
+int isValidResult(const resultRecord *record) {
+    return(record->flags == 0);
+}
+
+void initResultTimebase(resultTimebase *timebase, const resultHeader *header) {
+    timebase->lastTick = header->startTick;
+    timebase->lastTimeInMicros = 0;
+}
+
+int64_t getResultTimeInMicros(resultTimebase *timebase, uint32_t tick) {
+    timebase->lastTimeInMicros += (int32_t) (tick - timebase->lastTick);
+    timebase->lastTick = tick;
+    return(timebase->lastTimeInMicros);
+}
@@ -0,0 +1,191 @@
+/*
+Binary result files
+
+A session is saved as one header with everything that is the same for all pulses, followed by
+one fixed size record per detected pulse. Pulses lost on the way and edges that were not accepted
+as an arrival get a record with RESULT_FLAG_LOST or RESULT_FLAG_SPURIOUS, only records without
+flags are valid measurements.
+The records are queued without blocking and written by a background thread at least every
+RESULT_FLUSH_INTERVAL_IN_S, so a crash loses the last interval at most. A record cut off by a
+crash is ignored by the reader, and finished stays 0 in the header of such a session.
+The structs are written as they are in memory, which is little endian on the Raspberry Pi.
+
+Trace files have the same header with TRACE_MAGIC, followed by one traceRecord per raw edge and
+per emission of the measurement loop, in the order the loop processed them, so a session can be
+replayed without the rig.
+*/
+
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RESULT_MAGIC "LAGRES\r\n" // 8 bytes, the line breaks reveal text mode transfers
+#define RESULT_VERSION 1
+#define RESULT_HEADER_SIZE 512
+#define RESULT_FILE_SUFFIX ".lag"
+#define RESULT_QUEUE_SIZE 8192 // Must be a power of two
+#define RESULT_FLUSH_INTERVAL_IN_S 0.1
+#define TRACE_MAGIC "LAGTRC\r\n"
+#define TRACE_FILE_SUFFIX ".lagtrace"
+
+// Record flags
+#define RESULT_FLAG_REJECTED 1 // The arrival was older than the pulse, not counted as valid
+#define RESULT_FLAG_LOST 2 // No arrival was accepted, arriveTick is when the pulse timed out
+#define RESULT_FLAG_SPURIOUS 4 // A line in pulse that was no arrival, sendTick is the pulse it was checked against
+
+// Session options
+#define RESULT_OPTION_PERSISTENT_STREAM 1
+#define RESULT_OPTION_HW_TIMESTAMPS 2
+#define RESULT_OPTION_MMAP 4
+#define RESULT_OPTION_DMA_PULSES 8
+#define RESULT_OPTION_REALTIME 16
+#define RESULT_OPTION_SOAK 32
+#define RESULT_OPTION_RIG_OFFSET 64 // rigOffsetInMicros is subtracted from the latency of every record
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize; /* The records start here */
+    uint32_t recordSize;
+    uint32_t finished; /* 1 once the session ended */
+    uint64_t pulses; /* Pulses sent, only known once the session ended */
+    int64_t startTimeInMicros; /* Wall clock at startTick, since the epoch */
+    uint32_t startTick; /* Timebase of the record ticks */
+    uint32_t tickResolutionInMicros;
+    uint32_t sampleRate; /* Negotiated, 0 for line out */
+    uint32_t channels;
+    uint32_t bytesPerFrame;
+    uint32_t periodFrames;
+    uint32_t bufferFrames;
+    uint32_t pipelineDepth;
+    uint32_t options; /* RESULT_OPTION_* */
+    char dutInput[16];
+    char dutOutput[16];
+    char format[16];
+    char waveform[16];
+    char device[64]; /* Sends the pulse */
+    char captureDevice[64]; /* Detects it */
+    char host[64];
+    char system[128]; /* Kernel name, release and machine */
+    int32_t rigOffsetInMicros; /* Calibrated delay of the rig itself, 0 if unknown */
+    uint32_t glitchFilterInMicros; /* Steady time of the glitch filter on line in, 0 if off */
+    uint32_t noiseFilterInMicros; /* Steady time of the noise filter on line in, 0 if off */
+    int32_t minPulseWidthInMicros; /* Shorter line in pulses are spurious, -1 if derived from the pulse width */
+    float acceptanceSigmas; /* Width of the acceptance window around the median, 0 if off */
+    uint32_t calibrationPulses; /* Finished pulses of the last calibration window of the mode, 0 without one */
+    float calibrationDetectionRate;
+    float calibrationSpreadInMicros;
+    uint32_t calibrationDoubleTriggers;
+    int32_t calibrationLatencyInMicros; /* Median, -1 without a detected pulse */
+    uint32_t calibrationGrade; /* 1 bad, 2 medium, 3 good */
+    uint32_t calibrationAgeInS; /* From the end of the calibration to the start of the session */
+    uint8_t reserved[4];
+} resultHeader;
+
+_Static_assert(sizeof(resultHeader) == RESULT_HEADER_SIZE, "resultHeader must keep its size");
+
+typedef struct {
+    uint32_t pulse; /* Index in the session, counted from 0 */
+    uint32_t sendTick; /* Both ticks wrap around every 72 minutes like the tick of pigpio */
+    uint32_t arriveTick;
+    uint16_t flags; /* RESULT_FLAG_* */
+    int16_t startSkewInMicros; /* Clamped to the range of int16_t */
+} resultRecord;
+
+// Trace events
+#define TRACE_EDGE 1 // gpio, level and tick of an edge taken from the edge queue
+#define TRACE_PULSE 2 // The measurement loop counted pulse
+#define TRACE_SIGNAL_START 3 // Start reference of a usb or hdmi pulse, value is its start skew
+#define TRACE_PULSE_WIDTH 4 // Width of code 0 in nanoseconds, value
+#define TRACE_TRAIN_RESET 5 // A DMA pulse train is built
+#define TRACE_TRAIN_PULSE 6 // Pulse added to the train, value is its offset in microseconds
+#define TRACE_TRAIN_SENT 7 // The train was handed to the DMA controller
+#define TRACE_TRAIN_DONE 8 // The train is over, all its pulses are emitted
+#define TRACE_EDGES_DROPPED 9 // Edges lost by a full edge queue, value is their count
+
+typedef struct {
+    uint32_t tick;
+    uint8_t type; /* TRACE_* */
+    uint8_t gpio;
+    uint8_t level;
+    uint8_t code; /* Pulse code */
+    uint32_t pulse;
+    int32_t value;
+} traceRecord;
+
+_Static_assert(sizeof(traceRecord) == sizeof(resultRecord), "Trace records are queued like result records");
+
+// Writes one result file, the records are appended by one producer thread
+typedef struct {
+    int fd;
+    off_t size; /* Bytes in the file, only used by the writer thread */
+    int error; /* First errno of a failed write */
+    resultHeader header;
+    int headerChanged;
+    pthread_mutex_t headerLock;
+    resultRecord records[RESULT_QUEUE_SIZE];
+    atomic_uint head; /* Next slot written by the producer */
+    atomic_uint tail; /* Next slot written to the file */
+    atomic_uint dropped; /* Records lost because the queue was full */
+    atomic_int active; /* 0 until opened and after closing */
+    sem_t wakeup;
+    pthread_t thread;
+} resultWriter;
+
+// A result file mapped into memory for reading
+typedef struct {
+    const resultHeader *header;
+    const char *records;
+    long count;
+    size_t trailingBytes; /* Of a record cut off by a crash */
+    void *map;
+    size_t size;
+} resultFile;
+
+// Extends the wrapping ticks to microseconds since the session started, see getResultTimeInMicros
+typedef struct {
+    uint32_t lastTick;
+    int64_t lastTimeInMicros;
+} resultTimebase;
+
+/* Sets the fixed fields, the host and the timebase, everything else is 0 */
+void initResultHeader(resultHeader *header, uint32_t startTick, unsigned int tickResolutionInMicros);
+/* Like initResultHeader, for a trace file */
+void initTraceHeader(resultHeader *header, uint32_t startTick, unsigned int tickResolutionInMicros);
+/* Copies text into a text field of the header, cut off if it does not fit */
+void setResultText(char *field, size_t size, const char *text);
+/* Creates the file and starts the writer thread, returns 0 or -errno */
+int openResultWriter(resultWriter *writer, const char *path, const resultHeader *header);
+/* Producer side, never blocks, returns 0 or -1 if the writer is closed or its queue is full */
+int appendResult(resultWriter *writer, long pulse, uint32_t sendTick, uint32_t arriveTick, int startSkewInMicros, unsigned int flags);
+/* The header may be changed until unlockResultHeader, it is rewritten with the next records */
+/* Like appendResult, for a writer opened with a trace header */
+int appendTrace(resultWriter *writer, const traceRecord *record);
+resultHeader *lockResultHeader(resultWriter *writer);
+void unlockResultHeader(resultWriter *writer);
+int isResultWriterOpen(resultWriter *writer);
+unsigned int takeDroppedResultCount(resultWriter *writer);
+/* Writes everything queued and closes the file, returns 0 or -errno of the first failed write */
+int closeResultWriter(resultWriter *writer);
+
+/* Returns 0, -errno or -EINVAL if the file is no result file of this version */
+int mapResultFile(resultFile *file, const char *path);
+int mapTraceFile(resultFile *file, const char *path);
+void unmapResultFile(resultFile *file);
+const resultRecord *getResultRecord(const resultFile *file, long index);
+/* Arrive minus send tick, without the rig offset if the session subtracted it */
+int32_t getResultLatencyInMicros(const resultHeader *header, const resultRecord *record);
+/* A measured latency, no rejected or lost pulse and no spurious edge */
+int isValidResult(const resultRecord *record);
+const traceRecord *getTraceRecord(const resultFile *file, long index);
+void initResultTimebase(resultTimebase *timebase, const resultHeader *header);
+/* The ticks must be passed in file order and less than 35 minutes apart from the previous one */
+int64_t getResultTimeInMicros(resultTimebase *timebase, uint32_t tick);
+
+#endif
@@ -2,5 +2,5 @@
 
 cd /home/$USER/Desktop/AudioLatencyMeasurement/
 make
-sudo ./audio_lag_module
+sudo ./audio_lag_module --realtime
 $SHELL
@@ -0,0 +1,149 @@
+/*
+Streaming latency statistics
+*/
+
+#include "stats.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int getBucketIndex(int value) {
+    int shift;
+
+    if (value < STATS_SUB_BUCKETS) {
+        return(value);
+    }
+    // value >> shift is between STATS_HALF_SUB_BUCKETS and STATS_SUB_BUCKETS - 1
+    shift = (31 - __builtin_clz((unsigned int) value)) - (STATS_SUB_BUCKET_BITS - 1);
+    return(STATS_SUB_BUCKETS + (shift - 1) * STATS_HALF_SUB_BUCKETS + ((value >> shift) - STATS_HALF_SUB_BUCKETS));
+}
+
+// Middle of the value range counted by a bucket
+static double getBucketValue(int index) {
+    int shift, subBucket;
+
+    if (index < STATS_SUB_BUCKETS) {
+        return(index);
+    }
+    shift = (index - STATS_SUB_BUCKETS) / STATS_HALF_SUB_BUCKETS + 1;
+    subBucket = (index - STATS_SUB_BUCKETS) % STATS_HALF_SUB_BUCKETS + STATS_HALF_SUB_BUCKETS;
+    return(((double) subBucket + 0.5) * (1 << shift) - 0.5);
+}
+
+void initLatencyStats(latencyStats *stats) {
+    memset(stats, 0, sizeof(latencyStats));
+    stats->min = -1;
+    stats->max = -1;
+    stats->last = -1;
+    stats->jitterMax = -1;
+}
+
+void addLatency(latencyStats *stats, int latencyInMicros) {
+    double delta;
+    int jitter;
+
+    if (latencyInMicros < 0) {
+        return;
+    }
+    stats->count += 1;
+    delta = latencyInMicros - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->squaredDeviationSum += delta * (latencyInMicros - stats->mean);
+
+    if (stats->min == -1 || latencyInMicros < stats->min) {
+        stats->min = latencyInMicros;
+    }
+    if (latencyInMicros > stats->max) {
+        stats->max = latencyInMicros;
+    }
+    if (stats->last != -1) {
+        jitter = abs(latencyInMicros - stats->last);
+        stats->jitterCount += 1;
+        stats->jitterMean += (jitter - stats->jitterMean) / stats->jitterCount;
+        if (jitter > stats->jitterMax) {
+            stats->jitterMax = jitter;
+        }
+    }
+    stats->last = latencyInMicros;
+    stats->histogram[getBucketIndex(latencyInMicros)] += 1;
+}
+
+double getLatencyStandardDeviation(const latencyStats *stats) {
+    if (stats->count < 2) {
+        return(0.0);
+    }
+    return(sqrt(stats->squaredDeviationSum / (stats->count - 1)));
+}
+
+int getLatencyPercentile(const latencyStats *stats, double percentile) {
+    long rank, cumulativeCount = 0;
+    double value;
+
+    if (stats->count == 0) {
+        return(-1);
+    }
+    rank = (long) ceil(percentile / 100.0 * stats->count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int index = 0; index < STATS_BUCKETS; index++) {
+        cumulativeCount += stats->histogram[index];
+        if (cumulativeCount >= rank) {
+            // The bucket middle can lie outside of the values that were actually measured
+            value = fmin(fmax(getBucketValue(index), stats->min), stats->max);
+            return((int) lround(value));
+        }
+    }
+    return(stats->max);
+}
+
+void mergeLatencyStats(latencyStats *stats, const latencyStats *other) {
+    long count = stats->count + other->count;
+    long jitterCount = stats->jitterCount + other->jitterCount;
+    double delta = other->mean - stats->mean;
+
+    if (other->count == 0) {
+        return;
+    }
+    // Parallel variant of Welford's algorithm by Chan et al.
+    stats->squaredDeviationSum += other->squaredDeviationSum + delta * delta * stats->count * other->count / count;
+    stats->mean += delta * other->count / count;
+    stats->count = count;
+    if (stats->min == -1 || other->min < stats->min) {
+        stats->min = other->min;
+    }
+    if (other->max > stats->max) {
+        stats->max = other->max;
+    }
+    if (jitterCount > 0) {
+        stats->jitterMean = (stats->jitterMean * stats->jitterCount + other->jitterMean * other->jitterCount) / jitterCount;
+        stats->jitterCount = jitterCount;
+    }
+    if (other->jitterMax > stats->jitterMax) {
+        stats->jitterMax = other->jitterMax;
+    }
+    stats->last = other->last;
+    for (int index = 0; index < STATS_BUCKETS; index++) {
+        stats->histogram[index] += other->histogram[index];
+    }
+}
+
+void getLatencyHistogram(const latencyStats *stats, int min, int max, int bins, long *counts) {
+    double width = (double) (max - min + 1) / bins;
+    int bin;
+
+    memset(counts, 0, bins * sizeof(long));
+    for (int index = 0; index < STATS_BUCKETS; index++) {
+        if (stats->histogram[index] == 0) {
+            continue;
+        }
+        bin = (int) floor((getBucketValue(index) - min) / width);
+        if (bin < 0) {
+            bin = 0;
+        }
+        else if (bin >= bins) {
+            bin = bins - 1;
+        }
+        counts[bin] += stats->histogram[index];
+    }
+}
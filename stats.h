@@ -0,0 +1,46 @@
+/*
+Streaming latency statistics
+
+Every measurement is added in O(1) time and constant memory, so a session
+does not need to keep its samples to know mean, spread and percentiles:
+- Mean and variance with Welford's algorithm
+- Minimum and maximum
+- Log-linear histogram like HdrHistogram, values below STATS_SUB_BUCKETS
+  microseconds are exact, larger ones have a relative error below 1 / STATS_SUB_BUCKETS
+- Jitter as absolute difference between the latencies of consecutive pulses
+
+Percentiles are read from the histogram, which takes STATS_BUCKETS steps.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_SUB_BUCKET_BITS 10 // About three significant digits
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_HALF_SUB_BUCKETS (STATS_SUB_BUCKETS / 2)
+// Covers all positive int values
+#define STATS_BUCKETS (STATS_SUB_BUCKETS + (31 - STATS_SUB_BUCKET_BITS) * STATS_HALF_SUB_BUCKETS)
+
+typedef struct {
+    long count;
+    double mean;
+    double squaredDeviationSum; /* Welford's M2 */
+    int min;
+    int max;
+    int last;
+    long jitterCount;
+    double jitterMean;
+    int jitterMax;
+    long histogram[STATS_BUCKETS];
+} latencyStats;
+
+void initLatencyStats(latencyStats *stats);
+void addLatency(latencyStats *stats, int latencyInMicros);
+double getLatencyStandardDeviation(const latencyStats *stats);
+int getLatencyPercentile(const latencyStats *stats, double percentile); /* -1 if empty */
+/* Adds all measurements of other, as if they were added one by one after the ones of stats */
+void mergeLatencyStats(latencyStats *stats, const latencyStats *other);
+/* Counts the measurements in bins of equal width from min to max, the ones outside in the first and last bin */
+void getLatencyHistogram(const latencyStats *stats, int min, int max, int bins, long *counts);
+
+#endif
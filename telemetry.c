@@ -0,0 +1,305 @@
+/*
+Live telemetry
+*/
+
+#define _GNU_SOURCE
+#include "telemetry.h"
+#include "realtime.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+void publishTelemetryResult(telemetryServer *server, long pulse, uint32_t sendTick, uint32_t arriveTick,
+                            int startSkewInMicros, unsigned int flags) {
+    telemetryMap *map = server->map;
+    resultRecord *record;
+    unsigned int head;
+
+    if (map == NULL) {
+        return;
+    }
+    head = atomic_load_explicit(&map->head, memory_order_relaxed);
+    record = &map->records[head & (TELEMETRY_RING_SIZE - 1)];
+    record->pulse = (uint32_t) pulse;
+    record->sendTick = sendTick;
+    record->arriveTick = arriveTick;
+    record->flags = (uint16_t) flags;
+    if (startSkewInMicros > INT16_MAX) {
+        startSkewInMicros = INT16_MAX;
+    }
+    else if (startSkewInMicros < INT16_MIN) {
+        startSkewInMicros = INT16_MIN;
+    }
+    record->startSkewInMicros = (int16_t) startSkewInMicros;
+    atomic_store_explicit(&map->head, head + 1, memory_order_release);
+}
+
+telemetryStatistics *beginTelemetryUpdate(telemetryServer *server) {
+    telemetryMap *map = server->map;
+
+    if (map == NULL) {
+        return(NULL);
+    }
+    atomic_store_explicit(&map->sequence, atomic_load_explicit(&map->sequence, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return(&map->statistics);
+}
+
+void endTelemetryUpdate(telemetryServer *server) {
+    telemetryMap *map = server->map;
+
+    atomic_store_explicit(&map->sequence, atomic_load_explicit(&map->sequence, memory_order_relaxed) + 1, memory_order_release);
+}
+
+void readTelemetryStatistics(const telemetryMap *map, telemetryStatistics *statistics) {
+    unsigned int before, after;
+
+    do {
+        before = atomic_load_explicit((atomic_uint *) &map->sequence, memory_order_acquire);
+        memcpy(statistics, (const void *) &map->statistics, sizeof(telemetryStatistics));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit((atomic_uint *) &map->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+// Appends to text like snprintf, length stays at size - 1 once text is full
+static void appendText(char *text, int size, int *length, const char *format, ...) {
+    va_list arguments;
+    int written;
+
+    if (*length >= size - 1) {
+        return;
+    }
+    va_start(arguments, format);
+    written = vsnprintf(text + *length, size - *length, format, arguments);
+    va_end(arguments);
+    if (written < 0) {
+        return;
+    }
+    *length += written < size - *length ? written : size - 1 - *length;
+}
+
+// Label values are quoted, so quotes, backslashes and line breaks are escaped
+static void appendLabelValue(char *text, int size, int *length, const char *value, size_t valueSize) {
+    for (size_t i = 0; i < valueSize && value[i] != '\0'; i++) {
+        if (value[i] == '"' || value[i] == '\\') {
+            appendText(text, size, length, "\\%c", value[i]);
+        }
+        else if (value[i] == '\n') {
+            appendText(text, size, length, "\\n");
+        }
+        else {
+            appendText(text, size, length, "%c", value[i]);
+        }
+    }
+}
+
+static void appendMetric(char *text, int size, int *length, const char *name, const char *type, const char *help, double value) {
+    appendText(text, size, length, "# HELP %s %s\n# TYPE %s %s\n%s %.10g\n", name, help, name, type, name, value);
+}
+
+int formatTelemetryMetrics(const telemetryStatistics *statistics, char *text, int size) {
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    int32_t values[] = {statistics->p50InMicros, statistics->p90InMicros, statistics->p99InMicros, statistics->p999InMicros};
+    int length = 0;
+
+    text[0] = '\0';
+    appendText(text, size, &length, "# HELP audio_lag_session_info Session that runs or ran last\n");
+    appendText(text, size, &length, "# TYPE audio_lag_session_info gauge\n");
+    appendText(text, size, &length, "audio_lag_session_info{method=\"");
+    appendLabelValue(text, size, &length, statistics->method, sizeof(statistics->method));
+    appendText(text, size, &length, "\",dut_input=\"");
+    appendLabelValue(text, size, &length, statistics->dutInput, sizeof(statistics->dutInput));
+    appendText(text, size, &length, "\",dut_output=\"");
+    appendLabelValue(text, size, &length, statistics->dutOutput, sizeof(statistics->dutOutput));
+    appendText(text, size, &length, "\",device=\"");
+    appendLabelValue(text, size, &length, statistics->device, sizeof(statistics->device));
+    appendText(text, size, &length, "\"} 1\n");
+    appendMetric(text, size, &length, "audio_lag_sessions_total", "counter", "Sessions started", statistics->sessions);
+    appendMetric(text, size, &length, "audio_lag_session_running", "gauge", "1 while a session runs", statistics->running);
+    appendMetric(text, size, &length, "audio_lag_pulses_total", "counter", "Pulses sent in the session", (double) statistics->pulses);
+    appendMetric(text, size, &length, "audio_lag_valid_pulses_total", "counter", "Pulses of the session with a valid latency", (double) statistics->valid);
+    appendMetric(text, size, &length, "audio_lag_lost_pulses_total", "counter", "Pulses of the session without a valid latency", (double) statistics->lost);
+    appendMetric(text, size, &length, "audio_lag_spurious_edges_total", "counter", "Line in pulses of the session that were no arrival", (double) statistics->spurious);
+    if (statistics->valid == 0) {
+        return(length);
+    }
+    appendText(text, size, &length, "# HELP audio_lag_latency_microseconds Latency of the valid pulses of the session\n");
+    appendText(text, size, &length, "# TYPE audio_lag_latency_microseconds summary\n");
+    for (int i = 0; i < 4; i++) {
+        if (values[i] >= 0) {
+            appendText(text, size, &length, "audio_lag_latency_microseconds{quantile=\"%s\"} %d\n", quantiles[i], values[i]);
+        }
+    }
+    appendText(text, size, &length, "audio_lag_latency_microseconds_sum %.1f\n", statistics->meanInMicros * statistics->valid);
+    appendText(text, size, &length, "audio_lag_latency_microseconds_count %llu\n", (unsigned long long) statistics->valid);
+    appendMetric(text, size, &length, "audio_lag_latency_last_microseconds", "gauge", "Latency of the last valid pulse", statistics->lastInMicros);
+    appendMetric(text, size, &length, "audio_lag_latency_min_microseconds", "gauge", "Smallest latency of the session", statistics->minInMicros);
+    appendMetric(text, size, &length, "audio_lag_latency_max_microseconds", "gauge", "Largest latency of the session", statistics->maxInMicros);
+    appendMetric(text, size, &length, "audio_lag_latency_mean_microseconds", "gauge", "Mean latency of the session", statistics->meanInMicros);
+    appendMetric(text, size, &length, "audio_lag_latency_stddev_microseconds", "gauge", "Standard deviation of the latency", statistics->standardDeviationInMicros);
+    appendMetric(text, size, &length, "audio_lag_jitter_mean_microseconds", "gauge", "Mean latency difference of consecutive pulses", statistics->jitterMeanInMicros);
+    appendMetric(text, size, &length, "audio_lag_jitter_max_microseconds", "gauge", "Largest latency difference of consecutive pulses", statistics->jitterMaxInMicros);
+    appendMetric(text, size, &length, "audio_lag_drift_ppm", "gauge", "Drift of the latency against the send time with --drift", statistics->driftInPpm);
+    return(length);
+}
+
+// Writes all of data, the client may be gone already
+static void sendFully(int fd, const char *data, int count) {
+    ssize_t sent;
+
+    while (count > 0) {
+        sent = send(fd, data, count, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+        data += sent;
+        count -= sent;
+    }
+}
+
+static void answerTelemetryClient(telemetryServer *server, int client) {
+    struct pollfd request = {client, POLLIN, 0};
+    telemetryStatistics statistics;
+    char metrics[TELEMETRY_MAX_METRICS_SIZE], header[256], buffer[1024];
+    ssize_t received = 0;
+    int length, headerLength;
+
+    // Only the first bytes matter, a client that sends nothing gets the plain text
+    if (poll(&request, 1, TELEMETRY_REQUEST_TIMEOUT_IN_MS) > 0) {
+        received = recv(client, buffer, sizeof(buffer), 0);
+    }
+    readTelemetryStatistics(server->map, &statistics);
+    length = formatTelemetryMetrics(&statistics, metrics, sizeof(metrics));
+    if (received >= 4 && memcmp(buffer, "GET ", 4) == 0) {
+        headerLength = snprintf(header, sizeof(header),
+                                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                                length);
+        sendFully(client, header, headerLength);
+    }
+    sendFully(client, metrics, length);
+}
+
+static void *runTelemetryServer(void *argument) {
+    telemetryServer *server = (telemetryServer *) argument;
+    struct pollfd listener = {server->socketFd, POLLIN, 0};
+    int client;
+
+    // Never competes with the real-time threads it may have inherited its profile from
+    setCpuAffinity(-1);
+    setRealtimePriority(0);
+    while (atomic_load(&server->active)) {
+        if (poll(&listener, 1, TELEMETRY_POLL_TIMEOUT_IN_MS) <= 0) {
+            continue;
+        }
+        client = accept(server->socketFd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        answerTelemetryClient(server, client);
+        close(client);
+    }
+    return(NULL);
+}
+
+static int openTelemetrySocket(telemetryServer *server) {
+    struct sockaddr_un address;
+    int status;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, server->socketPath);
+    server->socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->socketFd < 0) {
+        return(-errno);
+    }
+    // Left over by a crashed run
+    unlink(server->socketPath);
+    if (bind(server->socketFd, (struct sockaddr *) &address, sizeof(address)) < 0
+        || listen(server->socketFd, 4) < 0) {
+        status = -errno;
+        close(server->socketFd);
+        return(status);
+    }
+    return(0);
+}
+
+int openTelemetry(telemetryServer *server, const char *shmName, const char *socketPath) {
+    telemetryMap *map;
+    int fd, status;
+
+    server->map = NULL;
+    if (strlen(shmName) >= sizeof(server->shmName) || strlen(socketPath) >= sizeof(server->socketPath)) {
+        return(-ENAMETOOLONG);
+    }
+    strcpy(server->shmName, shmName);
+    strcpy(server->socketPath, socketPath);
+    fd = shm_open(shmName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return(-errno);
+    }
+    if (ftruncate(fd, sizeof(telemetryMap)) < 0) {
+        status = -errno;
+        close(fd);
+        shm_unlink(shmName);
+        return(status);
+    }
+    map = (telemetryMap *) mmap(NULL, sizeof(telemetryMap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    status = map == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (status < 0) {
+        shm_unlink(shmName);
+        return(status);
+    }
+    // ftruncate filled it with zeros, the magic comes last so readers see a complete header
+    map->version = TELEMETRY_VERSION;
+    map->size = sizeof(telemetryMap);
+    map->ringSize = TELEMETRY_RING_SIZE;
+    map->recordSize = sizeof(resultRecord);
+    map->statistics.lastInMicros = -1;
+    map->statistics.minInMicros = -1;
+    map->statistics.maxInMicros = -1;
+    atomic_thread_fence(memory_order_release);
+    memcpy(map->magic, TELEMETRY_MAGIC, sizeof(map->magic));
+
+    server->map = map;
+    status = openTelemetrySocket(server);
+    if (status == 0) {
+        atomic_store(&server->active, 1);
+        status = -pthread_create(&server->thread, NULL, runTelemetryServer, server);
+        if (status < 0) {
+            close(server->socketFd);
+            unlink(server->socketPath);
+        }
+    }
+    if (status < 0) {
+        atomic_store(&server->active, 0);
+        server->map = NULL;
+        munmap(map, sizeof(telemetryMap));
+        shm_unlink(shmName);
+    }
+    return(status);
+}
+
+void closeTelemetry(telemetryServer *server) {
+    if (server->map == NULL) {
+        return;
+    }
+    atomic_store(&server->active, 0);
+    pthread_join(server->thread, NULL);
+    close(server->socketFd);
+    unlink(server->socketPath);
+    munmap(server->map, sizeof(telemetryMap));
+    shm_unlink(server->shmName);
+    server->map = NULL;
+}
@@ -0,0 +1,99 @@
+/*
+Live telemetry
+
+The measurement loop publishes every result and the running statistics of its session into
+a POSIX shared memory object, so dashboards and scripts can watch a session while it runs:
+- records is a ring of the last TELEMETRY_RING_SIZE results, the same records as in the
+  binary result files (results.h). head counts the records published so far, the newest one
+  is at (head - 1) % TELEMETRY_RING_SIZE. A reader copies the records it has not seen yet
+  and reads head again, the ones further back than TELEMETRY_RING_SIZE were overwritten
+  while it copied them.
+- statistics is guarded by sequence, which is odd while the statistics are written. A reader
+  copies them and retries if sequence was odd or changed in between.
+The writer never waits for a reader.
+
+A server thread answers every connection to a Unix domain socket with the statistics in the
+Prometheus text format, and with an HTTP response around it if the request starts with GET,
+like from curl --unix-socket. It reads the shared memory like any other reader.
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "results.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC "LAGTEL\r\n" // 8 bytes
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_RING_SIZE 4096 // Must be a power of two
+#define TELEMETRY_SHM_NAME "/audio_lag_module" // Mapped from /dev/shm/audio_lag_module on Linux
+#define TELEMETRY_SOCKET_PATH "/tmp/audio_lag_module.sock"
+#define TELEMETRY_POLL_TIMEOUT_IN_MS 100 // The server checks this often whether it has to stop
+#define TELEMETRY_REQUEST_TIMEOUT_IN_MS 100 // A client that sends nothing gets the plain metrics
+#define TELEMETRY_MAX_METRICS_SIZE 8192
+
+typedef struct {
+    uint32_t sessions; /* Started since the program started */
+    uint32_t running; /* 1 while a session runs */
+    char method[16]; /* measure or calibrate */
+    char dutInput[16];
+    char dutOutput[16];
+    char device[64];
+    uint64_t pulses;
+    uint64_t valid;
+    uint64_t lost;
+    uint64_t spurious;
+    int32_t lastInMicros; /* -1 until the first valid pulse */
+    int32_t minInMicros;
+    int32_t maxInMicros;
+    int32_t p50InMicros; /* The percentiles are updated less often than the rest */
+    int32_t p90InMicros;
+    int32_t p99InMicros;
+    int32_t p999InMicros;
+    int32_t jitterMaxInMicros;
+    double meanInMicros;
+    double standardDeviationInMicros;
+    double jitterMeanInMicros;
+    double driftInPpm; /* 0 without --drift */
+} telemetryStatistics;
+
+// Layout of the shared memory object
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size; /* Of the whole object */
+    uint32_t ringSize;
+    uint32_t recordSize;
+    atomic_uint sequence;
+    telemetryStatistics statistics;
+    atomic_uint head; /* Records published, wraps around */
+    resultRecord records[TELEMETRY_RING_SIZE];
+} telemetryMap;
+
+typedef struct {
+    telemetryMap *map; /* NULL until opened and after closing */
+    char shmName[64];
+    char socketPath[108]; /* Like sun_path */
+    int socketFd;
+    atomic_int active;
+    pthread_t thread;
+} telemetryServer;
+
+/* Creates the shared memory and the socket and starts the server thread, returns 0 or -errno */
+int openTelemetry(telemetryServer *server, const char *shmName, const char *socketPath);
+/* Does nothing if the server is not open, never blocks */
+void publishTelemetryResult(telemetryServer *server, long pulse, uint32_t sendTick, uint32_t arriveTick,
+                            int startSkewInMicros, unsigned int flags);
+/* The statistics may be changed until endTelemetryUpdate, NULL if the server is not open */
+telemetryStatistics *beginTelemetryUpdate(telemetryServer *server);
+void endTelemetryUpdate(telemetryServer *server);
+/* Copies the statistics without tearing, retries while the writer changes them */
+void readTelemetryStatistics(const telemetryMap *map, telemetryStatistics *statistics);
+/* Prometheus text of the statistics, returns its length */
+int formatTelemetryMetrics(const telemetryStatistics *statistics, char *text, int size);
+/* Stops the server, removes the socket and the shared memory */
+void closeTelemetry(telemetryServer *server);
+
+#endif
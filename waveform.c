@@ -0,0 +1,230 @@
+/*
+Waveform bank
+*/
+
+#include "waveform.h"
+#include "hal.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *waveformNames[WAVEFORM_COUNT] = {"constant", "square", "sine", "chirp", "mls"};
+static const char *formatNames[HAL_PCM_FORMAT_COUNT] = {"S16_LE", "S24_3LE", "S32_LE"};
+static unsigned char mlsBits[(1 << WAVEFORM_MLS_ORDER) - 1];
+static pthread_once_t mlsOnce = PTHREAD_ONCE_INIT;
+
+// Fibonacci LFSR with the primitive polynomial x^15 + x^14 + 1
+static void createMls() {
+    unsigned int state = 1;
+    unsigned int bit;
+
+    for (int i = 0; i < (1 << WAVEFORM_MLS_ORDER) - 1; i++) {
+        mlsBits[i] = state & 1;
+        bit = (state ^ (state >> 1)) & 1;
+        state = (state >> 1) | (bit << (WAVEFORM_MLS_ORDER - 1));
+    }
+}
+
+unsigned int getBytesPerSample(int format) {
+    switch (format) {
+        case HAL_PCM_FORMAT_S16_LE:
+            return(2);
+        case HAL_PCM_FORMAT_S24_3LE:
+            return(3);
+        case HAL_PCM_FORMAT_S32_LE:
+            return(4);
+        default:
+            return(0);
+    }
+}
+
+// Stores value (-1.0 to 1.0) as one sample on every channel of the frame
+static void storeFrame(waveformBank *bank, unsigned long frame, double value, char *data) {
+    char *destination = data + frame * bank->bytesPerFrame;
+    int16_t sample16;
+    int32_t sample32;
+
+    for (unsigned int channel = 0; channel < bank->channels; channel++) {
+        switch (bank->format) {
+            case HAL_PCM_FORMAT_S16_LE:
+                sample16 = (int16_t) lround(value * 32767.0);
+                destination[0] = sample16 & 0xFF;
+                destination[1] = (sample16 >> 8) & 0xFF;
+                destination += 2;
+                break;
+            case HAL_PCM_FORMAT_S24_3LE:
+                sample32 = (int32_t) lround(value * 8388607.0);
+                destination[0] = sample32 & 0xFF;
+                destination[1] = (sample32 >> 8) & 0xFF;
+                destination[2] = (sample32 >> 16) & 0xFF;
+                destination += 3;
+                break;
+            case HAL_PCM_FORMAT_S32_LE:
+                sample32 = (int32_t) lround(value * 2147483647.0);
+                destination[0] = sample32 & 0xFF;
+                destination[1] = (sample32 >> 8) & 0xFF;
+                destination[2] = (sample32 >> 16) & 0xFF;
+                destination[3] = (sample32 >> 24) & 0xFF;
+                destination += 4;
+                break;
+        }
+    }
+}
+
+static double getSample(int waveform, unsigned long frame, unsigned long frames, unsigned int sampleRate) {
+    double time = (double) frame / sampleRate;
+    double duration = (double) frames / sampleRate;
+    double position = frames > 1 ? (double) frame / (frames - 1) : 0.0;
+    double endFrequency, phase, window;
+
+    switch (waveform) {
+        case WAVEFORM_SQUARE:
+            return(fmod(time * WAVEFORM_FREQUENCY_IN_HZ, 1.0) < 0.5 ? WAVEFORM_AMPLITUDE : -WAVEFORM_AMPLITUDE);
+        case WAVEFORM_SINE:
+            window = 0.5 - 0.5 * cos(2.0 * M_PI * position);
+            return(WAVEFORM_AMPLITUDE * window * sin(2.0 * M_PI * WAVEFORM_FREQUENCY_IN_HZ * time));
+        case WAVEFORM_CHIRP:
+            endFrequency = fmin(WAVEFORM_CHIRP_END_IN_HZ, sampleRate / 4.0);
+            phase = 2.0 * M_PI * (WAVEFORM_CHIRP_START_IN_HZ * time
+                                  + (endFrequency - WAVEFORM_CHIRP_START_IN_HZ) * time * time / (2.0 * duration));
+            // Tukey window, flat in the middle
+            if (position < WAVEFORM_CHIRP_FADE) {
+                window = 0.5 - 0.5 * cos(M_PI * position / WAVEFORM_CHIRP_FADE);
+            }
+            else if (position > 1.0 - WAVEFORM_CHIRP_FADE) {
+                window = 0.5 - 0.5 * cos(M_PI * (1.0 - position) / WAVEFORM_CHIRP_FADE);
+            }
+            else {
+                window = 1.0;
+            }
+            return(WAVEFORM_AMPLITUDE * window * sin(phase));
+        case WAVEFORM_MLS:
+            pthread_once(&mlsOnce, createMls);
+            return(mlsBits[frame % ((1 << WAVEFORM_MLS_ORDER) - 1)] ? WAVEFORM_AMPLITUDE : -WAVEFORM_AMPLITUDE);
+        default:
+            return(0.0);
+    }
+}
+
+int createWaveformBank(waveformBank *bank, int format, unsigned int sampleRate, unsigned int channels, unsigned long frames) {
+    size_t size;
+
+    memset(bank, 0, sizeof(waveformBank));
+    bank->format = format;
+    bank->sampleRate = sampleRate;
+    bank->channels = channels;
+    bank->frames = frames;
+    bank->bytesPerFrame = getBytesPerSample(format) * channels;
+    if (bank->bytesPerFrame == 0 || frames == 0) {
+        return(-EINVAL);
+    }
+    size = frames * bank->bytesPerFrame;
+
+    bank->silence = (char *) calloc(size, 1);
+    if (bank->silence == NULL) {
+        freeWaveformBank(bank);
+        return(-ENOMEM);
+    }
+    for (int waveform = 0; waveform < WAVEFORM_COUNT; waveform++) {
+        bank->waveforms[waveform] = (char *) malloc(size);
+        if (bank->waveforms[waveform] == NULL) {
+            freeWaveformBank(bank);
+            return(-ENOMEM);
+        }
+        if (waveform == WAVEFORM_CONSTANT) {
+            memset(bank->waveforms[waveform], 127, size);
+            continue;
+        }
+        for (unsigned long frame = 0; frame < frames; frame++) {
+            storeFrame(bank, frame, getSample(waveform, frame, frames, sampleRate), bank->waveforms[waveform]);
+        }
+    }
+    return(0);
+}
+
+void freeWaveformBank(waveformBank *bank) {
+    for (int waveform = 0; waveform < WAVEFORM_COUNT; waveform++) {
+        free(bank->waveforms[waveform]);
+        bank->waveforms[waveform] = NULL;
+    }
+    free(bank->silence);
+    bank->silence = NULL;
+    bank->frames = 0;
+}
+
+int isWaveformBankMatching(waveformBank *bank, int format, unsigned int sampleRate, unsigned int channels, unsigned long frames) {
+    return(bank->silence != NULL
+           && bank->format == format
+           && bank->sampleRate == sampleRate
+           && bank->channels == channels
+           && bank->frames == frames);
+}
+
+int parseWaveform(const char *name) {
+    for (int waveform = 0; waveform < WAVEFORM_COUNT; waveform++) {
+        if (strcmp(name, waveformNames[waveform]) == 0) {
+            return(waveform);
+        }
+    }
+    return(-1);
+}
+
+const char *getWaveformName(int waveform) {
+    if (waveform < 0 || waveform >= WAVEFORM_COUNT) {
+        return("unknown");
+    }
+    return(waveformNames[waveform]);
+}
+
+int parseFormat(const char *name) {
+    for (int format = 0; format < HAL_PCM_FORMAT_COUNT; format++) {
+        if (strcmp(name, formatNames[format]) == 0) {
+            return(format);
+        }
+    }
+    return(-1);
+}
+
+const char *getFormatName(int format) {
+    if (format < 0 || format >= HAL_PCM_FORMAT_COUNT) {
+        return("unknown");
+    }
+    return(formatNames[format]);
+}
+
+int getWaveformSamples(int waveform, unsigned int sampleRate, unsigned long frames, float *samples) {
+    if (waveform < 0 || waveform >= WAVEFORM_COUNT || sampleRate == 0) {
+        return(-EINVAL);
+    }
+    for (unsigned long frame = 0; frame < frames; frame++) {
+        // Every byte of the constant waveform is 127
+        samples[frame] = waveform == WAVEFORM_CONSTANT ? 0x7F7F / 32768.0f : (float) getSample(waveform, frame, frames, sampleRate);
+    }
+    return(0);
+}
+
+void getFirstChannelSamples(const char *frames, int format, unsigned int channels, unsigned long count, float *samples) {
+    unsigned int bytesPerFrame = getBytesPerSample(format) * channels;
+    const unsigned char *sample;
+
+    for (unsigned long frame = 0; frame < count; frame++) {
+        sample = (const unsigned char *) frames + frame * bytesPerFrame;
+        switch (format) {
+            case HAL_PCM_FORMAT_S16_LE:
+                samples[frame] = (int16_t) (sample[0] | (sample[1] << 8)) / 32768.0f;
+                break;
+            case HAL_PCM_FORMAT_S24_3LE:
+                samples[frame] = (int32_t) ((uint32_t) sample[0] << 8 | (uint32_t) sample[1] << 16 | (uint32_t) sample[2] << 24) / 2147483648.0f;
+                break;
+            case HAL_PCM_FORMAT_S32_LE:
+                samples[frame] = (int32_t) ((uint32_t) sample[0] | (uint32_t) sample[1] << 8 | (uint32_t) sample[2] << 16 | (uint32_t) sample[3] << 24) / 2147483648.0f;
+                break;
+            default:
+                samples[frame] = 0.0f;
+                break;
+        }
+    }
+}
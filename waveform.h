@@ -0,0 +1,50 @@
+/*
+Waveform bank
+
+The pulses played on PCM devices are computed once for the negotiated
+sample format, sample rate and channel count, then reused for every pulse.
+This avoids allocating and filling a buffer per pulse.
+*/
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+// Pulse waveforms
+#define WAVEFORM_CONSTANT 0 // Every byte 127, the original pulse
+#define WAVEFORM_SQUARE 1 // Square burst
+#define WAVEFORM_SINE 2 // Hann windowed sine burst
+#define WAVEFORM_CHIRP 3 // Linear sweep with faded edges
+#define WAVEFORM_MLS 4 // Maximum length sequence of order 15, white like noise
+#define WAVEFORM_COUNT 5
+
+#define WAVEFORM_AMPLITUDE 0.99 // Relative to full scale
+#define WAVEFORM_FREQUENCY_IN_HZ 1000.0 // Square and sine burst
+#define WAVEFORM_CHIRP_START_IN_HZ 200.0
+#define WAVEFORM_CHIRP_END_IN_HZ 8000.0 // Limited to a quarter of the sample rate
+#define WAVEFORM_CHIRP_FADE 0.1 // Part of the chirp faded in and out
+#define WAVEFORM_MLS_ORDER 15 // The sequence repeats after 2^15 - 1 frames
+
+typedef struct {
+    int format;
+    unsigned int sampleRate;
+    unsigned int channels;
+    unsigned long frames;
+    unsigned int bytesPerFrame;
+    char *waveforms[WAVEFORM_COUNT];
+    char *silence; /* Same length as the waveforms */
+} waveformBank;
+
+int createWaveformBank(waveformBank *bank, int format, unsigned int sampleRate, unsigned int channels, unsigned long frames);
+void freeWaveformBank(waveformBank *bank);
+int isWaveformBankMatching(waveformBank *bank, int format, unsigned int sampleRate, unsigned int channels, unsigned long frames);
+int parseWaveform(const char *name);
+const char *getWaveformName(int waveform);
+unsigned int getBytesPerSample(int format); /* 0 for unknown formats */
+int parseFormat(const char *name); /* ALSA name like S16_LE, -1 if unknown */
+const char *getFormatName(int format);
+/* The first frames of a waveform as -1.0 to 1.0, the reference of the cross-correlation detector */
+int getWaveformSamples(int waveform, unsigned int sampleRate, unsigned long frames, float *samples);
+/* First channel of interleaved frames as -1.0 to 1.0 */
+void getFirstChannelSamples(const char *frames, int format, unsigned int channels, unsigned long count, float *samples);
+
+#endif
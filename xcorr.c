@@ -0,0 +1,212 @@
+/*
+Cross-correlation detector
+*/
+
+#include "xcorr.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 4 floats, loaded and stored at any float aligned address
+typedef float v4sf __attribute__((vector_size(16), aligned(4)));
+
+static inline __attribute__((always_inline)) v4sf load4(const float *source) {
+    return(*(const v4sf *) source);
+}
+
+static inline __attribute__((always_inline)) void store4(float *destination, v4sf value) {
+    *(v4sf *) destination = value;
+}
+
+// In-place radix-2 FFT of size detector->size on split real and imaginary parts
+static void transform(const xcorrDetector *detector, float *real, float *imaginary) {
+    int size = detector->size;
+    int other;
+    float swap, productReal, productImaginary;
+    const float *twiddleReal, *twiddleImaginary;
+    v4sf aReal, aImaginary, bReal, bImaginary, wReal, wImaginary, cReal, cImaginary;
+
+    for (int i = 0; i < size; i++) {
+        other = detector->bitReversal[i];
+        if (other > i) {
+            swap = real[i];
+            real[i] = real[other];
+            real[other] = swap;
+            swap = imaginary[i];
+            imaginary[i] = imaginary[other];
+            imaginary[other] = swap;
+        }
+    }
+    for (int half = 1; half < size; half *= 2) {
+        twiddleReal = detector->twiddleReal + half - 1;
+        twiddleImaginary = detector->twiddleImaginary + half - 1;
+        for (int block = 0; block < size; block += 2 * half) {
+            if (half >= 4) {
+                for (int j = block; j < block + half; j += 4) {
+                    aReal = load4(real + j);
+                    aImaginary = load4(imaginary + j);
+                    bReal = load4(real + j + half);
+                    bImaginary = load4(imaginary + j + half);
+                    wReal = load4(twiddleReal + j - block);
+                    wImaginary = load4(twiddleImaginary + j - block);
+                    cReal = bReal * wReal - bImaginary * wImaginary;
+                    cImaginary = bReal * wImaginary + bImaginary * wReal;
+                    store4(real + j, aReal + cReal);
+                    store4(imaginary + j, aImaginary + cImaginary);
+                    store4(real + j + half, aReal - cReal);
+                    store4(imaginary + j + half, aImaginary - cImaginary);
+                }
+                continue;
+            }
+            for (int j = block; j < block + half; j++) {
+                productReal = real[j + half] * twiddleReal[j - block] - imaginary[j + half] * twiddleImaginary[j - block];
+                productImaginary = real[j + half] * twiddleImaginary[j - block] + imaginary[j + half] * twiddleReal[j - block];
+                real[j + half] = real[j] - productReal;
+                imaginary[j + half] = imaginary[j] - productImaginary;
+                real[j] += productReal;
+                imaginary[j] += productImaginary;
+            }
+        }
+    }
+}
+
+// Zero padded copy of samples into the work buffers
+static void loadSamples(xcorrDetector *detector, const float *samples, int count) {
+    memcpy(detector->real, samples, count * sizeof(float));
+    memset(detector->real + count, 0, (detector->size - count) * sizeof(float));
+    memset(detector->imaginary, 0, detector->size * sizeof(float));
+}
+
+int initXcorrDetector(xcorrDetector *detector, const float *reference, int referenceLength, int maxCaptureLength) {
+    int bits = 0;
+    double angle;
+
+    memset(detector, 0, sizeof(xcorrDetector));
+    if (referenceLength <= 0 || maxCaptureLength < referenceLength
+        || referenceLength + maxCaptureLength > XCORR_MAX_SIZE) {
+        return(-EINVAL);
+    }
+    detector->referenceLength = referenceLength;
+    detector->maxCaptureLength = maxCaptureLength;
+    // Large enough that the correlation does not wrap around
+    detector->size = 4;
+    while (detector->size < referenceLength + maxCaptureLength) {
+        detector->size *= 2;
+    }
+    while ((1 << bits) < detector->size) {
+        bits++;
+    }
+
+    detector->bitReversal = (int *) malloc(detector->size * sizeof(int));
+    detector->twiddleReal = (float *) malloc(detector->size * sizeof(float));
+    detector->twiddleImaginary = (float *) malloc(detector->size * sizeof(float));
+    detector->referenceReal = (float *) malloc(detector->size * sizeof(float));
+    detector->referenceImaginary = (float *) malloc(detector->size * sizeof(float));
+    detector->real = (float *) malloc(detector->size * sizeof(float));
+    detector->imaginary = (float *) malloc(detector->size * sizeof(float));
+    detector->captureEnergy = (double *) malloc((maxCaptureLength + 1) * sizeof(double));
+    if (detector->bitReversal == NULL || detector->twiddleReal == NULL || detector->twiddleImaginary == NULL
+        || detector->referenceReal == NULL || detector->referenceImaginary == NULL
+        || detector->real == NULL || detector->imaginary == NULL || detector->captureEnergy == NULL) {
+        freeXcorrDetector(detector);
+        return(-ENOMEM);
+    }
+
+    for (int i = 0; i < detector->size; i++) {
+        detector->bitReversal[i] = 0;
+        for (int bit = 0; bit < bits; bit++) {
+            if (i & (1 << bit)) {
+                detector->bitReversal[i] |= 1 << (bits - 1 - bit);
+            }
+        }
+    }
+    for (int half = 1; half < detector->size; half *= 2) {
+        for (int j = 0; j < half; j++) {
+            angle = -M_PI * j / half;
+            detector->twiddleReal[half - 1 + j] = (float) cos(angle);
+            detector->twiddleImaginary[half - 1 + j] = (float) sin(angle);
+        }
+    }
+
+    loadSamples(detector, reference, referenceLength);
+    transform(detector, detector->real, detector->imaginary);
+    for (int i = 0; i < detector->size; i++) {
+        detector->referenceReal[i] = detector->real[i];
+        detector->referenceImaginary[i] = -detector->imaginary[i];
+    }
+    detector->referenceEnergy = 0.0;
+    for (int i = 0; i < referenceLength; i++) {
+        detector->referenceEnergy += (double) reference[i] * reference[i];
+    }
+    if (detector->referenceEnergy <= 0.0) {
+        freeXcorrDetector(detector);
+        return(-EINVAL);
+    }
+    return(0);
+}
+
+void freeXcorrDetector(xcorrDetector *detector) {
+    free(detector->bitReversal);
+    free(detector->twiddleReal);
+    free(detector->twiddleImaginary);
+    free(detector->referenceReal);
+    free(detector->referenceImaginary);
+    free(detector->real);
+    free(detector->imaginary);
+    free(detector->captureEnergy);
+    memset(detector, 0, sizeof(xcorrDetector));
+}
+
+int findReference(xcorrDetector *detector, const float *capture, int captureLength, xcorrResult *result) {
+    int lastLag = captureLength - detector->referenceLength;
+    int peak = 0;
+    float *real = detector->real, *imaginary = detector->imaginary;
+    v4sf captureReal, captureImaginary, referenceReal, referenceImaginary;
+    double peakValue = -1.0, before, after, curvature, windowEnergy;
+
+    if (detector->size == 0 || captureLength < detector->referenceLength || captureLength > detector->maxCaptureLength) {
+        return(-EINVAL);
+    }
+    loadSamples(detector, capture, captureLength);
+    transform(detector, real, imaginary);
+    // Capture spectrum times the conjugated reference spectrum, conjugated again,
+    // so the forward transform computes the inverse transform
+    for (int i = 0; i < detector->size; i += 4) {
+        captureReal = load4(real + i);
+        captureImaginary = load4(imaginary + i);
+        referenceReal = load4(detector->referenceReal + i);
+        referenceImaginary = load4(detector->referenceImaginary + i);
+        store4(real + i, captureReal * referenceReal - captureImaginary * referenceImaginary);
+        store4(imaginary + i, -(captureReal * referenceImaginary + captureImaginary * referenceReal));
+    }
+    transform(detector, real, imaginary);
+
+    // real[lag] is size times the correlation of the reference starting at capture sample lag
+    for (int lag = 0; lag <= lastLag; lag++) {
+        if (fabsf(real[lag]) > peakValue) {
+            peakValue = fabsf(real[lag]);
+            peak = lag;
+        }
+    }
+    result->lagInSamples = peak;
+    if (peak > 0 && peak < lastLag) {
+        before = fabsf(real[peak - 1]);
+        after = fabsf(real[peak + 1]);
+        curvature = before - 2.0 * peakValue + after;
+        if (curvature < 0.0) {
+            result->lagInSamples += 0.5 * (before - after) / curvature;
+        }
+    }
+
+    detector->captureEnergy[0] = 0.0;
+    for (int i = 0; i < captureLength; i++) {
+        detector->captureEnergy[i + 1] = detector->captureEnergy[i] + (double) capture[i] * capture[i];
+    }
+    windowEnergy = detector->captureEnergy[peak + detector->referenceLength] - detector->captureEnergy[peak];
+    result->confidence = 0.0;
+    if (windowEnergy > 0.0) {
+        result->confidence = fmin(1.0, peakValue / detector->size / sqrt(detector->referenceEnergy * windowEnergy));
+    }
+    return(0);
+}
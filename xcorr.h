@@ -0,0 +1,44 @@
+/*
+Cross-correlation detector
+
+Finds a known reference signal, like the chirp played as pulse, in a block of
+captured samples and reports where it starts:
+- The correlation is computed with an FFT, the spectrum of the reference is computed once,
+  so a detection costs one forward and one inverse FFT of XCORR size
+- Butterflies and spectrum products work on 4 floats at once with GCC vector extensions,
+  which become NEON instructions on the Pi 4 and SSE instructions on x86
+- The peak is refined to a fraction of a sample with a parabola through its neighbours
+- The confidence is the normalised correlation coefficient at the peak, 1.0 for an exact copy
+  of the reference, the polarity of the DUT does not matter
+*/
+
+#ifndef XCORR_H
+#define XCORR_H
+
+#define XCORR_MAX_SIZE (1 << 20) // Reference plus capture length in samples at most
+
+typedef struct {
+    int size; /* FFT size, a power of two */
+    int referenceLength;
+    int maxCaptureLength;
+    double referenceEnergy;
+    int *bitReversal;
+    float *twiddleReal; /* Stage with half size h uses the h entries from h - 1 on */
+    float *twiddleImaginary;
+    float *referenceReal; /* Conjugated spectrum of the reference */
+    float *referenceImaginary;
+    float *real; /* Work buffers */
+    float *imaginary;
+    double *captureEnergy; /* Running sum of the squared capture samples */
+} xcorrDetector;
+
+typedef struct {
+    double lagInSamples; /* Capture sample at which the reference starts */
+    double confidence; /* 0.0 to 1.0 */
+} xcorrResult;
+
+int initXcorrDetector(xcorrDetector *detector, const float *reference, int referenceLength, int maxCaptureLength);
+void freeXcorrDetector(xcorrDetector *detector);
+int findReference(xcorrDetector *detector, const float *capture, int captureLength, xcorrResult *result);
+
+#endif